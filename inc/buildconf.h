@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #define _LARGEFILE64_SOURCE
 #define _FILE_OFFSET_BITS 64
 
@@ -7,8 +8,79 @@
 #define CONFIG_USB_HS_SUPPORT 1      // USB 2.0 High speed
 //#define CONFIG_USB_SS_SUPPORT 1    // USB 3.0 SuperSpeed
 
-#define CONFIG_READ_FILE_BUFFER_SIZE  (1024*1024) // Must be a 2^x value.
-#define CONFIG_MAX_TX_USB_BUFFER_SIZE (16*512)    // Must be a multiple of 512 and be less than CONFIG_READ_FILE_BUFFER_SIZE
+// Default values. Can be changed at runtime with the configuration file.
+#define CONFIG_READ_FILE_BUFFER_SIZE  (1024*1024) // Must be greater or equal to CONFIG_MAX_TX_USB_BUFFER_SIZE
+#define CONFIG_MAX_TX_USB_BUFFER_SIZE (16*512)    // Must be a multiple of 512
 #define CONFIG_MAX_RX_USB_BUFFER_SIZE (16*512)    // Must be a multiple of 512
 
+#define CONFIG_WRITE_FILE_BUFFER_SIZE (1024*1024) // Upload write coalescing buffer.
+#define CONFIG_DIRECT_IO_ALIGNMENT    4096        // O_DIRECT buffer/offset/size alignment.
+
+#define CONFIG_MMAP_THRESHOLD    (4*1024*1024)  // Objects above this size are sent from a file mapping.
+#define CONFIG_MMAP_SEGMENT_SIZE (32*1024*1024) // Size of the file mapping window.
+
+#define CONFIG_FD_CACHE_SIZE          8           // Files kept open between GetObject/GetPartialObject requests.
+#define CONFIG_BLOCK_CACHE_NB         8           // Recently read file blocks kept in memory.
+#define CONFIG_BLOCK_CACHE_BLOCK_SIZE (64*1024)   // Must be a power of 2.
+
+#define CONFIG_READAHEAD_MIN (128*1024)           // Sequential streams prefetch window (doubled on each
+#define CONFIG_READAHEAD_MAX (8*1024*1024)        // sequential request up to CONFIG_READAHEAD_MAX).
+
+#define CONFIG_PREFETCH_SIZE   0                  // Metadata triggered prefetch size (0 : disabled).
+#define CONFIG_PREFETCH_BUDGET (8*1024*1024)      // Maximum prefetched bytes waiting for a GetObject.
+
+#define CONFIG_FS_DB_MAX_DEPTH 4096               // Objects db parents chain walk limit (consistency guard).
+
+#define CONFIG_INOTIFY_DEBOUNCE_MS  250           // IN_MODIFY bursts are notified once per window (0 : disabled).
+#define CONFIG_INOTIFY_MAX_PENDING  64            // Modified objects waiting for the end of their window.
+#define CONFIG_INOTIFY_MAX_WATCHES  4096          // Watched folders (least recently listed ones evicted, 0 : no limit).
+#define CONFIG_INOTIFY_MAX_ECHOES   16            // Responder file system changes filtered from the inotify events.
+#define CONFIG_INOTIFY_ECHO_GRACE_MS 1000         // Late echoes window after the end of a change.
+
+#define CONFIG_EVENT_QUEUE_SIZE       128         // MTP events waiting for the interrupt endpoint.
+#define CONFIG_EVENT_STORM_THRESHOLD  32          // Pending object events of a storage replaced by a StorageInfoChanged.
+#define CONFIG_EVENT_BATCH_DELAY_MS   20          // Events burst gathering delay.
+
+#define CONFIG_COPY_CHUNK_SIZE        (8*1024*1024) // CopyObject / MoveObject copy_file_range() chunk.
+#define CONFIG_COPY_PROGRESS_PERIOD_MS 2000       // Folder copy progress log period.
+
+#define CONFIG_THUMB_MAX_SIZE         160         // Generated thumbnails maximum width / height.
+#define CONFIG_THUMB_QUALITY          75          // Generated thumbnails JPEG quality.
+#define CONFIG_THUMB_WORKERS          2           // Thumbnails generation threads.
+#define CONFIG_THUMB_MAX_WORKERS      8
+#define CONFIG_THUMB_QUEUE_SIZE       64          // Images waiting for their thumbnail generation.
+#define CONFIG_THUMB_MAX_MARKERS      16          // JPEG header markers parsed to find the EXIF thumbnail.
+#define CONFIG_THUMB_HEADER_SIZE      4096        // Thumbnail bytes read to get its size.
+#define CONFIG_THUMB_MAX_DATA_SIZE    (256*1024)
+#define CONFIG_THUMB_CACHE_MAX_SIZE   64          // Thumbnails cache folder size limit in MB (0 : no limit).
+#define CONFIG_THUMB_CACHE_TOUCH_S    3600        // Used cache files modification time refresh period (LRU eviction).
+
+#define CONFIG_MEDIA_WORKERS          1           // Media metadata indexer threads (0 : read on demand only).
+#define CONFIG_MEDIA_MAX_WORKERS      4
+#define CONFIG_MEDIA_QUEUE_SIZE       1024        // Media files waiting for their indexing.
+#define CONFIG_MEDIA_MAX_STRING       256         // Tags maximum size (UTF-8, bytes).
+#define CONFIG_MEDIA_MAX_BLOCKS       64          // FLAC metadata blocks / JPEG markers parsed.
+#define CONFIG_MEDIA_SCAN_SIZE        (8*1024)    // MP3 frame header / Ogg last page search window.
+
+#define CONFIG_FIND_MAX_RESULTS       65536       // FindObjects maximum number of handles found.
+#define CONFIG_FIND_MAX_SCANS         1024        // Folders never listed scanned per FindObjects.
+#define CONFIG_FIND_MAX_DEPTH         256
+#define CONFIG_FIND_INDEX_MIN_TAIL    4096        // New entries searched without the sorted names index before its rebuild.
+
+#define CONFIG_PROPLIST_BATCH         1024        // GetObjectPropList : Objects checked per db lock hold.
+
+#define CONFIG_ARCHIVE_READAHEAD_FILES 16         // GetFolderArchive : Next files of the folder opened and read ahead
+#define CONFIG_ARCHIVE_READAHEAD_SIZE  (4*1024*1024) // while the current one is sent.
+#define CONFIG_ARCHIVE_ZSTD_LEVEL      3          // Compression level of the zstd archives (ZSTD=1 build).
+#define CONFIG_ARCHIVE_MAX_ERRORS      256        // SendFolderArchive : Entries errors kept for GetArchiveErrors.
+#define CONFIG_ARCHIVE_MAX_DEPTH       256
+
+#define CONFIG_JOURNAL_SIZE           4096        // Change journal records kept : Older tokens expire.
+#define CONFIG_JOURNAL_MAX_CHANGES    1024        // Changes returned per GetChanges.
+#define CONFIG_JOURNAL_MAX_DEPTH      256
+
+// Runtime configuration limits
+#define CONFIG_MAX_USB_BUFFER_SIZE_LIMIT  (16*1024*1024)
+#define CONFIG_MAX_FILE_BUFFER_SIZE_LIMIT (64*1024*1024)
+
 #include "custom_buildconf.h"
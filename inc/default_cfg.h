@@ -49,6 +49,9 @@
 #define USB_EPOUT   "/dev/ffs-mtp/ep2"
 #define USB_EPINTIN "/dev/ffs-mtp/ep3"
 
+// Vendor extension advertised in the DeviceInfo MTP extensions string (FindObjects...).
+#define UMTPRD_MTP_EXTENSION "umtprd.viveris.com: 1.0;"
+
 #define MANUFACTURER "Viveris Technologies"
 #define PRODUCT      "The Viveris Product !"
 #define SERIALNUMBER "01234567"
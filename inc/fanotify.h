@@ -0,0 +1,40 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * @file   fanotify.h
+ * @brief  fanotify file system events backend.
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+#ifndef _INC_FANOTIFY_H_
+#define _INC_FANOTIFY_H_
+
+// Watch descriptors above this value are fanotify watched folders.
+#define FANOTIFY_WD_BASE 0x40000000
+
+int fanotify_handler_init( mtp_ctx * ctx );
+int fanotify_handler_deinit( mtp_ctx * ctx );
+
+int fanotify_handler_addwatch( mtp_ctx * ctx, char * path );
+int fanotify_handler_rmwatch( mtp_ctx * ctx, int wd );
+
+int fanotify_handler_read( mtp_ctx * ctx, char * buffer, int size );
+
+#endif
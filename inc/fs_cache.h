@@ -0,0 +1,44 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/**
+ * @file   fs_cache.h
+ * @brief  Open files and read blocks cache.
+ * @author Jean-François DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+#ifndef _INC_FS_CACHE_H_
+#define _INC_FS_CACHE_H_
+
+void fs_cache_init(mtp_ctx * ctx);
+void fs_cache_deinit(mtp_ctx * ctx);
+
+int  fs_cache_open(mtp_ctx * ctx, fs_entry * entry);
+void fs_cache_release(mtp_ctx * ctx, fs_entry * entry);
+void fs_cache_prefetch(mtp_ctx * ctx, fs_entry * entry);
+void fs_cache_prefetch_handle(mtp_ctx * ctx, uint32_t handle);
+void fs_cache_access(mtp_ctx * ctx, fs_entry * entry, mtp_offset offset, mtp_size size);
+int  fs_cache_read(mtp_ctx * ctx, fs_entry * entry, unsigned char * buffer_out, mtp_offset offset, mtp_size size);
+
+void fs_cache_invalidate(mtp_ctx * ctx, uint32_t handle);
+void fs_cache_invalidate_storage(mtp_ctx * ctx, uint32_t storage_id);
+void fs_cache_flush(mtp_ctx * ctx);
+
+#endif
@@ -43,26 +43,47 @@ struct fs_entry
 	char * name;
 	uint32_t flags;
 	mtp_size size;
-	uint32_t date;
+	uint32_t date;      // Modification time (0 : unknown)
 
 	int file_descriptor;
 	int watch_descriptor;
 
+	int pin_count;      // Data phases in progress (running without the db lock)
+
+	void * media;       // Indexed media metadata (mtp_media_info, see mtp_media.h)
+
 	fs_entry * next;
 };
 
 #define ENTRY_IS_DIR 0x00000001
 #define ENTRY_IS_DELETED 0x00000002
+#define ENTRY_IS_SYNCED  0x00000004   // Folder content kept up to date by its watch
+#define ENTRY_IS_SCANNED 0x00000008   // Folder content added to the db at least once
 
 #define _DEF_FS_HANDLES_ 1
 #define HASH_TABLE_SIZE 1024  // Configurable table size
 
-typedef struct hash_node {
-	fs_entry **entries;
+// Hash buckets are copy-on-write : Lookups are lock-free (see fs_db_read_lock()),
+// writers serialize on the db lock and retire the replaced buckets.
+typedef struct hash_bucket {
 	uint32_t size;
 	uint32_t capacity;
+	fs_entry *entries[];
+} hash_bucket;
+
+typedef struct hash_node {
+	hash_bucket *bucket;
 } hash_node;
 
+// Memory retired by the writers, released once no reader can access it anymore.
+typedef struct db_retired {
+	void *ptr;
+	uint64_t epoch;
+	struct db_retired *next;
+} db_retired;
+
+#define DB_MAX_READERS 8
+
 #define POOL_BLOCK_SIZE 1024
 
 typedef struct fs_entry_pool_block {
@@ -70,21 +91,51 @@ typedef struct fs_entry_pool_block {
 	struct fs_entry_pool_block *next;
 } fs_entry_pool_block;
 
-typedef struct fs_handles_db_ {
+// The db is sharded per storage : Each storage has its own entries list, indexes
+// and memory pool, and is protected by its own lock (see mtp_db_lock_storage()).
+// The shard index is the storage index, and is encoded in the handles upper bits.
+#define FS_DB_SHARD_SHIFT 28
+#define FS_DB_MAX_SHARDS  (1 << (32 - FS_DB_SHARD_SHIFT))
+#define FS_DB_HANDLE_MASK ((1 << FS_DB_SHARD_SHIFT) - 1)
+
+#define FS_DB_HANDLE_SHARD(handle) ( (int)((uint32_t)(handle) >> FS_DB_SHARD_SHIFT) )
+
+struct fs_handles_db_;
+
+typedef struct fs_db_shard_ {
 	fs_entry * entry_list;
 	hash_node hash_table_by_name[HASH_TABLE_SIZE];   // Hash table by file name for performance improvement
 	hash_node hash_table_by_handle[HASH_TABLE_SIZE]; // Hash table by file handle for performance improvement
 
+	uint32_t storage_id;
 	uint32_t next_handle;
 
+	fs_entry_pool_block *pool_head;                  // Memory pool for fs_entry allocation to improve memory handling performance
+	uint32_t pool_free_count;
+
+	db_retired *retired;
+
+	fs_entry **name_index;                           // Entries sorted by name (case insensitive), see fs_db_find_names()
+	uint32_t name_index_size;
+	uint32_t name_index_next_handle;                 // Entries allocated after the index build : not sorted yet
+	uint32_t name_index_renames;
+	uint32_t renames;                                // Entries renamed (sorted index invalidation)
+	uint32_t deletions;                              // Entries deleted (walks resumed after a db lock release)
+
+	struct fs_handles_db_ *db;
+} fs_db_shard;
+
+typedef struct fs_handles_db_ {
+	fs_db_shard * shards[FS_DB_MAX_SHARDS];
+
 	fs_entry *search_entry;
 	uint32_t handle_search;
 	uint32_t storage_search;
 
 	void *mtp_ctx;
 
-	fs_entry_pool_block *pool_head;                  // Memory pool for fs_entry allocation to improve memory handling performance
-	uint32_t pool_free_count;
+	uint64_t epoch;                                  // Reclamation epoch
+	uint64_t reader_epoch[DB_MAX_READERS];           // Epoch seen by each lock-free reader (0 : not reading)
 } fs_handles_db;
 
 
@@ -93,30 +144,46 @@ typedef struct filefoundinfo_
 	int isdirectory;
 	char filename[FS_HANDLE_MAX_FILENAME_SIZE + 1];
 	mtp_size size;
+	uint32_t date;      // Modification time (0 : unknown)
 }filefoundinfo;
 
 
 fs_handles_db * init_fs_db(void * mtp_ctx);
 void deinit_fs_db(fs_handles_db * fsh);
+
+int  fs_db_read_lock(fs_handles_db * db);
+void fs_db_read_unlock(fs_handles_db * db);
+void fs_db_retire(fs_db_shard * shard, void * ptr);
+fs_db_shard * fs_db_get_shard(fs_handles_db * db, uint32_t storage_id);
+void fs_db_drop_storage(fs_handles_db * db, uint32_t storage_id);
+void fs_db_delete_entry(fs_handles_db * db, fs_entry * entry);
 int scan_and_add_folder(fs_handles_db * db, char * base, uint32_t parent, uint32_t storage_id);
 fs_entry * init_search_handle(fs_handles_db * db, uint32_t parent, uint32_t storage_id);
 fs_entry * get_next_child_handle(fs_handles_db * db);
 fs_entry * get_entry_by_handle(fs_handles_db * db, uint32_t handle);
 fs_entry * get_entry_by_handle_and_storageid(fs_handles_db * db, uint32_t handle, uint32_t storage_id);
-fs_entry * get_entry_by_wd(fs_handles_db * db, int watch_descriptor, fs_entry * entry_list);
+fs_entry * get_entry_by_wd(fs_handles_db * db, uint32_t storage_id, int watch_descriptor, fs_entry * entry_list);
 fs_entry * get_entry_by_storageid( fs_handles_db * db, uint32_t storage_id, fs_entry * entry_list );
 fs_entry * add_entry(fs_handles_db * db, filefoundinfo *fileinfo, uint32_t parent, uint32_t storage_id);
 fs_entry * search_entry(fs_handles_db * db, filefoundinfo *fileinfo, uint32_t parent, uint32_t storage_id);
 fs_entry * alloc_root_entry(fs_handles_db * db, uint32_t storage_id);
 
+typedef int (*fs_db_name_cb)(fs_entry * entry, void * arg);
+int fs_db_find_names(fs_handles_db * db, uint32_t storage_id, const char * prefix, fs_db_name_cb callback, void * arg);
+
 int entry_open(fs_handles_db * db, fs_entry * entry, int flags, mode_t mode);
 int entry_read(fs_handles_db * db, fs_entry * entry, unsigned char * buffer_out, mtp_offset offset, mtp_size size);
 void entry_close(fs_handles_db * db, fs_entry * entry);
 
+void entry_pin(fs_entry * entry);
+void entry_unpin(fs_handles_db * db, fs_entry * entry);
+
 char * build_full_path(fs_handles_db * db,char * root_path,fs_entry * entry);
 
 int fs_remove_tree( char *folder );
 
 int fs_entry_stat(char *path, filefoundinfo* fileinfo);
 
+int fs_preallocate(int file, mtp_size size);
+
 #endif
@@ -29,14 +29,16 @@
 #include "fs_handles_db.h"
 
 int init_hash_node(hash_node *node);
-int expand_hash_node(hash_node *node);
+int expand_hash_node(fs_db_shard *shard, hash_node *node);
+void free_hash_node(hash_node *node);
+hash_bucket *get_hash_bucket(hash_node *node, uint32_t *size);
 uint32_t hash_function_name(const char *name);
 uint32_t hash_function_handle(uint32_t handle);
-int allocate_pool_block(fs_handles_db *db);
-void insert_entry_generic(hash_node *node, fs_entry* entry);
-void insert_entry(fs_handles_db *db, fs_entry *entry);
-void remove_entry_generic(hash_node *node, fs_entry *entry);
-fs_entry *find_entry(fs_handles_db *db, const char *name, uint32_t parent, uint32_t storage_id);
-void remove_entry(fs_handles_db *db, fs_entry *entry);
+int allocate_pool_block(fs_db_shard *shard);
+void insert_entry_generic(fs_db_shard *shard, hash_node *node, fs_entry* entry);
+void insert_entry(fs_db_shard *shard, fs_entry *entry);
+void remove_entry_generic(fs_db_shard *shard, hash_node *node, fs_entry *entry);
+fs_entry *find_entry(fs_db_shard *shard, const char *name, uint32_t parent, uint32_t storage_id);
+void remove_entry(fs_db_shard *shard, fs_entry *entry);
 
 #endif // _INC_HASH_UTILS_H_
@@ -3,3 +3,7 @@ int inotify_handler_deinit( mtp_ctx * ctx );
 
 int inotify_handler_addwatch( mtp_ctx * ctx, char * path );
 int inotify_handler_rmwatch( mtp_ctx * ctx, int wd );
+int inotify_handler_touchwatch( mtp_ctx * ctx, int wd );
+
+void inotify_handler_echo_begin( mtp_ctx * ctx, uint32_t storage_id, uint32_t parent, char * name, uint32_t mask );
+void inotify_handler_echo_end( mtp_ctx * ctx, uint32_t storage_id, uint32_t parent, char * name );
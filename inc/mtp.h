@@ -47,6 +47,10 @@ typedef struct _MTP_PACKET_HEADER
 
 #include "fs_handles_db.h"
 
+#if MAX_STORAGE_NB > FS_DB_MAX_SHARDS
+#error "MAX_STORAGE_NB : The storage index must fit in the objects handles (FS_DB_SHARD_SHIFT)"
+#endif
+
 typedef struct mtp_usb_cfg_
 {
 	uint16_t usb_vendor_id;
@@ -88,8 +92,203 @@ typedef struct mtp_storage_
 	uint32_t flags;
 	int uid;
 	int gid;
+
+	pthread_mutex_t db_lock;  // Protects the storage objects (fs_handles_db shard)
 }mtp_storage;
 
+#define AUTOTUNE_MAX_CANDIDATES 8
+
+enum
+{
+	AUTOTUNE_IDLE = 0,
+	AUTOTUNE_MEASURING,
+	AUTOTUNE_DONE
+};
+
+typedef struct mtp_autotune_
+{
+	int enabled;
+	int state;
+	int speed;
+
+	int nb_candidates;
+	int candidate;
+
+	int chunk_size[AUTOTUNE_MAX_CANDIDATES];
+	int readahead_size[AUTOTUNE_MAX_CANDIDATES];
+
+	uint64_t bytes[AUTOTUNE_MAX_CANDIDATES];
+	uint64_t time_us[AUTOTUNE_MAX_CANDIDATES];
+
+	uint64_t sample_size;
+}mtp_autotune;
+
+typedef struct mtp_stats_
+{
+	uint64_t tx_payload_bytes;        // File data bytes sent to the host
+	uint64_t tx_payload_copied_bytes; // File data bytes copied in user space before being sent
+	uint64_t tx_chunks;               // USB writes issued for the file data
+
+	uint64_t tx_read_bytes;           // File data sent with the buffered (read) path
+	uint64_t tx_read_transfers;
+	uint64_t tx_read_time_us;
+
+	uint64_t tx_mmap_bytes;           // File data sent from a file mapping
+	uint64_t tx_mmap_transfers;
+	uint64_t tx_mmap_time_us;
+	uint64_t tx_mmap_fallbacks;       // Mapped transfers completed with the buffered path
+
+	uint64_t fd_cache_hits;           // Files found open in the file descriptors cache
+	uint64_t fd_cache_misses;
+	uint64_t block_cache_hits;        // Blocks found in the read blocks cache
+	uint64_t block_cache_misses;
+
+	uint64_t file_read_bytes;         // Bytes read from the storage to serve the requests
+	uint64_t file_prefetch_bytes;     // Bytes requested in advance (posix_fadvise WILLNEED)
+
+	uint64_t prefetch_issued;         // Metadata triggered prefetches
+	uint64_t prefetch_hits;           // ... followed by a read of the prefetched data
+	uint64_t prefetch_wasted;         // ... dropped without being used
+	uint64_t prefetch_skipped;        // ... not issued (prefetch budget exhausted)
+
+	uint64_t db_lock_count;           // Handles db lock acquisitions (writers)
+	uint64_t db_lock_contended;       // ... which had to wait for another thread
+	uint64_t db_lock_wait_us;         // Total time spent waiting for the lock
+	uint64_t db_read_sections;        // Lock-free lookups sections
+
+	uint64_t inotify_events;          // inotify events received
+	uint64_t inotify_coalesced;       // IN_MODIFY merged in a pending notification
+	uint64_t inotify_emitted;         // MTP events sent from the inotify thread
+	uint64_t inotify_rescans;         // Storages rescanned after an events queue overflow
+	uint64_t inotify_echoes;          // Events caused by the responder itself (filtered)
+	uint64_t inotify_echo_external;   // External changes found behind filtered events
+	uint64_t inotify_watches;         // Active inotify watches
+	uint64_t inotify_watch_evictions; // Watches removed to stay within the budget
+	uint64_t inotify_watch_failures;  // Folders that couldn't be watched
+
+	uint64_t events_queued;           // MTP events pushed
+	uint64_t events_sent;             // MTP events written to the interrupt endpoint
+	uint64_t events_superseded;       // Events dropped because of a later one
+	uint64_t events_storms;           // Object events bursts sent as StorageInfoChanged
+	uint64_t events_dropped;          // Events lost (queue full)
+
+	uint64_t copy_objects;            // Files copied on the device (CopyObject / MoveObject)
+	uint64_t copy_bytes;              // Bytes copied (not cloned)
+	uint64_t copy_reflinks;           // Files cloned (shared extents)
+	uint64_t copy_renames;            // Objects moved with a rename
+	uint64_t copy_cancelled;          // Copies cancelled
+
+	uint64_t thumb_sent;              // GetThumb requests served
+	uint64_t thumb_exif;              // Thumbnails extracted from the EXIF header
+	uint64_t thumb_generated;         // Thumbnails generated (downscaled images)
+	uint64_t thumb_cache_hits;        // Thumbnails found in the cache
+	uint64_t thumb_dropped;           // Generations not queued (queue full)
+
+	uint64_t media_indexed;           // Media files indexed in background
+	uint64_t media_on_demand;         // Media files metadata read while serving a request
+	uint64_t media_dropped;           // Media files not queued (queue full)
+
+	uint64_t archive_sent;            // Folders archives sent (GetFolderArchive)
+	uint64_t archive_files;           // Files sent in the archives
+	uint64_t archive_bytes;           // Files data bytes sent in the archives
+	uint64_t archive_received;        // Folders archives received (SendFolderArchive)
+	uint64_t archive_errors;          // Received archives entries not extracted
+	uint64_t archive_cancelled;       // Archives transfers cancelled
+
+	uint64_t journal_records;         // Changes recorded in the change journal
+	uint64_t journal_walks;           // Storages walked to find the changes not seen live
+	uint64_t journal_expired;         // GetChanges answered "token expired"
+}mtp_stats;
+
+// File system change in progress by the responder : Its inotify events are echoes.
+typedef struct mtp_fs_echo_
+{
+	int wd;                           // Parent folder watch
+	char name[FS_HANDLE_MAX_FILENAME_SIZE];
+	uint32_t mask;                    // Expected events
+	int in_progress;
+
+	uint64_t expires;                 // End of the late echoes window
+	int late;                         // Event filtered after the change end
+
+	// Object state left by the responder
+	uint32_t handle;
+	int64_t size;
+	int64_t mtime_sec;
+	long mtime_nsec;
+}mtp_fs_echo;
+
+typedef struct mtp_event_
+{
+	uint32_t code;
+	int nbparams;
+	uint32_t params[3];
+	int storm;                        // StorageInfoChanged replacing a burst of object events
+}mtp_event;
+
+typedef struct mtp_event_queue_
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int running;
+	int stop;
+	volatile int done;     // Sender thread exited
+
+	mtp_event events[CONFIG_EVENT_QUEUE_SIZE];
+	int nb_events;
+
+	uint32_t generation;   // Incremented by each flush : The events taken before are dropped.
+}mtp_event_queue;
+
+typedef struct fs_cache_fd_
+{
+	uint32_t handle;
+	uint32_t storage_id;
+	int fd;
+	int in_use;
+	int stale;          // Invalidated while in use : closed when released
+	mtp_size size;      // File size and modification time when the blocks were cached
+	int64_t mtime;
+	uint64_t last_use;
+
+	// Access pattern tracking
+	int access;
+	int seq_count;
+	mtp_offset next_offset;
+	mtp_offset prefetch_end;
+	mtp_size readahead;
+
+	mtp_size meta_prefetch;  // Metadata triggered prefetch waiting for a read
+}fs_cache_fd;
+
+enum
+{
+	FS_ACCESS_UNKNOWN = 0,
+	FS_ACCESS_SEQUENTIAL,
+	FS_ACCESS_RANDOM
+};
+
+typedef struct fs_cache_block_
+{
+	uint32_t handle;    // 0 : free block
+	mtp_offset offset;
+	int valid;
+	unsigned char * data;
+	uint64_t last_use;
+}fs_cache_block;
+
+typedef struct fs_cache_
+{
+	fs_cache_fd fds[CONFIG_FD_CACHE_SIZE];
+	fs_cache_block blocks[CONFIG_BLOCK_CACHE_NB];
+	unsigned char * blocks_buffer;
+	uint64_t use_counter;
+	mtp_size prefetch_pending;
+	pthread_mutex_t lock;
+}fs_cache;
+
+#define UMTP_STORAGE_DIRECT_IO   0x00000020
 #define UMTP_STORAGE_LOCKED      0x00000010
 #define UMTP_STORAGE_LOCKABLE    0x00000008
 #define UMTP_STORAGE_REMOVABLE   0x00000004
@@ -107,6 +306,7 @@ typedef struct mtp_ctx_
 
 	unsigned char * wrbuffer;
 	int usb_wr_buffer_max_size;
+	int usb_wr_chunk_size;
 
 	unsigned char * rdbuffer;
 	unsigned char * rdbuffer2;
@@ -114,6 +314,27 @@ typedef struct mtp_ctx_
 
 	unsigned char * read_file_buffer;
 	int read_file_buffer_size;
+	int read_file_chunk_size;
+
+	int mmap_threshold;
+
+	int prefetch_size;
+	int prefetch_budget;
+
+	mtp_autotune autotune;
+
+	mtp_stats stats;
+	mtp_stats session_stats;  // Statistics at the session opening
+
+	fs_cache file_cache;
+
+	unsigned char * write_file_buffer;
+	int write_file_buffer_size;
+	int write_file_buffer_fill;
+	int write_file_fd;
+	int write_file_direct;
+	int write_file_error;
+	mtp_offset write_file_offset;
 
 	uint32_t *temp_array;
 
@@ -122,6 +343,7 @@ typedef struct mtp_ctx_
 	uint32_t SendObjInfoHandle;
 	mtp_size SendObjInfoSize;
 	mtp_offset SendObjInfoOffset;
+	time_t SendObjInfoDate;         // Modification time to set at the end of the SendObject (0 : none)
 
 	uint32_t SetObjectPropValue_Handle;
 	uint32_t SetObjectPropValue_PropCode;
@@ -138,7 +360,21 @@ typedef struct mtp_ctx_
 	int msgqueue_id;
 	pthread_t msgqueue_thread;
 
+	mtp_event_queue event_queue;
+
 	int no_inotify;
+	int inotify_debounce_ms;
+
+	void * inotify_watches;
+	int inotify_max_watches;
+
+	int use_fanotify;
+	int fanotify_fd;
+	void * fanotify_watches;
+
+	pthread_mutex_t inotify_echo_mutex;
+	mtp_fs_echo inotify_echoes[CONFIG_INOTIFY_MAX_ECHOES];
+	int inotify_nb_echoes;
 
 	int sync_when_close;
 
@@ -149,6 +385,27 @@ typedef struct mtp_ctx_
 	int default_gid;
 
 	volatile int cancel_req;
+
+	void * copy_job;
+
+	uint32_t * find_results;        // Handles found by the last FindObjects
+	int find_results_count;
+
+	void * archive_errors;          // Entries errors of the last SendFolderArchive
+
+	char thumbnail_cache[MAX_CFG_STRING_SIZE + 1];
+	uint32_t thumbnail_cache_max_size;  // MB (0 : no limit)
+	int thumbnail_workers;
+	void * thumb_pool;
+	pthread_mutex_t thumb_cache_lock;
+	int64_t thumb_cache_size;           // Cache folder size (< 0 : not measured yet)
+
+	int media_workers;
+	void * media_pool;
+
+	int change_journal;
+	char change_journal_file[MAX_CFG_STRING_SIZE + 1];
+	void * journal;
 	volatile int transferring_file_data;
 
 	pthread_mutexattr_t cancel_mutex_attr;
@@ -176,11 +433,23 @@ int check_handle_access( mtp_ctx * ctx, fs_entry * entry, uint32_t handle, int w
 
 int mtp_push_event(mtp_ctx * ctx, uint32_t event, int nbparams, uint32_t * parameters );
 
+int  mtp_db_lock(mtp_ctx * ctx);
+int  mtp_db_unlock(mtp_ctx * ctx);
+int  mtp_db_lock_storage(mtp_ctx * ctx, int store_index);
+int  mtp_db_unlock_storage(mtp_ctx * ctx, int store_index);
+int  mtp_db_read_lock(mtp_ctx * ctx);
+void mtp_db_read_unlock(mtp_ctx * ctx, int lock);
+
+void mtp_print_stats(mtp_ctx * ctx);
+void mtp_reset_stats(mtp_ctx * ctx);
+void mtp_print_session_stats(mtp_ctx * ctx);
+
 void mtp_deinit_responder(mtp_ctx * ctx);
 
 int build_response(mtp_ctx * ctx, uint32_t tx_id, uint16_t type, uint16_t status, void * buffer, int maxsize, void * datain,int size);
 int check_and_send_USB_ZLP(mtp_ctx * ctx , int size);
 int parse_incoming_dataset(mtp_ctx * ctx,void * datain,int size,uint32_t * newhandle, uint32_t parent_handle, uint32_t storage_id);
+uint32_t mtp_create_object(mtp_ctx * ctx, uint32_t storage_id, uint32_t parent_handle, char * name, int isdir, mtp_size objectsize, uint32_t * newhandle);
 
 #define APP_VERSION "v1.9.1"
 
@@ -0,0 +1,39 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/**
+ * @file   mtp_archive.h
+ * @brief  Folders archives (GetFolderArchive / SendFolderArchive vendor extensions).
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+#ifndef _INC_MTP_ARCHIVE_H_
+#define _INC_MTP_ARCHIVE_H_
+
+// GetFolderArchive (parameter 2) / SendFolderArchive (parameter 3) formats
+#define MTP_ARCHIVE_TAR      0x0000
+#define MTP_ARCHIVE_TAR_ZSTD 0x0001
+
+uint32_t mtp_archive_send(mtp_ctx * ctx, MTP_PACKET_HEADER * mtp_packet_hdr, uint32_t handle, uint32_t format, uint32_t * files, uint32_t * skipped);
+uint32_t mtp_archive_receive(mtp_ctx * ctx, uint32_t storage_id, uint32_t parent_handle, uint32_t format, uint32_t * objects, uint32_t * errors);
+int mtp_archive_errors_dataset(mtp_ctx * ctx, mtp_dataset_writer * dsw, uint32_t first);
+void mtp_archive_free(mtp_ctx * ctx);
+
+#endif
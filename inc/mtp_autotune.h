@@ -0,0 +1,33 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * @file   mtp_autotune.h
+ * @brief  USB transfer buffers sizes auto-tuning.
+ * @author Jean-François DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+#ifndef _INC_MTP_AUTOTUNE_H_
+#define _INC_MTP_AUTOTUNE_H_
+
+void mtp_autotune_reset(mtp_ctx * ctx, int speed);
+void mtp_autotune_update(mtp_ctx * ctx, mtp_size bytes, uint64_t time_us);
+uint64_t mtp_autotune_get_time_us(void);
+
+#endif
@@ -409,6 +409,21 @@
 // Called to commit changes made by SendPartialObject and TruncateObject
 #define MTP_OPERATION_END_EDIT_OBJECT                       0x95C5
 
+// uMTP Responder extensions (UMTPRD_MTP_EXTENSION)
+
+// Search the objects by name : Storage ID, root folder handle, match mode + pattern string (data)
+#define MTP_OPERATION_FIND_OBJECTS                          0x9D01
+// Handles found by the last FindObjects, from the index given as parameter
+#define MTP_OPERATION_GET_FIND_RESULTS                      0x9D02
+// Folder content as a tar stream : Folder handle, format (tar / tar + zstd)
+#define MTP_OPERATION_GET_FOLDER_ARCHIVE                    0x9D03
+// Tar stream (data) unpacked in a folder : Storage ID, parent folder handle, format
+#define MTP_OPERATION_SEND_FOLDER_ARCHIVE                   0x9D04
+// Entries errors of the last SendFolderArchive, from the index given as parameter
+#define MTP_OPERATION_GET_ARCHIVE_ERRORS                    0x9D05
+// Objects changes since a token : Token (2 x UINT32), Storage ID
+#define MTP_OPERATION_GET_CHANGES                           0x9D06
+
 // MTP Response Codes
 #define MTP_RESPONSE_UNDEFINED                                  0x2000
 #define MTP_RESPONSE_OK                                         0x2001
@@ -453,6 +468,12 @@
 #define MTP_RESPONSE_SPECIFICATION_BY_DEPTH_UNSUPPORTED         0xA808
 #define MTP_RESPONSE_OBJECT_TOO_LARGE                           0xA809
 #define MTP_RESPONSE_OBJECT_PROP_NOT_SUPPORTED                  0xA80A
+
+// uMTP Responder extensions (UMTPRD_MTP_EXTENSION)
+
+// GetChanges : The token is older than the journal, a full sync is needed.
+#define MTP_RESPONSE_CHANGES_TOKEN_EXPIRED                      0xAD01
+
 #define MTP_RESPONSE_NO_RESPONSE                                0xFFFF
 
 // MTP Event Codes
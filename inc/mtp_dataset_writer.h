@@ -0,0 +1,56 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/**
+ * @file   mtp_dataset_writer.h
+ * @brief  Streaming dataset writer.
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+#ifndef _INC_MTP_DATASET_WRITER_H_
+#define _INC_MTP_DATASET_WRITER_H_
+
+typedef struct mtp_dataset_writer_
+{
+	mtp_ctx * ctx;
+
+	unsigned char * buffer;
+	int size;           // Buffer size
+	int ofs;            // Current offset in the buffer
+
+	int measure;        // 1 : Nothing is sent, only the dataset size is computed.
+	int error;
+
+	mtp_size length;    // Container length (0 : Set at the end, the dataset must fit in the buffer,
+	                    // DATASET_UNKNOWN_LENGTH : 0xFFFFFFFF container ended by a short packet)
+	mtp_size total;     // Bytes already sent (or measured)
+}mtp_dataset_writer;
+
+#define DATASET_UNKNOWN_LENGTH ((mtp_size)-1)
+
+void dataset_writer_init(mtp_ctx * ctx, mtp_dataset_writer * dsw, int measure);
+int dataset_writer_begin(mtp_dataset_writer * dsw, uint32_t tx_id, uint16_t code, mtp_size length);
+int dataset_writer_flush(mtp_dataset_writer * dsw);
+int dataset_writer_commit(mtp_dataset_writer * dsw, int ofs);
+int dataset_writer_put32(mtp_dataset_writer * dsw, uint32_t data);
+int dataset_writer_put_data(mtp_dataset_writer * dsw, void * data, int size);
+mtp_size dataset_writer_end(mtp_dataset_writer * dsw);
+
+#endif
@@ -0,0 +1,34 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * @file   mtp_events.h
+ * @brief  MTP events sender.
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+#ifndef _INC_MTP_EVENTS_H_
+#define _INC_MTP_EVENTS_H_
+
+int mtp_events_init(mtp_ctx * ctx);
+int mtp_events_deinit(mtp_ctx * ctx);
+
+int mtp_events_queue(mtp_ctx * ctx, uint32_t event, int nbparams, uint32_t * parameters);
+void mtp_events_flush(mtp_ctx * ctx);
+#endif
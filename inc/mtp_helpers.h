@@ -32,6 +32,7 @@ int poke08(void * buffer, int index, int maxsize, uint8_t  data);
 uint32_t peek(void * buffer, int index, int typesize);
 uint64_t peek64(void * buffer, int index, int typesize);
 int poke_string(void * buffer, int index, int maxsize, const char *str);
+int peek_string(void * buffer, int index, int maxsize, char * str, int maxstrsize);
 int poke_array(void * buffer, int index, int maxsize, int size, int elementsize, const unsigned char *bufferin,int prefixed);
 uint16_t posix_to_mtp_errcode(int err);
 
@@ -0,0 +1,79 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/**
+ * @file   mtp_journal.h
+ * @brief  Objects changes journal (GetChanges vendor operation).
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+#ifndef _INC_MTP_JOURNAL_H_
+#define _INC_MTP_JOURNAL_H_
+
+#include "mtp.h"
+#include "mtp_dataset_writer.h"
+
+enum
+{
+	JOURNAL_ADD = 1,
+	JOURNAL_REMOVE,
+	JOURNAL_MODIFY,
+	JOURNAL_RENAME
+};
+
+#define JOURNAL_FLAG_FOLDER 0x0001
+
+typedef struct journal_record_
+{
+	uint64_t seq;
+	uint32_t storage_id;
+	uint16_t type;
+	uint16_t flags;
+	uint32_t cookie;      // inotify rename cookie (live records only)
+	mtp_size size;
+	int64_t date;
+	char * path;          // Relative to the storage root
+	char * old_path;      // Rename : Previous path
+}journal_record;
+
+// Changes returned by a GetChanges
+typedef struct mtp_journal_changes_
+{
+	journal_record * records;
+	int nb;
+	uint64_t token;       // Token to give to the next GetChanges
+	int more;             // More changes after the token
+}mtp_journal_changes;
+
+// The db storage lock must be held by the callers of the recording functions.
+void mtp_journal_record(mtp_ctx * ctx, int type, uint32_t storage_id, char * path, uint32_t cookie);
+void mtp_journal_entry(mtp_ctx * ctx, int type, fs_entry * entry, uint32_t cookie);
+void mtp_journal_rename(mtp_ctx * ctx, uint32_t old_storage_id, char * old_path, uint32_t storage_id, char * path);
+
+void mtp_journal_session_open(mtp_ctx * ctx);
+void mtp_journal_rescan(mtp_ctx * ctx, uint32_t storage_id);
+void mtp_journal_save(mtp_ctx * ctx);
+void mtp_journal_deinit(mtp_ctx * ctx);
+
+uint32_t mtp_journal_get_changes(mtp_ctx * ctx, uint64_t token, uint32_t storage_id, mtp_journal_changes * changes);
+int mtp_journal_changes_dataset(mtp_dataset_writer * dsw, mtp_journal_changes * changes);
+void mtp_journal_free_changes(mtp_journal_changes * changes);
+
+#endif
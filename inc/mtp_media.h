@@ -0,0 +1,66 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/**
+ * @file   mtp_media.h
+ * @brief  Media files metadata indexer.
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+#ifndef _INC_MTP_MEDIA_H_
+#define _INC_MTP_MEDIA_H_
+
+enum
+{
+	MEDIA_STR_TITLE = 0,
+	MEDIA_STR_ARTIST,
+	MEDIA_STR_ALBUM,
+	MEDIA_STR_GENRE,
+	MEDIA_STR_DATE,      // Date taken (images) or release date (audio), MTP date string
+
+	MEDIA_STR_NB
+};
+
+// Metadata of a media object, attached to its fs_entry (entry->media).
+typedef struct mtp_media_info_
+{
+	mtp_size size;       // Object size and modification date when indexed
+	uint32_t date;
+
+	uint16_t format;
+	uint16_t track;
+	uint32_t duration;   // ms
+	uint32_t width;
+	uint32_t height;
+
+	uint16_t str_ofs[MEDIA_STR_NB];   // Offsets in strings (0xFFFF : not set)
+	char strings[];
+}mtp_media_info;
+
+uint16_t mtp_media_format(fs_entry * entry);
+
+mtp_media_info * mtp_media_get(mtp_ctx * ctx, fs_entry * entry, mtp_media_info ** tmp_info, int indexed_only);
+const char * mtp_media_string(mtp_media_info * info, int str_id);
+
+void mtp_media_queue(mtp_ctx * ctx, fs_entry * entry);
+void mtp_media_flush(mtp_ctx * ctx);
+void mtp_media_deinit(mtp_ctx * ctx);
+
+#endif
@@ -24,7 +24,14 @@
  */
 
 mtp_size send_file_data( mtp_ctx * ctx, fs_entry * entry,mtp_offset offset, mtp_size maxsize );
+
+int file_wrcache_open( mtp_ctx * ctx, int file, mtp_offset offset );
+unsigned char * file_wrcache_getbuf( mtp_ctx * ctx, int size );
+void file_wrcache_commit( mtp_ctx * ctx, int size );
+void file_wrcache_write( mtp_ctx * ctx, unsigned char * data, int size );
+int file_wrcache_close( mtp_ctx * ctx );
 int delete_tree(mtp_ctx * ctx,uint32_t handle);
+int sync_folder(mtp_ctx * ctx, fs_entry * entry, char * full_path, uint32_t parent_handle, uint32_t storage_id);
 
 int umount_store(mtp_ctx * ctx, int store_index, int update_flag);
 int mount_store(mtp_ctx * ctx, int store_index, int update_flag);
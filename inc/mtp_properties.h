@@ -27,6 +27,7 @@
 #define _INC_MTP_PROPERTIES_H_
 
 #include "mtp.h"
+#include "mtp_media.h"
 
 typedef struct profile_property_
 {
@@ -57,6 +58,24 @@ int setObjectPropValue(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, uint32_
 int build_device_properties_dataset(mtp_ctx * ctx,void * buffer, int maxsize,uint32_t property_id);
 int build_DevicePropValue_dataset(mtp_ctx * ctx,void * buffer, int maxsize,uint32_t prop_code);
 
-int build_objectproplist_dataset(mtp_ctx * ctx, void * buffer, int maxsize,fs_entry * entry, uint32_t handle,uint32_t format_id, uint32_t prop_code, uint32_t prop_group_code, uint32_t depth);
+// Values of an object properties list. Read once : The bulk lists are measured then sent.
+// (name and media stay valid within a db read section started before the read)
+typedef struct objectproplist_values_
+{
+	fs_entry * entry;
+	char * name;
+	mtp_size size;
+	uint32_t date;
+	uint16_t format;
+	mtp_media_info * media;
+	mtp_media_info * tmp_media;
+}objectproplist_values;
+
+int objectproplist_format_match(fs_entry * entry, uint32_t format_id);
+int objectproplist_read(mtp_ctx * ctx, fs_entry * entry, objectproplist_values * values, uint32_t prop_code, int use_index);
+int build_objectproplist_values(mtp_ctx * ctx, void * buffer, int * ofs, int maxsize, objectproplist_values * values, uint32_t prop_code, uint32_t prop_group_code);
+void objectproplist_release(objectproplist_values * values);
+int build_objectproplist_entry(mtp_ctx * ctx, void * buffer, int * ofs, int maxsize, fs_entry * entry, uint32_t prop_code, uint32_t prop_group_code, int use_index);
+void objectproplist_media_changed(mtp_ctx * ctx, uint32_t handle, uint16_t format, mtp_media_info * media);
 
 #endif
@@ -0,0 +1,38 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/**
+ * @file   mtp_search.h
+ * @brief  Objects search (FindObjects vendor extension).
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+#ifndef _INC_MTP_SEARCH_H_
+#define _INC_MTP_SEARCH_H_
+
+// FindObjects match modes (parameter 3)
+#define MTP_FIND_SUBSTRING  0x0000
+#define MTP_FIND_PREFIX     0x0001
+#define MTP_FIND_GLOB       0x0002
+
+uint32_t mtp_find_objects(mtp_ctx * ctx, uint32_t storage_id, uint32_t root_handle, uint32_t mode, char * pattern, int * incomplete);
+void mtp_find_free(mtp_ctx * ctx);
+
+#endif
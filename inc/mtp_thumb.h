@@ -0,0 +1,45 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/**
+ * @file   mtp_thumb.h
+ * @brief  Objects thumbnails.
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+#ifndef _INC_MTP_THUMB_H_
+#define _INC_MTP_THUMB_H_
+
+typedef struct mtp_thumb_info_
+{
+	uint16_t format;      // 0x0000 : No thumbnail
+	uint32_t size;        // 0 : Not known yet
+	uint32_t width;
+	uint32_t height;
+}mtp_thumb_info;
+
+int mtp_thumb_supported(char * name);
+int mtp_thumb_get_info(mtp_ctx * ctx, char * path, struct stat64 * st, mtp_thumb_info * info);
+unsigned char * mtp_thumb_get(mtp_ctx * ctx, char * path, struct stat64 * st, int * size);
+
+void mtp_thumb_init(mtp_ctx * ctx);
+void mtp_thumb_deinit(mtp_ctx * ctx);
+
+#endif
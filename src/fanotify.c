@@ -0,0 +1,426 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * @file   fanotify.c
+ * @brief  fanotify file system events backend.
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+// One filesystem mark reports the changes of a whole storage, without the inotify
+// per folder watches (max_user_watches) : The events give the parent folder file
+// handle and the entry name. The folders listed by the host are registered with
+// their file handle and get a watch descriptor : The events are translated to
+// inotify events and go through the inotify events processing.
+// Requires CAP_SYS_ADMIN and a 5.9+ kernel : inotify is used otherwise.
+
+#include "buildconf.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/statfs.h>
+
+#include "mtp.h"
+#include "fanotify.h"
+
+#include "logs_out.h"
+
+#define FANOTIFY_EVENTS ( FAN_CREATE | FAN_DELETE | FAN_MODIFY | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR )
+
+#define FANOTIFY_HASH_SIZE 256
+
+typedef struct fanotify_watch_
+{
+	int wd;
+
+	fsid_t fsid;
+	int handle_type;
+	unsigned int handle_bytes;
+	unsigned char handle[MAX_HANDLE_SZ];
+
+	struct fanotify_watch_ * next;
+}fanotify_watch;
+
+typedef struct fanotify_watches_
+{
+	pthread_mutex_t lock;
+	fanotify_watch * hash[FANOTIFY_HASH_SIZE];
+	int next_wd;
+}fanotify_watches;
+
+static uint32_t hash_handle( unsigned char * handle, unsigned int handle_bytes )
+{
+	uint32_t hash = 5381;
+	unsigned int i;
+
+	for( i = 0; i < handle_bytes; i++ )
+		hash = ((hash << 5) + hash) + handle[i];
+
+	return hash % FANOTIFY_HASH_SIZE;
+}
+
+// Must be called with the watches lock held.
+static fanotify_watch * find_watch( fanotify_watches * watches, fsid_t * fsid, int handle_type, unsigned char * handle, unsigned int handle_bytes )
+{
+	fanotify_watch * watch;
+
+	if( handle_bytes > MAX_HANDLE_SZ )
+		return NULL;
+
+	watch = watches->hash[hash_handle( handle, handle_bytes )];
+	while( watch )
+	{
+		if( watch->handle_type == handle_type && watch->handle_bytes == handle_bytes &&
+			!memcmp( &watch->fsid, fsid, sizeof(fsid_t) ) &&
+			!memcmp( watch->handle, handle, handle_bytes ) )
+		{
+			return watch;
+		}
+
+		watch = watch->next;
+	}
+
+	return NULL;
+}
+
+int fanotify_handler_init( mtp_ctx * ctx )
+{
+	fanotify_watches * watches;
+
+	if( !ctx->use_fanotify || ctx->no_inotify )
+		return -1;
+
+	if( ctx->fanotify_fd != -1 )
+		return 0;
+
+	ctx->fanotify_fd = fanotify_init( FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE );
+	if( ctx->fanotify_fd < 0 )
+	{
+		PRINT_WARN("fanotify not available (error %d), inotify used instead.", errno);
+		ctx->fanotify_fd = -1;
+		ctx->use_fanotify = 0;
+		return -1;
+	}
+
+	watches = malloc( sizeof(fanotify_watches) );
+	if( !watches )
+	{
+		close( ctx->fanotify_fd );
+		ctx->fanotify_fd = -1;
+		ctx->use_fanotify = 0;
+		return -1;
+	}
+
+	memset( watches, 0, sizeof(fanotify_watches) );
+	pthread_mutex_init( &watches->lock, NULL );
+	watches->next_wd = FANOTIFY_WD_BASE;
+
+	ctx->fanotify_watches = watches;
+
+	PRINT_DEBUG("fanotify_handler_init : fanotify_fd = %d", ctx->fanotify_fd);
+
+	// Wake up the events thread : The new descriptor is polled.
+	pthread_kill( ctx->inotify_thread, SIGUSR1 );
+
+	return 0;
+}
+
+int fanotify_handler_deinit( mtp_ctx * ctx )
+{
+	fanotify_watches * watches;
+	fanotify_watch * watch;
+	fanotify_watch * next;
+	int i;
+
+	if( ctx->fanotify_fd != -1 )
+	{
+		close( ctx->fanotify_fd );
+		ctx->fanotify_fd = -1;
+	}
+
+	watches = ctx->fanotify_watches;
+	if( watches )
+	{
+		for( i = 0; i < FANOTIFY_HASH_SIZE; i++ )
+		{
+			watch = watches->hash[i];
+			while( watch )
+			{
+				next = watch->next;
+				free( watch );
+				watch = next;
+			}
+		}
+
+		pthread_mutex_destroy( &watches->lock );
+		free( watches );
+		ctx->fanotify_watches = NULL;
+	}
+
+	return 0;
+}
+
+// Returns the folder watch descriptor, -1 if fanotify can't watch this folder.
+int fanotify_handler_addwatch( mtp_ctx * ctx, char * path )
+{
+	fanotify_watches * watches;
+	fanotify_watch * watch;
+	struct file_handle * fh;
+	struct statfs fs_stat;
+	unsigned char fh_buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+	uint32_t hash;
+	int mount_id, wd;
+
+	if( fanotify_handler_init( ctx ) < 0 )
+		return -1;
+
+	watches = ctx->fanotify_watches;
+
+	fh = (struct file_handle *)fh_buf;
+	fh->handle_bytes = MAX_HANDLE_SZ;
+
+	if( name_to_handle_at( AT_FDCWD, path, fh, &mount_id, 0 ) < 0 || statfs( path, &fs_stat ) < 0 )
+		return -1;
+
+	// The whole file system is marked : Adding it again only updates the mark.
+	if( fanotify_mark( ctx->fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_EVENTS, AT_FDCWD, path ) < 0 )
+	{
+		PRINT_DEBUG("fanotify_handler_addwatch : Can't mark %s (error %d)", path, errno);
+		return -1;
+	}
+
+	pthread_mutex_lock( &watches->lock );
+
+	watch = find_watch( watches, &fs_stat.f_fsid, fh->handle_type, fh->f_handle, fh->handle_bytes );
+	if( watch )
+	{
+		wd = watch->wd;
+	}
+	else
+	{
+		wd = -1;
+
+		watch = malloc( sizeof(fanotify_watch) );
+		if( watch )
+		{
+			memset( watch, 0, sizeof(fanotify_watch) );
+
+			watch->wd = watches->next_wd++;
+			watch->fsid = fs_stat.f_fsid;
+			watch->handle_type = fh->handle_type;
+			watch->handle_bytes = fh->handle_bytes;
+			memcpy( watch->handle, fh->f_handle, fh->handle_bytes );
+
+			hash = hash_handle( watch->handle, watch->handle_bytes );
+			watch->next = watches->hash[hash];
+			watches->hash[hash] = watch;
+
+			wd = watch->wd;
+		}
+	}
+
+	pthread_mutex_unlock( &watches->lock );
+
+	return wd;
+}
+
+int fanotify_handler_rmwatch( mtp_ctx * ctx, int wd )
+{
+	fanotify_watches * watches;
+	fanotify_watch ** prev;
+	fanotify_watch * watch;
+	int i, ret;
+
+	watches = ctx->fanotify_watches;
+	if( !watches || wd < FANOTIFY_WD_BASE )
+		return -1;
+
+	ret = -1;
+
+	pthread_mutex_lock( &watches->lock );
+
+	for( i = 0; i < FANOTIFY_HASH_SIZE && ret < 0; i++ )
+	{
+		prev = &watches->hash[i];
+		while( *prev )
+		{
+			watch = *prev;
+			if( watch->wd == wd )
+			{
+				*prev = watch->next;
+				free( watch );
+				ret = 0;
+				break;
+			}
+
+			prev = &watch->next;
+		}
+	}
+
+	pthread_mutex_unlock( &watches->lock );
+
+	return ret;
+}
+
+static int add_inotify_event( char * buffer, int size, int offset, int wd, uint32_t mask, const char * name )
+{
+	struct inotify_event * event;
+	int name_len, len;
+
+	name_len = 0;
+	if( name )
+		name_len = strlen( name ) + 1;
+
+	// Name padded to the next event alignment.
+	len = ( name_len + sizeof(struct inotify_event) - 1 ) & ~( sizeof(struct inotify_event) - 1 );
+
+	if( offset + (int)sizeof(struct inotify_event) + len > size )
+		return offset;
+
+	event = (struct inotify_event *)&buffer[offset];
+
+	memset( event, 0, sizeof(struct inotify_event) + len );
+	event->wd = wd;
+	event->mask = mask;
+	event->len = len;
+	if( name )
+		memcpy( event->name, name, name_len );
+
+	return offset + sizeof(struct inotify_event) + len;
+}
+
+static uint32_t inotify_mask( uint64_t fan_mask )
+{
+	uint32_t mask;
+
+	mask = 0;
+
+	if( fan_mask & FAN_CREATE )
+		mask |= IN_CREATE;
+
+	if( fan_mask & FAN_DELETE )
+		mask |= IN_DELETE;
+
+	if( fan_mask & FAN_MODIFY )
+		mask |= IN_MODIFY;
+
+	if( fan_mask & FAN_MOVED_FROM )
+		mask |= IN_MOVED_FROM;
+
+	if( fan_mask & FAN_MOVED_TO )
+		mask |= IN_MOVED_TO;
+
+	if( fan_mask & FAN_ONDIR )
+		mask |= IN_ISDIR;
+
+	return mask;
+}
+
+// Reads the pending fanotify events and translates them to inotify events.
+// Returns the inotify events buffer length, -1 on error.
+int fanotify_handler_read( mtp_ctx * ctx, char * buffer, int size )
+{
+	fanotify_watches * watches;
+	fanotify_watch * watch;
+	struct fanotify_event_metadata * metadata;
+	struct fanotify_event_info_fid * fid;
+	struct file_handle * fh;
+	char fan_buffer[16*1024] __attribute__ ((aligned(__alignof__(struct fanotify_event_metadata))));
+	char * name;
+	int len, offset, wd;
+	pid_t pid;
+
+	watches = ctx->fanotify_watches;
+	if( ctx->fanotify_fd == -1 || !watches )
+		return -1;
+
+	// Keep room for the translated events : A translated event is smaller than the fanotify one.
+	if( size > (int)sizeof(fan_buffer) )
+		size = sizeof(fan_buffer);
+
+	len = read( ctx->fanotify_fd, fan_buffer, size );
+	if( len < 0 )
+	{
+		if( errno == EAGAIN || errno == EINTR )
+			return 0;
+
+		return -1;
+	}
+
+	pid = getpid();
+	offset = 0;
+
+	metadata = (struct fanotify_event_metadata *)fan_buffer;
+	while( FAN_EVENT_OK( metadata, len ) )
+	{
+		if( metadata->vers != FANOTIFY_METADATA_VERSION )
+		{
+			PRINT_ERROR("fanotify_handler_read : Unsupported metadata version !");
+			return -1;
+		}
+
+		if( metadata->mask & FAN_Q_OVERFLOW )
+		{
+			offset = add_inotify_event( buffer, size, offset, -1, IN_Q_OVERFLOW, NULL );
+		}
+		else if( metadata->pid == pid )
+		{
+			// The responder own changes.
+			__atomic_fetch_add( &ctx->stats.inotify_echoes, 1, __ATOMIC_RELAXED );
+		}
+		else if( metadata->event_len >= metadata->metadata_len + sizeof(struct fanotify_event_info_fid) )
+		{
+			fid = (struct fanotify_event_info_fid *)( (char*)metadata + metadata->metadata_len );
+			fh = (struct file_handle *)fid->handle;
+			name = (char *)( fh->f_handle + fh->handle_bytes );
+
+			if( fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME &&
+				name < (char*)metadata + metadata->event_len &&
+				strcmp( name, "." ) )
+			{
+				pthread_mutex_lock( &watches->lock );
+
+				watch = find_watch( watches, (fsid_t *)&fid->fsid, fh->handle_type, fh->f_handle, fh->handle_bytes );
+				wd = watch ? watch->wd : -1;
+
+				pthread_mutex_unlock( &watches->lock );
+
+				// Folders never listed by the host : Nothing to update.
+				if( wd != -1 )
+					offset = add_inotify_event( buffer, size, offset, wd, inotify_mask( metadata->mask ), name );
+			}
+		}
+
+		if( metadata->fd >= 0 )
+			close( metadata->fd );
+
+		metadata = FAN_EVENT_NEXT( metadata, len );
+	}
+
+	return offset;
+}
@@ -0,0 +1,658 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/**
+ * @file   fs_cache.c
+ * @brief  Open files and read blocks cache.
+ * @author Jean-François DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+// Hosts stream media files with long sequences of GetPartialObject requests.
+// The files stay open between the requests (LRU of file descriptors keyed by handle),
+// and the aligned blocks partially used by a request are kept for the next one.
+// The access pattern of each open file is tracked : sequential streams get an
+// increasing prefetch window, random reads only fetch the requested span.
+// Optionally, the object metadata requests (GetObjectInfo, GetObjectPropValue...)
+// trigger a prefetch of the object content, as they usually precede a GetObject.
+// fs_cache_open() must be called with the db lock held (db access),
+// the other functions can be used during the unlocked data phases.
+
+#include "buildconf.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "mtp.h"
+#include "fs_cache.h"
+
+#include "logs_out.h"
+
+static void drop_blocks(fs_cache * cache, uint32_t handle)
+{
+	int i;
+
+	for( i = 0; i < CONFIG_BLOCK_CACHE_NB; i++ )
+	{
+		if( cache->blocks[i].handle == handle )
+		{
+			cache->blocks[i].handle = 0;
+			cache->blocks[i].valid = 0;
+		}
+	}
+}
+
+static void drop_fd(mtp_ctx * ctx, fs_cache_fd * slot)
+{
+	fs_cache * cache;
+
+	cache = &ctx->file_cache;
+
+	if( slot->fd != -1 )
+	{
+		if( slot->meta_prefetch )
+		{
+			// Prefetched, never read.
+			ctx->stats.prefetch_wasted++;
+
+			cache->prefetch_pending -= slot->meta_prefetch;
+			slot->meta_prefetch = 0;
+		}
+
+		drop_blocks(cache, slot->handle);
+
+		close(slot->fd);
+
+		slot->fd = -1;
+		slot->handle = 0;
+		slot->in_use = 0;
+		slot->stale = 0;
+		slot->access = FS_ACCESS_UNKNOWN;
+		slot->seq_count = 0;
+		slot->next_offset = 0;
+		slot->prefetch_end = 0;
+		slot->readahead = 0;
+	}
+}
+
+static fs_cache_fd * find_fd(fs_cache * cache, uint32_t handle)
+{
+	int i;
+
+	for( i = 0; i < CONFIG_FD_CACHE_SIZE; i++ )
+	{
+		if( cache->fds[i].fd != -1 && cache->fds[i].handle == handle )
+			return &cache->fds[i];
+	}
+
+	return NULL;
+}
+
+static int64_t get_mtime(struct stat * filestat)
+{
+	return ((int64_t)filestat->st_mtim.tv_sec * 1000000000) + filestat->st_mtim.tv_nsec;
+}
+
+void fs_cache_init(mtp_ctx * ctx)
+{
+	int i;
+
+	memset(&ctx->file_cache, 0, sizeof(fs_cache));
+
+	for( i = 0; i < CONFIG_FD_CACHE_SIZE; i++ )
+		ctx->file_cache.fds[i].fd = -1;
+
+	pthread_mutex_init( &ctx->file_cache.lock, NULL );
+}
+
+void fs_cache_deinit(mtp_ctx * ctx)
+{
+	fs_cache_flush(ctx);
+
+	if( ctx->file_cache.blocks_buffer )
+		free( ctx->file_cache.blocks_buffer );
+
+	ctx->file_cache.blocks_buffer = NULL;
+
+	pthread_mutex_destroy( &ctx->file_cache.lock );
+}
+
+static int cache_open(mtp_ctx * ctx, fs_entry * entry)
+{
+	fs_cache * cache;
+	fs_cache_fd * slot;
+	struct stat filestat;
+	int i,fd;
+
+	cache = &ctx->file_cache;
+
+	// Already opened by an edit session : use it as is.
+	if( entry->file_descriptor > 0 && !find_fd(cache, entry->handle) )
+		return entry->file_descriptor;
+
+	slot = find_fd(cache, entry->handle);
+	if( slot )
+	{
+		ctx->stats.fd_cache_hits++;
+
+		// Changed behind our back (no inotify event yet, or inotify disabled) ?
+		if( fstat(slot->fd, &filestat) || filestat.st_nlink == 0 )
+		{
+			drop_fd(ctx, slot);
+			slot = NULL;
+		}
+		else
+		{
+			if( filestat.st_size != slot->size || get_mtime(&filestat) != slot->mtime )
+			{
+				drop_blocks(cache, slot->handle);
+				slot->size = filestat.st_size;
+				slot->mtime = get_mtime(&filestat);
+				slot->prefetch_end = 0;
+			}
+		}
+	}
+
+	if( !slot )
+	{
+		ctx->stats.fd_cache_misses++;
+
+		entry->file_descriptor = -1;
+		fd = entry_open(ctx->fs_db, entry, O_RDONLY | O_LARGEFILE, 0);
+		if( fd == -1 )
+			return -1;
+
+		// Least recently used slot
+		for( i = 0; i < CONFIG_FD_CACHE_SIZE; i++ )
+		{
+			if( cache->fds[i].in_use )
+				continue;
+
+			if( !slot || cache->fds[i].fd == -1 || ( slot->fd != -1 && cache->fds[i].last_use < slot->last_use ) )
+				slot = &cache->fds[i];
+		}
+
+		if( !slot )
+			return fd;
+
+		drop_fd(ctx, slot);
+
+		slot->fd = fd;
+		slot->handle = entry->handle;
+		slot->storage_id = entry->storage_id;
+
+		if( !fstat(fd, &filestat) )
+		{
+			slot->size = filestat.st_size;
+			slot->mtime = get_mtime(&filestat);
+		}
+	}
+
+	slot->in_use = 1;
+	slot->last_use = ++cache->use_counter;
+
+	entry->file_descriptor = slot->fd;
+
+	return slot->fd;
+}
+
+static void cache_release(mtp_ctx * ctx, fs_entry * entry)
+{
+	fs_cache_fd * slot;
+
+	if( !entry )
+		return;
+
+	slot = find_fd(&ctx->file_cache, entry->handle);
+	if( slot && slot->fd == entry->file_descriptor )
+	{
+		// Keep the file open for the next request.
+		slot->in_use = 0;
+		entry->file_descriptor = -1;
+
+		// Invalidated during the transfer : deferred close.
+		if( slot->stale )
+			drop_fd(ctx, slot);
+	}
+	else
+	{
+		entry_close(ctx->fs_db, entry);
+	}
+}
+
+static void cache_prefetch(mtp_ctx * ctx, fs_entry * entry)
+{
+	fs_cache * cache;
+	fs_cache_fd * slot;
+	mtp_size len;
+
+	cache = &ctx->file_cache;
+
+	if( !ctx->prefetch_size || ( entry->flags & ENTRY_IS_DIR ) || entry->size <= 0 )
+		return;
+
+	// Opened for edition : leave it alone.
+	if( entry->file_descriptor > 0 )
+		return;
+
+	// Already prefetched or being read ?
+	slot = find_fd(cache, entry->handle);
+	if( slot && ( slot->meta_prefetch || slot->access != FS_ACCESS_UNKNOWN ) )
+		return;
+
+	// Small files : the whole content. Larger files : the head.
+	len = entry->size;
+	if( len > ctx->prefetch_size )
+		len = ctx->prefetch_size;
+
+	if( cache->prefetch_pending + len > ctx->prefetch_budget )
+	{
+		ctx->stats.prefetch_skipped++;
+		return;
+	}
+
+	if( cache_open(ctx, entry) == -1 )
+		return;
+
+	slot = find_fd(cache, entry->handle);
+	if( slot && slot->fd == entry->file_descriptor )
+	{
+		posix_fadvise( slot->fd, 0, len, POSIX_FADV_WILLNEED );
+
+		slot->meta_prefetch = len;
+		cache->prefetch_pending += len;
+
+		ctx->stats.prefetch_issued++;
+		ctx->stats.file_prefetch_bytes += len;
+	}
+
+	cache_release(ctx, entry);
+}
+
+static void cache_access(mtp_ctx * ctx, fs_entry * entry, mtp_offset offset, mtp_size size)
+{
+	fs_cache_fd * slot;
+	mtp_offset start,end;
+
+	slot = find_fd(&ctx->file_cache, entry->handle);
+	if( !slot || slot->fd != entry->file_descriptor )
+		return;
+
+	if( slot->meta_prefetch )
+	{
+		if( offset < slot->meta_prefetch )
+			ctx->stats.prefetch_hits++;
+		else
+			ctx->stats.prefetch_wasted++;
+
+		ctx->file_cache.prefetch_pending -= slot->meta_prefetch;
+		slot->meta_prefetch = 0;
+	}
+
+	// Does this request continue the previous one ?
+	if( offset && offset == slot->next_offset )
+		slot->seq_count++;
+	else
+		slot->seq_count = 0;
+
+	slot->next_offset = offset + size;
+
+	if( slot->seq_count || size >= ctx->read_file_chunk_size )
+	{
+		// Sequential stream (or whole object) : ramp up the prefetch window.
+		if( slot->access != FS_ACCESS_SEQUENTIAL )
+		{
+			posix_fadvise( slot->fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+			slot->access = FS_ACCESS_SEQUENTIAL;
+		}
+
+		if( !slot->seq_count )
+		{
+			slot->readahead = CONFIG_READAHEAD_MIN;
+			slot->prefetch_end = 0;
+		}
+		else
+		{
+			if( slot->readahead < CONFIG_READAHEAD_MAX )
+				slot->readahead *= 2;
+		}
+
+		// Fetch the data expected by the next request while this one is sent.
+		start = offset + size;
+		if( start < slot->prefetch_end )
+			start = slot->prefetch_end;
+
+		end = offset + size + slot->readahead;
+		if( end > entry->size )
+			end = entry->size;
+
+		if( end > start )
+		{
+			posix_fadvise( slot->fd, start, end - start, POSIX_FADV_WILLNEED );
+
+			ctx->stats.file_prefetch_bytes += end - start;
+			slot->prefetch_end = end;
+		}
+	}
+	else
+	{
+		// Random access (metadata readers, seeking) : no read-ahead.
+		if( slot->access != FS_ACCESS_RANDOM )
+		{
+			posix_fadvise( slot->fd, 0, 0, POSIX_FADV_RANDOM );
+			slot->access = FS_ACCESS_RANDOM;
+		}
+
+		slot->prefetch_end = 0;
+	}
+}
+
+static fs_cache_block * get_block(fs_cache * cache, uint32_t handle, mtp_offset offset)
+{
+	int i;
+
+	for( i = 0; i < CONFIG_BLOCK_CACHE_NB; i++ )
+	{
+		if( cache->blocks[i].handle == handle && cache->blocks[i].offset == offset )
+			return &cache->blocks[i];
+	}
+
+	return NULL;
+}
+
+static fs_cache_block * load_block(fs_cache * cache, int fd, uint32_t handle, mtp_offset offset)
+{
+	fs_cache_block * block;
+	int i,ret;
+
+	if( !cache->blocks_buffer )
+	{
+		cache->blocks_buffer = malloc( CONFIG_BLOCK_CACHE_NB * CONFIG_BLOCK_CACHE_BLOCK_SIZE );
+		if( !cache->blocks_buffer )
+			return NULL;
+
+		for( i = 0; i < CONFIG_BLOCK_CACHE_NB; i++ )
+			cache->blocks[i].data = &cache->blocks_buffer[i * CONFIG_BLOCK_CACHE_BLOCK_SIZE];
+	}
+
+	block = &cache->blocks[0];
+	for( i = 1; i < CONFIG_BLOCK_CACHE_NB; i++ )
+	{
+		if( !block->handle )
+			break;
+
+		if( !cache->blocks[i].handle || cache->blocks[i].last_use < block->last_use )
+			block = &cache->blocks[i];
+	}
+
+	block->handle = 0;
+
+	do
+	{
+		ret = pread( fd, block->data, CONFIG_BLOCK_CACHE_BLOCK_SIZE, offset );
+	}while( ret < 0 && errno == EINTR );
+
+	if( ret < 0 )
+		return NULL;
+
+	block->handle = handle;
+	block->offset = offset;
+	block->valid = ret;
+
+	return block;
+}
+
+static int cache_read(mtp_ctx * ctx, fs_entry * entry, unsigned char * buffer_out, mtp_offset offset, mtp_size size)
+{
+	fs_cache * cache;
+	fs_cache_fd * slot;
+	fs_cache_block * block;
+	mtp_size done,len;
+	mtp_offset pos,block_offset;
+	int in_block,ret,random_access;
+
+	cache = &ctx->file_cache;
+
+	if( entry->file_descriptor == -1 )
+		return 0;
+
+	slot = find_fd(cache, entry->handle);
+	random_access = ( slot && slot->access == FS_ACCESS_RANDOM );
+
+	done = 0;
+	while( done < size )
+	{
+		pos = offset + done;
+		block_offset = pos & ~((mtp_offset)CONFIG_BLOCK_CACHE_BLOCK_SIZE - 1);
+		in_block = pos - block_offset;
+
+		len = size - done;
+		if( len > CONFIG_BLOCK_CACHE_BLOCK_SIZE - in_block )
+			len = CONFIG_BLOCK_CACHE_BLOCK_SIZE - in_block;
+
+		block = get_block(cache, entry->handle, block_offset);
+		if( block )
+		{
+			ctx->stats.block_cache_hits++;
+		}
+		else
+		{
+			if( random_access || ( !in_block && len == CONFIG_BLOCK_CACHE_BLOCK_SIZE ) )
+			{
+				// Whole blocks : read them straight to the caller buffer.
+				// Random access : read only the requested span (the page cache works at the page granularity).
+				if( random_access )
+					len = size - done;
+				else
+					len = ( (size - done) / CONFIG_BLOCK_CACHE_BLOCK_SIZE ) * CONFIG_BLOCK_CACHE_BLOCK_SIZE;
+
+				// Don't block the cache users (inotify thread...) during the storage access.
+				pthread_mutex_unlock( &cache->lock );
+
+				ret = pread( entry->file_descriptor, &buffer_out[done], len, pos );
+
+				pthread_mutex_lock( &cache->lock );
+				if( ret < 0 )
+				{
+					if( errno == EINTR )
+						continue;
+
+					return done ? done : -1;
+				}
+
+				ctx->stats.file_read_bytes += ret;
+				done += ret;
+
+				if( ret < len )
+					break;
+
+				continue;
+			}
+
+			// Partially used block : keep it for the next request.
+			ctx->stats.block_cache_misses++;
+
+			block = load_block(cache, entry->file_descriptor, entry->handle, block_offset);
+			if( !block )
+				return done ? done : -1;
+
+			ctx->stats.file_read_bytes += block->valid;
+		}
+
+		block->last_use = ++cache->use_counter;
+
+		if( in_block + len > block->valid )
+		{
+			// End of file
+			if( block->valid > in_block )
+			{
+				memcpy( &buffer_out[done], &block->data[in_block], block->valid - in_block );
+				done += block->valid - in_block;
+			}
+			break;
+		}
+
+		memcpy( &buffer_out[done], &block->data[in_block], len );
+		done += len;
+	}
+
+	return done;
+}
+
+static void cache_invalidate(mtp_ctx * ctx, uint32_t handle)
+{
+	fs_cache_fd * slot;
+
+	slot = find_fd(&ctx->file_cache, handle);
+	if( slot )
+	{
+		if( slot->in_use )
+		{
+			drop_blocks(&ctx->file_cache, handle);
+			slot->stale = 1;
+		}
+		else
+			drop_fd(ctx, slot);
+	}
+	else
+		drop_blocks(&ctx->file_cache, handle);
+}
+
+static void cache_invalidate_storage(mtp_ctx * ctx, uint32_t storage_id)
+{
+	int i;
+
+	for( i = 0; i < CONFIG_FD_CACHE_SIZE; i++ )
+	{
+		if( ctx->file_cache.fds[i].fd != -1 && ctx->file_cache.fds[i].storage_id == storage_id )
+		{
+			if( ctx->file_cache.fds[i].in_use )
+				ctx->file_cache.fds[i].stale = 1;
+			else
+				drop_fd(ctx, &ctx->file_cache.fds[i]);
+		}
+	}
+}
+
+static void cache_flush(mtp_ctx * ctx)
+{
+	int i;
+
+	for( i = 0; i < CONFIG_FD_CACHE_SIZE; i++ )
+	{
+		if( ctx->file_cache.fds[i].in_use )
+			ctx->file_cache.fds[i].stale = 1;
+		else
+			drop_fd(ctx, &ctx->file_cache.fds[i]);
+	}
+
+	for( i = 0; i < CONFIG_BLOCK_CACHE_NB; i++ )
+		ctx->file_cache.blocks[i].handle = 0;
+}
+
+// Locked entry points
+
+int fs_cache_open(mtp_ctx * ctx, fs_entry * entry)
+{
+	int ret;
+
+	pthread_mutex_lock( &ctx->file_cache.lock );
+	ret = cache_open(ctx, entry);
+	pthread_mutex_unlock( &ctx->file_cache.lock );
+
+	return ret;
+}
+
+void fs_cache_release(mtp_ctx * ctx, fs_entry * entry)
+{
+	pthread_mutex_lock( &ctx->file_cache.lock );
+	cache_release(ctx, entry);
+	pthread_mutex_unlock( &ctx->file_cache.lock );
+}
+
+void fs_cache_prefetch(mtp_ctx * ctx, fs_entry * entry)
+{
+	pthread_mutex_lock( &ctx->file_cache.lock );
+	cache_prefetch(ctx, entry);
+	pthread_mutex_unlock( &ctx->file_cache.lock );
+}
+
+// Prefetch from a lock-free lookup section : the open needs the db lock.
+void fs_cache_prefetch_handle(mtp_ctx * ctx, uint32_t handle)
+{
+	fs_entry * entry;
+
+	if( !ctx->prefetch_size || !ctx->fs_db )
+		return;
+
+	if( mtp_db_lock( ctx ) )
+		return;
+
+	entry = get_entry_by_handle(ctx->fs_db, handle);
+	if( entry )
+		fs_cache_prefetch(ctx, entry);
+
+	mtp_db_unlock( ctx );
+}
+
+void fs_cache_access(mtp_ctx * ctx, fs_entry * entry, mtp_offset offset, mtp_size size)
+{
+	pthread_mutex_lock( &ctx->file_cache.lock );
+	cache_access(ctx, entry, offset, size);
+	pthread_mutex_unlock( &ctx->file_cache.lock );
+}
+
+int fs_cache_read(mtp_ctx * ctx, fs_entry * entry, unsigned char * buffer_out, mtp_offset offset, mtp_size size)
+{
+	int ret;
+
+	pthread_mutex_lock( &ctx->file_cache.lock );
+	ret = cache_read(ctx, entry, buffer_out, offset, size);
+	pthread_mutex_unlock( &ctx->file_cache.lock );
+
+	return ret;
+}
+
+void fs_cache_invalidate(mtp_ctx * ctx, uint32_t handle)
+{
+	pthread_mutex_lock( &ctx->file_cache.lock );
+	cache_invalidate(ctx, handle);
+	pthread_mutex_unlock( &ctx->file_cache.lock );
+}
+
+void fs_cache_invalidate_storage(mtp_ctx * ctx, uint32_t storage_id)
+{
+	pthread_mutex_lock( &ctx->file_cache.lock );
+	cache_invalidate_storage(ctx, storage_id);
+	pthread_mutex_unlock( &ctx->file_cache.lock );
+}
+
+void fs_cache_flush(mtp_ctx * ctx)
+{
+	pthread_mutex_lock( &ctx->file_cache.lock );
+	cache_flush(ctx);
+	pthread_mutex_unlock( &ctx->file_cache.lock );
+}
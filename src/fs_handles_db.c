@@ -30,9 +30,11 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <dirent.h>
 #include <errno.h>
 
@@ -42,6 +44,7 @@
 
 #include "fs_handles_db.h"
 #include "inotify.h"
+#include "fs_cache.h"
 #include "logs_out.h"
 #include "hash_utils.h"
 
@@ -124,6 +127,7 @@ int fs_entry_stat(char *path, filefoundinfo* fileinfo)
 			fileinfo->isdirectory = 0;
 
 		fileinfo->size = fileStat.st_size;
+		fileinfo->date = fileStat.st_mtime;
 
 		i = strlen(path);
 		while( i )
@@ -144,11 +148,38 @@ int fs_entry_stat(char *path, filefoundinfo* fileinfo)
 
 	PRINT_WARN("stat64(%s) error: %s",path, strerror(errno));
 	fileinfo->size = 0;
+	fileinfo->date = 0;
 	fileinfo->filename[0] = '\0';
 
 	return 0;
 }
 
+int fs_preallocate(int file, mtp_size size)
+{
+	struct statvfs64 fsinfo;
+
+	if( size <= 0 )
+		return 0;
+
+	// Reserve the blocks without changing the file size :
+	// the final size is set once the data phase is done.
+	if( !fallocate64(file, FALLOC_FL_KEEP_SIZE, 0, size) )
+		return 0;
+
+	if( errno == ENOSPC || errno == EFBIG )
+		return ENOSPC;
+
+	// fallocate not supported by this file system.
+	// At least check that there is enough free space.
+	if( !fstatvfs64(file, &fsinfo) )
+	{
+		if( (mtp_size)fsinfo.f_bavail * (mtp_size)fsinfo.f_frsize < size )
+			return ENOSPC;
+	}
+
+	return 0;
+}
+
 DIR * fs_find_first_file(char *folder, filefoundinfo* fileinfo)
 {
 	struct dirent *d;
@@ -237,50 +268,338 @@ fs_handles_db * init_fs_db(void * mtp_ctx)
 	if( db )
 	{
 		memset(db,0,sizeof(fs_handles_db));
-		db->next_handle = 0x00000001;
 		db->mtp_ctx = mtp_ctx;
+		db->epoch = 1;
 	}
 
 	return db;
 }
 
-void deinit_fs_db(fs_handles_db * fsh)
+static fs_db_shard * get_shard_by_index(fs_handles_db * db, int index)
 {
-	if (fsh)
+	if( !db || index < 0 || index >= FS_DB_MAX_SHARDS )
+		return NULL;
+
+	return __atomic_load_n(&db->shards[index], __ATOMIC_ACQUIRE);
+}
+
+fs_db_shard * fs_db_get_shard(fs_handles_db * db, uint32_t storage_id)
+{
+	fs_db_shard * shard;
+	int i;
+
+	if( !db )
+		return NULL;
+
+	for( i = 0; i < FS_DB_MAX_SHARDS; i++ )
 	{
-		for (int i = 0; i < HASH_TABLE_SIZE; i++)
+		shard = get_shard_by_index(db, i);
+		if( shard && shard->storage_id == storage_id )
+			return shard;
+	}
+
+	return NULL;
+}
+
+// Must be called with the storage lock held.
+static fs_db_shard * alloc_shard(fs_handles_db * db, uint32_t storage_id)
+{
+	fs_db_shard * shard;
+	int index;
+
+	shard = fs_db_get_shard(db, storage_id);
+	if( shard )
+		return shard;
+
+	index = mtp_get_storage_index_by_id(db->mtp_ctx, storage_id);
+	if( index < 0 || index >= FS_DB_MAX_SHARDS )
+		return NULL;
+
+	// Storage slot reused : keep the previous handles range.
+	shard = db->shards[index];
+	if( shard )
+	{
+		shard->storage_id = storage_id;
+		return shard;
+	}
+
+	shard = malloc(sizeof(fs_db_shard));
+	if( !shard )
+		return NULL;
+
+	memset(shard, 0, sizeof(fs_db_shard));
+	shard->storage_id = storage_id;
+	shard->next_handle = ( (uint32_t)index << FS_DB_SHARD_SHIFT ) | 0x00000001;
+	shard->db = db;
+
+	__atomic_store_n(&db->shards[index], shard, __ATOMIC_RELEASE);
+
+	return shard;
+}
+
+// Lock-free readers : Each reader thread publishes the epoch it entered with.
+// Memory retired by a writer is released once every reader has left the epochs
+// preceding the retirement.
+// The reader slots are given back when the threads exit (the io thread is created
+// again at each USB connection).
+
+static uint32_t reader_slots_used = 0;   // Slots bitmap
+static int reader_slots_warned = 0;
+static pthread_key_t reader_key;
+static pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+static __thread int reader_slot = -1;
+static __thread int reader_depth = 0;
+
+static void release_reader_slot(void * arg)
+{
+	int slot;
+
+	slot = (int)(intptr_t)arg - 1;
+
+	__atomic_fetch_and(&reader_slots_used, ~( 1U << slot ), __ATOMIC_RELEASE);
+}
+
+static void create_reader_key(void)
+{
+	pthread_key_create(&reader_key, release_reader_slot);
+}
+
+static int alloc_reader_slot(void)
+{
+	uint32_t used;
+	int slot;
+
+	pthread_once(&reader_key_once, create_reader_key);
+
+	used = __atomic_load_n(&reader_slots_used, __ATOMIC_RELAXED);
+	do
+	{
+		for( slot = 0; slot < DB_MAX_READERS; slot++ )
 		{
-			hash_node *node = &fsh->hash_table_by_name[i];
-			if (node->entries)
-			{
-				for (uint32_t j = 0; j < node->size; j++)
-				{
-					if (node->entries[j]->watch_descriptor != -1)
-					{
-						inotify_handler_rmwatch(fsh->mtp_ctx, node->entries[j]->watch_descriptor);
-					}
+			if( !( used & ( 1U << slot ) ) )
+				break;
+		}
 
-				}
-				free(node->entries);
-			}
+		if( slot == DB_MAX_READERS )
+			return -1;
+
+	}while( !__atomic_compare_exchange_n(&reader_slots_used, &used, used | ( 1U << slot ), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) );
+
+	// Released by the key destructor at the thread exit.
+	if( pthread_setspecific(reader_key, (void *)(intptr_t)( slot + 1 )) )
+	{
+		__atomic_fetch_and(&reader_slots_used, ~( 1U << slot ), __ATOMIC_RELEASE);
+		return -1;
+	}
+
+	return slot;
+}
+
+int fs_db_read_lock(fs_handles_db * db)
+{
+	uint64_t epoch;
+
+	if( reader_slot < 0 )
+	{
+		// No free slot : The db lock is used, a slot may be free at the next call.
+		reader_slot = alloc_reader_slot();
+		if( reader_slot < 0 )
+		{
+			if( !__atomic_exchange_n(&reader_slots_warned, 1, __ATOMIC_RELAXED) )
+				PRINT_WARN("fs_db_read_lock : Too many reader threads, using the db lock");
+
+			return -1;
 		}
+	}
 
-		entry_close(fsh, fsh->entry_list);
+	if( !reader_depth++ )
+	{
+		epoch = __atomic_load_n(&db->epoch, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&db->reader_epoch[reader_slot], epoch, __ATOMIC_SEQ_CST);
+	}
 
-		// Free pool memory
-		fs_entry_pool_block *current = fsh->pool_head;
-		while (current)
+	return 0;
+}
+
+void fs_db_read_unlock(fs_handles_db * db)
+{
+	if( reader_slot < 0 || !reader_depth )
+		return;
+
+	if( !--reader_depth )
+		__atomic_store_n(&db->reader_epoch[reader_slot], 0, __ATOMIC_RELEASE);
+}
+
+static void reclaim_retired(fs_db_shard * shard, int force)
+{
+	fs_handles_db * db = shard->db;
+	db_retired *item, **prev;
+	uint64_t min_epoch, epoch;
+	int i;
+
+	min_epoch = UINT64_MAX;
+	for( i = 0; i < DB_MAX_READERS && !force; i++ )
+	{
+		epoch = __atomic_load_n(&db->reader_epoch[i], __ATOMIC_SEQ_CST);
+		if( epoch && epoch < min_epoch )
+			min_epoch = epoch;
+	}
+
+	prev = &shard->retired;
+	item = shard->retired;
+	while( item )
+	{
+		if( force || item->epoch < min_epoch )
+		{
+			*prev = item->next;
+			free(item->ptr);
+			free(item);
+			item = *prev;
+		}
+		else
+		{
+			prev = &item->next;
+			item = item->next;
+		}
+	}
+}
+
+// Must be called by a writer (storage lock held) : Frees the memory once no reader can see it.
+void fs_db_retire(fs_db_shard * shard, void * ptr)
+{
+	db_retired *item;
+
+	if( !ptr || !shard )
+		return;
+
+	item = malloc(sizeof(db_retired));
+	if( !item )
+	{
+		// Can't track it : keep it allocated rather than risk a reader use-after-free.
+		PRINT_ERROR("fs_db_retire : Memory allocation error");
+		return;
+	}
+
+	item->ptr = ptr;
+	item->epoch = __atomic_fetch_add(&shard->db->epoch, 1, __ATOMIC_SEQ_CST);
+	item->next = shard->retired;
+	shard->retired = item;
+
+	reclaim_retired(shard, 0);
+}
+
+static void rmwatch_shard(fs_db_shard * shard)
+{
+	fs_entry * entry;
+
+	for( entry = shard->entry_list; entry; entry = entry->next )
+	{
+		if( entry->watch_descriptor != -1 )
+		{
+			inotify_handler_rmwatch(shard->db->mtp_ctx, entry->watch_descriptor);
+			entry->watch_descriptor = -1;
+		}
+	}
+}
+
+// Storage unmounted : drop its objects. Only this storage shard is walked.
+// The entries memory is kept until the db release (pinned entries, lock-free readers).
+// Must be called with the storage lock held.
+void fs_db_drop_storage(fs_handles_db * db, uint32_t storage_id)
+{
+	fs_db_shard * shard;
+	fs_entry * entry;
+	hash_bucket * bucket;
+	int i;
+
+	shard = fs_db_get_shard(db, storage_id);
+	if( !shard )
+		return;
+
+	rmwatch_shard(shard);
+
+	for( entry = shard->entry_list; entry; entry = entry->next )
+	{
+		if( entry->storage_id == storage_id )
+			entry->flags |= ENTRY_IS_DELETED;
+	}
+
+	shard->deletions++;
+
+	// Empty the indexes : the deleted entries don't slow down the lookups anymore.
+	for( i = 0; i < HASH_TABLE_SIZE; i++ )
+	{
+		bucket = shard->hash_table_by_name[i].bucket;
+		if( bucket )
+		{
+			__atomic_store_n(&shard->hash_table_by_name[i].bucket, NULL, __ATOMIC_RELEASE);
+			fs_db_retire(shard, bucket);
+		}
+
+		bucket = shard->hash_table_by_handle[i].bucket;
+		if( bucket )
 		{
-			fs_entry_pool_block *next = current->next;
-			for (int i = 0; i < POOL_BLOCK_SIZE; i++)
+			__atomic_store_n(&shard->hash_table_by_handle[i].bucket, NULL, __ATOMIC_RELEASE);
+			fs_db_retire(shard, bucket);
+		}
+	}
+}
+
+static void free_shard(fs_db_shard * shard)
+{
+	fs_entry_pool_block *current, *next;
+	fs_entry * entry;
+	int i;
+
+	rmwatch_shard(shard);
+
+	for (i = 0; i < HASH_TABLE_SIZE; i++)
+	{
+		free_hash_node(&shard->hash_table_by_name[i]);
+		free_hash_node(&shard->hash_table_by_handle[i]);
+	}
+
+	reclaim_retired(shard, 1);
+
+	free(shard->name_index);
+
+	for( entry = shard->entry_list; entry; entry = entry->next )
+		entry_close(shard->db, entry);
+
+	// Free pool memory
+	current = shard->pool_head;
+	while (current)
+	{
+		next = current->next;
+		for (i = 0; i < POOL_BLOCK_SIZE; i++)
+		{
+			if (current->entries[i].name)
 			{
-				if (current->entries[i].name)
-				{
-					free(current->entries[i].name);
-				}
+				free(current->entries[i].name);
 			}
-			free(current);
-			current = next;
+
+			free(current->entries[i].media);
+		}
+		free(current);
+		current = next;
+	}
+
+	free(shard);
+}
+
+void deinit_fs_db(fs_handles_db * fsh)
+{
+	if (fsh)
+	{
+		mtp_print_session_stats(fsh->mtp_ctx);
+
+		// Handles are only valid during the session.
+		fs_cache_flush(fsh->mtp_ctx);
+
+		for (int i = 0; i < FS_DB_MAX_SHARDS; i++)
+		{
+			if (fsh->shards[i])
+				free_shard(fsh->shards[i]);
 		}
 
 		free(fsh);
@@ -289,29 +608,43 @@ void deinit_fs_db(fs_handles_db * fsh)
 
 fs_entry * search_entry(fs_handles_db * db, filefoundinfo *fileinfo, uint32_t parent, uint32_t storage_id)
 {
-	if( !db )
+	fs_db_shard * shard;
+
+	shard = fs_db_get_shard(db, storage_id);
+	if( !shard )
 		return NULL;
 
-	return find_entry(db, fileinfo->filename, parent, storage_id);
+	return find_entry(shard, fileinfo->filename, parent, storage_id);
 }
 
 fs_entry * alloc_entry(fs_handles_db * db, filefoundinfo *fileinfo, uint32_t parent, uint32_t storage_id)
 {
 	fs_entry * entry;
+	fs_db_shard * shard;
 
-	if (db->pool_free_count == 0)
+	shard = alloc_shard(db, storage_id);
+	if (!shard)
+		return NULL;
+
+	if ( ( shard->next_handle & FS_DB_HANDLE_MASK ) == FS_DB_HANDLE_MASK )
+	{
+		PRINT_ERROR("alloc_entry : No more handles for the storage 0x%.8X !", storage_id);
+		return NULL;
+	}
+
+	if (shard->pool_free_count == 0)
 	{
-		if (!allocate_pool_block(db))
+		if (!allocate_pool_block(shard))
 		{
 			return NULL;
 		}
 	}
 
-	entry = &db->pool_head->entries[--db->pool_free_count];
+	entry = &shard->pool_head->entries[--shard->pool_free_count];
 	memset(entry, 0, sizeof(fs_entry));
 
-	entry->handle = db->next_handle;
-	db->next_handle++;
+	entry->handle = shard->next_handle;
+	shard->next_handle++;
 	entry->parent = parent;
 	entry->storage_id = storage_id;
 
@@ -319,15 +652,17 @@ fs_entry * alloc_entry(fs_handles_db * db, filefoundinfo *fileinfo, uint32_t par
 	if( !entry->name )
 	{
 		memset(entry, 0, sizeof(fs_entry));
-		db->pool_free_count++;
-		db->next_handle--;
+		shard->pool_free_count++;
+		shard->next_handle--;
 
 		return NULL;
 	}
 
 	entry->size = fileinfo->size;
+	entry->date = fileinfo->date;
 
 	entry->watch_descriptor = -1;
+	entry->file_descriptor = -1;
 
 	if (fileinfo->isdirectory)
 		entry->flags = ENTRY_IS_DIR;
@@ -335,11 +670,11 @@ fs_entry * alloc_entry(fs_handles_db * db, filefoundinfo *fileinfo, uint32_t par
 		entry->flags = 0x00000000;
 
 	// Add entry to hash table
-	insert_entry(db, entry);
+	insert_entry(shard, entry);
 
 	// Maintain backward compatibility with list linkage
-	entry->next = db->entry_list;
-	db->entry_list = entry;
+	entry->next = shard->entry_list;
+	__atomic_store_n(&shard->entry_list, entry, __ATOMIC_RELEASE);
 
 	return entry;
 }
@@ -347,19 +682,24 @@ fs_entry * alloc_entry(fs_handles_db * db, filefoundinfo *fileinfo, uint32_t par
 fs_entry * alloc_root_entry(fs_handles_db * db, uint32_t storage_id)
 {
 	fs_entry * entry;
+	fs_db_shard * shard;
 
 	if (!db)
 		return NULL;
 
-	if (db->pool_free_count == 0)
+	shard = alloc_shard(db, storage_id);
+	if (!shard)
+		return NULL;
+
+	if (shard->pool_free_count == 0)
 	{
-		if (!allocate_pool_block(db))
+		if (!allocate_pool_block(shard))
 		{
 			return NULL;
 		}
 	}
 
-	entry = &db->pool_head->entries[--db->pool_free_count];
+	entry = &shard->pool_head->entries[--shard->pool_free_count];
 	memset(entry, 0, sizeof(fs_entry));
 
 	entry->handle = 0x00000000;
@@ -374,14 +714,15 @@ fs_entry * alloc_root_entry(fs_handles_db * db, uint32_t storage_id)
 
 	entry->size = 1;
 	entry->watch_descriptor = -1;
+	entry->file_descriptor = -1;
 	entry->flags = ENTRY_IS_DIR;
 
 	// Add root entry to hash table
-	insert_entry(db, entry);
+	insert_entry(shard, entry);
 
 	// Maintain backward compatibility with list linkage
-	entry->next = db->entry_list;
-	db->entry_list = entry;
+	entry->next = shard->entry_list;
+	__atomic_store_n(&shard->entry_list, entry, __ATOMIC_RELEASE);
 
 	return entry;
 }
@@ -407,8 +748,24 @@ fs_entry * add_entry(fs_handles_db * db, filefoundinfo *fileinfo, uint32_t paren
 	return entry;
 }
 
+static fs_entry * next_child(fs_entry * entry_list, uint32_t parent, uint32_t storage_id)
+{
+	while( entry_list )
+	{
+		if( !( entry_list->flags & ENTRY_IS_DELETED ) && ( entry_list->parent == parent ) && ( entry_list->storage_id == storage_id ) && ( entry_list->handle != entry_list->parent ) )
+		{
+			return entry_list;
+		}
+
+		entry_list = entry_list->next;
+	}
+
+	return NULL;
+}
+
 int scan_and_add_folder(fs_handles_db * db, char * base, uint32_t parent, uint32_t storage_id)
 {
+	fs_db_shard * shard;
 	fs_entry * entry;
 	char * path;
 	DIR* dir;
@@ -440,10 +797,12 @@ int scan_and_add_folder(fs_handles_db * db, char * base, uint32_t parent, uint32
 	}
 
 	// Scan the DB to find and remove deleted files...
-	init_search_handle(db, parent, storage_id);
+	// (Local cursor : the scan may run outside of the MTP thread.)
+	shard = fs_db_get_shard(db, storage_id);
+	entry = shard ? __atomic_load_n(&shard->entry_list, __ATOMIC_ACQUIRE) : NULL;
 	do
 	{
-		entry = get_next_child_handle(db);
+		entry = next_child(entry, parent, storage_id);
 		if(entry)
 		{
 			path = build_full_path(db, mtp_get_storage_root(db->mtp_ctx, entry->storage_id), entry);
@@ -454,20 +813,18 @@ int scan_and_add_folder(fs_handles_db * db, char * base, uint32_t parent, uint32
 				if(ret)
 				{
 					PRINT_DEBUG("scan_and_add_folder : discard entry %s - stat error", path);
-					entry->flags |= ENTRY_IS_DELETED;
-					if( entry->watch_descriptor != -1 )
-					{
-						inotify_handler_rmwatch( db->mtp_ctx, entry->watch_descriptor );
-						entry->watch_descriptor = -1;
-					}
+					fs_db_delete_entry(db, entry);
 				}
 				else
 				{
 					entry->size = entrystat.st_size;
+					entry->date = entrystat.st_mtime;
 				}
 
 				free(path);
 			}
+
+			entry = entry->next;
 		}
 	}while(entry);
 
@@ -479,7 +836,11 @@ int scan_and_add_folder(fs_handles_db * db, char * base, uint32_t parent, uint32
 
 fs_entry * init_search_handle(fs_handles_db * db, uint32_t parent, uint32_t storage_id)
 {
-	db->search_entry = db->entry_list;
+	fs_db_shard * shard;
+
+	shard = fs_db_get_shard(db, storage_id);
+
+	db->search_entry = shard ? __atomic_load_n(&shard->entry_list, __ATOMIC_ACQUIRE) : NULL;
 	db->handle_search = parent;
 	db->storage_search = storage_id;
 
@@ -488,39 +849,167 @@ fs_entry * init_search_handle(fs_handles_db * db, uint32_t parent, uint32_t stor
 
 fs_entry * get_next_child_handle(fs_handles_db * db)
 {
-	fs_entry * entry_list;
+	fs_entry * entry;
 
-	entry_list = db->search_entry;
+	entry = next_child(db->search_entry, db->handle_search, db->storage_search);
+	if( entry )
+	{
+		db->search_entry = entry->next;
 
-	while( entry_list )
+		return entry;
+	}
+
+	db->search_entry = 0x00000000;
+
+	return NULL;
+}
+
+static int cmp_entries_names(const void * a, const void * b)
+{
+	return strcasecmp( (*(fs_entry **)a)->name, (*(fs_entry **)b)->name );
+}
+
+static int build_name_index(fs_db_shard * shard)
+{
+	fs_entry ** index;
+	fs_entry * entry;
+	uint32_t nb;
+
+	nb = 0;
+	for( entry = shard->entry_list; entry; entry = entry->next )
+	{
+		if( !( entry->flags & ENTRY_IS_DELETED ) )
+			nb++;
+	}
+
+	index = malloc( ( nb + 1 ) * sizeof(fs_entry *) );
+	if( !index )
+		return -1;
+
+	nb = 0;
+	for( entry = shard->entry_list; entry; entry = entry->next )
 	{
-		if( !( entry_list->flags & ENTRY_IS_DELETED ) && ( entry_list->parent == db->handle_search ) && ( entry_list->storage_id == db->storage_search ) && ( entry_list->handle != entry_list->parent ) )
+		if( !( entry->flags & ENTRY_IS_DELETED ) )
+			index[nb++] = entry;
+	}
+
+	qsort(index, nb, sizeof(fs_entry *), cmp_entries_names);
+
+	free(shard->name_index);
+
+	shard->name_index = index;
+	shard->name_index_size = nb;
+	shard->name_index_next_handle = shard->next_handle;
+	shard->name_index_renames = shard->renames;
+
+	return 0;
+}
+
+// Call callback for each entry of the storage whose name starts with prefix (case insensitive, "" : all entries).
+// The prefix lookups use a sorted names index, rebuilt after renames or when too many entries were added since.
+// The storage lock must be held. Returns the number of entries found, < 0 on error or if the callback stopped the search.
+int fs_db_find_names(fs_handles_db * db, uint32_t storage_id, const char * prefix, fs_db_name_cb callback, void * arg)
+{
+	fs_db_shard * shard;
+	fs_entry * entry;
+	uint32_t first,last,mid;
+	int len,nb;
+
+	shard = fs_db_get_shard(db, storage_id);
+	if( !shard )
+		return 0;
+
+	nb = 0;
+	len = strlen(prefix);
+
+	if( !len )
+	{
+		for( entry = shard->entry_list; entry; entry = entry->next )
 		{
-			db->search_entry = entry_list->next;
+			if( entry->storage_id != storage_id || ( entry->flags & ENTRY_IS_DELETED ) )
+				continue;
 
-			return entry_list;
+			if( callback(entry, arg) )
+				return -1;
+
+			nb++;
 		}
 
-		entry_list = entry_list->next;
+		return nb;
 	}
 
-	db->search_entry = 0x00000000;
+	if( !shard->name_index || shard->name_index_renames != shard->renames ||
+		shard->next_handle - shard->name_index_next_handle > shard->name_index_size / 8 + CONFIG_FIND_INDEX_MIN_TAIL )
+	{
+		if( build_name_index(shard) < 0 )
+			return -1;
+	}
 
-	return NULL;
+	// Entries added since the index build (newest first in the list, root entries have the handle 0)
+	for( entry = shard->entry_list; entry && ( entry->handle >= shard->name_index_next_handle || !entry->handle ); entry = entry->next )
+	{
+		if( entry->handle >= shard->name_index_next_handle && entry->storage_id == storage_id &&
+			!( entry->flags & ENTRY_IS_DELETED ) && !strncasecmp(entry->name, prefix, len) )
+		{
+			if( callback(entry, arg) )
+				return -1;
+
+			nb++;
+		}
+	}
+
+	// First indexed name >= prefix : The matching names follow.
+	first = 0;
+	last = shard->name_index_size;
+	while( first < last )
+	{
+		mid = first + ( last - first ) / 2;
+		if( strcasecmp(shard->name_index[mid]->name, prefix) < 0 )
+			first = mid + 1;
+		else
+			last = mid;
+	}
+
+	while( first < shard->name_index_size && !strncasecmp(shard->name_index[first]->name, prefix, len) )
+	{
+		entry = shard->name_index[first++];
+
+		if( entry->storage_id != storage_id || ( entry->flags & ENTRY_IS_DELETED ) )
+			continue;
+
+		if( callback(entry, arg) )
+			return -1;
+
+		nb++;
+	}
+
+	return nb;
 }
 
-fs_entry * get_entry_by_handle(fs_handles_db * db, uint32_t handle)
+static fs_entry * find_handle_in_shard(fs_db_shard * shard, uint32_t handle, uint32_t storage_id, int any_storage)
 {
 	uint32_t index = hash_function_handle(handle) % HASH_TABLE_SIZE;
-	hash_node *node = &db->hash_table_by_handle[index];
+	hash_bucket *bucket;
+	uint32_t size;
 
-	for (uint32_t i = 0; i < node->size; i++)
+	if( !shard )
+		return NULL;
+
+	bucket = get_hash_bucket(&shard->hash_table_by_handle[index], &size);
+
+	for (uint32_t i = 0; i < size; i++)
 	{
-		if( !(  node->entries[i]->flags & ENTRY_IS_DELETED ) && (  node->entries[i]->handle == handle ) )
+		if( !(  bucket->entries[i]->flags & ENTRY_IS_DELETED ) && (  bucket->entries[i]->handle == handle ) )
 		{
-			if( mtp_get_storage_root(db->mtp_ctx,  node->entries[i]->storage_id) )
+			if( any_storage )
 			{
-				return  node->entries[i];
+				if( mtp_get_storage_root(shard->db->mtp_ctx,  bucket->entries[i]->storage_id) )
+					return  bucket->entries[i];
+			}
+			else
+			{
+				if( bucket->entries[i]->storage_id == storage_id )
+					return  bucket->entries[i];
 			}
 		}
 	}
@@ -528,22 +1017,106 @@ fs_entry * get_entry_by_handle(fs_handles_db * db, uint32_t handle)
 	return NULL;
 }
 
+fs_entry * get_entry_by_handle(fs_handles_db * db, uint32_t handle)
+{
+	fs_entry * entry;
+	int i;
+
+	if( !db )
+		return NULL;
+
+	if( handle )
+		return find_handle_in_shard(get_shard_by_index(db, FS_DB_HANDLE_SHARD(handle)), handle, 0, 1);
+
+	// Root entries : One per storage.
+	for( i = 0; i < FS_DB_MAX_SHARDS; i++ )
+	{
+		entry = find_handle_in_shard(get_shard_by_index(db, i), handle, 0, 1);
+		if( entry )
+			return entry;
+	}
+
+	return NULL;
+}
+
 fs_entry * get_entry_by_handle_and_storageid(fs_handles_db * db, uint32_t handle, uint32_t storage_id)
 {
-	fs_entry * entry_list;
+	return find_handle_in_shard(fs_db_get_shard(db, storage_id), handle, storage_id, 0);
+}
 
-	entry_list = db->entry_list;
+static void delete_entry(fs_db_shard * shard, fs_entry * entry)
+{
+	entry->flags |= ENTRY_IS_DELETED;
+	shard->deletions++;
 
-	while( entry_list )
+	if( entry->watch_descriptor != -1 )
+	{
+		inotify_handler_rmwatch(shard->db->mtp_ctx, entry->watch_descriptor);
+		entry->watch_descriptor = -1;
+	}
+}
+
+// Object removed (or moved to another storage) : The entry and, for a folder, its whole
+// content are flagged deleted. Else the content entries would still be found by the
+// storage-wide walks (GetObjectPropList, FindObjects...).
+// Must be called with the storage lock held.
+void fs_db_delete_entry(fs_handles_db * db, fs_entry * entry)
+{
+	fs_db_shard * shard;
+	fs_entry ** content;
+	fs_entry * cur;
+	fs_entry * parent;
+	uint32_t handle;
+	int i,nb,depth;
+
+	shard = fs_db_get_shard(db, entry->storage_id);
+	if( !shard || ( entry->flags & ENTRY_IS_DELETED ) )
+		return;
+
+	if( entry->flags & ENTRY_IS_DIR )
 	{
-		if( !( entry_list->flags & ENTRY_IS_DELETED ) && ( entry_list->handle == handle ) && ( entry_list->storage_id == storage_id ) )
+		nb = 0;
+		for( cur = shard->entry_list; cur; cur = cur->next )
+			nb++;
+
+		content = malloc(nb * sizeof(fs_entry *));
+		if( !content )
 		{
-			return entry_list;
+			PRINT_ERROR("fs_db_delete_entry : Memory allocation failure !");
+		}
+		else
+		{
+			// The content entries : Their parents chain leads to the folder.
+			// (Flagged once found : The lookups skip the deleted entries.)
+			nb = 0;
+			for( cur = shard->entry_list; cur; cur = cur->next )
+			{
+				if( cur == entry || ( cur->flags & ENTRY_IS_DELETED ) || cur->storage_id != entry->storage_id )
+					continue;
+
+				handle = cur->parent;
+				depth = 0;
+				while( handle != entry->handle && depth++ < CONFIG_FS_DB_MAX_DEPTH )
+				{
+					parent = find_handle_in_shard(shard, handle, entry->storage_id, 0);
+					if( !parent || parent->handle == parent->parent )
+						break;
+
+					handle = parent->parent;
+				}
+
+				if( handle == entry->handle )
+					content[nb++] = cur;
+			}
+
+			for( i = 0; i < nb; i++ )
+				delete_entry(shard, content[i]);
+
+			free(content);
 		}
-		entry_list = entry_list->next;
 	}
 
-	return NULL;
+	delete_entry(shard, entry);
 }
 
 char * build_full_path(fs_handles_db * db,char * root_path,fs_entry * entry)
@@ -773,10 +1346,41 @@ void entry_close(fs_handles_db * db, fs_entry * entry)
 	entry->file_descriptor = -1;
 }
 
-fs_entry * get_entry_by_wd( fs_handles_db * db, int watch_descriptor, fs_entry * entry_list )
+// An entry is pinned while a data phase uses it without the db lock.
+// The entries memory is only released with the db : a pinned entry removed
+// underneath stays valid, and its resources are released when it is unpinned.
+void entry_pin(fs_entry * entry)
+{
+	if( entry )
+		entry->pin_count++;
+}
+
+void entry_unpin(fs_handles_db * db, fs_entry * entry)
+{
+	if( !entry || !db )
+		return;
+
+	if( entry->pin_count > 0 )
+		entry->pin_count--;
+
+	if( !entry->pin_count && ( entry->flags & ENTRY_IS_DELETED ) )
+	{
+		PRINT_DEBUG("entry_unpin : Entry 0x%.8X removed during the transfer, released now", entry->handle);
+
+		fs_cache_invalidate(db->mtp_ctx, entry->handle);
+	}
+}
+
+fs_entry * get_entry_by_wd( fs_handles_db * db, uint32_t storage_id, int watch_descriptor, fs_entry * entry_list )
 {
+	fs_db_shard * shard;
+
 	if(!entry_list && db)
-		entry_list = db->entry_list;
+	{
+		shard = fs_db_get_shard(db, storage_id);
+		if(shard)
+			entry_list = __atomic_load_n(&shard->entry_list, __ATOMIC_ACQUIRE);
+	}
 
 	while( entry_list )
 	{
@@ -793,8 +1397,14 @@ fs_entry * get_entry_by_wd( fs_handles_db * db, int watch_descriptor, fs_entry *
 
 fs_entry * get_entry_by_storageid( fs_handles_db * db, uint32_t storage_id, fs_entry * entry_list )
 {
+	fs_db_shard * shard;
+
 	if(!entry_list && db)
-		entry_list = db->entry_list;
+	{
+		shard = fs_db_get_shard(db, storage_id);
+		if(shard)
+			entry_list = __atomic_load_n(&shard->entry_list, __ATOMIC_ACQUIRE);
+	}
 
 	while( entry_list )
 	{
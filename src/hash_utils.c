@@ -36,35 +36,89 @@
 #define INITIAL_NODE_CAPACITY 4
 #define NODE_GROWTH_FACTOR 2
 
+static hash_bucket *alloc_hash_bucket(uint32_t capacity)
+{
+	hash_bucket *bucket;
+
+	bucket = malloc(sizeof(hash_bucket) + (capacity * sizeof(fs_entry*)));
+	if (!bucket)
+		return NULL;
+
+	bucket->capacity = capacity;
+	bucket->size = 0;
+
+	return bucket;
+}
+
+// Publish a new bucket : readers see either the old or the new one, never a partial update.
+static void publish_hash_bucket(fs_db_shard *shard, hash_node *node, hash_bucket *new_bucket)
+{
+	hash_bucket *old_bucket;
+
+	old_bucket = node->bucket;
+
+	__atomic_store_n(&node->bucket, new_bucket, __ATOMIC_RELEASE);
+
+	if (old_bucket)
+		fs_db_retire(shard, old_bucket);
+}
+
+hash_bucket *get_hash_bucket(hash_node *node, uint32_t *size)
+{
+	hash_bucket *bucket;
+
+	bucket = __atomic_load_n(&node->bucket, __ATOMIC_ACQUIRE);
+	if (!bucket)
+	{
+		*size = 0;
+		return NULL;
+	}
+
+	*size = __atomic_load_n(&bucket->size, __ATOMIC_ACQUIRE);
+
+	return bucket;
+}
+
 int init_hash_node(hash_node *node)
 {
-	node->entries = malloc(INITIAL_NODE_CAPACITY * sizeof(fs_entry*));
+	hash_bucket *bucket;
 
-	if (!node->entries)
+	bucket = alloc_hash_bucket(INITIAL_NODE_CAPACITY);
+	if (!bucket)
 		return 0;
 
-	node->capacity = INITIAL_NODE_CAPACITY;
-	node->size = 0;
+	__atomic_store_n(&node->bucket, bucket, __ATOMIC_RELEASE);
+
 	return 1;
 }
 
-int expand_hash_node(hash_node *node)
+void free_hash_node(hash_node *node)
+{
+	if (node->bucket)
+		free(node->bucket);
+
+	node->bucket = NULL;
+}
+
+int expand_hash_node(fs_db_shard *shard, hash_node *node)
 {
 	uint32_t new_capacity;
+	hash_bucket *new_bucket;
 
 	// Integer overflow allocation size check.
-	if( node->capacity >= (0x80000000 / sizeof(fs_entry*) ) )
+	if( node->bucket->capacity >= (0x80000000 / sizeof(fs_entry*) ) )
 		return 0;
 
-	new_capacity = node->capacity * NODE_GROWTH_FACTOR;
-
-	fs_entry **new_entries = realloc(node->entries, new_capacity * sizeof(fs_entry*));
+	new_capacity = node->bucket->capacity * NODE_GROWTH_FACTOR;
 
-	if (!new_entries)
+	new_bucket = alloc_hash_bucket(new_capacity);
+	if (!new_bucket)
 		return 0;
 
-	node->entries = new_entries;
-	node->capacity = new_capacity;
+	memcpy(new_bucket->entries, node->bucket->entries, node->bucket->size * sizeof(fs_entry*));
+	new_bucket->size = node->bucket->size;
+
+	publish_hash_bucket(shard, node, new_bucket);
 
 	return 1;
 }
@@ -87,7 +141,7 @@ uint32_t hash_function_handle(uint32_t handle)
 	return hash % HASH_TABLE_SIZE;
 }
 
-int allocate_pool_block(fs_handles_db *db)
+int allocate_pool_block(fs_db_shard *shard)
 {
 	fs_entry_pool_block *new_block = malloc(sizeof(fs_entry_pool_block));
 
@@ -97,16 +151,18 @@ int allocate_pool_block(fs_handles_db *db)
 	}
 
 	memset(new_block, 0, sizeof(fs_entry_pool_block));
-	new_block->next = db->pool_head;
-	db->pool_head = new_block;
-	db->pool_free_count += POOL_BLOCK_SIZE;
+	new_block->next = shard->pool_head;
+	shard->pool_head = new_block;
+	shard->pool_free_count += POOL_BLOCK_SIZE;
 
 	return 1;
 }
 
-void insert_entry_generic(hash_node *node, fs_entry* entry)
+void insert_entry_generic(fs_db_shard *shard, hash_node *node, fs_entry* entry)
 {
-	if (node->entries == NULL || node->capacity == 0)
+	hash_bucket *bucket;
+
+	if (node->bucket == NULL)
 	{
 		if (!init_hash_node(node))
 		{
@@ -115,73 +171,97 @@ void insert_entry_generic(hash_node *node, fs_entry* entry)
 		}
 	}
 
-	if (node->size >= node->capacity)
+	if (node->bucket->size >= node->bucket->capacity)
 	{
-		if (!expand_hash_node(node))
+		if (!expand_hash_node(shard, node))
 		{
 			PRINT_ERROR("Failed to expand hash node");
 			return;
 		}
 	}
 
-	node->entries[node->size++] = entry;
+	// Append : The entry slot is written before the size is published.
+	bucket = node->bucket;
+	bucket->entries[bucket->size] = entry;
+	__atomic_store_n(&bucket->size, bucket->size + 1, __ATOMIC_RELEASE);
 }
 
-void insert_entry(fs_handles_db *db, fs_entry *entry)
+void insert_entry(fs_db_shard *shard, fs_entry *entry)
 {
 	uint32_t index_name = hash_function_name(entry->name) % HASH_TABLE_SIZE;
 	uint32_t index_handle = hash_function_handle(entry->handle) % HASH_TABLE_SIZE;
 
-	hash_node *node_name = &db->hash_table_by_name[index_name];
-	hash_node *node_handle = &db->hash_table_by_handle[index_handle];
+	hash_node *node_name = &shard->hash_table_by_name[index_name];
+	hash_node *node_handle = &shard->hash_table_by_handle[index_handle];
 
-	insert_entry_generic(node_handle, entry);
-	insert_entry_generic(node_name, entry);
+	insert_entry_generic(shard, node_handle, entry);
+	insert_entry_generic(shard, node_name, entry);
 }
 
-fs_entry *find_entry(fs_handles_db *db, const char *name, uint32_t parent, uint32_t storage_id)
+fs_entry *find_entry(fs_db_shard *shard, const char *name, uint32_t parent, uint32_t storage_id)
 {
 	uint32_t index = hash_function_name(name) % HASH_TABLE_SIZE;
-	hash_node *node = &db->hash_table_by_name[index];
+	hash_bucket *bucket;
+	uint32_t size;
 
-	for (uint32_t i = 0; i < node->size; i++)
+	bucket = get_hash_bucket(&shard->hash_table_by_name[index], &size);
+
+	for (uint32_t i = 0; i < size; i++)
 	{
-		if (strcmp(node->entries[i]->name, name) == 0 &&
-			node->entries[i]->parent == parent &&
-			node->entries[i]->storage_id == storage_id &&
-			 ((node->entries[i]->flags & ENTRY_IS_DELETED) == 0))
+		if (strcmp(bucket->entries[i]->name, name) == 0 &&
+			bucket->entries[i]->parent == parent &&
+			bucket->entries[i]->storage_id == storage_id &&
+			 ((bucket->entries[i]->flags & ENTRY_IS_DELETED) == 0))
 		{
-			return node->entries[i];
+			return bucket->entries[i];
 		}
 	}
 
 	return NULL;
 }
 
-void remove_entry_generic(hash_node *node, fs_entry *entry_to_remove)
+void remove_entry_generic(fs_db_shard *shard, hash_node *node, fs_entry *entry_to_remove)
 {
-	for (int i = 0; i < node->size; i++) {
-		if (node->entries[i] == entry_to_remove) {
-			// Move remaining entries forward to fill the gap
-			for (int j = i; j < node->size - 1; j++) {
-				node->entries[j] = node->entries[j + 1];
+	hash_bucket *bucket;
+	hash_bucket *new_bucket;
+	uint32_t i;
+
+	bucket = node->bucket;
+	if (!bucket)
+		return;
+
+	for (i = 0; i < bucket->size; i++) {
+		if (bucket->entries[i] == entry_to_remove) {
+			// Copy the remaining entries to a new bucket (readers may be walking the current one)
+			new_bucket = alloc_hash_bucket(bucket->capacity);
+			if (!new_bucket) {
+				PRINT_ERROR("Failed to remove hash node entry");
+				return;
 			}
-			node->size--;
+
+			memcpy(new_bucket->entries, bucket->entries, i * sizeof(fs_entry*));
+			memcpy(&new_bucket->entries[i], &bucket->entries[i + 1], (bucket->size - i - 1) * sizeof(fs_entry*));
+			new_bucket->size = bucket->size - 1;
+
+			publish_hash_bucket(shard, node, new_bucket);
 			break;
 		}
 	}
 }
 
-void remove_entry(fs_handles_db *db, fs_entry *entry_to_remove)
+void remove_entry(fs_db_shard *shard, fs_entry *entry_to_remove)
 {
 	// Remove from name hash table
 	uint32_t index_name = hash_function_name(entry_to_remove->name) % HASH_TABLE_SIZE;
-	hash_node *node_name = &db->hash_table_by_name[index_name];
+	hash_node *node_name = &shard->hash_table_by_name[index_name];
 
 	// Remove from handle hash table
 	uint32_t index_handle = hash_function_handle(entry_to_remove->handle) % HASH_TABLE_SIZE;
-	hash_node *node_handle = &db->hash_table_by_handle[index_handle];
+	hash_node *node_handle = &shard->hash_table_by_handle[index_handle];
+
+	remove_entry_generic(shard, node_name, entry_to_remove);
+	remove_entry_generic(shard, node_handle, entry_to_remove);
 
-	remove_entry_generic(node_name, entry_to_remove);
-	remove_entry_generic(node_handle, entry_to_remove);
+	// Removed to be renamed : The sorted names index must be rebuilt.
+	shard->renames++;
 }
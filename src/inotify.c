@@ -33,6 +33,10 @@
 #include <sys/prctl.h>
 #include <unistd.h>
 #include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/stat.h>
 
 #include "mtp.h"
 #include "mtp_helpers.h"
@@ -42,10 +46,16 @@
 #include "usb_gadget_fct.h"
 #include "fs_handles_db.h"
 #include "inotify.h"
+#include "fanotify.h"
+#include "fs_cache.h"
+#include "mtp_autotune.h"
+#include "mtp_journal.h"
 #include "logs_out.h"
 
 #define INOTIFY_RD_BUF_SIZE ( 32*1024 )
 
+static void release_watch( mtp_ctx * ctx, int wd );
+
 static int get_file_info(mtp_ctx * ctx, const struct inotify_event *event, fs_entry * entry, filefoundinfo * fileinfo, int deleted)
 {
 	char * path;
@@ -94,20 +104,671 @@ static void *inotify_gotsig(int sig, siginfo_t *info, void *ucontext)
 	return NULL;
 }
 
-static void* inotify_thread(void* arg)
+// Modified objects waiting for the end of their debounce window.
+typedef struct inotify_pending_
 {
-	mtp_ctx * ctx;
-	int i, length;
-	int send_event_flag;
+	uint32_t handle;
+	int store_index;
+	uint64_t deadline;
+}inotify_pending;
+
+// MTP events queued while the storage is locked.
+typedef struct inotify_mtp_event_
+{
+	uint32_t code;
+	uint32_t handle;
+}inotify_mtp_event;
+
+#define INOTIFY_MAX_QUEUED_EVENTS 256
+
+typedef struct inotify_batch_
+{
+	inotify_pending pending[CONFIG_INOTIFY_MAX_PENDING];
+	int nb_pending;
+
+	inotify_mtp_event events[INOTIFY_MAX_QUEUED_EVENTS];
+	int nb_events;
+
+	int rescan;
+}inotify_batch;
+
+static void push_mtp_event( mtp_ctx * ctx, uint32_t code, uint32_t handle )
+{
+	uint32_t params[1];
+
+	params[0] = handle;
+
+	mtp_push_event( ctx, code, 1, (uint32_t *)&params );
+
+	__atomic_fetch_add( &ctx->stats.inotify_emitted, 1, __ATOMIC_RELAXED );
+}
+
+static void queue_mtp_event( mtp_ctx * ctx, inotify_batch * batch, uint32_t code, uint32_t handle )
+{
+	if( batch->nb_events >= INOTIFY_MAX_QUEUED_EVENTS )
+	{
+		// Queue full : send it now.
+		push_mtp_event( ctx, code, handle );
+		return;
+	}
+
+	batch->events[batch->nb_events].code = code;
+	batch->events[batch->nb_events].handle = handle;
+	batch->nb_events++;
+}
+
+static void send_queued_events( mtp_ctx * ctx, inotify_batch * batch )
+{
+	int i;
+
+	for( i = 0; i < batch->nb_events; i++ )
+	{
+		push_mtp_event( ctx, batch->events[i].code, batch->events[i].handle );
+	}
+
+	batch->nb_events = 0;
+}
+
+static void cancel_pending( inotify_batch * batch, uint32_t handle )
+{
+	int i;
+
+	for( i = 0; i < batch->nb_pending; i++ )
+	{
+		if( batch->pending[i].handle == handle )
+		{
+			batch->pending[i] = batch->pending[--batch->nb_pending];
+			return;
+		}
+	}
+}
+
+// Returns 0 if the object modification is already pending (coalesced).
+static int add_pending( mtp_ctx * ctx, inotify_batch * batch, int store_index, uint32_t handle )
+{
+	int i,oldest;
+
+	for( i = 0; i < batch->nb_pending; i++ )
+	{
+		if( batch->pending[i].handle == handle )
+			return 0;
+	}
+
+	if( batch->nb_pending >= CONFIG_INOTIFY_MAX_PENDING )
+	{
+		// Table full : the oldest one is notified right now.
+		oldest = 0;
+		for( i = 1; i < batch->nb_pending; i++ )
+		{
+			if( batch->pending[i].deadline < batch->pending[oldest].deadline )
+				oldest = i;
+		}
+
+		queue_mtp_event( ctx, batch, MTP_EVENT_OBJECT_INFO_CHANGED, batch->pending[oldest].handle );
+		batch->pending[oldest] = batch->pending[--batch->nb_pending];
+	}
+
+	batch->pending[batch->nb_pending].handle = handle;
+	batch->pending[batch->nb_pending].store_index = store_index;
+	batch->pending[batch->nb_pending].deadline = mtp_autotune_get_time_us() + ( (uint64_t)ctx->inotify_debounce_ms * 1000 );
+	batch->nb_pending++;
+
+	return 1;
+}
+
+// Responder file system changes : Their echoes are filtered from the inotify events.
+
+// Must be called with the echoes lock held.
+static mtp_fs_echo * find_echo( mtp_ctx * ctx, int wd, const char * name )
+{
+	int i;
+
+	for( i = 0; i < ctx->inotify_nb_echoes; i++ )
+	{
+		if( ctx->inotify_echoes[i].wd == wd && !strcmp( ctx->inotify_echoes[i].name, name ) )
+			return &ctx->inotify_echoes[i];
+	}
+
+	return NULL;
+}
+
+static int get_parent_wd( mtp_ctx * ctx, uint32_t storage_id, uint32_t parent )
+{
+	fs_entry * parent_entry;
+
+	if( ctx->inotify_fd == -1 || ctx->no_inotify || !ctx->fs_db )
+		return -1;
+
+	parent_entry = get_entry_by_handle_and_storageid( ctx->fs_db, parent, storage_id );
+	if( !parent_entry )
+		return -1;
+
+	return parent_entry->watch_descriptor;
+}
+
+// Must be called with the storage lock held, before the change.
+void inotify_handler_echo_begin( mtp_ctx * ctx, uint32_t storage_id, uint32_t parent, char * name, uint32_t mask )
+{
+	mtp_fs_echo * echo;
+	uint64_t now;
+	int wd, i;
+
+	wd = get_parent_wd( ctx, storage_id, parent );
+	if( wd == -1 || strlen( name ) >= FS_HANDLE_MAX_FILENAME_SIZE )
+		return;
+
+	now = mtp_autotune_get_time_us();
+
+	pthread_mutex_lock( &ctx->inotify_echo_mutex );
+
+	echo = find_echo( ctx, wd, name );
+	if( !echo )
+	{
+		// Free the expired slots not waiting for a check.
+		i = 0;
+		while( i < ctx->inotify_nb_echoes )
+		{
+			if( !ctx->inotify_echoes[i].in_progress && !ctx->inotify_echoes[i].late && ctx->inotify_echoes[i].expires <= now )
+				ctx->inotify_echoes[i] = ctx->inotify_echoes[--ctx->inotify_nb_echoes];
+			else
+				i++;
+		}
+
+		// Table full : The events of this change are processed as external ones.
+		if( ctx->inotify_nb_echoes < CONFIG_INOTIFY_MAX_ECHOES )
+		{
+			echo = &ctx->inotify_echoes[ctx->inotify_nb_echoes++];
+
+			memset( echo, 0, sizeof(mtp_fs_echo) );
+			echo->wd = wd;
+			strcpy( echo->name, name );
+		}
+	}
+
+	if( echo )
+	{
+		echo->mask |= mask;
+		echo->in_progress++;
+	}
+
+	pthread_mutex_unlock( &ctx->inotify_echo_mutex );
+}
+
+// Must be called with the storage lock held, after the change.
+void inotify_handler_echo_end( mtp_ctx * ctx, uint32_t storage_id, uint32_t parent, char * name )
+{
+	struct stat64 entrystat;
+	filefoundinfo fileinfo;
+	mtp_fs_echo * echo;
 	fs_entry * entry;
+	uint32_t handle;
+	char * path;
+	int wd;
+
+	wd = get_parent_wd( ctx, storage_id, parent );
+	if( wd == -1 )
+		return;
+
+	// State left by the responder, checked again at the end of the window if some events are still coming.
+	handle = 0x00000000;
+	memset( &entrystat, 0, sizeof(entrystat) );
+
+	strncpy( fileinfo.filename, name, FS_HANDLE_MAX_FILENAME_SIZE );
+	fileinfo.filename[FS_HANDLE_MAX_FILENAME_SIZE] = '\0';
+
+	entry = search_entry( ctx->fs_db, &fileinfo, parent, storage_id );
+	if( entry && !( entry->flags & ENTRY_IS_DIR ) )
+	{
+		path = build_full_path( ctx->fs_db, mtp_get_storage_root( ctx, entry->storage_id ), entry );
+		if( path )
+		{
+			if( !stat64( path, &entrystat ) )
+				handle = entry->handle;
+
+			free( path );
+		}
+	}
+
+	pthread_mutex_lock( &ctx->inotify_echo_mutex );
+
+	echo = find_echo( ctx, wd, name );
+	if( echo && echo->in_progress > 0 )
+	{
+		echo->in_progress--;
+		if( !echo->in_progress )
+		{
+			echo->expires = mtp_autotune_get_time_us() + ( (uint64_t)CONFIG_INOTIFY_ECHO_GRACE_MS * 1000 );
+			echo->late = 0;
+			echo->handle = handle;
+			echo->size = entrystat.st_size;
+			echo->mtime_sec = entrystat.st_mtim.tv_sec;
+			echo->mtime_nsec = entrystat.st_mtim.tv_nsec;
+		}
+	}
+
+	pthread_mutex_unlock( &ctx->inotify_echo_mutex );
+}
+
+// Returns 1 if the event is a responder change echo.
+static int filter_echo( mtp_ctx * ctx, const struct inotify_event *event, uint64_t now )
+{
+	mtp_fs_echo * echo;
+	int ret;
+
+	ret = 0;
+
+	pthread_mutex_lock( &ctx->inotify_echo_mutex );
+
+	echo = find_echo( ctx, event->wd, event->name );
+	if( echo && !( event->mask & ~( echo->mask | IN_ISDIR ) ) && ( echo->in_progress || echo->expires > now ) )
+	{
+		// After the change : May be an external one, checked at the end of the window.
+		if( !echo->in_progress )
+			echo->late = 1;
+
+		ret = 1;
+	}
+
+	pthread_mutex_unlock( &ctx->inotify_echo_mutex );
+
+	return ret;
+}
+
+// End of the echoes windows : An object not matching the state left by the responder
+// has been modified by someone else in the meantime.
+static void expire_echoes( mtp_ctx * ctx, inotify_batch * batch )
+{
+	mtp_fs_echo checks[CONFIG_INOTIFY_MAX_ECHOES];
+	struct stat64 entrystat;
+	fs_entry * entry;
+	uint64_t now;
+	char * path;
+	int i, nb_checks, store_index;
+
+	now = mtp_autotune_get_time_us();
+	nb_checks = 0;
+
+	pthread_mutex_lock( &ctx->inotify_echo_mutex );
+
+	i = 0;
+	while( i < ctx->inotify_nb_echoes )
+	{
+		if( ctx->inotify_echoes[i].in_progress || ctx->inotify_echoes[i].expires > now )
+		{
+			i++;
+			continue;
+		}
+
+		if( ctx->inotify_echoes[i].late && ctx->inotify_echoes[i].handle )
+			checks[nb_checks++] = ctx->inotify_echoes[i];
+
+		ctx->inotify_echoes[i] = ctx->inotify_echoes[--ctx->inotify_nb_echoes];
+	}
+
+	pthread_mutex_unlock( &ctx->inotify_echo_mutex );
+
+	for( i = 0; i < nb_checks; i++ )
+	{
+		store_index = FS_DB_HANDLE_SHARD( checks[i].handle );
+		if( store_index >= MAX_STORAGE_NB || mtp_db_lock_storage( ctx, store_index ) )
+			continue;
+
+		entry = get_entry_by_handle( ctx->fs_db, checks[i].handle );
+		if( entry )
+		{
+			path = build_full_path( ctx->fs_db, mtp_get_storage_root( ctx, entry->storage_id ), entry );
+			if( path )
+			{
+				if( !stat64( path, &entrystat ) &&
+					( entrystat.st_size != checks[i].size ||
+					  entrystat.st_mtim.tv_sec != checks[i].mtime_sec ||
+					  entrystat.st_mtim.tv_nsec != checks[i].mtime_nsec ) )
+				{
+					entry->size = entrystat.st_size;
+					entry->date = entrystat.st_mtime;
+					fs_cache_invalidate( ctx, entry->handle );
+
+					queue_mtp_event( ctx, batch, MTP_EVENT_OBJECT_INFO_CHANGED, entry->handle );
+
+					mtp_journal_record( ctx, JOURNAL_MODIFY, entry->storage_id, path, 0 );
+
+					__atomic_fetch_add( &ctx->stats.inotify_echo_external, 1, __ATOMIC_RELAXED );
+
+					PRINT_DEBUG( "inotify_thread : Entry %s modified during a responder change (Handle 0x%.8X)", entry->name, entry->handle );
+				}
+
+				free( path );
+			}
+		}
+
+		mtp_db_unlock_storage( ctx, store_index );
+	}
+
+	send_queued_events( ctx, batch );
+}
+
+// Must be called with the storage lock held.
+static void refresh_entry_size( mtp_ctx * ctx, fs_entry * entry )
+{
+	struct stat64 entrystat;
+	char * path;
+
+	path = build_full_path( ctx->fs_db, mtp_get_storage_root( ctx, entry->storage_id ), entry );
+	if( path )
+	{
+		if( !stat64( path, &entrystat ) )
+		{
+			entry->size = entrystat.st_size;
+			entry->date = entrystat.st_mtime;
+		}
+
+		free( path );
+	}
+}
+
+// Must be called with the storage lock held.
+static void handle_event( mtp_ctx * ctx, inotify_batch * batch, int store_index, const struct inotify_event *event, fs_entry * entry )
+{
 	fs_entry * deleted_entry;
 	fs_entry * modified_entry;
 	fs_entry * new_entry;
 	fs_entry * old_entry;
 	filefoundinfo fileinfo;
-	uint32_t handle[3];
+
+	if ( ( event->mask & IN_CREATE ) || ( event->mask & IN_MOVED_TO ) )
+	{
+		if ( get_file_info( ctx, event, entry, &fileinfo, 0 ) )
+		{
+			old_entry = search_entry(ctx->fs_db, &fileinfo, entry->handle, entry->storage_id);
+			if( !old_entry )
+			{
+				// If the entry is not in the db, add it and trigger an MTP_EVENT_OBJECT_ADDED event
+				new_entry = add_entry( ctx->fs_db, &fileinfo, entry->handle, entry->storage_id );
+				if( new_entry )
+				{
+					// Send an "ObjectAdded" (0x4002) MTP event message with the entry handle.
+					queue_mtp_event( ctx, batch, MTP_EVENT_OBJECT_ADDED, new_entry->handle );
+
+					mtp_journal_entry( ctx, JOURNAL_ADD, new_entry, event->cookie );
+
+					PRINT_DEBUG( "inotify_thread (IN_CREATE): Entry %s created (Handle 0x%.8X)", event->name, new_entry->handle );
+				}
+				else
+				{
+					PRINT_DEBUG( "inotify_thread (IN_CREATE): Entry %s creation failure !", event->name );
+				}
+			}
+			else
+			{
+				// Replaced (moved over) : The cached file is outdated.
+				fs_cache_invalidate( ctx, old_entry->handle );
+
+				mtp_journal_entry( ctx, JOURNAL_ADD, old_entry, event->cookie );
+
+				PRINT_DEBUG( "inotify_thread (IN_CREATE): Entry %s already in the db ! (Handle 0x%.8X)", event->name, old_entry->handle );
+			}
+		}
+	}
+
+	if ( event->mask & IN_MODIFY )
+	{
+		if ( get_file_info( ctx, event, entry, &fileinfo, 1 ) )
+		{
+			modified_entry = search_entry(ctx->fs_db, &fileinfo, entry->handle, entry->storage_id);
+			if( modified_entry )
+			{
+				fs_cache_invalidate( ctx, modified_entry->handle );
+
+				// Send an "ObjectInfoChanged" (0x4007) MTP event message with the entry handle,
+				// once per modifications burst.
+				if( ctx->inotify_debounce_ms )
+				{
+					if( !add_pending( ctx, batch, store_index, modified_entry->handle ) )
+						__atomic_fetch_add( &ctx->stats.inotify_coalesced, 1, __ATOMIC_RELAXED );
+				}
+				else
+				{
+					refresh_entry_size( ctx, modified_entry );
+
+					queue_mtp_event( ctx, batch, MTP_EVENT_OBJECT_INFO_CHANGED, modified_entry->handle );
+
+					mtp_journal_entry( ctx, JOURNAL_MODIFY, modified_entry, 0 );
+				}
+
+				PRINT_DEBUG( "inotify_thread (IN_MODIFY): Entry %s modified (Handle 0x%.8X)", event->name, modified_entry->handle);
+			}
+		}
+	}
+
+	if ( ( event->mask & IN_DELETE ) || ( event->mask & IN_MOVED_FROM ) )
+	{
+		if ( get_file_info( ctx, event, entry, &fileinfo, 1 ) )
+		{
+			deleted_entry = search_entry(ctx->fs_db, &fileinfo, entry->handle, entry->storage_id);
+			if( deleted_entry )
+			{
+				if( deleted_entry->flags & ENTRY_IS_DIR )
+					fs_cache_invalidate_storage( ctx, deleted_entry->storage_id );
+				else
+					fs_cache_invalidate( ctx, deleted_entry->handle );
+
+				mtp_journal_entry( ctx, JOURNAL_REMOVE, deleted_entry, event->cookie );
+
+				// A folder content entries too.
+				fs_db_delete_entry( ctx->fs_db, deleted_entry );
+
+				cancel_pending( batch, deleted_entry->handle );
+
+				// Send an "ObjectRemoved" (0x4003) MTP event message with the entry handle.
+				queue_mtp_event( ctx, batch, MTP_EVENT_OBJECT_REMOVED, deleted_entry->handle );
+
+				PRINT_DEBUG( "inotify_thread (IN_DELETE): Entry %s deleted (Handle 0x%.8X)", event->name, deleted_entry->handle);
+			}
+		}
+	}
+}
+
+// Process a whole read buffer : Each storage is locked once.
+static int process_events( mtp_ctx * ctx, inotify_batch * batch, char * buffer, int length )
+{
+	struct inotify_event *event;
+	fs_entry * entry;
+	uint64_t now;
+	int i, store_index, nb_events;
+
+	now = mtp_autotune_get_time_us();
+	nb_events = 0;
+
+	// Events count / overflow check / echoes filtering
+	i = 0;
+	while ( i + (int)sizeof(struct inotify_event) <= length )
+	{
+		event = ( struct inotify_event * ) &buffer[ i ];
+
+		__atomic_fetch_add( &ctx->stats.inotify_events, 1, __ATOMIC_RELAXED );
+
+		if( event->mask & IN_Q_OVERFLOW )
+		{
+			PRINT_WARN( "inotify_thread : Events queue overflow, rescan scheduled" );
+			batch->rescan = 1;
+		}
+
+		if( event->mask & IN_IGNORED )
+			release_watch( ctx, event->wd );
+
+		if( event->len && ( i + (int)sizeof(struct inotify_event) + (int)event->len <= length ) && filter_echo( ctx, event, now ) )
+		{
+			event->mask = 0;
+
+			__atomic_fetch_add( &ctx->stats.inotify_echoes, 1, __ATOMIC_RELAXED );
+		}
+		else
+		{
+			nb_events++;
+		}
+
+		i +=  (( sizeof (struct inotify_event) ) + event->len);
+	}
+
+	// Only echoes : No need to lock the storages.
+	if( !nb_events )
+		return 0;
+
+	for( store_index = 0; store_index < MAX_STORAGE_NB; store_index++ )
+	{
+		if( !ctx->storages[store_index].root_path )
+			continue;
+
+		if ( mtp_db_lock_storage( ctx, store_index ) )
+		{
+			PRINT_ERROR( "inotify_thread - pthread_mutex_lock failure !");
+			return -1;
+		}
+
+		i = 0;
+		while ( i < length && i < INOTIFY_RD_BUF_SIZE )
+		{
+			event = ( struct inotify_event * ) &buffer[ i ];
+
+			// Sanity check to prevent possible buffer overrun/overflow.
+			if ( event->len && event->mask && (i + (( sizeof (struct inotify_event) ) + event->len) < INOTIFY_RD_BUF_SIZE) )
+			{
+				entry = NULL;
+				while( ( entry = get_entry_by_wd( ctx->fs_db, ctx->storages[store_index].storage_id, event->wd, entry ) ) )
+				{
+					handle_event( ctx, batch, store_index, event, entry );
+
+					entry = entry->next;
+				}
+			}
+			else if( event->mask & IN_IGNORED )
+			{
+				// Watch lost : The folder content is revalidated at its next listing.
+				entry = NULL;
+				while( ( entry = get_entry_by_wd( ctx->fs_db, ctx->storages[store_index].storage_id, event->wd, entry ) ) )
+				{
+					entry->watch_descriptor = -1;
+					entry->flags &= ~ENTRY_IS_SYNCED;
+
+					entry = entry->next;
+				}
+			}
+
+			i +=  (( sizeof (struct inotify_event) ) + event->len);
+		}
+
+		if ( mtp_db_unlock_storage( ctx, store_index ) )
+		{
+			PRINT_ERROR( "inotify_thread - pthread_mutex_unlock failure !");
+			return -1;
+		}
+
+		// The MTP events are sent without the lock.
+		send_queued_events( ctx, batch );
+	}
+
+	return 0;
+}
+
+// End of the debounce windows : refresh the objects size and notify the host.
+static void flush_pending( mtp_ctx * ctx, inotify_batch * batch )
+{
+	fs_entry * entry;
+	uint64_t now;
+	int i;
+
+	now = mtp_autotune_get_time_us();
+
+	i = 0;
+	while( i < batch->nb_pending )
+	{
+		if( batch->pending[i].deadline > now )
+		{
+			i++;
+			continue;
+		}
+
+		if( !mtp_db_lock_storage( ctx, batch->pending[i].store_index ) )
+		{
+			entry = get_entry_by_handle( ctx->fs_db, batch->pending[i].handle );
+			if( entry )
+			{
+				refresh_entry_size( ctx, entry );
+
+				queue_mtp_event( ctx, batch, MTP_EVENT_OBJECT_INFO_CHANGED, entry->handle );
+
+				mtp_journal_entry( ctx, JOURNAL_MODIFY, entry, 0 );
+			}
+
+			mtp_db_unlock_storage( ctx, batch->pending[i].store_index );
+		}
+
+		batch->pending[i] = batch->pending[--batch->nb_pending];
+	}
+
+	send_queued_events( ctx, batch );
+}
+
+// Events lost : Rescan the folders watched by the host and let it refresh the storages.
+static void rescan_storages( mtp_ctx * ctx, inotify_batch * batch )
+{
+	fs_entry * entry;
+	char * path;
+	int store_index;
+	uint32_t storage_id;
+
+	batch->rescan = 0;
+
+	for( store_index = 0; store_index < MAX_STORAGE_NB; store_index++ )
+	{
+		if( !ctx->storages[store_index].root_path )
+			continue;
+
+		if( mtp_db_lock_storage( ctx, store_index ) )
+			continue;
+
+		storage_id = ctx->storages[store_index].storage_id;
+
+		fs_cache_invalidate_storage( ctx, storage_id );
+
+		entry = get_entry_by_storageid( ctx->fs_db, storage_id, NULL );
+		while( entry )
+		{
+			if( ( entry->flags & ENTRY_IS_DIR ) && entry->watch_descriptor != -1 )
+			{
+				path = build_full_path( ctx->fs_db, mtp_get_storage_root( ctx, storage_id ), entry );
+				if( path )
+				{
+					scan_and_add_folder( ctx->fs_db, path, entry->handle, storage_id );
+					free( path );
+				}
+			}
+
+			// Next entry of this storage (From NULL, get_entry_by_storageid() restarts at the list head)
+			entry = entry->next;
+			if( entry )
+				entry = get_entry_by_storageid( ctx->fs_db, storage_id, entry );
+		}
+
+		__atomic_fetch_add( &ctx->stats.inotify_rescans, 1, __ATOMIC_RELAXED );
+
+		mtp_db_unlock_storage( ctx, store_index );
+
+		// Changes in the folders not watched : Found by the change journal storage walk.
+		mtp_journal_rescan( ctx, storage_id );
+
+		push_mtp_event( ctx, MTP_EVENT_STORAGE_INFO_CHANGED, storage_id );
+	}
+}
+
+static void* inotify_thread(void* arg)
+{
+	mtp_ctx * ctx;
+	int length, timeout, remaining, i;
+	uint64_t now;
+	inotify_batch * batch;
 	char inotify_buffer[INOTIFY_RD_BUF_SIZE] __attribute__ ((aligned(__alignof__(struct inotify_event))));
-	const struct inotify_event *event;
+	struct pollfd pfd[2];
 	struct sigaction sa;
 
 	prctl(PR_SET_NAME, (unsigned long) __func__);
@@ -124,220 +785,376 @@ static void* inotify_thread(void* arg)
 		return (void *)-1;
 	}
 
+	batch = malloc( sizeof(inotify_batch) );
+	if( !batch )
+	{
+		return (void *)-1;
+	}
+
+	memset( batch, 0, sizeof(inotify_batch) );
+
 	for (;;)
 	{
-		memset(inotify_buffer,0,sizeof(inotify_buffer));
+		// Wake up at the end of the nearest debounce window.
+		timeout = -1;
+		now = mtp_autotune_get_time_us();
+		for( i = 0; i < batch->nb_pending; i++ )
+		{
+			remaining = 0;
+			if( batch->pending[i].deadline > now )
+				remaining = ( batch->pending[i].deadline - now + 999 ) / 1000;
 
-		length = read(ctx->inotify_fd, inotify_buffer, sizeof(inotify_buffer));
+			if( timeout < 0 || remaining < timeout )
+				timeout = remaining;
+		}
 
-		if ( length >= 0 )
+		// ... and of the echoes windows to check.
+		pthread_mutex_lock( &ctx->inotify_echo_mutex );
+		for( i = 0; i < ctx->inotify_nb_echoes; i++ )
 		{
-#ifdef DEBUG
-			if(!length)
-				PRINT_DEBUG( "inotify_thread : Null sized packet ?");
-#endif
+			if( ctx->inotify_echoes[i].in_progress || !ctx->inotify_echoes[i].late )
+				continue;
 
-			i = 0;
-			while ( i < length && i < INOTIFY_RD_BUF_SIZE )
-			{
-				event = ( struct inotify_event * ) &inotify_buffer[ i ];
+			remaining = 0;
+			if( ctx->inotify_echoes[i].expires > now )
+				remaining = ( ctx->inotify_echoes[i].expires - now + 999 ) / 1000;
 
-				// Sanity check to prevent possible buffer overrun/overflow.
-				if ( event->len && (i + (( sizeof (struct inotify_event) ) + event->len) < sizeof(inotify_buffer)) )
-				{
-					if ( ( event->mask & IN_CREATE ) || ( event->mask & IN_MOVED_TO ) )
-					{
-						entry = NULL;
-						do
-						{
-							send_event_flag = 0;
-
-							if ( pthread_mutex_lock( &ctx->inotify_mutex ) )
-							{
-								PRINT_ERROR( "inotify_thread - pthread_mutex_lock failure !");
-								return NULL;
-							}
-
-							entry = get_entry_by_wd( ctx->fs_db, event->wd, entry );
-							if ( get_file_info( ctx, event, entry, &fileinfo, 0 ) )
-							{
-								old_entry = search_entry(ctx->fs_db, &fileinfo, entry->handle, entry->storage_id);
-								if( !old_entry )
-								{
-									// If the entry is not in the db, add it and trigger an MTP_EVENT_OBJECT_ADDED event
-									new_entry = add_entry( ctx->fs_db, &fileinfo, entry->handle, entry->storage_id );
-									if( new_entry )
-									{
-										// Send an "ObjectAdded" (0x4002) MTP event message with the entry handle.
-										handle[0] = new_entry->handle;
-										send_event_flag = 1;
-
-										PRINT_DEBUG( "inotify_thread (IN_CREATE): Entry %s created (Handle 0x%.8X)", event->name, new_entry->handle );
-									}
-									else
-									{
-										PRINT_DEBUG( "inotify_thread (IN_CREATE): Entry %s creation failure !", event->name );
-									}
-								}
-								else
-								{
-									PRINT_DEBUG( "inotify_thread (IN_CREATE): Entry %s already in the db ! (Handle 0x%.8X)", event->name, old_entry->handle );
-								}
-							}
-							else
-							{
-								PRINT_DEBUG( "inotify_thread (IN_CREATE): Watch point descriptor not found in the db ! (Descriptor 0x%.8X)", event->wd );
-							}
-
-							if(entry)
-							{
-								entry = entry->next;
-							}
-
-							if ( pthread_mutex_unlock( &ctx->inotify_mutex ) )
-							{
-								PRINT_ERROR( "inotify_thread - pthread_mutex_unlock failure !");
-								return NULL;
-							}
-
-							if( send_event_flag )
-							{
-								mtp_push_event( ctx, MTP_EVENT_OBJECT_ADDED, 1, (uint32_t *)&handle );
-							}
-
-						}while(entry);
-					}
-
-					if ( event->mask & IN_MODIFY )
-					{
-						entry = NULL;
-
-						do
-						{
-							send_event_flag = 0;
-
-							if ( pthread_mutex_lock( &ctx->inotify_mutex ) )
-							{
-								PRINT_ERROR( "inotify_thread - pthread_mutex_lock failure !");
-								return NULL;
-							}
-
-							entry = get_entry_by_wd( ctx->fs_db, event->wd, entry );
-							if ( get_file_info( ctx, event, entry, &fileinfo, 1 ) )
-							{
-								modified_entry = search_entry(ctx->fs_db, &fileinfo, entry->handle, entry->storage_id);
-								if( modified_entry )
-								{
-									// Send an "ObjectInfoChanged" (0x4007) MTP event message with the entry handle.
-									handle[0] = modified_entry->handle;
-									send_event_flag = 1;
-
-									PRINT_DEBUG( "inotify_thread (IN_MODIFY): Entry %s modified (Handle 0x%.8X)", event->name, modified_entry->handle);
-								}
-							}
-							else
-							{
-								PRINT_DEBUG( "inotify_thread (IN_MODIFY): Watch point descriptor not found in the db ! (Descriptor 0x%.8X)", event->wd );
-							}
-
-							if(entry)
-							{
-								entry = entry->next;
-							}
-
-							if ( pthread_mutex_unlock( &ctx->inotify_mutex ) )
-							{
-								PRINT_ERROR( "inotify_thread - pthread_mutex_unlock failure !");
-								return NULL;
-							}
-
-							if( send_event_flag )
-							{
-								mtp_push_event( ctx, MTP_EVENT_OBJECT_INFO_CHANGED, 1, (uint32_t *)&handle );
-							}
-
-						}while(entry);
-					}
-
-					if ( ( event->mask & IN_DELETE ) || ( event->mask & IN_MOVED_FROM ) )
-					{
-						entry = NULL;
-
-						do
-						{
-							send_event_flag = 0;
-
-							if ( pthread_mutex_lock( &ctx->inotify_mutex ) )
-							{
-								PRINT_ERROR( "inotify_thread - pthread_mutex_lock failure !");
-								return NULL;
-							}
-
-							entry = get_entry_by_wd( ctx->fs_db, event->wd, entry );
-							if ( get_file_info( ctx, event, entry, &fileinfo, 1 ) )
-							{
-								deleted_entry = search_entry(ctx->fs_db, &fileinfo, entry->handle, entry->storage_id);
-								if( deleted_entry )
-								{
-									deleted_entry->flags |= ENTRY_IS_DELETED;
-									if( deleted_entry->watch_descriptor != -1 )
-									{
-										inotify_handler_rmwatch( ctx, deleted_entry->watch_descriptor );
-										deleted_entry->watch_descriptor = -1;
-									}
-
-									// Send an "ObjectRemoved" (0x4003) MTP event message with the entry handle.
-									handle[0] = deleted_entry->handle;
-									send_event_flag = 1;
-
-									PRINT_DEBUG( "inotify_thread (IN_DELETE): Entry %s deleted (Handle 0x%.8X)", event->name, deleted_entry->handle);
-								}
-							}
-							else
-							{
-								PRINT_DEBUG( "inotify_thread (IN_DELETE): Watch point descriptor not found in the db ! (Descriptor 0x%.8X)", event->wd );
-							}
-
-							if(entry)
-							{
-								entry = entry->next;
-							}
-
-							if ( pthread_mutex_unlock( &ctx->inotify_mutex ) )
-							{
-								PRINT_ERROR( "inotify_thread - pthread_mutex_unlock failure !");
-								return NULL;
-							}
-
-							if( send_event_flag )
-							{
-								mtp_push_event( ctx, MTP_EVENT_OBJECT_REMOVED, 1, (uint32_t *)&handle );
-							}
-						}while(entry);
-					}
-				}
+			if( timeout < 0 || remaining < timeout )
+				timeout = remaining;
+		}
+		pthread_mutex_unlock( &ctx->inotify_echo_mutex );
 
-				i +=  (( sizeof (struct inotify_event) ) + event->len);
+		pfd[0].fd = ctx->inotify_fd;
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+
+		// -1 if fanotify is not used : ignored.
+		pfd[1].fd = ctx->fanotify_fd;
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+
+		if ( poll( pfd, 2, timeout ) < 0 )
+		{
+			if (shutdown_requested)
+				break;
+
+			if( errno == EINTR )
+				continue;
+
+			PRINT_DEBUG( "inotify_thread : poll error %d",errno );
+			break;
+		}
+
+		if( pfd[1].revents & POLLIN )
+		{
+			// fanotify events translated to inotify events.
+			length = fanotify_handler_read( ctx, inotify_buffer, sizeof(inotify_buffer) );
+			if( length > 0 )
+			{
+				if( process_events( ctx, batch, inotify_buffer, length ) < 0 )
+					break;
+			}
+			else if( length < 0 )
+			{
+				if (shutdown_requested)
+					break;
+				PRINT_DEBUG( "inotify_thread : fanotify read error %d", errno );
+				break;
 			}
 		}
-		else
+
+		if( pfd[0].revents & POLLIN )
 		{
-			if (shutdown_requested)
+			memset(inotify_buffer,0,sizeof(inotify_buffer));
+
+			length = read(ctx->inotify_fd, inotify_buffer, sizeof(inotify_buffer));
+
+			if ( length >= 0 )
+			{
+#ifdef DEBUG
+				if(!length)
+					PRINT_DEBUG( "inotify_thread : Null sized packet ?");
+#endif
+
+				if( process_events( ctx, batch, inotify_buffer, length ) < 0 )
+					break;
+			}
+			else
+			{
+				if (shutdown_requested)
+					break;
+				PRINT_DEBUG( "inotify_thread : read error %d",length );
 				break;
-			PRINT_DEBUG( "inotify_thread : read error %d",length );
-			return NULL;
+			}
 		}
+
+		if( batch->rescan )
+			rescan_storages( ctx, batch );
+
+		expire_echoes( ctx, batch );
+
+		flush_pending( ctx, batch );
 	}
 
+	free( batch );
+
 	return NULL;
 }
 
+// inotify watches budget : The least recently listed folders lose their watch.
+
+#define WATCHES_HASH_SIZE 1024
+
+typedef struct inotify_watch_
+{
+	int wd;
+
+	struct inotify_watch_ * hash_next;
+
+	// LRU list (head : most recently used)
+	struct inotify_watch_ * prev;
+	struct inotify_watch_ * next;
+}inotify_watch;
+
+typedef struct inotify_watches_
+{
+	pthread_mutex_t lock;
+
+	inotify_watch * hash[WATCHES_HASH_SIZE];
+
+	inotify_watch * head;
+	inotify_watch * tail;
+
+	int nb_watches;
+}inotify_watches;
+
+// Must be called with the watches lock held.
+static inotify_watch * find_watch( inotify_watches * watches, int wd )
+{
+	inotify_watch * watch;
+
+	watch = watches->hash[(unsigned int)wd % WATCHES_HASH_SIZE];
+	while( watch )
+	{
+		if( watch->wd == wd )
+			return watch;
+
+		watch = watch->hash_next;
+	}
+
+	return NULL;
+}
+
+static void lru_unlink( inotify_watches * watches, inotify_watch * watch )
+{
+	if( watch->prev )
+		watch->prev->next = watch->next;
+	else
+		watches->head = watch->next;
+
+	if( watch->next )
+		watch->next->prev = watch->prev;
+	else
+		watches->tail = watch->prev;
+
+	watch->prev = NULL;
+	watch->next = NULL;
+}
+
+static void lru_push_head( inotify_watches * watches, inotify_watch * watch )
+{
+	watch->prev = NULL;
+	watch->next = watches->head;
+
+	if( watches->head )
+		watches->head->prev = watch;
+	else
+		watches->tail = watch;
+
+	watches->head = watch;
+}
+
+// Must be called with the watches lock held.
+static void forget_watch( mtp_ctx * ctx, inotify_watches * watches, inotify_watch * watch )
+{
+	inotify_watch ** prev;
+
+	prev = &watches->hash[(unsigned int)watch->wd % WATCHES_HASH_SIZE];
+	while( *prev && *prev != watch )
+		prev = &(*prev)->hash_next;
+
+	if( *prev )
+		*prev = watch->hash_next;
+
+	lru_unlink( watches, watch );
+
+	watches->nb_watches--;
+	__atomic_store_n( &ctx->stats.inotify_watches, watches->nb_watches, __ATOMIC_RELAXED );
+
+	free( watch );
+}
+
+// Must be called with the watches lock held.
+// The folder content is revalidated at its next listing (IN_IGNORED event).
+static int evict_watch( mtp_ctx * ctx, inotify_watches * watches )
+{
+	inotify_watch * watch;
+
+	watch = watches->tail;
+	if( !watch )
+		return -1;
+
+	PRINT_DEBUG( "inotify : Watch budget reached, wd %d evicted", watch->wd );
+
+	inotify_rm_watch( ctx->inotify_fd, watch->wd );
+
+	forget_watch( ctx, watches, watch );
+
+	__atomic_fetch_add( &ctx->stats.inotify_watch_evictions, 1, __ATOMIC_RELAXED );
+
+	return 0;
+}
+
+// Watch removed by the kernel (IN_IGNORED : folder deleted, file system unmounted, watch evicted...)
+static void release_watch( mtp_ctx * ctx, int wd )
+{
+	inotify_watches * watches;
+	inotify_watch * watch;
+
+	watches = ctx->inotify_watches;
+	if( !watches )
+		return;
+
+	pthread_mutex_lock( &watches->lock );
+
+	watch = find_watch( watches, wd );
+	if( watch )
+		forget_watch( ctx, watches, watch );
+
+	pthread_mutex_unlock( &watches->lock );
+}
+
+static int add_inotify_watch( mtp_ctx * ctx, char * path )
+{
+	inotify_watches * watches;
+	inotify_watch * watch;
+	int wd, retry;
+
+	watches = ctx->inotify_watches;
+	if( !watches )
+		return -1;
+
+	pthread_mutex_lock( &watches->lock );
+
+	retry = 1;
+	do
+	{
+		wd = inotify_add_watch( ctx->inotify_fd, path, IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO );
+
+		// max_user_watches reached : Free one and try again.
+		if( wd < 0 && errno == ENOSPC && retry && !evict_watch( ctx, watches ) )
+		{
+			retry = 0;
+			continue;
+		}
+
+		break;
+	}while( 1 );
+
+	if( wd < 0 )
+	{
+		PRINT_WARN( "inotify : Can't watch %s (error %d) !", path, errno );
+
+		__atomic_fetch_add( &ctx->stats.inotify_watch_failures, 1, __ATOMIC_RELAXED );
+
+		pthread_mutex_unlock( &watches->lock );
+
+		return -1;
+	}
+
+	watch = find_watch( watches, wd );
+	if( watch )
+	{
+		// Already watched.
+		lru_unlink( watches, watch );
+		lru_push_head( watches, watch );
+	}
+	else
+	{
+		watch = malloc( sizeof(inotify_watch) );
+		if( !watch )
+		{
+			inotify_rm_watch( ctx->inotify_fd, wd );
+
+			pthread_mutex_unlock( &watches->lock );
+
+			return -1;
+		}
+
+		memset( watch, 0, sizeof(inotify_watch) );
+		watch->wd = wd;
+
+		watch->hash_next = watches->hash[(unsigned int)wd % WATCHES_HASH_SIZE];
+		watches->hash[(unsigned int)wd % WATCHES_HASH_SIZE] = watch;
+
+		lru_push_head( watches, watch );
+
+		watches->nb_watches++;
+
+		// Budget exceeded : The least recently listed folder is evicted.
+		if( ctx->inotify_max_watches > 0 && watches->nb_watches > ctx->inotify_max_watches )
+			evict_watch( ctx, watches );
+
+		__atomic_store_n( &ctx->stats.inotify_watches, watches->nb_watches, __ATOMIC_RELAXED );
+	}
+
+	pthread_mutex_unlock( &watches->lock );
+
+	return wd;
+}
+
+static void free_watches( mtp_ctx * ctx )
+{
+	inotify_watches * watches;
+	inotify_watch * watch;
+
+	watches = ctx->inotify_watches;
+	if( !watches )
+		return;
+
+	while( watches->head )
+	{
+		watch = watches->head;
+		watches->head = watch->next;
+		free( watch );
+	}
+
+	pthread_mutex_destroy( &watches->lock );
+	free( watches );
+
+	ctx->inotify_watches = NULL;
+}
+
 int inotify_handler_init( mtp_ctx * ctx )
 {
 	if( ctx )
 	{
 		ctx->inotify_fd = inotify_init1(0x00);
 
+		// fanotify is started by the first watched folder (configuration loaded).
+		ctx->fanotify_fd = -1;
+		ctx->fanotify_watches = NULL;
+
+		pthread_mutex_init( &ctx->inotify_echo_mutex, NULL );
+		ctx->inotify_nb_echoes = 0;
+
+		ctx->inotify_watches = malloc( sizeof(inotify_watches) );
+		if( ctx->inotify_watches )
+		{
+			memset( ctx->inotify_watches, 0, sizeof(inotify_watches) );
+			pthread_mutex_init( &((inotify_watches *)ctx->inotify_watches)->lock, NULL );
+		}
+
 		PRINT_DEBUG("init_inotify_handler : inotify_fd = %d", ctx->inotify_fd);
 
 		pthread_create(&ctx->inotify_thread, NULL, inotify_thread, ctx);
@@ -362,6 +1179,10 @@ int inotify_handler_deinit( mtp_ctx * ctx )
 			ctx->inotify_fd = -1;
 		}
 
+		fanotify_handler_deinit( ctx );
+
+		free_watches( ctx );
+
 		return 1;
 	}
 
@@ -370,21 +1191,63 @@ int inotify_handler_deinit( mtp_ctx * ctx )
 
 int inotify_handler_addwatch( mtp_ctx * ctx, char * path )
 {
+	int wd;
+
 	if( ctx->inotify_fd != -1 )
 	{
 		if( !ctx->no_inotify )
 		{
-			return inotify_add_watch( ctx->inotify_fd, path, IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO );
+			wd = fanotify_handler_addwatch( ctx, path );
+			if( wd != -1 )
+				return wd;
+
+			return add_inotify_watch( ctx, path );
 		}
 	}
 
 	return -1;
 }
 
+// Returns 1 if the folder is still watched (and marks it as recently used), 0 otherwise.
+int inotify_handler_touchwatch( mtp_ctx * ctx, int wd )
+{
+	inotify_watches * watches;
+	inotify_watch * watch;
+
+	if( wd == -1 || ctx->no_inotify )
+		return 0;
+
+	// fanotify watched folders are not limited.
+	if( wd >= FANOTIFY_WD_BASE )
+		return ctx->fanotify_fd != -1;
+
+	watches = ctx->inotify_watches;
+	if( !watches )
+		return 0;
+
+	pthread_mutex_lock( &watches->lock );
+
+	watch = find_watch( watches, wd );
+	if( watch )
+	{
+		lru_unlink( watches, watch );
+		lru_push_head( watches, watch );
+	}
+
+	pthread_mutex_unlock( &watches->lock );
+
+	return watch != NULL;
+}
+
 int inotify_handler_rmwatch( mtp_ctx * ctx, int wd )
 {
+	if( wd >= FANOTIFY_WD_BASE )
+		return fanotify_handler_rmwatch( ctx, wd );
+
 	if( ctx->inotify_fd != -1 && wd != -1 )
 	{
+		release_watch( ctx, wd );
+
 		return inotify_rm_watch( ctx->inotify_fd, wd );
 	}
 
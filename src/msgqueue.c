@@ -127,7 +127,7 @@ static void* msgqueue_thread( void* arg )
 
 				if(store_index >= 0)
 				{
-					if( !pthread_mutex_lock( &ctx->inotify_mutex ) )
+					if( !mtp_db_lock_storage( ctx, store_index ) )
 					{
 						mount_store( ctx, store_index, 1 );
 
@@ -135,7 +135,7 @@ static void* msgqueue_thread( void* arg )
 
 						mtp_push_event( ctx, MTP_EVENT_STORE_ADDED, 1, (uint32_t *)&handle );
 
-						if( pthread_mutex_unlock( &ctx->inotify_mutex ) )
+						if( mtp_db_unlock_storage( ctx, store_index ) )
 						{
 							goto error;
 						}
@@ -152,7 +152,7 @@ static void* msgqueue_thread( void* arg )
 				store_index = mtp_get_storage_index_by_name(ctx, message + 8);
 				if(store_index >= 0)
 				{
-					if( !pthread_mutex_lock( &ctx->inotify_mutex ) )
+					if( !mtp_db_lock_storage( ctx, store_index ) )
 					{
 						umount_store( ctx, store_index, 1 );
 
@@ -160,7 +160,7 @@ static void* msgqueue_thread( void* arg )
 
 						mtp_push_event( ctx, MTP_EVENT_STORE_REMOVED, 1, (uint32_t *)&handle );
 
-						if( pthread_mutex_unlock( &ctx->inotify_mutex ) )
+						if( mtp_db_unlock_storage( ctx, store_index ) )
 						{
 							goto error;
 						}
@@ -172,6 +172,14 @@ static void* msgqueue_thread( void* arg )
 				}
 			}
 
+			if(!strncmp(message,"stats",5))
+			{
+				if(!strncmp(message,"stats:reset",11))
+					mtp_reset_stats(ctx);
+				else
+					mtp_print_stats(ctx);
+			}
+
 			if(!strncmp(message,"lock",4))
 			{
 				store_index = 0;
@@ -182,7 +190,7 @@ static void* msgqueue_thread( void* arg )
 						!(ctx->storages[store_index].flags & UMTP_STORAGE_LOCKED)
 					)
 					{
-						if( !pthread_mutex_lock( &ctx->inotify_mutex ) )
+						if( !mtp_db_lock_storage( ctx, store_index ) )
 						{
 							umount_store( ctx, store_index, 0 );
 
@@ -192,7 +200,7 @@ static void* msgqueue_thread( void* arg )
 
 							mtp_push_event( ctx, MTP_EVENT_STORE_REMOVED, 1, (uint32_t *)&handle );
 
-							if( pthread_mutex_unlock( &ctx->inotify_mutex ) )
+							if( mtp_db_unlock_storage( ctx, store_index ) )
 							{
 								goto error;
 							}
@@ -213,7 +221,7 @@ static void* msgqueue_thread( void* arg )
 						(ctx->storages[store_index].flags & UMTP_STORAGE_LOCKED)
 					)
 					{
-						if( !pthread_mutex_lock( &ctx->inotify_mutex ) )
+						if( !mtp_db_lock_storage( ctx, store_index ) )
 						{
 							mount_store( ctx, store_index, 0 );
 
@@ -223,7 +231,7 @@ static void* msgqueue_thread( void* arg )
 
 							mtp_push_event( ctx, MTP_EVENT_STORE_ADDED, 1, (uint32_t *)&handle );
 
-							if( pthread_mutex_unlock( &ctx->inotify_mutex ) )
+							if( mtp_db_unlock_storage( ctx, store_index ) )
 							{
 								goto error;
 							}
@@ -33,9 +33,11 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #include <sys/stat.h>
 #include <unistd.h>
+#include <sys/inotify.h>
 
 #include "mtp.h"
 #include "mtp_helpers.h"
@@ -52,12 +54,23 @@
 
 #include "inotify.h"
 #include "msgqueue.h"
+#include "mtp_events.h"
+#include "fs_cache.h"
+#include "mtp_autotune.h"
+#include "mtp_copy.h"
+#include "mtp_thumb.h"
+#include "mtp_media.h"
+#include "mtp_search.h"
+#include "mtp_dataset_writer.h"
+#include "mtp_archive.h"
+#include "mtp_journal.h"
 
 #include "logs_out.h"
 
 mtp_ctx * mtp_init_responder()
 {
 	mtp_ctx * ctx;
+	int i;
 
 	PRINT_DEBUG("init_mtp_responder");
 
@@ -76,6 +89,13 @@ mtp_ctx * mtp_init_responder()
 		ctx->read_file_buffer_size = CONFIG_READ_FILE_BUFFER_SIZE;
 		ctx->read_file_buffer = NULL;
 
+		ctx->write_file_buffer_size = CONFIG_WRITE_FILE_BUFFER_SIZE;
+		ctx->write_file_buffer = NULL;
+		ctx->write_file_fd = -1;
+
+		fs_cache_init(ctx);
+		mtp_thumb_init(ctx);
+
 		ctx->temp_array = malloc( MAX_STORAGE_NB * sizeof(uint32_t) );
 		if(!ctx->temp_array)
 			goto init_error;
@@ -101,6 +121,13 @@ mtp_ctx * mtp_init_responder()
 		if( pthread_mutex_init (&ctx->inotify_mutex, &ctx->inotify_mutex_attr ) )
 			goto init_error;
 
+		for( i = 0; i < MAX_STORAGE_NB; i++ )
+		{
+			if( pthread_mutex_init (&ctx->storages[i].db_lock, &ctx->inotify_mutex_attr ) )
+				goto init_error;
+		}
+
+		mtp_events_init( ctx );
 		inotify_handler_init( ctx );
 		msgqueue_handler_init( ctx );
 
@@ -146,8 +173,15 @@ void mtp_deinit_responder(mtp_ctx * ctx)
 {
 	if( ctx )
 	{
+		mtp_copy_cancel( ctx );
+		mtp_thumb_deinit( ctx );
+		mtp_media_deinit( ctx );
+		mtp_journal_deinit( ctx );
+		mtp_find_free( ctx );
+		mtp_archive_free( ctx );
 		msgqueue_handler_deinit( ctx );
 		inotify_handler_deinit( ctx );
+		mtp_events_deinit( ctx );
 
 		if(ctx->wrbuffer)
 			free(ctx->wrbuffer);
@@ -164,6 +198,11 @@ void mtp_deinit_responder(mtp_ctx * ctx)
 		if(ctx->read_file_buffer)
 			free(ctx->read_file_buffer);
 
+		if(ctx->write_file_buffer)
+			free(ctx->write_file_buffer);
+
+		fs_cache_deinit(ctx);
+
 		free(ctx);
 	}
 }
@@ -188,35 +227,22 @@ int build_response(mtp_ctx * ctx, uint32_t tx_id, uint16_t type, uint16_t status
 	return ofs;
 }
 
-int parse_incoming_dataset(mtp_ctx * ctx,void * datain,int size,uint32_t * newhandle, uint32_t parent_handle, uint32_t storage_id)
+// Create a new file or folder and register it in the db. The db lock must be held.
+// objectsize : File size (< 0 : unknown). The new file is the target of the next SendObject.
+uint32_t mtp_create_object(mtp_ctx * ctx, uint32_t storage_id, uint32_t parent_handle, char * name, int isdir, mtp_size objectsize, uint32_t * newhandle)
 {
-	MTP_PACKET_HEADER * tmp_hdr;
-	unsigned char *dataset_ptr;
-	uint32_t objectformat,objectsize;
-#ifdef DEBUG
-	uint32_t type;
-#endif
-	unsigned char string_len;
-	char tmp_str[256+1];
-	uint16_t unicode_str[256+1];
 	char * parent_folder;
 	char * tmp_path;
 	int tmp_path_len;
 	uint32_t storage_flags;
-	int i,ret_code,ret;
+	int ret;
 	fs_entry * entry;
 	int file;
 	filefoundinfo tmp_file_entry;
 
-	ret_code = MTP_RESPONSE_GENERAL_ERROR;
-
-	tmp_hdr = (MTP_PACKET_HEADER *)datain;
-
 	if(parent_handle == 0xFFFFFFFF)
 		parent_handle = 0x00000000;
 
-	PRINT_DEBUG("Incoming dataset : %d bytes (raw) %d bytes, operation 0x%x, code 0x%x, tx_id: %x",size,tmp_hdr->length,tmp_hdr->operation,tmp_hdr->code ,tmp_hdr->tx_id );
-
 	storage_flags = mtp_get_storage_flags(ctx, storage_id);
 	if( storage_flags == 0xFFFFFFFF )
 	{
@@ -230,226 +256,202 @@ int parse_incoming_dataset(mtp_ctx * ctx,void * datain,int size,uint32_t * newha
 		return MTP_RESPONSE_STORE_READ_ONLY;
 	}
 
-	dataset_ptr = (datain + sizeof(MTP_PACKET_HEADER));
+	ctx->SendObjInfoHandle = 0xFFFFFFFF;
+	ctx->SendObjInfoSize = 0;
+	ctx->SendObjInfoOffset = 0;
+	ctx->SendObjInfoDate = 0;
 
-	switch( tmp_hdr->code )
+	entry = get_entry_by_handle_and_storageid(ctx->fs_db, parent_handle,storage_id);
+	if( !entry || !(entry->flags & ENTRY_IS_DIR) )
+		return MTP_RESPONSE_INVALID_PARENT_OBJECT;
+
+	tmp_path = NULL;
+	tmp_path_len = 0;
+
+	parent_folder = build_full_path(ctx->fs_db, mtp_get_storage_root(ctx, entry->storage_id), entry);
+
+	if(parent_folder)
 	{
-		case MTP_OPERATION_SEND_OBJECT_INFO:
-			objectformat = peek(dataset_ptr, 0x04, 2);     // ObjectFormat Code
-			if(objectformat==MTP_FORMAT_ASSOCIATION)
-			{
-				objectsize = peek(dataset_ptr, 0x08, 4);   // Object Compressed Size
-				//parent = peek(dataset_ptr,0x26, 4);      // Parent Object (NR)
-#ifdef DEBUG
-				type = peek(dataset_ptr,0x2A, 2);          // Association Type
-#else
-				peek(dataset_ptr,0x2A, 2);                 // Association Type
-#endif
+		PRINT_DEBUG("%s : Parent folder %s", __func__, parent_folder);
+		tmp_path_len = strlen(parent_folder) + 1 + strlen(name) + 1;
+		tmp_path = malloc(tmp_path_len);
+	}
 
-				string_len = peek(dataset_ptr,0x34, 1);    // File name
+	if(!tmp_path)
+	{
+		if(parent_folder)
+			free(parent_folder);
 
-				if(string_len > 255)
-					string_len = 255;
+		return MTP_RESPONSE_GENERAL_ERROR;
+	}
 
-				memset(unicode_str,0,sizeof(unicode_str));
-				for(i=0;i<string_len;i++)
-				{
-					unicode_str[i] = peek(dataset_ptr,0x35 + (i*2), 2);
-				}
+	snprintf(tmp_path,tmp_path_len,"%s/%s",parent_folder,name);
+	free(parent_folder);
 
-				unicode2charstring(tmp_str, unicode_str, sizeof(tmp_str));
+	PRINT_DEBUG("%s : Creating %s ...", __func__, tmp_path);
 
-				if (sanitize_name(tmp_str, sizeof(tmp_str) ) != 1 )
-				{
-					PRINT_ERROR("MTP_OPERATION_SEND_OBJECT_INFO : Malformed object name !");
-					ret_code = MTP_RESPONSE_INVALID_DATASET;
-					return ret_code;
-				}
+	tmp_file_entry.isdirectory = isdir;
+	strcpy(tmp_file_entry.filename,name);
+	tmp_file_entry.size = 0;
+	tmp_file_entry.date = 0;
 
-				PRINT_DEBUG("MTP_OPERATION_SEND_OBJECT_INFO : 0x%x objectformat Size %d, Parent 0x%.8x, type: %x, strlen %d str:%s",objectformat,objectsize,parent_handle,type,string_len,tmp_str);
+	if( isdir )
+	{
+		ret = -1;
 
-				entry = get_entry_by_handle_and_storageid(ctx->fs_db, parent_handle,storage_id);
-				if(entry)
-				{
-					if(entry->flags & ENTRY_IS_DIR)
-					{
-						tmp_path = NULL;
-						tmp_path_len = 0;
+		inotify_handler_echo_begin(ctx, storage_id, parent_handle, name, IN_CREATE);
 
-						parent_folder = build_full_path(ctx->fs_db, mtp_get_storage_root(ctx, entry->storage_id), entry);
+		if(!set_storage_giduid(ctx, storage_id))
+		{
+			ret = mkdir(tmp_path, 0777);
+		}
 
-						if(parent_folder)
-						{
-							PRINT_DEBUG("MTP_OPERATION_SEND_OBJECT_INFO : Parent folder %s",parent_folder);
-							tmp_path_len = strlen(parent_folder) + 1 + strlen(tmp_str) + 1;
-							tmp_path = malloc(tmp_path_len);
-						}
+		restore_giduid(ctx);
 
-						if(tmp_path)
-						{
-							snprintf(tmp_path,tmp_path_len,"%s/%s",parent_folder,tmp_str);
-							PRINT_DEBUG("MTP_OPERATION_SEND_OBJECT_INFO : Creating %s ...",tmp_path);
+		if( ret )
+		{
+			inotify_handler_echo_end(ctx, storage_id, parent_handle, name);
 
-							ret = -1;
+			PRINT_WARN("%s : Can't create %s ...", __func__, tmp_path);
 
-							if(!set_storage_giduid(ctx, entry->storage_id))
-							{
-								ret = mkdir(tmp_path, 0777);
-							}
+			free(tmp_path);
 
-							restore_giduid(ctx);
+			return MTP_RESPONSE_ACCESS_DENIED;
+		}
 
-							if( ret )
-							{
-								PRINT_WARN("MTP_OPERATION_SEND_OBJECT_INFO : Can't create %s ...",tmp_path);
+		entry = add_entry(ctx->fs_db, &tmp_file_entry, parent_handle, storage_id);
 
-								if(parent_folder)
-									free(parent_folder);
+		inotify_handler_echo_end(ctx, storage_id, parent_handle, name);
 
-								free(tmp_path);
+		mtp_journal_record(ctx, JOURNAL_ADD, storage_id, tmp_path, 0);
 
-								ret_code = MTP_RESPONSE_ACCESS_DENIED;
+		free(tmp_path);
 
-								return ret_code;
-							}
+		if(!entry)
+			return MTP_RESPONSE_GENERAL_ERROR;
 
-							tmp_file_entry.isdirectory = 1;
-							strcpy(tmp_file_entry.filename,tmp_str);
-							tmp_file_entry.size = 0;
+		*newhandle = entry->handle;
 
-							entry = add_entry(ctx->fs_db, &tmp_file_entry, parent_handle, storage_id);
+		return MTP_RESPONSE_OK;
+	}
 
-							if(entry)
-							{
-								*newhandle = entry->handle;
-							}
+	if( objectsize > 0 )
+		tmp_file_entry.size = objectsize;
 
-							free(tmp_path);
+	file = -1;
 
-							ret_code = MTP_RESPONSE_OK;
-						}
+	inotify_handler_echo_begin(ctx, storage_id, parent_handle, name, IN_CREATE | IN_MODIFY);
 
-						if(parent_folder)
-							free(parent_folder);
-					}
-				}
-			}
-			else
-			{
-				objectsize = peek(dataset_ptr, 0x08, 4);   // Object Compressed Size
-				//parent = peek(dataset_ptr,0x26, 4);      // Parent Object (NR)
+	if(!set_storage_giduid(ctx, storage_id))
+	{
+		file = open(tmp_path,
+				O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
+				S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	}
+
+	restore_giduid(ctx);
+
+	if( file == -1)
+	{
+		inotify_handler_echo_end(ctx, storage_id, parent_handle, name);
+
+		PRINT_WARN("%s : Can't create %s ...", __func__, tmp_path);
+
+		free(tmp_path);
+
+		return MTP_RESPONSE_ACCESS_DENIED;
+	}
+
+	// Reserve the space now to fail early and to limit the fragmentation.
+	if( objectsize > 0 && fs_preallocate( file, objectsize ) == ENOSPC )
+	{
+		PRINT_WARN("%s : Not enough space to store %s (%"SIZEHEX" bytes) !", __func__, tmp_path, objectsize);
+
+		close( file );
+		remove( tmp_path );
+
+		inotify_handler_echo_end(ctx, storage_id, parent_handle, name);
+
+		free(tmp_path);
+
+		return MTP_RESPONSE_STORAGE_FULL;
+	}
+
+	close( file );
+
+	entry = add_entry(ctx->fs_db, &tmp_file_entry, parent_handle, storage_id);
+
+	inotify_handler_echo_end(ctx, storage_id, parent_handle, name);
+
+	mtp_journal_record(ctx, JOURNAL_ADD, storage_id, tmp_path, 0);
+
+	free(tmp_path);
+
+	if(!entry)
+		return MTP_RESPONSE_GENERAL_ERROR;
+
+	ctx->SendObjInfoHandle = entry->handle;
+	ctx->SendObjInfoSize = objectsize;
+	ctx->SendObjInfoOffset = 0;
+	*newhandle = entry->handle;
+
+	return MTP_RESPONSE_OK;
+}
+
+int parse_incoming_dataset(mtp_ctx * ctx,void * datain,int size,uint32_t * newhandle, uint32_t parent_handle, uint32_t storage_id)
+{
+	MTP_PACKET_HEADER * tmp_hdr;
+	unsigned char *dataset_ptr;
+	uint32_t objectformat,objectsize;
+#ifdef DEBUG
+	uint32_t type;
+#endif
+	char tmp_str[256+1];
+	int ret_code;
+
+	ret_code = MTP_RESPONSE_GENERAL_ERROR;
+
+	tmp_hdr = (MTP_PACKET_HEADER *)datain;
+
+	if(parent_handle == 0xFFFFFFFF)
+		parent_handle = 0x00000000;
+
+	PRINT_DEBUG("Incoming dataset : %d bytes (raw) %d bytes, operation 0x%x, code 0x%x, tx_id: %x",size,tmp_hdr->length,tmp_hdr->operation,tmp_hdr->code ,tmp_hdr->tx_id );
+
+	dataset_ptr = (datain + sizeof(MTP_PACKET_HEADER));
+
+	switch( tmp_hdr->code )
+	{
+		case MTP_OPERATION_SEND_OBJECT_INFO:
+			objectformat = peek(dataset_ptr, 0x04, 2);     // ObjectFormat Code
+			objectsize = peek(dataset_ptr, 0x08, 4);       // Object Compressed Size
+			//parent = peek(dataset_ptr,0x26, 4);          // Parent Object (NR)
 #ifdef DEBUG
-				type = peek(dataset_ptr,0x2A, 2);          // Association Type
-#else
-				peek(dataset_ptr,0x2A, 2);                 // Association Type
+			type = peek(dataset_ptr,0x2A, 2);              // Association Type
 #endif
 
-				string_len = peek(dataset_ptr,0x34, 1);    // File name
-
-				memset(unicode_str,0,sizeof(unicode_str));
-				for(i=0;i<string_len;i++)
-				{
-					unicode_str[i] = peek(dataset_ptr,0x35 + (i*2), 2);
-				}
-
-				unicode2charstring(tmp_str, unicode_str, sizeof(tmp_str));
-
-				if (sanitize_name(tmp_str, sizeof(tmp_str) ) != 1 )
-				{
-					PRINT_ERROR("MTP_OPERATION_SEND_OBJECT_INFO : Malformed object name !");
-					ret_code = MTP_RESPONSE_INVALID_DATASET;
-					return ret_code;
-				}
-
-				PRINT_DEBUG("MTP_OPERATION_SEND_OBJECT_INFO : 0x%x objectformat Size %d, Parent 0x%.8x, type: %x, strlen %d str:%s",objectformat,objectsize,parent_handle,type,string_len,tmp_str);
-
-				entry = get_entry_by_handle_and_storageid(ctx->fs_db, parent_handle,storage_id);
-				if(entry)
-				{
-					if(entry->flags & ENTRY_IS_DIR)
-					{
-						parent_folder = build_full_path(ctx->fs_db, mtp_get_storage_root(ctx, entry->storage_id), entry);
-
-						tmp_path = NULL;
-						tmp_path_len = 0;
-						entry = NULL;
-
-						if(parent_folder)
-						{
-							PRINT_DEBUG("MTP_OPERATION_SEND_OBJECT_INFO : Parent folder %s",parent_folder);
-							tmp_path_len = strlen(parent_folder) + 1 + strlen(tmp_str) + 1;
-							tmp_path = malloc(tmp_path_len);
-						}
-
-						if( tmp_path )
-						{
-							snprintf(tmp_path, tmp_path_len, "%s/%s",parent_folder,tmp_str);
-							PRINT_DEBUG("MTP_OPERATION_SEND_OBJECT_INFO : Creating %s ...",tmp_path);
-
-							tmp_file_entry.isdirectory = 0;
-							strcpy(tmp_file_entry.filename,tmp_str);
-							tmp_file_entry.size = objectsize;
-
-							file = -1;
-
-							if(!set_storage_giduid(ctx, storage_id))
-							{
-								file = open(tmp_path,
-										O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
-										S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-							}
-
-							restore_giduid(ctx);
-
-							if( file == -1)
-							{
-								PRINT_WARN("MTP_OPERATION_SEND_OBJECT_INFO : Can't create %s ...",tmp_path);
-
-								if(parent_folder)
-									free(parent_folder);
-
-								free(tmp_path);
-
-								ret_code = MTP_RESPONSE_ACCESS_DENIED;
-
-								return ret_code;
-							}
-							close( file );
-
-							entry = add_entry(ctx->fs_db, &tmp_file_entry, parent_handle, storage_id);
-
-							free(tmp_path);
-						}
-
-						if(entry)
-						{
-							ctx->SendObjInfoHandle = entry->handle;
-							ctx->SendObjInfoSize = objectsize;
-							ctx->SendObjInfoOffset = 0;
-							*newhandle = entry->handle;
-						}
-						else
-						{
-							ctx->SendObjInfoHandle = 0xFFFFFFFF;
-							ctx->SendObjInfoSize = 0;
-							ctx->SendObjInfoOffset = 0;
-						}
-
-						if( parent_folder )
-							free(parent_folder);
-
-						ret_code = MTP_RESPONSE_OK;
-					}
-				}
+			// File name
+			if( peek_string(dataset_ptr, 0x34, size - (int)sizeof(MTP_PACKET_HEADER), tmp_str, sizeof(tmp_str)) < 0 ||
+				sanitize_name(tmp_str, sizeof(tmp_str) ) != 1 )
+			{
+				PRINT_ERROR("MTP_OPERATION_SEND_OBJECT_INFO : Malformed object name !");
+				return MTP_RESPONSE_INVALID_DATASET;
 			}
 
+			PRINT_DEBUG("MTP_OPERATION_SEND_OBJECT_INFO : 0x%x objectformat Size %d, Parent 0x%.8x, type: %x, str:%s",objectformat,objectsize,parent_handle,type,tmp_str);
+
+			// 0xFFFFFFFF : Object size unknown or > 4GB.
+			ret_code = mtp_create_object(ctx, storage_id, parent_handle, tmp_str,
+										 objectformat == MTP_FORMAT_ASSOCIATION,
+										 objectsize == 0xFFFFFFFF ? -1 : (mtp_size)objectsize,
+										 newhandle);
 		break;
 
 		default :
 		break;
 	}
 
-	return MTP_RESPONSE_OK;
+	return ret_code;
 }
 
 int check_and_send_USB_ZLP(mtp_ctx * ctx , int size)
@@ -596,6 +598,10 @@ int process_in_packet(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int raws
 			response_code = mtp_op_SendObject(ctx,mtp_packet_hdr,&size,(uint32_t*)&params,&params_size);
 		break;
 
+		case MTP_OPERATION_GET_THUMB:
+			response_code = mtp_op_GetThumb(ctx,mtp_packet_hdr,&size,(uint32_t*)&params,&params_size);
+		break;
+
 		case MTP_OPERATION_DELETE_OBJECT:
 			response_code = mtp_op_DeleteObject(ctx,mtp_packet_hdr,&size,(uint32_t*)&params,&params_size);
 		break;
@@ -604,6 +610,38 @@ int process_in_packet(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int raws
 			response_code = mtp_op_GetObjectPropsSupported(ctx,mtp_packet_hdr,&size,(uint32_t*)&params,&params_size);
 		break;
 
+		case MTP_OPERATION_COPY_OBJECT:
+			response_code = mtp_op_CopyObject(ctx,mtp_packet_hdr,&size,(uint32_t*)&params,&params_size);
+		break;
+
+		case MTP_OPERATION_MOVE_OBJECT:
+			response_code = mtp_op_MoveObject(ctx,mtp_packet_hdr,&size,(uint32_t*)&params,&params_size);
+		break;
+
+		case MTP_OPERATION_FIND_OBJECTS:
+			response_code = mtp_op_FindObjects(ctx,mtp_packet_hdr,&size,(uint32_t*)&params,&params_size);
+		break;
+
+		case MTP_OPERATION_GET_FIND_RESULTS:
+			response_code = mtp_op_GetFindResults(ctx,mtp_packet_hdr,&size,(uint32_t*)&params,&params_size);
+		break;
+
+		case MTP_OPERATION_GET_FOLDER_ARCHIVE:
+			response_code = mtp_op_GetFolderArchive(ctx,mtp_packet_hdr,&size,(uint32_t*)&params,&params_size);
+		break;
+
+		case MTP_OPERATION_SEND_FOLDER_ARCHIVE:
+			response_code = mtp_op_SendFolderArchive(ctx,mtp_packet_hdr,&size,(uint32_t*)&params,&params_size);
+		break;
+
+		case MTP_OPERATION_GET_ARCHIVE_ERRORS:
+			response_code = mtp_op_GetArchiveErrors(ctx,mtp_packet_hdr,&size,(uint32_t*)&params,&params_size);
+		break;
+
+		case MTP_OPERATION_GET_CHANGES:
+			response_code = mtp_op_GetChanges(ctx,mtp_packet_hdr,&size,(uint32_t*)&params,&params_size);
+		break;
+
 		case MTP_OPERATION_GET_OBJECT_PROP_DESC:
 			response_code = mtp_op_GetObjectPropDesc(ctx,mtp_packet_hdr,&size,(uint32_t*)&params,&params_size);
 		break;
@@ -620,6 +658,10 @@ int process_in_packet(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int raws
 			response_code = mtp_op_GetObjectPropList(ctx,mtp_packet_hdr,&size,(uint32_t*)&params,&params_size);
 		break;
 
+		case MTP_OPERATION_SEND_OBJECT_PROP_LIST:
+			response_code = mtp_op_SendObjectPropList(ctx,mtp_packet_hdr,&size,(uint32_t*)&params,&params_size);
+		break;
+
 		case MTP_OPERATION_GET_OBJECT_REFERENCES:
 			response_code = mtp_op_GetObjectReferences(ctx,mtp_packet_hdr,&size,(uint32_t*)&params,&params_size);
 		break;
@@ -783,6 +825,119 @@ uint32_t mtp_add_storage(mtp_ctx * ctx, char * path, char * description, int uid
 	return 0x00000000;
 }
 
+static int db_lock_mutex(mtp_ctx * ctx, pthread_mutex_t * mutex)
+{
+	uint64_t start_time;
+	int ret;
+
+	ret = pthread_mutex_trylock( mutex );
+	if( ret == EBUSY )
+	{
+		start_time = mtp_autotune_get_time_us();
+
+		ret = pthread_mutex_lock( mutex );
+		if( ret )
+			return ret;
+
+		__atomic_fetch_add( &ctx->stats.db_lock_contended, 1, __ATOMIC_RELAXED );
+		__atomic_fetch_add( &ctx->stats.db_lock_wait_us, mtp_autotune_get_time_us() - start_time, __ATOMIC_RELAXED );
+	}
+
+	if( !ret )
+		__atomic_fetch_add( &ctx->stats.db_lock_count, 1, __ATOMIC_RELAXED );
+
+	return ret;
+}
+
+// Handles db writers lock : A single storage objects (shard)...
+int mtp_db_lock_storage(mtp_ctx * ctx, int store_index)
+{
+	if( store_index < 0 || store_index >= MAX_STORAGE_NB )
+		return -1;
+
+	return db_lock_mutex( ctx, &ctx->storages[store_index].db_lock );
+}
+
+int mtp_db_unlock_storage(mtp_ctx * ctx, int store_index)
+{
+	if( store_index < 0 || store_index >= MAX_STORAGE_NB )
+		return -1;
+
+	return pthread_mutex_unlock( &ctx->storages[store_index].db_lock );
+}
+
+// ... or the whole db (the inotify_mutex, then all the storages locks).
+int mtp_db_lock(mtp_ctx * ctx)
+{
+	int i,ret;
+
+	ret = db_lock_mutex( ctx, &ctx->inotify_mutex );
+	if( ret )
+		return ret;
+
+	for( i = 0; i < MAX_STORAGE_NB; i++ )
+	{
+		ret = pthread_mutex_lock( &ctx->storages[i].db_lock );
+		if( ret )
+		{
+			while( i-- )
+				pthread_mutex_unlock( &ctx->storages[i].db_lock );
+
+			pthread_mutex_unlock( &ctx->inotify_mutex );
+
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+int mtp_db_unlock(mtp_ctx * ctx)
+{
+	int i,ret;
+
+	ret = 0;
+
+	for( i = MAX_STORAGE_NB - 1; i >= 0; i-- )
+	{
+		if( pthread_mutex_unlock( &ctx->storages[i].db_lock ) )
+			ret = -1;
+	}
+
+	if( pthread_mutex_unlock( &ctx->inotify_mutex ) )
+		ret = -1;
+
+	return ret;
+}
+
+// Lookups section : lock-free, the writers keep running.
+// Returns -1 on error, else the value to pass to mtp_db_read_unlock().
+int mtp_db_read_lock(mtp_ctx * ctx)
+{
+	if( !ctx->fs_db )
+		return -1;
+
+	if( !fs_db_read_lock( ctx->fs_db ) )
+	{
+		__atomic_fetch_add( &ctx->stats.db_read_sections, 1, __ATOMIC_RELAXED );
+		return 0;
+	}
+
+	// No reader slot available : fall back to the writers lock.
+	if( mtp_db_lock( ctx ) )
+		return -1;
+
+	return 1;
+}
+
+void mtp_db_read_unlock(mtp_ctx * ctx, int lock)
+{
+	if( lock )
+		mtp_db_unlock( ctx );
+	else
+		fs_db_read_unlock( ctx->fs_db );
+}
+
 int mtp_remove_storage(mtp_ctx * ctx, char * name)
 {
 	int index = mtp_get_storage_index_by_name(ctx, name);
@@ -790,6 +945,13 @@ int mtp_remove_storage(mtp_ctx * ctx, char * name)
 	if (index < 0)
 		return index;
 
+	// Don't keep files of the removed storage open.
+	if( !mtp_db_lock( ctx ) )
+	{
+		fs_cache_invalidate_storage(ctx, ctx->storages[index].storage_id);
+		mtp_db_unlock( ctx );
+	}
+
 	free(ctx->storages[index].root_path);
 	free(ctx->storages[index].description);
 
@@ -963,20 +1125,85 @@ uint32_t mtp_get_storage_flags(mtp_ctx * ctx, uint32_t storage_id)
 
 int mtp_push_event(mtp_ctx * ctx, uint32_t event, int nbparams, uint32_t * parameters )
 {
-	unsigned char event_buffer[64];
-	int size;
-	int ret;
+	return mtp_events_queue( ctx, event, nbparams, parameters );
+}
 
-	size = build_event_dataset( ctx, event_buffer, sizeof(event_buffer), event , ctx->session_id, 0x00000000, nbparams, parameters);
-	if(size < 0)
-		return -1;
+static void print_read_amplification(const char * label, mtp_stats * st, mtp_stats * base)
+{
+	uint64_t read_bytes,prefetch_bytes,sent_bytes,ratio;
 
-	PRINT_DEBUG("mtp_push_event : Event packet buffer - %d Bytes :",size);
-	PRINT_DEBUG_BUF(event_buffer, size);
+	read_bytes = st->file_read_bytes - base->file_read_bytes;
+	prefetch_bytes = st->file_prefetch_bytes - base->file_prefetch_bytes;
+	sent_bytes = st->tx_payload_bytes - base->tx_payload_bytes;
 
-	ret = write_usb(ctx->usb_ctx,EP_DESCRIPTOR_INT_IN,event_buffer,size);
+	if( !sent_bytes )
+		return;
 
-	PRINT_DEBUG("write_usb return: %d", ret );
+	// Bytes fetched from the storage for each byte sent to the host (x100)
+	ratio = ( read_bytes * 100 ) / sent_bytes;
 
-	return ret;
+	PRINT_MSG("%s read amplification : %"PRIu64".%.2"PRIu64" (%"PRIu64" bytes read - %"PRIu64" bytes prefetched - %"PRIu64" bytes sent)",
+				label, ratio / 100, ratio % 100, read_bytes, prefetch_bytes, sent_bytes);
+}
+
+void mtp_print_stats(mtp_ctx * ctx)
+{
+	mtp_stats * st;
+
+	st = &ctx->stats;
+
+	PRINT_MSG("Data phase : %"PRIu64" payload bytes sent in %"PRIu64" USB writes",st->tx_payload_bytes,st->tx_chunks);
+	PRINT_MSG("Data phase : %"PRIu64" payload bytes copied (%"PRIu64" bytes zero-copy)",
+				st->tx_payload_copied_bytes,
+				st->tx_payload_bytes - st->tx_payload_copied_bytes);
+
+	// Throughput of both transfer paths (bytes per us == MB/s)
+	PRINT_MSG("Read path : %"PRIu64" bytes - %"PRIu64" transfers - %"PRIu64" KB/s",
+				st->tx_read_bytes, st->tx_read_transfers,
+				st->tx_read_time_us ? ( st->tx_read_bytes * 1000 ) / st->tx_read_time_us : 0 );
+	PRINT_MSG("mmap path : %"PRIu64" bytes - %"PRIu64" transfers - %"PRIu64" KB/s - %"PRIu64" fallbacks",
+				st->tx_mmap_bytes, st->tx_mmap_transfers,
+				st->tx_mmap_time_us ? ( st->tx_mmap_bytes * 1000 ) / st->tx_mmap_time_us : 0,
+				st->tx_mmap_fallbacks );
+
+	PRINT_MSG("Files cache : %"PRIu64" hits - %"PRIu64" misses",st->fd_cache_hits,st->fd_cache_misses);
+	PRINT_MSG("Blocks cache : %"PRIu64" hits - %"PRIu64" misses",st->block_cache_hits,st->block_cache_misses);
+	PRINT_MSG("Metadata prefetch : %"PRIu64" issued - %"PRIu64" hits - %"PRIu64" wasted - %"PRIu64" skipped",
+				st->prefetch_issued, st->prefetch_hits, st->prefetch_wasted, st->prefetch_skipped);
+
+	PRINT_MSG("Handles db : %"PRIu64" locks - %"PRIu64" contended (%"PRIu64" us waiting) - %"PRIu64" lock-free lookups",
+				st->db_lock_count, st->db_lock_contended, st->db_lock_wait_us, st->db_read_sections);
+	PRINT_MSG("inotify : %"PRIu64" events - %"PRIu64" coalesced - %"PRIu64" MTP events sent - %"PRIu64" rescans - %"PRIu64" echoes filtered (%"PRIu64" external changes)",
+				st->inotify_events, st->inotify_coalesced, st->inotify_emitted, st->inotify_rescans, st->inotify_echoes, st->inotify_echo_external);
+	PRINT_MSG("inotify watches : %"PRIu64" active - %"PRIu64" evicted - %"PRIu64" failures",
+				st->inotify_watches, st->inotify_watch_evictions, st->inotify_watch_failures);
+	PRINT_MSG("Events : %"PRIu64" queued - %"PRIu64" sent - %"PRIu64" superseded - %"PRIu64" storms - %"PRIu64" dropped",
+				st->events_queued, st->events_sent, st->events_superseded, st->events_storms, st->events_dropped);
+	PRINT_MSG("Copy : %"PRIu64" files - %"PRIu64" bytes - %"PRIu64" cloned - %"PRIu64" renamed - %"PRIu64" cancelled",
+				st->copy_objects, st->copy_bytes, st->copy_reflinks, st->copy_renames, st->copy_cancelled);
+	PRINT_MSG("Thumbnails : %"PRIu64" sent - %"PRIu64" EXIF - %"PRIu64" generated - %"PRIu64" cache hits - %"PRIu64" dropped",
+				st->thumb_sent, st->thumb_exif, st->thumb_generated, st->thumb_cache_hits, st->thumb_dropped);
+
+	PRINT_MSG("Media index : %"PRIu64" indexed - %"PRIu64" on demand - %"PRIu64" dropped",
+				st->media_indexed, st->media_on_demand, st->media_dropped);
+
+	PRINT_MSG("Archives : %"PRIu64" sent - %"PRIu64" files - %"PRIu64" bytes - %"PRIu64" received - %"PRIu64" entries errors - %"PRIu64" cancelled",
+				st->archive_sent, st->archive_files, st->archive_bytes, st->archive_received, st->archive_errors, st->archive_cancelled);
+
+	PRINT_MSG("Change journal : %"PRIu64" changes recorded - %"PRIu64" storages walks - %"PRIu64" tokens expired",
+				st->journal_records, st->journal_walks, st->journal_expired);
+
+	if( ctx->fs_db )
+		print_read_amplification("Session", st, &ctx->session_stats);
+}
+
+void mtp_print_session_stats(mtp_ctx * ctx)
+{
+	print_read_amplification("Session", &ctx->stats, &ctx->session_stats);
+}
+
+void mtp_reset_stats(mtp_ctx * ctx)
+{
+	memset(&ctx->stats, 0, sizeof(mtp_stats));
+	memset(&ctx->session_stats, 0, sizeof(mtp_stats));
 }
@@ -0,0 +1,1897 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/**
+ * @file   mtp_archive.c
+ * @brief  Folders archives (GetFolderArchive / SendFolderArchive vendor extensions).
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+// A folder is sent as a tar stream (optionally zstd compressed) in a single data phase :
+// One transaction instead of a GetObjectInfo + GetObject per file.
+// The archive is generated on the fly in the USB write buffer, without temporary file.
+// Its size isn't known in advance : The container length is 0xFFFFFFFF and the
+// transfer ends with a short packet.
+// The next files of the folder being sent are opened and read ahead (posix_fadvise)
+// while the current one is streamed.
+
+#include "buildconf.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "mtp.h"
+#include "mtp_helpers.h"
+#include "mtp_constant.h"
+#include "mtp_ops_helpers.h"
+#include "mtp_dataset_writer.h"
+#include "mtp_sanitize.h"
+#include "mtp_archive.h"
+#include "mtp_journal.h"
+#include "fs_cache.h"
+#include "inotify.h"
+
+#include "usb_gadget_fct.h"
+
+#include "logs_out.h"
+
+#define TAR_BLOCK_SIZE 512
+
+typedef struct tar_header_
+{
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+}tar_header;
+
+typedef struct archive_file_
+{
+	char * name;
+	int fd;               // Opened by the read-ahead (-1 : not opened / skipped)
+	struct stat64 st;
+	mtp_size ra_size;     // Bytes read ahead
+}archive_file;
+
+typedef struct mtp_archive_
+{
+	mtp_ctx * ctx;
+	mtp_dataset_writer dsw;
+
+#ifdef USE_ZSTD
+	ZSTD_CCtx * zcs;
+	unsigned char * zbuf;  // Uncompressed data staging buffer
+	int zbuf_size;
+#endif
+
+	int error;             // USB or compression error : The stream is broken.
+	uint32_t files;
+	uint32_t skipped;
+	uint64_t bytes;
+}mtp_archive;
+
+///////////////////////////////////////////////////////////////////////////////
+// Output : tar data -> (zstd) -> USB write buffer
+
+#ifdef USE_ZSTD
+static int archive_compress(mtp_archive * arc, void * data, int size, ZSTD_EndDirective mode)
+{
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	mtp_dataset_writer * dsw;
+	size_t ret;
+
+	dsw = &arc->dsw;
+
+	in.src = data;
+	in.size = size;
+	in.pos = 0;
+
+	do
+	{
+		out.dst = dsw->buffer;
+		out.size = dsw->size;
+		out.pos = dsw->ofs;
+
+		ret = ZSTD_compressStream2(arc->zcs, &out, &in, mode);
+		if( ZSTD_isError(ret) )
+		{
+			PRINT_ERROR("mtp_archive : zstd error (%s) !", ZSTD_getErrorName(ret));
+			arc->error = 1;
+			return -1;
+		}
+
+		dsw->ofs = out.pos;
+
+		if( dsw->ofs == dsw->size && dataset_writer_flush(dsw) < 0 )
+		{
+			arc->error = 1;
+			return -1;
+		}
+
+	}while( in.pos < in.size || ( mode == ZSTD_e_end && ret ) );
+
+	return 0;
+}
+#endif
+
+// Get the buffer where the next archive bytes are written (*size : available bytes).
+static unsigned char * archive_getbuf(mtp_archive * arc, int * size)
+{
+	mtp_dataset_writer * dsw;
+
+	dsw = &arc->dsw;
+
+#ifdef USE_ZSTD
+	if( arc->zcs )
+	{
+		*size = arc->zbuf_size;
+		return arc->zbuf;
+	}
+#endif
+
+	if( dsw->ofs == dsw->size && dataset_writer_flush(dsw) < 0 )
+	{
+		arc->error = 1;
+		return NULL;
+	}
+
+	*size = dsw->size - dsw->ofs;
+
+	return dsw->buffer + dsw->ofs;
+}
+
+static int archive_commit(mtp_archive * arc, int size)
+{
+#ifdef USE_ZSTD
+	if( arc->zcs )
+		return archive_compress(arc, arc->zbuf, size, ZSTD_e_continue);
+#endif
+
+	arc->dsw.ofs += size;
+
+	return 0;
+}
+
+static int archive_write(mtp_archive * arc, void * data, int size)
+{
+	unsigned char * buf;
+	int chunk;
+
+	while( size > 0 )
+	{
+		buf = archive_getbuf(arc, &chunk);
+		if( !buf )
+			return -1;
+
+		if( chunk > size )
+			chunk = size;
+
+		if( data )
+		{
+			memcpy(buf, data, chunk);
+			data = (unsigned char *)data + chunk;
+		}
+		else
+		{
+			memset(buf, 0, chunk);
+		}
+
+		if( archive_commit(arc, chunk) < 0 )
+			return -1;
+
+		size -= chunk;
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// tar format (POSIX ustar, GNU long names and base-256 sizes)
+
+static void tar_number(char * field, int size, uint64_t value)
+{
+	int i;
+
+	if( value >> ( 3 * ( size - 1 ) ) )
+	{
+		// Doesn't fit in octal : GNU base-256 encoding.
+		for( i = size - 1; i > 0; i-- )
+		{
+			field[i] = value & 0xFF;
+			value >>= 8;
+		}
+
+		field[0] = (char)0x80;
+
+		return;
+	}
+
+	field[size - 1] = 0;
+
+	for( i = size - 2; i >= 0; i-- )
+	{
+		field[i] = '0' + ( value & 7 );
+		value >>= 3;
+	}
+}
+
+static int tar_put_header(mtp_archive * arc, tar_header * hdr)
+{
+	unsigned char * p;
+	unsigned int sum;
+	int i;
+
+	memcpy(hdr->magic, "ustar", 6);
+	memcpy(hdr->version, "00", 2);
+
+	memset(hdr->chksum, ' ', sizeof(hdr->chksum));
+
+	p = (unsigned char *)hdr;
+	sum = 0;
+	for( i = 0; i < TAR_BLOCK_SIZE; i++ )
+		sum += p[i];
+
+	tar_number(hdr->chksum, 7, sum);
+	hdr->chksum[7] = ' ';
+
+	return archive_write(arc, hdr, TAR_BLOCK_SIZE);
+}
+
+static int tar_put_entry(mtp_archive * arc, char * name, struct stat64 * st)
+{
+	tar_header hdr;
+	int len,i;
+
+	len = strlen(name);
+
+	memset(&hdr, 0, sizeof(hdr));
+
+	if( len > (int)sizeof(hdr.name) )
+	{
+		// ustar : Split the path between the prefix and the name fields.
+		for( i = len - 1; i > 0; i-- )
+		{
+			if( name[i] == '/' && i <= (int)sizeof(hdr.prefix) && len - i - 1 <= (int)sizeof(hdr.name) )
+				break;
+		}
+
+		if( i > 0 && len - i - 1 > 0 )
+		{
+			memcpy(hdr.prefix, name, i);
+			memcpy(hdr.name, &name[i + 1], len - i - 1);
+		}
+		else
+		{
+			// GNU long name record before the entry.
+			strcpy(hdr.name, "././@LongLink");
+			tar_number(hdr.mode, sizeof(hdr.mode), 0644);
+			tar_number(hdr.uid, sizeof(hdr.uid), 0);
+			tar_number(hdr.gid, sizeof(hdr.gid), 0);
+			tar_number(hdr.size, sizeof(hdr.size), len + 1);
+			tar_number(hdr.mtime, sizeof(hdr.mtime), 0);
+			hdr.typeflag = 'L';
+
+			if( tar_put_header(arc, &hdr) < 0 ||
+				archive_write(arc, name, len + 1) < 0 ||
+				archive_write(arc, NULL, ( TAR_BLOCK_SIZE - ( ( len + 1 ) % TAR_BLOCK_SIZE ) ) % TAR_BLOCK_SIZE) < 0 )
+				return -1;
+
+			memset(&hdr, 0, sizeof(hdr));
+			memcpy(hdr.name, name, sizeof(hdr.name));
+		}
+	}
+	else
+	{
+		memcpy(hdr.name, name, len);
+	}
+
+	tar_number(hdr.mode, sizeof(hdr.mode), st->st_mode & 07777);
+	tar_number(hdr.uid, sizeof(hdr.uid), st->st_uid <= 07777777 ? st->st_uid : 0);
+	tar_number(hdr.gid, sizeof(hdr.gid), st->st_gid <= 07777777 ? st->st_gid : 0);
+	tar_number(hdr.mtime, sizeof(hdr.mtime), st->st_mtime > 0 ? st->st_mtime : 0);
+
+	if( S_ISDIR(st->st_mode) )
+	{
+		tar_number(hdr.size, sizeof(hdr.size), 0);
+		hdr.typeflag = '5';
+	}
+	else
+	{
+		tar_number(hdr.size, sizeof(hdr.size), st->st_size);
+		hdr.typeflag = '0';
+	}
+
+	return tar_put_header(arc, &hdr);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Folders walk
+
+static int list_folder(char * path, archive_file ** files)
+{
+	struct dirent *d;
+	archive_file * list;
+	archive_file * tmp;
+	DIR * dir;
+	int count,max;
+
+	*files = NULL;
+
+	dir = opendir(path);
+	if( !dir )
+		return -1;
+
+	list = NULL;
+	count = 0;
+	max = 0;
+
+	while( (d = readdir(dir)) )
+	{
+		if( !strcmp(d->d_name,".") || !strcmp(d->d_name,"..") )
+			continue;
+
+		if( count == max )
+		{
+			max = max ? max * 2 : 64;
+			tmp = realloc(list, max * sizeof(archive_file));
+			if( !tmp )
+				break;
+
+			list = tmp;
+		}
+
+		list[count].name = strdup(d->d_name);
+		if( !list[count].name )
+			break;
+
+		list[count].fd = -1;
+		list[count].ra_size = 0;
+		memset(&list[count].st, 0, sizeof(struct stat64));
+		count++;
+	}
+
+	closedir(dir);
+
+	*files = list;
+
+	return count;
+}
+
+static char * child_path(char * path, char * name)
+{
+	char * child;
+
+	child = malloc(strlen(path) + strlen(name) + 2);
+	if( child )
+		sprintf(child,"%s/%s",path,name);
+
+	return child;
+}
+
+// Open the file and ask the kernel to read it ahead. Return the bytes requested.
+static mtp_size read_ahead(char * path, archive_file * file, mtp_size budget)
+{
+	char * full_path;
+	mtp_size size;
+
+	full_path = child_path(path, file->name);
+	if( !full_path )
+		return 0;
+
+	file->fd = open(full_path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+	if( file->fd == -1 || fstat64(file->fd, &file->st) )
+	{
+		if( file->fd != -1 )
+			close(file->fd);
+
+		file->fd = -1;
+
+		// Symbolic links are not followed.
+		if( lstat64(full_path, &file->st) )
+			memset(&file->st, 0, sizeof(file->st));
+
+		free(full_path);
+
+		return 0;
+	}
+
+	free(full_path);
+
+	size = 0;
+	if( S_ISREG(file->st.st_mode) && budget > 0 )
+	{
+		size = file->st.st_size;
+		if( size > budget )
+			size = budget;
+
+		posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+		if( size > 0 )
+			posix_fadvise(file->fd, 0, size, POSIX_FADV_WILLNEED);
+	}
+
+	return size;
+}
+
+static int send_file_content(mtp_archive * arc, archive_file * file, char * name)
+{
+	mtp_ctx * ctx;
+	unsigned char * buf;
+	mtp_size remaining;
+	int chunk,ret,short_read;
+
+	ctx = arc->ctx;
+
+	if( tar_put_entry(arc, name, &file->st) < 0 )
+		return -1;
+
+	// The size announced in the header is sent : A file shrinking during the transfer is padded.
+	short_read = 0;
+	remaining = file->st.st_size;
+	while( remaining > 0 && !ctx->cancel_req )
+	{
+		buf = archive_getbuf(arc, &chunk);
+		if( !buf )
+			return -1;
+
+		if( chunk > remaining )
+			chunk = remaining;
+
+		ret = -1;
+		if( !short_read )
+			ret = read(file->fd, buf, chunk);
+
+		if( ret <= 0 )
+		{
+			if( !short_read )
+				PRINT_WARN("mtp_archive : %s shrank or can't be read, padding...", name);
+
+			short_read = 1;
+			memset(buf, 0, chunk);
+			ret = chunk;
+		}
+
+		if( archive_commit(arc, ret) < 0 )
+			return -1;
+
+		remaining -= ret;
+		arc->bytes += ret;
+	}
+
+	if( ctx->cancel_req )
+		return -1;
+
+	if( short_read )
+		arc->skipped++;
+	else
+		arc->files++;
+
+	return archive_write(arc, NULL, ( TAR_BLOCK_SIZE - ( file->st.st_size % TAR_BLOCK_SIZE ) ) % TAR_BLOCK_SIZE);
+}
+
+static int archive_tree(mtp_archive * arc, char * path, char * name)
+{
+	archive_file * files;
+	char * full_path;
+	char * tar_name;
+	mtp_size ra_bytes;
+	int count,i,ra,ret;
+
+	count = list_folder(path, &files);
+	if( count < 0 )
+	{
+		PRINT_WARN("mtp_archive : Can't list %s (%s)", path, strerror(errno));
+		arc->skipped++;
+		return 0;
+	}
+
+	ret = 0;
+	ra = 0;
+	ra_bytes = 0;
+
+	for( i = 0; i < count && !ret && !arc->ctx->cancel_req; i++ )
+	{
+		// Read-ahead window : The next files of the folder are already being read.
+		while( ra < count && ( ra == i ||
+			   ( ra - i < CONFIG_ARCHIVE_READAHEAD_FILES && ra_bytes < CONFIG_ARCHIVE_READAHEAD_SIZE ) ) )
+		{
+			files[ra].ra_size = read_ahead(path, &files[ra], CONFIG_ARCHIVE_READAHEAD_SIZE - ra_bytes);
+			ra_bytes += files[ra].ra_size;
+			ra++;
+		}
+
+		ra_bytes -= files[i].ra_size;
+
+		tar_name = malloc(strlen(name) + strlen(files[i].name) + 3);
+		if( !tar_name )
+		{
+			ret = -1;
+			break;
+		}
+
+		if( name[0] )
+			sprintf(tar_name,"%s/%s",name,files[i].name);
+		else
+			strcpy(tar_name,files[i].name);
+
+		if( S_ISREG(files[i].st.st_mode) )
+		{
+			if( files[i].fd != -1 )
+			{
+				ret = send_file_content(arc, &files[i], tar_name);
+			}
+			else
+			{
+				PRINT_WARN("mtp_archive : %s skipped (can't be opened)", tar_name);
+				arc->skipped++;
+			}
+		}
+		else if( S_ISDIR(files[i].st.st_mode) )
+		{
+			if( files[i].fd != -1 )
+			{
+				close(files[i].fd);
+				files[i].fd = -1;
+			}
+
+			strcat(tar_name, "/");
+
+			ret = tar_put_entry(arc, tar_name, &files[i].st);
+
+			tar_name[strlen(tar_name) - 1] = 0;
+
+			full_path = child_path(path, files[i].name);
+			if( !ret && full_path )
+				ret = archive_tree(arc, full_path, tar_name);
+
+			if( !full_path )
+				ret = -1;
+
+			free(full_path);
+		}
+		else
+		{
+			PRINT_WARN("mtp_archive : %s skipped (not a regular file or folder)", tar_name);
+			arc->skipped++;
+		}
+
+		free(tar_name);
+
+		if( files[i].fd != -1 )
+		{
+			close(files[i].fd);
+			files[i].fd = -1;
+		}
+	}
+
+	for( i = 0; i < count; i++ )
+	{
+		if( files[i].fd != -1 )
+			close(files[i].fd);
+
+		free(files[i].name);
+	}
+
+	free(files);
+
+	if( arc->ctx->cancel_req )
+		return -1;
+
+	return ret;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+static uint32_t send_archive(mtp_archive * arc, MTP_PACKET_HEADER * mtp_packet_hdr, char * path, char * name, struct stat64 * st)
+{
+	mtp_ctx * ctx;
+	int ret;
+
+	ctx = arc->ctx;
+
+	dataset_writer_init(ctx, &arc->dsw, 0);
+
+	if( dataset_writer_begin(&arc->dsw, mtp_packet_hdr->tx_id, mtp_packet_hdr->code, DATASET_UNKNOWN_LENGTH) < 0 )
+		return MTP_RESPONSE_GENERAL_ERROR;
+
+	// Storage root : Its content is at the archive root.
+	ret = 0;
+	if( name[0] )
+		ret = tar_put_entry(arc, name, st);
+
+	if( !ret )
+	{
+		// The folder name without the trailing slash is the prefix of its content.
+		if( name[0] )
+			name[strlen(name) - 1] = 0;
+
+		ret = archive_tree(arc, path, name);
+	}
+
+	// End of archive : Two empty blocks.
+	if( !ret && !ctx->cancel_req )
+		ret = archive_write(arc, NULL, 2 * TAR_BLOCK_SIZE);
+
+#ifdef USE_ZSTD
+	if( !ret && arc->zcs && !ctx->cancel_req )
+		ret = archive_compress(arc, NULL, 0, ZSTD_e_end);
+#endif
+
+	if( !pthread_mutex_lock( &ctx->cancel_mutex ) )
+	{
+		if( ctx->cancel_req )
+		{
+			PRINT_DEBUG("mtp_archive : Cancelled ! Aborted...");
+
+			ctx->cancel_req = 0;
+			pthread_mutex_unlock( &ctx->cancel_mutex );
+
+			ctx->stats.archive_cancelled++;
+
+			return MTP_RESPONSE_NO_RESPONSE;
+		}
+
+		pthread_mutex_unlock( &ctx->cancel_mutex );
+	}
+
+	if( ret || arc->error || dataset_writer_end(&arc->dsw) < 0 )
+		return MTP_RESPONSE_INCOMPLETE_TRANSFER;
+
+	return MTP_RESPONSE_OK;
+}
+
+uint32_t mtp_archive_send(mtp_ctx * ctx, MTP_PACKET_HEADER * mtp_packet_hdr, uint32_t handle, uint32_t format, uint32_t * files, uint32_t * skipped)
+{
+	mtp_archive arc;
+	uint32_t response_code;
+	uint32_t storage_id;
+	struct stat64 st;
+	fs_entry * entry;
+	char * path;
+	char * name;
+	int store_index;
+
+#ifndef USE_ZSTD
+	if( format != MTP_ARCHIVE_TAR )
+		return MTP_RESPONSE_PARAMETER_NOT_SUPPORTED;
+#else
+	if( format != MTP_ARCHIVE_TAR && format != MTP_ARCHIVE_TAR_ZSTD )
+		return MTP_RESPONSE_PARAMETER_NOT_SUPPORTED;
+#endif
+
+	memset(&arc, 0, sizeof(arc));
+	arc.ctx = ctx;
+
+	// The db is only used to find the folder : The data phase runs without the db lock.
+	store_index = FS_DB_HANDLE_SHARD(handle);
+
+	if( mtp_db_lock_storage( ctx, store_index ) )
+		return MTP_RESPONSE_GENERAL_ERROR;
+
+	entry = get_entry_by_handle(ctx->fs_db, handle);
+	if( !entry )
+	{
+		mtp_db_unlock_storage( ctx, store_index );
+		return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
+	}
+
+	if( check_handle_access( ctx, entry, handle, 0, &response_code) )
+	{
+		mtp_db_unlock_storage( ctx, store_index );
+		return response_code;
+	}
+
+	if( !( entry->flags & ENTRY_IS_DIR ) )
+	{
+		mtp_db_unlock_storage( ctx, store_index );
+		return MTP_RESPONSE_INVALID_PARENT_OBJECT;
+	}
+
+	storage_id = entry->storage_id;
+
+	path = build_full_path(ctx->fs_db, mtp_get_storage_root(ctx, storage_id), entry);
+	name = malloc(strlen(entry->name) + 2);
+	if( !path || !name )
+	{
+		free(path);
+		free(name);
+		mtp_db_unlock_storage( ctx, store_index );
+		return MTP_RESPONSE_GENERAL_ERROR;
+	}
+
+	if( entry->handle == entry->parent )
+		name[0] = 0;
+	else
+		sprintf(name,"%s/",entry->name);
+
+	mtp_db_unlock_storage( ctx, store_index );
+
+	response_code = MTP_RESPONSE_GENERAL_ERROR;
+
+	if( !set_storage_giduid(ctx, storage_id) && !stat64(path, &st) )
+	{
+#ifdef USE_ZSTD
+		if( format == MTP_ARCHIVE_TAR_ZSTD )
+		{
+			arc.zbuf_size = ctx->read_file_chunk_size;
+			arc.zbuf = malloc(arc.zbuf_size);
+			arc.zcs = ZSTD_createCCtx();
+
+			if( arc.zcs )
+				ZSTD_CCtx_setParameter(arc.zcs, ZSTD_c_compressionLevel, CONFIG_ARCHIVE_ZSTD_LEVEL);
+		}
+
+		if( format == MTP_ARCHIVE_TAR || ( arc.zbuf && arc.zcs ) )
+#endif
+		{
+			PRINT_DEBUG("mtp_archive : Sending %s (format %d)", path, format);
+
+			ctx->transferring_file_data = 1;
+
+			response_code = send_archive(&arc, mtp_packet_hdr, path, name, &st);
+
+			ctx->transferring_file_data = 0;
+		}
+
+#ifdef USE_ZSTD
+		ZSTD_freeCCtx(arc.zcs);
+		free(arc.zbuf);
+#endif
+	}
+	restore_giduid(ctx);
+
+	PRINT_DEBUG("mtp_archive : %s : %d files - %"PRIu64" bytes - %d skipped", path, arc.files, arc.bytes, arc.skipped);
+
+	free(path);
+	free(name);
+
+	if( response_code == MTP_RESPONSE_OK )
+	{
+		ctx->stats.archive_sent++;
+		ctx->stats.archive_files += arc.files;
+		ctx->stats.archive_bytes += arc.bytes;
+	}
+
+	*files = arc.files;
+	*skipped = arc.skipped;
+
+	return response_code;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Archive reception : The tar stream is unpacked into the target folder while received.
+// The objects are added to the db by batches (the storage lock is taken once for all
+// the entries of a USB buffer) and a single StorageInfoChanged event is sent at the end. The entries errors are
+// kept for GetArchiveErrors.
+
+#define UNARCHIVE_HEADER  0
+#define UNARCHIVE_DATA    1
+#define UNARCHIVE_PADDING 2
+
+#define UNARCHIVE_MAX_META 4096     // GNU long name / pax header maximum size
+
+typedef struct archive_error_
+{
+	uint32_t index;           // Entry index in the archive
+	uint16_t code;            // MTP response code
+	char name[256];
+}archive_error;
+
+typedef struct mtp_archive_errors_
+{
+	uint32_t count;           // Errors (may be above the number of errors kept)
+	archive_error errors[CONFIG_ARCHIVE_MAX_ERRORS];
+}mtp_archive_errors;
+
+typedef struct mtp_unarchive_
+{
+	mtp_ctx * ctx;
+
+	uint32_t storage_id;
+	int store_index;
+	int locked;
+	char * storage_root;
+
+	uint32_t target;          // Target folder
+	char * target_path;
+
+	// Parser
+	int state;
+	unsigned char block[TAR_BLOCK_SIZE];
+	int block_fill;
+	int zero_blocks;
+	mtp_size remaining;       // Current entry data bytes left
+	int padding;
+	int ended;
+	int broken;
+
+	char * meta;              // GNU long name / pax header data
+	int meta_size;
+	char meta_type;
+	char * next_name;         // Name of the next entry (GNU long name / pax path)
+	mtp_size next_size;       // Size of the next entry (pax size, -1 : none)
+
+	// Current entry
+	uint32_t index;
+	char * name;
+	int file;
+	uint32_t file_handle;
+	time_t mtime;
+
+	// Last parent folder resolved
+	char * parent_rel;
+	char * parent_path;
+	uint32_t parent_handle;
+
+	uint32_t objects;
+	mtp_archive_errors * errors;
+
+#ifdef USE_ZSTD
+	ZSTD_DCtx * zds;
+	unsigned char * zbuf;
+	int zbuf_size;
+#endif
+}mtp_unarchive;
+
+static void unarchive_error(mtp_unarchive * ua, char * name, uint16_t code)
+{
+	mtp_ctx * ctx;
+	archive_error * err;
+	int len;
+
+	ctx = ua->ctx;
+
+	PRINT_WARN("mtp_archive : Entry %d (%s) not extracted (0x%.4X)", ua->index, name ? name : "", code);
+
+	if( !ua->errors )
+	{
+		ua->errors = malloc(sizeof(mtp_archive_errors));
+		if( !ua->errors )
+			return;
+
+		ua->errors->count = 0;
+	}
+
+	if( ua->errors->count < CONFIG_ARCHIVE_MAX_ERRORS )
+	{
+		err = &ua->errors->errors[ua->errors->count];
+
+		err->index = ua->index;
+		err->code = code;
+		err->name[0] = 0;
+
+		if( name )
+		{
+			// Truncated on an UTF-8 character boundary.
+			len = strlen(name);
+			if( len > (int)sizeof(err->name) - 1 )
+			{
+				len = sizeof(err->name) - 1;
+				while( len > 0 && ( (unsigned char)name[len] & 0xC0 ) == 0x80 )
+					len--;
+			}
+
+			memcpy(err->name, name, len);
+			err->name[len] = 0;
+		}
+	}
+
+	ua->errors->count++;
+
+	ctx->stats.archive_errors++;
+}
+
+static int unarchive_lock(mtp_unarchive * ua)
+{
+	if( !ua->locked )
+	{
+		if( mtp_db_lock_storage( ua->ctx, ua->store_index ) )
+			return -1;
+
+		ua->locked = 1;
+	}
+
+	return 0;
+}
+
+static void unarchive_unlock(mtp_unarchive * ua)
+{
+	if( ua->locked )
+	{
+		mtp_db_unlock_storage( ua->ctx, ua->store_index );
+		ua->locked = 0;
+	}
+}
+
+static fs_entry * unarchive_add_entry(mtp_unarchive * ua, uint32_t parent, char * name, int isdir, mtp_size size, time_t mtime)
+{
+	filefoundinfo fileinfo;
+	fs_entry * entry;
+
+	memset(&fileinfo, 0, sizeof(fileinfo));
+
+	fileinfo.isdirectory = isdir;
+	strcpy(fileinfo.filename, name);
+	fileinfo.size = size;
+	fileinfo.date = mtime > 0 ? mtime : 0;
+
+	entry = search_entry(ua->ctx->fs_db, &fileinfo, parent, ua->storage_id);
+	if( entry )
+	{
+		if( !( entry->flags & ENTRY_IS_DIR ) != !isdir )
+			return NULL;
+
+		if( !isdir )
+		{
+			// Overwritten file.
+			fs_cache_invalidate(ua->ctx, entry->handle);
+
+			entry->size = fileinfo.size;
+			entry->date = fileinfo.date;
+		}
+
+		return entry;
+	}
+
+	return add_entry(ua->ctx->fs_db, &fileinfo, parent, ua->storage_id);
+}
+
+// Split the entry path in sanitized components. Return the number of components (< 0 : invalid path).
+static int unarchive_split(char * path, char ** components, int max)
+{
+	char * comp;
+	char * saveptr;
+	int nb;
+
+	nb = 0;
+
+	comp = strtok_r(path, "/", &saveptr);
+	while( comp )
+	{
+		if( strcmp(comp, ".") )
+		{
+			if( nb >= max || strlen(comp) > FS_HANDLE_MAX_FILENAME_SIZE )
+				return -1;
+
+			// Same rules as the names received from the host ("..", forbidden characters...)
+			if( sanitize_name(comp, FS_HANDLE_MAX_FILENAME_SIZE + 1) != 1 )
+				return -1;
+
+			components[nb++] = comp;
+		}
+
+		comp = strtok_r(NULL, "/", &saveptr);
+	}
+
+	return nb;
+}
+
+// Find / create the folder made of the nb first components. The storage lock must be held.
+// Return the folder handle (0xFFFFFFFF : error, *code set).
+static uint32_t unarchive_folder(mtp_unarchive * ua, char ** components, int nb, uint16_t * code)
+{
+	struct stat64 st;
+	fs_entry * entry;
+	uint32_t handle;
+	char * rel;
+	char * path;
+	int i,len;
+
+	len = 1;
+	for( i = 0; i < nb; i++ )
+		len += strlen(components[i]) + 1;
+
+	rel = malloc(len);
+	path = malloc(strlen(ua->target_path) + len + 1);
+	if( !rel || !path )
+	{
+		free(rel);
+		free(path);
+		*code = MTP_RESPONSE_GENERAL_ERROR;
+		return 0xFFFFFFFF;
+	}
+
+	rel[0] = 0;
+	for( i = 0; i < nb; i++ )
+	{
+		strcat(rel, components[i]);
+		strcat(rel, "/");
+	}
+
+	// Archives entries are grouped by folder : Most of the time the last one.
+	if( ua->parent_rel && !strcmp(ua->parent_rel, rel) )
+	{
+		free(rel);
+		free(path);
+		return ua->parent_handle;
+	}
+
+	handle = ua->target;
+	strcpy(path, ua->target_path);
+
+	for( i = 0; i < nb; i++ )
+	{
+		strcat(path, "/");
+		strcat(path, components[i]);
+
+		if( mkdir(path, 0777) )
+		{
+			if( errno != EEXIST || lstat64(path, &st) )
+			{
+				*code = posix_to_mtp_errcode(errno);
+				break;
+			}
+
+			// Existing symbolic links may point outside the storage : Not followed.
+			if( S_ISLNK(st.st_mode) )
+			{
+				PRINT_ERROR("mtp_archive : %s is a symbolic link !", path);
+				*code = MTP_RESPONSE_ACCESS_DENIED;
+				break;
+			}
+
+			if( !S_ISDIR(st.st_mode) )
+			{
+				*code = posix_to_mtp_errcode(ENOTDIR);
+				break;
+			}
+		}
+
+		entry = unarchive_add_entry(ua, handle, components[i], 1, 0, 0);
+		if( !entry )
+		{
+			*code = MTP_RESPONSE_INVALID_PARENT_OBJECT;
+			break;
+		}
+
+		handle = entry->handle;
+	}
+
+	// The target folder path may contain links too.
+	if( i < nb || !check_realpath(ua->storage_root, path) )
+	{
+		if( i == nb )
+		{
+			PRINT_ERROR("mtp_archive : %s is outside the storage !", path);
+			*code = MTP_RESPONSE_ACCESS_DENIED;
+		}
+
+		free(rel);
+		free(path);
+
+		return 0xFFFFFFFF;
+	}
+
+	free(ua->parent_rel);
+	free(ua->parent_path);
+
+	ua->parent_rel = rel;
+	ua->parent_path = path;
+	ua->parent_handle = handle;
+
+	return handle;
+}
+
+static void unarchive_begin_entry(mtp_unarchive * ua, char type, mtp_size size)
+{
+	mtp_ctx * ctx;
+	char * components[CONFIG_ARCHIVE_MAX_DEPTH];
+	char * path;
+	char * full_path;
+	fs_entry * entry;
+	uint32_t parent;
+	uint16_t code;
+	int nb,isdir,file;
+
+	ctx = ua->ctx;
+
+	isdir = ( type == '5' );
+
+	path = strdup(ua->name);
+	if( !path )
+	{
+		unarchive_error(ua, ua->name, MTP_RESPONSE_GENERAL_ERROR);
+		return;
+	}
+
+	nb = unarchive_split(path, components, CONFIG_ARCHIVE_MAX_DEPTH);
+	if( nb <= 0 )
+	{
+		// "./" : The target folder itself.
+		if( nb < 0 || !isdir )
+			unarchive_error(ua, ua->name, MTP_RESPONSE_INVALID_DATASET);
+
+		free(path);
+		return;
+	}
+
+	if( unarchive_lock(ua) )
+	{
+		unarchive_error(ua, ua->name, MTP_RESPONSE_GENERAL_ERROR);
+		free(path);
+		return;
+	}
+
+	code = MTP_RESPONSE_OK;
+
+	if( isdir )
+	{
+		if( unarchive_folder(ua, components, nb, &code) != 0xFFFFFFFF )
+			ua->objects++;
+		else
+			unarchive_error(ua, ua->name, code);
+
+		free(path);
+		return;
+	}
+
+	parent = unarchive_folder(ua, components, nb - 1, &code);
+	if( parent == 0xFFFFFFFF )
+	{
+		unarchive_error(ua, ua->name, code);
+		free(path);
+		return;
+	}
+
+	full_path = child_path(ua->parent_path, components[nb - 1]);
+	if( !full_path )
+	{
+		unarchive_error(ua, ua->name, MTP_RESPONSE_GENERAL_ERROR);
+		free(path);
+		return;
+	}
+
+	// Symbolic links are not followed (O_NOFOLLOW) : The file is in the checked parent folder.
+	file = open(full_path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_LARGEFILE,
+				S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+
+	if( file == -1 )
+	{
+		code = posix_to_mtp_errcode(errno);
+	}
+	else if( size > 0 && fs_preallocate( file, size ) == ENOSPC )
+	{
+		code = MTP_RESPONSE_STORAGE_FULL;
+	}
+	else
+	{
+		entry = unarchive_add_entry(ua, parent, components[nb - 1], 0, size, ua->mtime);
+		if( !entry )
+			code = MTP_RESPONSE_GENERAL_ERROR;
+		else if( file_wrcache_open(ctx, file, 0) )
+			code = MTP_RESPONSE_GENERAL_ERROR;
+		else
+			ua->file_handle = entry->handle;
+	}
+
+	if( code != MTP_RESPONSE_OK )
+	{
+		if( file != -1 )
+			close(file);
+
+		unarchive_error(ua, ua->name, code);
+	}
+	else
+	{
+		ua->file = file;
+	}
+
+	free(full_path);
+	free(path);
+}
+
+static void unarchive_end_entry(mtp_unarchive * ua)
+{
+	struct timespec times[2];
+	int ret;
+
+	if( ua->meta_type )
+	{
+		ua->meta[ua->meta_size] = 0;
+
+		if( ua->meta_type == 'L' )
+		{
+			free(ua->next_name);
+			ua->next_name = strdup(ua->meta);
+		}
+		else
+		{
+			// pax records : "<length> <key>=<value>\n"
+			char * rec = ua->meta;
+			char * end;
+			long len;
+
+			while( *rec )
+			{
+				len = strtol(rec, &end, 10);
+				if( len <= 0 || *end != ' ' || len > (ua->meta + ua->meta_size) - rec )
+					break;
+
+				rec[len - 1] = 0;
+
+				if( !strncmp(end + 1, "path=", 5) )
+				{
+					free(ua->next_name);
+					ua->next_name = strdup(end + 6);
+				}
+				else if( !strncmp(end + 1, "size=", 5) )
+				{
+					ua->next_size = strtoll(end + 6, NULL, 10);
+				}
+
+				rec += len;
+			}
+		}
+
+		ua->meta_type = 0;
+		ua->meta_size = 0;
+
+		return;
+	}
+
+	if( ua->file == -1 )
+		return;
+
+	ret = file_wrcache_close(ua->ctx);
+
+	if( !ret && ftruncate64(ua->file, ua->ctx->write_file_offset) )
+		ret = errno;
+
+	if( !ret && ua->mtime > 0 )
+	{
+		times[0].tv_sec = ua->mtime;
+		times[0].tv_nsec = 0;
+		times[1] = times[0];
+
+		futimens(ua->file, times);
+	}
+
+	close(ua->file);
+	ua->file = -1;
+
+	if( ret )
+	{
+		unarchive_error(ua, ua->name, posix_to_mtp_errcode(ret));
+	}
+	else
+	{
+		ua->objects++;
+	}
+}
+
+static uint64_t tar_get_number(char * field, int size)
+{
+	uint64_t value;
+	int i;
+
+	value = 0;
+
+	if( (unsigned char)field[0] & 0x80 )
+	{
+		// GNU base-256 encoding
+		for( i = 1; i < size; i++ )
+			value = ( value << 8 ) | (unsigned char)field[i];
+
+		return value;
+	}
+
+	for( i = 0; i < size && field[i] == ' '; i++ );
+
+	for( ; i < size && field[i] >= '0' && field[i] <= '7'; i++ )
+		value = ( value << 3 ) | ( field[i] - '0' );
+
+	return value;
+}
+
+static char * tar_field(char * field, int size)
+{
+	char * str;
+
+	str = malloc(size + 1);
+	if( str )
+	{
+		memcpy(str, field, size);
+		str[size] = 0;
+	}
+
+	return str;
+}
+
+static void unarchive_header(mtp_unarchive * ua)
+{
+	tar_header * hdr;
+	unsigned int sum,ssum;
+	mtp_size size;
+	char * prefix;
+	char * name;
+	char * path;
+	int i;
+
+	hdr = (tar_header *)ua->block;
+
+	for( i = 0; i < TAR_BLOCK_SIZE && !ua->block[i]; i++ );
+
+	if( i == TAR_BLOCK_SIZE )
+	{
+		// End of archive : Two empty blocks.
+		if( ++ua->zero_blocks >= 2 )
+			ua->ended = 1;
+
+		return;
+	}
+
+	ua->zero_blocks = 0;
+
+	// Checksum (unsigned, or signed for some old archivers)
+	sum = 0;
+	ssum = 0;
+	for( i = 0; i < TAR_BLOCK_SIZE; i++ )
+	{
+		if( i >= 148 && i < 156 )
+		{
+			sum += ' ';
+			ssum += ' ';
+		}
+		else
+		{
+			sum += ua->block[i];
+			ssum += (signed char)ua->block[i];
+		}
+	}
+
+	if( tar_get_number(hdr->chksum, sizeof(hdr->chksum)) != sum && tar_get_number(hdr->chksum, sizeof(hdr->chksum)) != ssum )
+	{
+		PRINT_ERROR("mtp_archive : Bad tar header checksum (entry %d) !", ua->index);
+		ua->broken = 1;
+		return;
+	}
+
+	size = tar_get_number(hdr->size, sizeof(hdr->size));
+
+	ua->state = UNARCHIVE_DATA;
+
+	if( hdr->typeflag == 'L' || hdr->typeflag == 'x' )
+	{
+		// Name / attributes of the next entry.
+		if( size > UNARCHIVE_MAX_META )
+		{
+			ua->broken = 1;
+			return;
+		}
+
+		ua->meta_type = hdr->typeflag;
+		ua->meta_size = 0;
+		ua->remaining = size;
+		ua->padding = ( TAR_BLOCK_SIZE - ( size % TAR_BLOCK_SIZE ) ) % TAR_BLOCK_SIZE;
+
+		if( !size )
+		{
+			unarchive_end_entry(ua);
+			ua->state = UNARCHIVE_HEADER;
+		}
+
+		return;
+	}
+
+	if( ua->next_size >= 0 )
+		size = ua->next_size;
+
+	ua->next_size = -1;
+
+	if( ua->next_name )
+	{
+		name = ua->next_name;
+		ua->next_name = NULL;
+	}
+	else
+	{
+		name = tar_field(hdr->name, sizeof(hdr->name));
+
+		prefix = NULL;
+		if( !memcmp(hdr->magic, "ustar", 5) && hdr->prefix[0] )
+			prefix = tar_field(hdr->prefix, sizeof(hdr->prefix));
+
+		if( prefix && name )
+		{
+			path = malloc(strlen(prefix) + strlen(name) + 2);
+			if( path )
+				sprintf(path, "%s/%s", prefix, name);
+
+			free(name);
+			name = path;
+		}
+
+		free(prefix);
+	}
+
+	free(ua->name);
+	ua->name = name;
+
+	ua->index++;
+	ua->mtime = tar_get_number(hdr->mtime, sizeof(hdr->mtime));
+	ua->remaining = size;
+	ua->padding = ( TAR_BLOCK_SIZE - ( size % TAR_BLOCK_SIZE ) ) % TAR_BLOCK_SIZE;
+
+	if( !ua->name )
+	{
+		unarchive_error(ua, NULL, MTP_RESPONSE_GENERAL_ERROR);
+	}
+	else
+	{
+		switch( hdr->typeflag )
+		{
+			case '0':
+			case '\0':
+			case '7':
+				unarchive_begin_entry(ua, '0', size);
+			break;
+
+			case '5':
+				unarchive_begin_entry(ua, '5', 0);
+			break;
+
+			case 'g':
+				// pax global header : Ignored
+				ua->index--;
+			break;
+
+			default:
+				// Links, devices...
+				unarchive_error(ua, ua->name, MTP_RESPONSE_INVALID_OBJECT_FORMAT_CODE);
+			break;
+		}
+	}
+
+	if( !ua->remaining )
+	{
+		unarchive_end_entry(ua);
+		ua->state = ua->padding ? UNARCHIVE_PADDING : UNARCHIVE_HEADER;
+	}
+}
+
+static void unarchive_feed(mtp_unarchive * ua, unsigned char * data, int size)
+{
+	int chunk;
+
+	while( size > 0 && !ua->broken && !ua->ended )
+	{
+		switch( ua->state )
+		{
+			case UNARCHIVE_HEADER:
+				chunk = TAR_BLOCK_SIZE - ua->block_fill;
+				if( chunk > size )
+					chunk = size;
+
+				memcpy(&ua->block[ua->block_fill], data, chunk);
+				ua->block_fill += chunk;
+
+				if( ua->block_fill == TAR_BLOCK_SIZE )
+				{
+					ua->block_fill = 0;
+					unarchive_header(ua);
+				}
+			break;
+
+			case UNARCHIVE_DATA:
+				chunk = size;
+				if( chunk > ua->remaining )
+					chunk = ua->remaining;
+
+				if( ua->meta_type )
+				{
+					memcpy(&ua->meta[ua->meta_size], data, chunk);
+					ua->meta_size += chunk;
+				}
+				else if( ua->file != -1 )
+				{
+					file_wrcache_write(ua->ctx, data, chunk);
+				}
+
+				ua->remaining -= chunk;
+				if( !ua->remaining )
+				{
+					unarchive_end_entry(ua);
+					ua->state = ua->padding ? UNARCHIVE_PADDING : UNARCHIVE_HEADER;
+				}
+			break;
+
+			default:
+				chunk = size;
+				if( chunk > ua->padding )
+					chunk = ua->padding;
+
+				ua->padding -= chunk;
+				if( !ua->padding )
+					ua->state = UNARCHIVE_HEADER;
+			break;
+		}
+
+		data += chunk;
+		size -= chunk;
+	}
+}
+
+static void unarchive_data(mtp_unarchive * ua, unsigned char * data, int size)
+{
+#ifdef USE_ZSTD
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	size_t ret;
+
+	if( ua->zds )
+	{
+		in.src = data;
+		in.size = size;
+		in.pos = 0;
+
+		while( in.pos < in.size && !ua->broken )
+		{
+			out.dst = ua->zbuf;
+			out.size = ua->zbuf_size;
+			out.pos = 0;
+
+			ret = ZSTD_decompressStream(ua->zds, &out, &in);
+			if( ZSTD_isError(ret) )
+			{
+				PRINT_ERROR("mtp_archive : zstd error (%s) !", ZSTD_getErrorName(ret));
+				ua->broken = 1;
+				break;
+			}
+
+			unarchive_feed(ua, ua->zbuf, out.pos);
+		}
+
+		return;
+	}
+#endif
+
+	unarchive_feed(ua, data, size);
+}
+
+// Receive the archive (data phase). Return the bytes received (< 0 : USB error).
+static mtp_size unarchive_receive(mtp_unarchive * ua, int drop)
+{
+	mtp_ctx * ctx;
+	MTP_PACKET_HEADER * hdr;
+	mtp_size total;
+	int sz,first;
+
+	ctx = ua->ctx;
+	total = 0;
+	first = 1;
+
+	do
+	{
+		sz = read_usb(ctx->usb_ctx, ctx->rdbuffer2, ctx->usb_rd_buffer_max_size);
+		if( sz < 0 )
+			return -1;
+
+		total += sz;
+
+		if( drop )
+			continue;
+
+		if( first )
+		{
+			first = 0;
+
+			hdr = (MTP_PACKET_HEADER *)ctx->rdbuffer2;
+			if( sz < (int)sizeof(MTP_PACKET_HEADER) || hdr->operation != MTP_CONTAINER_TYPE_DATA )
+			{
+				ua->broken = 1;
+				continue;
+			}
+
+			unarchive_data(ua, ctx->rdbuffer2 + sizeof(MTP_PACKET_HEADER), sz - sizeof(MTP_PACKET_HEADER));
+		}
+		else
+		{
+			unarchive_data(ua, ctx->rdbuffer2, sz);
+		}
+
+		// The db isn't locked while waiting for the host.
+		unarchive_unlock(ua);
+
+	}while( sz == ctx->usb_rd_buffer_max_size && !ctx->cancel_req );
+
+	return total;
+}
+
+uint32_t mtp_archive_receive(mtp_ctx * ctx, uint32_t storage_id, uint32_t parent_handle, uint32_t format, uint32_t * objects, uint32_t * errors)
+{
+	mtp_unarchive ua;
+	uint32_t response_code;
+	uint32_t storage_flags;
+	fs_entry * entry;
+	int watched;
+
+	*objects = 0;
+	*errors = 0;
+
+	memset(&ua, 0, sizeof(ua));
+	ua.ctx = ctx;
+	ua.file = -1;
+	ua.next_size = -1;
+	ua.storage_id = storage_id;
+
+	mtp_archive_free(ctx);
+
+	if( parent_handle == 0xFFFFFFFF )
+		parent_handle = 0x00000000;
+
+	response_code = MTP_RESPONSE_OK;
+
+	storage_flags = mtp_get_storage_flags(ctx, storage_id);
+	if( storage_flags == 0xFFFFFFFF )
+		response_code = MTP_RESPONSE_INVALID_STORAGE_ID;
+	else if( storage_flags & UMTP_STORAGE_READONLY )
+		response_code = MTP_RESPONSE_STORE_READ_ONLY;
+
+#ifndef USE_ZSTD
+	if( format != MTP_ARCHIVE_TAR )
+		response_code = MTP_RESPONSE_PARAMETER_NOT_SUPPORTED;
+#else
+	if( format != MTP_ARCHIVE_TAR && format != MTP_ARCHIVE_TAR_ZSTD )
+		response_code = MTP_RESPONSE_PARAMETER_NOT_SUPPORTED;
+#endif
+
+	ua.store_index = mtp_get_storage_index_by_id(ctx, storage_id);
+	ua.storage_root = mtp_get_storage_root(ctx, storage_id);
+
+	watched = 0;
+
+	if( response_code == MTP_RESPONSE_OK )
+	{
+		if( unarchive_lock(&ua) )
+			return MTP_RESPONSE_GENERAL_ERROR;
+
+		entry = get_entry_by_handle_and_storageid(ctx->fs_db, parent_handle, storage_id);
+		if( !entry || !( entry->flags & ENTRY_IS_DIR ) )
+			response_code = MTP_RESPONSE_INVALID_PARENT_OBJECT;
+		else if( !check_handle_access( ctx, entry, parent_handle, 1, &response_code) )
+		{
+			ua.target = entry->handle;
+			ua.target_path = build_full_path(ctx->fs_db, ua.storage_root, entry);
+			if( !ua.target_path )
+				response_code = MTP_RESPONSE_GENERAL_ERROR;
+
+			// The target folder changes are not notified one by one : Watch it again at the end.
+			if( ua.target_path && entry->watch_descriptor != -1 )
+			{
+				inotify_handler_rmwatch( ctx, entry->watch_descriptor );
+				entry->watch_descriptor = -1;
+				entry->flags &= ~ENTRY_IS_SYNCED;
+				watched = 1;
+			}
+		}
+
+		unarchive_unlock(&ua);
+	}
+
+#ifdef USE_ZSTD
+	if( response_code == MTP_RESPONSE_OK && format == MTP_ARCHIVE_TAR_ZSTD )
+	{
+		ua.zbuf_size = ZSTD_DStreamOutSize();
+		ua.zbuf = malloc(ua.zbuf_size);
+		ua.zds = ZSTD_createDCtx();
+		if( !ua.zbuf || !ua.zds )
+			response_code = MTP_RESPONSE_GENERAL_ERROR;
+	}
+#endif
+
+	ua.meta = malloc(UNARCHIVE_MAX_META + 1);
+	if( !ua.meta )
+		response_code = MTP_RESPONSE_GENERAL_ERROR;
+
+	PRINT_DEBUG("mtp_archive : Receiving in %s (format %d)", ua.target_path ? ua.target_path : "?", format);
+
+	ctx->transferring_file_data = 1;
+
+	if( response_code == MTP_RESPONSE_OK && !set_storage_giduid(ctx, storage_id) )
+	{
+		if( unarchive_receive(&ua, 0) < 0 )
+			response_code = MTP_RESPONSE_INCOMPLETE_TRANSFER;
+	}
+	else
+	{
+		// The data phase must be received anyway.
+		unarchive_receive(&ua, 1);
+
+		if( response_code == MTP_RESPONSE_OK )
+			response_code = MTP_RESPONSE_ACCESS_DENIED;
+	}
+	restore_giduid(ctx);
+
+	ctx->transferring_file_data = 0;
+
+	// Interrupted in a file : Truncated to the received data, the db entry gets its real size.
+	if( ua.file != -1 )
+	{
+		file_wrcache_close(ctx);
+
+		if( ftruncate64(ua.file, ctx->write_file_offset) )
+			PRINT_WARN("mtp_archive : Can't truncate %s (%s)", ua.name, strerror(errno));
+
+		if( !unarchive_lock(&ua) )
+		{
+			entry = get_entry_by_handle_and_storageid(ctx->fs_db, ua.file_handle, storage_id);
+			if( entry )
+			{
+				entry->size = lseek64(ua.file, 0, SEEK_END);
+				entry->date = 0; // Modification time read again when needed
+			}
+
+			unarchive_unlock(&ua);
+		}
+
+		close(ua.file);
+		ua.file = -1;
+
+		if( !ctx->cancel_req )
+			unarchive_error(&ua, ua.name, MTP_RESPONSE_INCOMPLETE_TRANSFER);
+	}
+
+	if( response_code == MTP_RESPONSE_OK )
+	{
+		if( ua.broken )
+		{
+			unarchive_error(&ua, NULL, MTP_RESPONSE_INVALID_DATASET);
+			response_code = MTP_RESPONSE_INVALID_DATASET;
+		}
+		else if( !ua.ended && !ctx->cancel_req )
+		{
+			PRINT_WARN("mtp_archive : Truncated archive !");
+			response_code = MTP_RESPONSE_INCOMPLETE_TRANSFER;
+		}
+	}
+
+	if( ua.target_path && !unarchive_lock(&ua) )
+	{
+		if( watched )
+		{
+			entry = get_entry_by_handle_and_storageid(ctx->fs_db, ua.target, storage_id);
+			if( entry )
+				sync_folder(ctx, entry, ua.target_path, ua.target, storage_id);
+		}
+
+		unarchive_unlock(&ua);
+	}
+
+	// A single event for the whole archive, the change journal finds the objects with a storage walk.
+	// (The failed entries may have left folders or a truncated file)
+	if( ua.objects || ua.errors )
+	{
+		mtp_push_event(ctx, MTP_EVENT_STORAGE_INFO_CHANGED, 1, &storage_id);
+		mtp_journal_rescan(ctx, storage_id);
+	}
+
+	PRINT_DEBUG("mtp_archive : %d objects extracted - %d errors", ua.objects, ua.errors ? ua.errors->count : 0);
+
+	ctx->stats.archive_received++;
+
+	*objects = ua.objects;
+	*errors = ua.errors ? ua.errors->count : 0;
+
+	ctx->archive_errors = ua.errors;
+
+#ifdef USE_ZSTD
+	ZSTD_freeDCtx(ua.zds);
+	free(ua.zbuf);
+#endif
+	free(ua.meta);
+	free(ua.next_name);
+	free(ua.name);
+	free(ua.parent_rel);
+	free(ua.parent_path);
+	free(ua.target_path);
+
+	if( ctx->cancel_req )
+	{
+		ctx->cancel_req = 0;
+		ctx->stats.archive_cancelled++;
+
+		return MTP_RESPONSE_NO_RESPONSE;
+	}
+
+	return response_code;
+}
+
+// Errors of the last SendFolderArchive, from the first index.
+int mtp_archive_errors_dataset(mtp_ctx * ctx, mtp_dataset_writer * dsw, uint32_t first)
+{
+	mtp_archive_errors * errs;
+	archive_error * err;
+	uint32_t i,nb;
+	int ret;
+
+	errs = ctx->archive_errors;
+
+	nb = 0;
+	if( errs )
+	{
+		nb = errs->count;
+		if( nb > CONFIG_ARCHIVE_MAX_ERRORS )
+			nb = CONFIG_ARCHIVE_MAX_ERRORS;
+	}
+
+	nb = first < nb ? nb - first : 0;
+
+	if( dataset_writer_put32(dsw, nb) < 0 )
+		return -1;
+
+	for( i = 0; i < nb; i++ )
+	{
+		err = &errs->errors[first + i];
+
+		if( dataset_writer_put32(dsw, err->index) < 0 )
+			return -1;
+
+		do
+		{
+			ret = dataset_writer_commit(dsw, poke16(dsw->buffer, dsw->ofs, dsw->size, err->code));
+		}while( ret > 0 );
+
+		if( ret < 0 )
+			return -1;
+
+		do
+		{
+			ret = dataset_writer_commit(dsw, poke_string(dsw->buffer, dsw->ofs, dsw->size, err->name));
+		}while( ret > 0 );
+
+		if( ret < 0 )
+			return -1;
+	}
+
+	return 0;
+}
+
+void mtp_archive_free(mtp_ctx * ctx)
+{
+	free(ctx->archive_errors);
+
+	ctx->archive_errors = NULL;
+}
@@ -0,0 +1,253 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/**
+ * @file   mtp_autotune.c
+ * @brief  USB transfer buffers sizes auto-tuning.
+ * @author Jean-François DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+#include "buildconf.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/usb/ch9.h>
+
+#include "mtp.h"
+#include "mtp_autotune.h"
+
+#include "logs_out.h"
+
+typedef struct autotune_candidate_
+{
+	int chunk_size;
+	int readahead_size;
+}autotune_candidate;
+
+// Candidates : USB write chunk size / file read-ahead size.
+
+static const autotune_candidate fs_candidates[] =
+{
+	{ 0x1000,   0x10000 },
+	{ 0x4000,   0x10000 },
+	{ 0x4000,   0x40000 },
+	{ 0x10000,  0x40000 },
+	{ 0, 0 }
+};
+
+static const autotune_candidate hs_candidates[] =
+{
+	{ 0x4000,   0x40000 },
+	{ 0x10000,  0x40000 },
+	{ 0x10000,  0x100000 },
+	{ 0x40000,  0x100000 },
+	{ 0x40000,  0x400000 },
+	{ 0x100000, 0x400000 },
+	{ 0, 0 }
+};
+
+static const autotune_candidate ss_candidates[] =
+{
+	{ 0x10000,  0x100000 },
+	{ 0x40000,  0x100000 },
+	{ 0x40000,  0x400000 },
+	{ 0x100000, 0x400000 },
+	{ 0x100000, 0x1000000 },
+	{ 0x400000, 0x1000000 },
+	{ 0, 0 }
+};
+
+static const char * speed_name(int speed)
+{
+	switch(speed)
+	{
+		case USB_SPEED_LOW:
+			return "LS";
+		case USB_SPEED_FULL:
+			return "FS";
+		case USB_SPEED_HIGH:
+			return "HS";
+		case USB_SPEED_SUPER:
+			return "SS";
+		case USB_SPEED_SUPER_PLUS:
+			return "SS+";
+		default:
+			return "Unknown";
+	}
+}
+
+uint64_t mtp_autotune_get_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static void apply_candidate(mtp_ctx * ctx, int index)
+{
+	ctx->autotune.candidate = index;
+	ctx->usb_wr_chunk_size = ctx->autotune.chunk_size[index];
+	ctx->read_file_chunk_size = ctx->autotune.readahead_size[index];
+
+	PRINT_DEBUG("mtp_autotune : Trying chunk size 0x%X / read-ahead 0x%X", ctx->usb_wr_chunk_size, ctx->read_file_chunk_size);
+}
+
+void mtp_autotune_reset(mtp_ctx * ctx, int speed)
+{
+	const autotune_candidate * candidates;
+	mtp_autotune * at;
+	int i;
+
+	at = &ctx->autotune;
+
+	// Default : Use the configured sizes.
+	ctx->usb_wr_chunk_size = ctx->usb_wr_buffer_max_size;
+	ctx->read_file_chunk_size = ctx->read_file_buffer_size;
+
+	at->speed = speed;
+	at->state = AUTOTUNE_IDLE;
+	at->nb_candidates = 0;
+	at->candidate = 0;
+
+	if( !at->enabled )
+		return;
+
+	switch(speed)
+	{
+		case USB_SPEED_LOW:
+		case USB_SPEED_FULL:
+			candidates = fs_candidates;
+			at->sample_size = 1024 * 1024;
+		break;
+
+		case USB_SPEED_SUPER:
+		case USB_SPEED_SUPER_PLUS:
+			candidates = ss_candidates;
+			at->sample_size = 64 * 1024 * 1024;
+		break;
+
+		case USB_SPEED_HIGH:
+		default:
+			candidates = hs_candidates;
+			at->sample_size = 8 * 1024 * 1024;
+		break;
+	}
+
+	// Keep the candidates fitting in the allocated buffers.
+	// The configured sizes are the upper limits.
+	i = 0;
+	while( candidates[i].chunk_size && at->nb_candidates < AUTOTUNE_MAX_CANDIDATES )
+	{
+		if( candidates[i].chunk_size <= ctx->usb_wr_buffer_max_size &&
+			candidates[i].readahead_size <= ctx->read_file_buffer_size )
+		{
+			at->chunk_size[at->nb_candidates] = candidates[i].chunk_size;
+			at->readahead_size[at->nb_candidates] = candidates[i].readahead_size;
+			at->bytes[at->nb_candidates] = 0;
+			at->time_us[at->nb_candidates] = 0;
+			at->nb_candidates++;
+		}
+		i++;
+	}
+
+	// The configured maximum sizes are always a candidate.
+	if( at->nb_candidates < AUTOTUNE_MAX_CANDIDATES &&
+		( !at->nb_candidates ||
+		  at->chunk_size[at->nb_candidates - 1] != ctx->usb_wr_buffer_max_size ||
+		  at->readahead_size[at->nb_candidates - 1] != ctx->read_file_buffer_size ) )
+	{
+		at->chunk_size[at->nb_candidates] = ctx->usb_wr_buffer_max_size;
+		at->readahead_size[at->nb_candidates] = ctx->read_file_buffer_size;
+		at->bytes[at->nb_candidates] = 0;
+		at->time_us[at->nb_candidates] = 0;
+		at->nb_candidates++;
+	}
+
+	if( at->nb_candidates < 2 )
+	{
+		PRINT_MSG("mtp_autotune : %s link, nothing to tune (chunk size 0x%X / read-ahead 0x%X)", speed_name(speed), ctx->usb_wr_chunk_size, ctx->read_file_chunk_size);
+		at->state = AUTOTUNE_DONE;
+		return;
+	}
+
+	PRINT_MSG("mtp_autotune : %s link, %d candidates to measure", speed_name(speed), at->nb_candidates);
+
+	at->state = AUTOTUNE_MEASURING;
+
+	apply_candidate(ctx, 0);
+}
+
+void mtp_autotune_update(mtp_ctx * ctx, mtp_size bytes, uint64_t time_us)
+{
+	mtp_autotune * at;
+	uint64_t best_rate,rate;
+	int i,best;
+
+	at = &ctx->autotune;
+
+	if( at->state != AUTOTUNE_MEASURING )
+		return;
+
+	// Small transfers are dominated by the protocol overhead : ignore them.
+	if( bytes < (mtp_size)ctx->usb_wr_chunk_size * 4 || !time_us )
+		return;
+
+	at->bytes[at->candidate] += bytes;
+	at->time_us[at->candidate] += time_us;
+
+	if( at->bytes[at->candidate] < at->sample_size )
+		return;
+
+	PRINT_DEBUG("mtp_autotune : chunk size 0x%X / read-ahead 0x%X : %"PRIu64" KB/s",
+				at->chunk_size[at->candidate], at->readahead_size[at->candidate],
+				(at->bytes[at->candidate] * 1000000 / at->time_us[at->candidate]) / 1024);
+
+	if( at->candidate + 1 < at->nb_candidates )
+	{
+		apply_candidate(ctx, at->candidate + 1);
+		return;
+	}
+
+	// All the candidates measured : Keep the best one.
+	best = 0;
+	best_rate = 0;
+	for( i = 0; i < at->nb_candidates; i++ )
+	{
+		rate = at->bytes[i] * 1000000 / at->time_us[i];
+		if( rate > best_rate )
+		{
+			best_rate = rate;
+			best = i;
+		}
+	}
+
+	apply_candidate(ctx, best);
+
+	at->state = AUTOTUNE_DONE;
+
+	PRINT_MSG("mtp_autotune : %s link, selected chunk size 0x%X / read-ahead 0x%X (%"PRIu64" KB/s)",
+				speed_name(at->speed), ctx->usb_wr_chunk_size, ctx->read_file_chunk_size, best_rate / 1024);
+}
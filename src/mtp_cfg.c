@@ -59,6 +59,18 @@ enum
 	USBMAXRDBUFFERSIZE_CMD,
 	USBMAXWRBUFFERSIZE_CMD,
 	READBUFFERSIZE_CMD,
+	WRITEBUFFERSIZE_CMD,
+	USBBUFFERAUTOTUNE_CMD,
+	MMAPTHRESHOLD_CMD,
+	PREFETCHSIZE_CMD,
+	PREFETCHBUDGET_CMD,
+	INOTIFYDEBOUNCE_CMD,
+	INOTIFYMAXWATCHES_CMD,
+	FANOTIFY_CMD,
+	THUMBNAILWORKERS_CMD,
+	THUMBNAILCACHEMAXSIZE_CMD,
+	MEDIAINDEXERWORKERS_CMD,
+	CHANGE_JOURNAL_CMD,
 
 	USB_DEV_PATH_CMD,
 	USB_EPIN_PATH_CMD,
@@ -71,6 +83,8 @@ enum
 	VERSION_STRING_CMD,
 	MTP_EXTENSIONS_STRING_CMD,
 	INTERFACE_STRING_CMD,
+	THUMBNAIL_CACHE_CMD,
+	CHANGE_JOURNAL_FILE_CMD,
 
 	WAIT_CONNECTION,
 	LOOP_ON_DISCONNECT,
@@ -322,6 +336,11 @@ void mtp_add_storage_from_line(mtp_ctx * context, char * line, int idx)
 				flags |= (UMTP_STORAGE_LOCKABLE | UMTP_STORAGE_LOCKED);
 			}
 
+			if(test_flag(options, "direct_io",NULL))
+			{
+				flags |= UMTP_STORAGE_DIRECT_IO;
+			}
+
 			if(test_flag(options, "uid",tmpstr))
 			{
 				uid = atoi(tmpstr);
@@ -448,17 +467,37 @@ static int get_hex_param(mtp_ctx * context, char * line,int cmd)
 			break;
 
 			case USBMAXRDBUFFERSIZE_CMD:
-				context->usb_rd_buffer_max_size = param_value & (~(512-1));
+				context->usb_rd_buffer_max_size = param_value;
 			break;
 
 			case USBMAXWRBUFFERSIZE_CMD:
-				context->usb_wr_buffer_max_size = param_value & (~(512-1));
+				context->usb_wr_buffer_max_size = param_value;
 			break;
 
 			case READBUFFERSIZE_CMD:
 				context->read_file_buffer_size = param_value;
 			break;
 
+			case WRITEBUFFERSIZE_CMD:
+				context->write_file_buffer_size = param_value;
+			break;
+
+			case USBBUFFERAUTOTUNE_CMD:
+				context->autotune.enabled = param_value;
+			break;
+
+			case MMAPTHRESHOLD_CMD:
+				context->mmap_threshold = param_value;
+			break;
+
+			case PREFETCHSIZE_CMD:
+				context->prefetch_size = param_value;
+			break;
+
+			case PREFETCHBUDGET_CMD:
+				context->prefetch_budget = param_value;
+			break;
+
 			case USBFUNCTIONFSMODE_CMD:
 				if( param_value )
 					context->usb_cfg.usb_functionfs_mode = USB_FFS_MODE;
@@ -482,6 +521,14 @@ static int get_hex_param(mtp_ctx * context, char * line,int cmd)
 				context->no_inotify = param_value;
 			break;
 
+			case FANOTIFY_CMD:
+				context->use_fanotify = param_value;
+			break;
+
+			case CHANGE_JOURNAL_CMD:
+				context->change_journal = param_value;
+			break;
+
 			case SYNC_WHEN_CLOSE:
 				context->sync_when_close = param_value;
 
@@ -538,6 +585,14 @@ static int get_str_param(mtp_ctx * context, char * line,int cmd)
 				strncpy(context->usb_cfg.usb_string_mtp_extensions,tmp_txt,MAX_CFG_STRING_SIZE);
 			break;
 
+			case THUMBNAIL_CACHE_CMD:
+				strncpy(context->thumbnail_cache,tmp_txt,MAX_CFG_STRING_SIZE);
+			break;
+
+			case CHANGE_JOURNAL_FILE_CMD:
+				strncpy(context->change_journal_file,tmp_txt,MAX_CFG_STRING_SIZE);
+			break;
+
 			case INTERFACE_STRING_CMD:
 				strncpy(context->usb_cfg.usb_string_interface,tmp_txt,MAX_CFG_STRING_SIZE);
 			break;
@@ -587,6 +642,21 @@ static int get_dec_param(mtp_ctx * context, char * line,int cmd)
 			case DEFAULT_GID_CMD:
 				context->default_gid = param_value;
 			break;
+			case INOTIFYDEBOUNCE_CMD:
+				context->inotify_debounce_ms = param_value;
+			break;
+			case INOTIFYMAXWATCHES_CMD:
+				context->inotify_max_watches = param_value;
+			break;
+			case THUMBNAILWORKERS_CMD:
+				context->thumbnail_workers = param_value;
+			break;
+			case THUMBNAILCACHEMAXSIZE_CMD:
+				context->thumbnail_cache_max_size = param_value;
+			break;
+			case MEDIAINDEXERWORKERS_CMD:
+				context->media_workers = param_value;
+			break;
 		}
 	}
 	return 0;
@@ -605,6 +675,11 @@ kw_list kwlist[] =
 	{"usb_max_rd_buffer_size", get_hex_param,   USBMAXRDBUFFERSIZE_CMD},
 	{"usb_max_wr_buffer_size", get_hex_param,   USBMAXWRBUFFERSIZE_CMD},
 	{"read_buffer_cache_size", get_hex_param,   READBUFFERSIZE_CMD},
+	{"write_buffer_cache_size",get_hex_param,   WRITEBUFFERSIZE_CMD},
+	{"usb_buffer_autotune",    get_hex_param,   USBBUFFERAUTOTUNE_CMD},
+	{"mmap_threshold",         get_hex_param,   MMAPTHRESHOLD_CMD},
+	{"prefetch_size",          get_hex_param,   PREFETCHSIZE_CMD},
+	{"prefetch_budget",        get_hex_param,   PREFETCHBUDGET_CMD},
 
 	{"usb_functionfs_mode",    get_hex_param,   USBFUNCTIONFSMODE_CMD},
 
@@ -628,9 +703,20 @@ kw_list kwlist[] =
 	{"default_gid",            get_dec_param,   DEFAULT_GID_CMD},
 
 	{"no_inotify",             get_hex_param,   NO_INOTIFY},
+	{"inotify_debounce_ms",    get_dec_param,   INOTIFYDEBOUNCE_CMD},
+	{"inotify_max_watches",    get_dec_param,   INOTIFYMAXWATCHES_CMD},
+	{"fanotify",               get_hex_param,   FANOTIFY_CMD},
 
 	{"sync_when_close",        get_hex_param,   SYNC_WHEN_CLOSE},
 
+	{"thumbnail_cache",        get_str_param,   THUMBNAIL_CACHE_CMD},
+	{"thumbnail_workers",      get_dec_param,   THUMBNAILWORKERS_CMD},
+	{"thumbnail_cache_max_size",get_dec_param,   THUMBNAILCACHEMAXSIZE_CMD},
+	{"media_indexer_workers",  get_dec_param,   MEDIAINDEXERWORKERS_CMD},
+
+	{"change_journal",         get_hex_param,   CHANGE_JOURNAL_CMD},
+	{"change_journal_file",    get_str_param,   CHANGE_JOURNAL_FILE_CMD},
+
 	{ 0, 0, 0 }
 };
 
@@ -677,6 +763,49 @@ int execute_line(mtp_ctx * context,char * line)
 	return 0;
 }
 
+static int check_buffer_size(const char * name, unsigned long size, int min, int max, int multiple)
+{
+	unsigned long new_size;
+
+	new_size = size;
+
+	if( multiple > 1 )
+		new_size -= ( new_size % multiple );
+
+	if( new_size < min )
+		new_size = min;
+
+	if( new_size > max )
+		new_size = max;
+
+	if( new_size != size )
+	{
+		PRINT_WARN("%s : Invalid size 0x%lX, using 0x%lX", name, size, new_size);
+	}
+
+	return (int)new_size;
+}
+
+static void check_buffers_config(mtp_ctx * context)
+{
+	context->usb_rd_buffer_max_size = check_buffer_size("usb_max_rd_buffer_size", (unsigned int)context->usb_rd_buffer_max_size,
+														512, CONFIG_MAX_USB_BUFFER_SIZE_LIMIT, 512);
+
+	context->usb_wr_buffer_max_size = check_buffer_size("usb_max_wr_buffer_size", (unsigned int)context->usb_wr_buffer_max_size,
+														512, CONFIG_MAX_USB_BUFFER_SIZE_LIMIT, 512);
+
+	// The file read-ahead window must at least contain one USB write chunk.
+	context->read_file_buffer_size = check_buffer_size("read_buffer_cache_size", (unsigned int)context->read_file_buffer_size,
+														context->usb_wr_buffer_max_size, CONFIG_MAX_FILE_BUFFER_SIZE_LIMIT, 1);
+
+	context->write_file_buffer_size = check_buffer_size("write_buffer_cache_size", (unsigned int)context->write_file_buffer_size,
+														CONFIG_DIRECT_IO_ALIGNMENT, CONFIG_MAX_FILE_BUFFER_SIZE_LIMIT, 1);
+
+	// Effective sizes, may be reduced later by the auto-tuning.
+	context->usb_wr_chunk_size = context->usb_wr_buffer_max_size;
+	context->read_file_chunk_size = context->read_file_buffer_size;
+}
+
 int mtp_load_config_file(mtp_ctx * context, const char * conffile)
 {
 	int err = 0;
@@ -717,7 +846,20 @@ int mtp_load_config_file(mtp_ctx * context, const char * conffile)
 	context->default_uid = -1;
 
 	context->no_inotify = 0;
+	context->inotify_debounce_ms = CONFIG_INOTIFY_DEBOUNCE_MS;
+	context->inotify_max_watches = CONFIG_INOTIFY_MAX_WATCHES;
+	context->use_fanotify = 0;
 	context->sync_when_close = 0;
+	context->thumbnail_cache[0] = 0;
+	context->thumbnail_cache_max_size = CONFIG_THUMB_CACHE_MAX_SIZE;
+	context->thumbnail_workers = CONFIG_THUMB_WORKERS;
+	context->media_workers = CONFIG_MEDIA_WORKERS;
+	context->change_journal = 0;
+	context->change_journal_file[0] = 0;
+	context->autotune.enabled = 0;
+	context->mmap_threshold = CONFIG_MMAP_THRESHOLD;
+	context->prefetch_size = CONFIG_PREFETCH_SIZE;
+	context->prefetch_budget = CONFIG_PREFETCH_BUDGET;
 
 	f = fopen(conffile, "r");
 	if(f)
@@ -740,6 +882,8 @@ int mtp_load_config_file(mtp_ctx * context, const char * conffile)
 		PRINT_ERROR("Can't open %s ! Using default settings...", conffile);
 	}
 
+	check_buffers_config(context);
+
 	PRINT_MSG("USB Device path : %s",context->usb_cfg.usb_device_path);
 	PRINT_MSG("USB In End point path : %s",context->usb_cfg.usb_endpoint_in);
 	PRINT_MSG("USB Out End point path : %s",context->usb_cfg.usb_endpoint_out);
@@ -748,6 +892,26 @@ int mtp_load_config_file(mtp_ctx * context, const char * conffile)
 	PRINT_MSG("USB Max write buffer size : 0x%X bytes",context->usb_wr_buffer_max_size);
 	PRINT_MSG("USB Max read buffer size : 0x%X bytes",context->usb_rd_buffer_max_size);
 	PRINT_MSG("Read file buffer size : 0x%X bytes",context->read_file_buffer_size);
+	PRINT_MSG("Write file buffer size : 0x%X bytes",context->write_file_buffer_size);
+	PRINT_MSG("USB buffers auto-tuning : %s",context->autotune.enabled?"yes":"no");
+	if( context->mmap_threshold )
+		PRINT_MSG("mmap threshold : 0x%X bytes",context->mmap_threshold);
+	else
+		PRINT_MSG("mmap threshold : disabled");
+	if( context->prefetch_size )
+		PRINT_MSG("Metadata prefetch : 0x%X bytes (budget : 0x%X bytes)",context->prefetch_size,context->prefetch_budget);
+	else
+		PRINT_MSG("Metadata prefetch : disabled");
+
+	// Our vendor operations (FindObjects...) are always available.
+	if( !strstr(context->usb_cfg.usb_string_mtp_extensions, UMTPRD_MTP_EXTENSION) &&
+		strlen(context->usb_cfg.usb_string_mtp_extensions) + strlen(" " UMTPRD_MTP_EXTENSION) <= MAX_CFG_STRING_SIZE )
+	{
+		if( context->usb_cfg.usb_string_mtp_extensions[0] )
+			strcat(context->usb_cfg.usb_string_mtp_extensions, " ");
+
+		strcat(context->usb_cfg.usb_string_mtp_extensions, UMTPRD_MTP_EXTENSION);
+	}
 
 	PRINT_MSG("Manufacturer string : %s",context->usb_cfg.usb_string_manufacturer);
 	PRINT_MSG("Product string : %s",context->usb_cfg.usb_string_product);
@@ -804,8 +968,32 @@ int mtp_load_config_file(mtp_ctx * context, const char * conffile)
 	}
 
 	PRINT_MSG("inotify : %s",context->no_inotify?"no":"yes");
+	PRINT_MSG("fanotify : %s",context->use_fanotify?"yes":"no");
+	if( context->inotify_debounce_ms )
+		PRINT_MSG("inotify modifications debounce : %d ms",context->inotify_debounce_ms);
+	else
+		PRINT_MSG("inotify modifications debounce : disabled");
+	if( context->inotify_max_watches )
+		PRINT_MSG("inotify watches budget : %d folders",context->inotify_max_watches);
 
 	PRINT_MSG("Sync when close : %s",context->sync_when_close?"yes":"no");
 
+	if( context->thumbnail_cache[0] && context->thumbnail_cache_max_size )
+		PRINT_MSG("Thumbnails cache : %s (%d MB max, %d workers)",context->thumbnail_cache,context->thumbnail_cache_max_size,context->thumbnail_workers);
+	else if( context->thumbnail_cache[0] )
+		PRINT_MSG("Thumbnails cache : %s (no size limit, %d workers)",context->thumbnail_cache,context->thumbnail_workers);
+	else
+		PRINT_MSG("Thumbnails cache : disabled");
+
+	if( context->media_workers > 0 )
+		PRINT_MSG("Media indexer : %d workers",context->media_workers);
+	else
+		PRINT_MSG("Media indexer : on demand only");
+
+	if( context->change_journal )
+		PRINT_MSG("Change journal : %s",context->change_journal_file[0]?context->change_journal_file:"not saved");
+	else
+		PRINT_MSG("Change journal : disabled");
+
 	return err;
 }
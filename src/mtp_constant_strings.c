@@ -90,6 +90,12 @@ const opcodestring op_codes[]=
 	{ "MTP_OPERATION_TRUNCATE_OBJECT",            0x95C3 },
 	{ "MTP_OPERATION_BEGIN_EDIT_OBJECT",          0x95C4 },
 	{ "MTP_OPERATION_END_EDIT_OBJECT",            0x95C5 },
+	{ "MTP_OPERATION_FIND_OBJECTS",               0x9D01 },
+	{ "MTP_OPERATION_GET_FIND_RESULTS",           0x9D02 },
+	{ "MTP_OPERATION_GET_FOLDER_ARCHIVE",         0x9D03 },
+	{ "MTP_OPERATION_SEND_FOLDER_ARCHIVE",        0x9D04 },
+	{ "MTP_OPERATION_GET_ARCHIVE_ERRORS",         0x9D05 },
+	{ "MTP_OPERATION_GET_CHANGES",                0x9D06 },
 	{ "MTP_OPERATION_GET_OBJECT_PROPS_SUPPORTED", 0x9801 },
 	{ "MTP_OPERATION_GET_OBJECT_PROP_DESC ",      0x9802 },
 	{ "MTP_OPERATION_GET_OBJECT_PROP_VALUE",      0x9803 },
@@ -0,0 +1,789 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/**
+ * @file   mtp_copy.c
+ * @brief  Objects copy and move.
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+// The objects are copied / moved on the device : The data doesn't go through the host.
+// A move in a storage is a rename, the object keeps its handle. Between storages,
+// the object is renamed if possible (same file system), else copied then deleted.
+// The files are cloned (FICLONE) or copied in the kernel (copy_file_range).
+// A folder is copied by a background thread : The operation returns the new folder
+// handle at once and its content appears as it is copied. Deleting the destination
+// (or the moved folder), closing the session or the disconnection cancel the copy.
+
+#include "buildconf.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/prctl.h>
+#include <linux/fs.h>
+
+#include "mtp.h"
+#include "mtp_helpers.h"
+#include "mtp_constant.h"
+#include "mtp_ops_helpers.h"
+#include "mtp_autotune.h"
+#include "mtp_copy.h"
+#include "fs_cache.h"
+#include "inotify.h"
+#include "mtp_journal.h"
+
+#include "logs_out.h"
+
+typedef struct mtp_copy_job_
+{
+	mtp_ctx * ctx;
+	pthread_t thread;
+
+	char * src_path;
+	char * dst_path;
+
+	uint32_t src_handle;       // Moved folder (0xFFFFFFFF : copy)
+	uint32_t src_storage_id;
+	uint32_t dst_handle;
+	uint32_t dst_storage_id;
+
+	volatile int cancel;
+	volatile int running;
+
+	uint64_t objects;
+	uint64_t bytes;
+	uint64_t last_report;
+}mtp_copy_job;
+
+static int copy_data(mtp_ctx * ctx, int src, int dst, volatile int * cancel, uint64_t * bytes)
+{
+	unsigned char * buffer;
+	ssize_t sz,wr,ofs;
+	int use_copy_file_range;
+
+#ifdef FICLONE
+	// Same file system with shared extents support (btrfs, xfs...) : No data copy.
+	if( !ioctl(dst, FICLONE, src) )
+	{
+		__atomic_fetch_add(&ctx->stats.copy_reflinks, 1, __ATOMIC_RELAXED);
+		*bytes += lseek64(src, 0, SEEK_END);
+		return 0;
+	}
+#endif
+
+	buffer = NULL;
+	use_copy_file_range = 1;
+
+	while( !*cancel )
+	{
+		if( use_copy_file_range )
+		{
+			sz = copy_file_range(src, NULL, dst, NULL, CONFIG_COPY_CHUNK_SIZE, 0);
+			if( sz < 0 && ( errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP ) )
+			{
+				// Not supported between these files : Copy in user space.
+				use_copy_file_range = 0;
+				continue;
+			}
+		}
+		else
+		{
+			if( !buffer )
+			{
+				buffer = malloc(CONFIG_WRITE_FILE_BUFFER_SIZE);
+				if( !buffer )
+					return ENOMEM;
+			}
+
+			sz = read(src, buffer, CONFIG_WRITE_FILE_BUFFER_SIZE);
+
+			ofs = 0;
+			while( sz > 0 && ofs < sz )
+			{
+				wr = write(dst, buffer + ofs, sz - ofs);
+				if( wr <= 0 )
+				{
+					sz = -1;
+					break;
+				}
+				ofs += wr;
+			}
+		}
+
+		if( sz < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+
+			free(buffer);
+			return errno ? errno : EIO;
+		}
+
+		if( !sz )
+			break;
+
+		*bytes += sz;
+		__atomic_fetch_add(&ctx->stats.copy_bytes, sz, __ATOMIC_RELAXED);
+	}
+
+	free(buffer);
+
+	if( *cancel )
+		return ECANCELED;
+
+	return 0;
+}
+
+// Copy a file (data, mode and modification time). Return 0 or an errno value.
+static int copy_file(mtp_ctx * ctx, char * src_path, char * dst_path, volatile int * cancel, uint64_t * bytes)
+{
+	struct stat64 src_stat;
+	struct timespec times[2];
+	int src,dst,ret;
+
+	src = open(src_path, O_RDONLY | O_LARGEFILE);
+	if( src < 0 )
+		return errno;
+
+	if( fstat64(src, &src_stat) )
+	{
+		ret = errno;
+		close(src);
+		return ret;
+	}
+
+	dst = open(dst_path, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, src_stat.st_mode & 0777);
+	if( dst < 0 )
+	{
+		ret = errno;
+		close(src);
+		return ret;
+	}
+
+	ret = 0;
+
+	if( src_stat.st_size > 0 && fs_preallocate( dst, src_stat.st_size ) == ENOSPC )
+		ret = ENOSPC;
+
+	if( !ret )
+		ret = copy_data(ctx, src, dst, cancel, bytes);
+
+	if( !ret )
+	{
+		times[0] = src_stat.st_atim;
+		times[1] = src_stat.st_mtim;
+		futimens(dst, times);
+	}
+
+	close(src);
+
+	if( close(dst) && !ret )
+		ret = errno;
+
+	if( ret )
+		remove(dst_path);
+	else
+		__atomic_fetch_add(&ctx->stats.copy_objects, 1, __ATOMIC_RELAXED);
+
+	return ret;
+}
+
+static void report_progress(mtp_copy_job * job, int last)
+{
+	uint64_t now;
+
+	now = mtp_autotune_get_time_us();
+
+	if( !last && now - job->last_report < (uint64_t)CONFIG_COPY_PROGRESS_PERIOD_MS * 1000 )
+		return;
+
+	job->last_report = now;
+
+	PRINT_MSG("%s %s : %"PRIu64" objects - %"PRIu64" MB%s",
+				job->src_handle != 0xFFFFFFFF ? "Moving" : "Copying",
+				job->dst_path, job->objects, job->bytes / (1024*1024),
+				last ? ( job->cancel ? " - cancelled" : " - done" ) : "" );
+}
+
+static int copy_tree(mtp_copy_job * job, char * src_path, char * dst_path)
+{
+	struct dirent *d;
+	struct stat64 fileStat;
+	DIR * dir;
+	char * src;
+	char * dst;
+	int ret;
+
+	dir = opendir(src_path);
+	if( !dir )
+		return errno;
+
+	ret = 0;
+
+	while( !ret && !job->cancel && (d = readdir(dir)) )
+	{
+		if( !strcmp(d->d_name,".") || !strcmp(d->d_name,"..") )
+			continue;
+
+		src = malloc(strlen(src_path) + strlen(d->d_name) + 2);
+		dst = malloc(strlen(dst_path) + strlen(d->d_name) + 2);
+		if( !src || !dst )
+		{
+			free(src);
+			free(dst);
+			ret = ENOMEM;
+			break;
+		}
+
+		sprintf(src,"%s/%s",src_path,d->d_name);
+		sprintf(dst,"%s/%s",dst_path,d->d_name);
+
+		if( !lstat64(src, &fileStat) )
+		{
+			if( S_ISDIR(fileStat.st_mode) )
+			{
+				if( mkdir(dst, fileStat.st_mode & 0777) )
+					ret = errno;
+				else
+					ret = copy_tree(job, src, dst);
+			}
+			else if( S_ISREG(fileStat.st_mode) )
+			{
+				ret = copy_file(job->ctx, src, dst, &job->cancel, &job->bytes);
+			}
+			else
+			{
+				PRINT_WARN("mtp_copy : %s skipped (not a regular file)", src);
+			}
+
+			job->objects++;
+			report_progress(job, 0);
+		}
+
+		free(src);
+		free(dst);
+	}
+
+	closedir(dir);
+
+	if( job->cancel )
+		return ECANCELED;
+
+	return ret;
+}
+
+static void * copy_thread(void * arg)
+{
+	mtp_copy_job * job;
+	mtp_ctx * ctx;
+	fs_entry * entry;
+	uint32_t param;
+	int ret;
+
+	job = (mtp_copy_job *)arg;
+	ctx = job->ctx;
+
+	prctl(PR_SET_NAME, (unsigned long) __func__);
+
+	job->last_report = mtp_autotune_get_time_us();
+
+	ret = -1;
+	if( !set_storage_giduid(ctx, job->dst_storage_id) )
+		ret = copy_tree(job, job->src_path, job->dst_path);
+	restore_giduid(ctx);
+
+	report_progress(job, 1);
+
+	if( ret )
+	{
+		if( ret == ECANCELED )
+			__atomic_fetch_add(&ctx->stats.copy_cancelled, 1, __ATOMIC_RELAXED);
+		else
+			PRINT_ERROR("mtp_copy : %s copy error (%s) !", job->dst_path, strerror(ret));
+	}
+
+	if( !mtp_db_lock( ctx ) )
+	{
+		// Move : Delete the source once the whole folder is copied.
+		if( !ret && job->src_handle != 0xFFFFFFFF )
+		{
+			if( !set_storage_giduid(ctx, job->src_storage_id) && !delete_tree(ctx, job->src_handle) )
+			{
+				param = job->src_handle;
+				mtp_push_event( ctx, MTP_EVENT_OBJECT_REMOVED, 1, &param );
+			}
+			restore_giduid(ctx);
+		}
+
+		// Folder recorded once copied.
+		mtp_journal_record(ctx, JOURNAL_ADD, job->dst_storage_id, job->dst_path, 0);
+
+		// The destination folder content changed.
+		entry = get_entry_by_handle(ctx->fs_db, job->dst_handle);
+		if( entry )
+		{
+			entry->flags &= ~ENTRY_IS_SYNCED;
+
+			param = job->dst_handle;
+			mtp_push_event( ctx, MTP_EVENT_OBJECT_INFO_CHANGED, 1, &param );
+		}
+
+		mtp_db_unlock( ctx );
+	}
+
+	job->running = 0;
+
+	return NULL;
+}
+
+static void free_job(mtp_ctx * ctx)
+{
+	mtp_copy_job * job;
+
+	job = (mtp_copy_job *)ctx->copy_job;
+	if( !job )
+		return;
+
+	pthread_join(job->thread, NULL);
+
+	free(job->src_path);
+	free(job->dst_path);
+	free(job);
+
+	ctx->copy_job = NULL;
+}
+
+// Must be called without the db lock.
+void mtp_copy_cancel(mtp_ctx * ctx)
+{
+	mtp_copy_job * job;
+
+	job = (mtp_copy_job *)ctx->copy_job;
+	if( !job )
+		return;
+
+	job->cancel = 1;
+
+	free_job(ctx);
+}
+
+// Cancel the copy writing / moving this object. Must be called without the db lock.
+void mtp_copy_cancel_handle(mtp_ctx * ctx, uint32_t handle)
+{
+	mtp_copy_job * job;
+
+	job = (mtp_copy_job *)ctx->copy_job;
+	if( !job )
+		return;
+
+	if( job->running && handle != 0xFFFFFFFF && job->dst_handle != handle && job->src_handle != handle )
+		return;
+
+	mtp_copy_cancel(ctx);
+}
+
+static int copy_busy(mtp_ctx * ctx)
+{
+	mtp_copy_job * job;
+
+	job = (mtp_copy_job *)ctx->copy_job;
+	if( !job )
+		return 0;
+
+	if( job->running )
+		return 1;
+
+	free_job(ctx);
+
+	return 0;
+}
+
+// Copy / move the entry to dst_path. The db lock must be held : It is released during a file copy.
+static uint32_t copy_entry(mtp_ctx * ctx, fs_entry * entry, fs_entry * parent, char * src_path, char * dst_path, int move, uint32_t * newhandle)
+{
+	mtp_copy_job * job;
+	filefoundinfo fileinfo;
+	fs_entry * new_entry;
+	uint32_t src_handle,src_storage_id;
+	uint32_t dst_parent,dst_storage_id;
+	uint32_t param;
+	uint64_t bytes;
+	int ret;
+
+	src_handle = entry->handle;
+	src_storage_id = entry->storage_id;
+	dst_parent = parent->handle;
+	dst_storage_id = parent->storage_id;
+
+	memset(&fileinfo, 0, sizeof(filefoundinfo));
+	snprintf(fileinfo.filename, sizeof(fileinfo.filename), "%s", entry->name);
+
+	if( entry->flags & ENTRY_IS_DIR )
+	{
+		if( copy_busy(ctx) )
+			return MTP_RESPONSE_DEVICE_BUSY;
+
+		job = malloc(sizeof(mtp_copy_job));
+		if( !job )
+			return MTP_RESPONSE_GENERAL_ERROR;
+
+		memset(job, 0, sizeof(mtp_copy_job));
+
+		job->ctx = ctx;
+		job->src_path = strdup(src_path);
+		job->dst_path = strdup(dst_path);
+		job->src_handle = move ? src_handle : 0xFFFFFFFF;
+		job->src_storage_id = src_storage_id;
+		job->dst_storage_id = dst_storage_id;
+
+		inotify_handler_echo_begin(ctx, dst_storage_id, dst_parent, fileinfo.filename, IN_CREATE);
+
+		ret = -1;
+		if( job->src_path && job->dst_path && !set_storage_giduid(ctx, dst_storage_id) )
+			ret = mkdir(dst_path, 0777);
+		restore_giduid(ctx);
+
+		new_entry = NULL;
+		if( !ret )
+		{
+			fileinfo.isdirectory = 1;
+			new_entry = add_entry(ctx->fs_db, &fileinfo, dst_parent, dst_storage_id);
+		}
+
+		inotify_handler_echo_end(ctx, dst_storage_id, dst_parent, fileinfo.filename);
+
+		if( !new_entry )
+		{
+			if( !ret )
+				rmdir(dst_path);
+
+			free(job->src_path);
+			free(job->dst_path);
+			free(job);
+
+			return ret ? MTP_RESPONSE_ACCESS_DENIED : MTP_RESPONSE_GENERAL_ERROR;
+		}
+
+		job->dst_handle = new_entry->handle;
+		job->running = 1;
+
+		if( pthread_create(&job->thread, NULL, copy_thread, job) )
+		{
+			PRINT_ERROR("mtp_copy : Thread creation failure !");
+
+			free(job->src_path);
+			free(job->dst_path);
+			free(job);
+
+			return MTP_RESPONSE_GENERAL_ERROR;
+		}
+
+		ctx->copy_job = job;
+
+		*newhandle = new_entry->handle;
+
+		return MTP_RESPONSE_OK;
+	}
+
+	// File : Copied now, without the db lock.
+	inotify_handler_echo_begin(ctx, dst_storage_id, dst_parent, fileinfo.filename, IN_CREATE | IN_MODIFY);
+
+	mtp_db_unlock( ctx );
+
+	bytes = 0;
+	ret = EPERM;
+	if( !set_storage_giduid(ctx, dst_storage_id) )
+		ret = copy_file(ctx, src_path, dst_path, &ctx->cancel_req, &bytes);
+	restore_giduid(ctx);
+
+	if( mtp_db_lock( ctx ) )
+		PRINT_ERROR("mtp_copy : Mutex lock error !");
+
+	new_entry = NULL;
+	if( !ret && !fs_entry_stat(dst_path, &fileinfo) )
+		new_entry = add_entry(ctx->fs_db, &fileinfo, dst_parent, dst_storage_id);
+
+	inotify_handler_echo_end(ctx, dst_storage_id, dst_parent, fileinfo.filename);
+
+	if( new_entry )
+		mtp_journal_record(ctx, JOURNAL_ADD, dst_storage_id, dst_path, 0);
+
+	if( ret == ECANCELED )
+	{
+		ctx->cancel_req = 0;
+		__atomic_fetch_add(&ctx->stats.copy_cancelled, 1, __ATOMIC_RELAXED);
+		return MTP_RESPONSE_NO_RESPONSE;
+	}
+
+	if( ret )
+	{
+		PRINT_WARN("mtp_copy : Can't copy %s to %s (%s)", src_path, dst_path, strerror(ret));
+		return posix_to_mtp_errcode(ret);
+	}
+
+	if( !new_entry )
+		return MTP_RESPONSE_GENERAL_ERROR;
+
+	*newhandle = new_entry->handle;
+
+	if( move )
+	{
+		ret = -1;
+		if( !set_storage_giduid(ctx, src_storage_id) )
+			ret = delete_tree(ctx, src_handle);
+		restore_giduid(ctx);
+
+		if( !ret )
+		{
+			param = src_handle;
+			mtp_push_event( ctx, MTP_EVENT_OBJECT_REMOVED, 1, &param );
+		}
+	}
+
+	return MTP_RESPONSE_OK;
+}
+
+// Check the source and destination and build their paths. The db lock must be held.
+static uint32_t prepare(mtp_ctx * ctx, uint32_t handle, uint32_t storage_id, uint32_t parent_handle, int move, fs_entry ** entry, fs_entry ** parent, char ** src_path, char ** dst_path)
+{
+	struct stat64 fileStat;
+	uint32_t response_code;
+	fs_entry * tmp_entry;
+	char * parent_path;
+	int len;
+
+	*entry = NULL;
+	*parent = NULL;
+	*src_path = NULL;
+	*dst_path = NULL;
+
+	if(parent_handle == 0xFFFFFFFF)
+		parent_handle = 0x00000000;
+
+	*entry = get_entry_by_handle(ctx->fs_db, handle);
+	if( !handle || !*entry )
+		return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
+
+	if( check_handle_access( ctx, *entry, 0x00000000, move, &response_code) )
+		return response_code;
+
+	if( !mtp_get_storage_root(ctx, storage_id) )
+		return MTP_RESPONSE_INVALID_STORAGE_ID;
+
+	*parent = get_entry_by_handle_and_storageid(ctx->fs_db, parent_handle, storage_id);
+	if( !*parent || !( (*parent)->flags & ENTRY_IS_DIR ) )
+		return MTP_RESPONSE_INVALID_PARENT_OBJECT;
+
+	if( check_handle_access( ctx, *parent, 0x00000000, 1, &response_code) )
+		return response_code;
+
+	// A folder can't be moved / copied into itself.
+	if( ( (*entry)->flags & ENTRY_IS_DIR ) && (*entry)->storage_id == storage_id )
+	{
+		tmp_entry = *parent;
+		while( tmp_entry && tmp_entry->handle )
+		{
+			if( tmp_entry->handle == handle )
+				return MTP_RESPONSE_INVALID_PARENT_OBJECT;
+
+			tmp_entry = get_entry_by_handle_and_storageid(ctx->fs_db, tmp_entry->parent, storage_id);
+		}
+	}
+
+	*src_path = build_full_path(ctx->fs_db, mtp_get_storage_root(ctx, (*entry)->storage_id), *entry);
+	parent_path = build_full_path(ctx->fs_db, mtp_get_storage_root(ctx, storage_id), *parent);
+
+	if( !*src_path || !parent_path )
+	{
+		free(*src_path);
+		free(parent_path);
+		*src_path = NULL;
+		return MTP_RESPONSE_GENERAL_ERROR;
+	}
+
+	len = strlen(parent_path) + 1 + strlen((*entry)->name) + 1;
+	*dst_path = malloc(len);
+	if( *dst_path )
+		snprintf(*dst_path, len, "%s/%s", parent_path, (*entry)->name);
+
+	free(parent_path);
+
+	if( !*dst_path )
+		return MTP_RESPONSE_GENERAL_ERROR;
+
+	if( !lstat64(*dst_path, &fileStat) )
+	{
+		PRINT_WARN("mtp_copy : %s already exists !", *dst_path);
+		return MTP_RESPONSE_INVALID_PARENT_OBJECT;
+	}
+
+	return MTP_RESPONSE_OK;
+}
+
+uint32_t mtp_copy_object(mtp_ctx * ctx, uint32_t handle, uint32_t storage_id, uint32_t parent_handle, uint32_t * newhandle)
+{
+	uint32_t response_code;
+	fs_entry * entry;
+	fs_entry * parent;
+	char * src_path;
+	char * dst_path;
+
+	if( mtp_db_lock( ctx ) )
+		return MTP_RESPONSE_GENERAL_ERROR;
+
+	response_code = prepare(ctx, handle, storage_id, parent_handle, 0, &entry, &parent, &src_path, &dst_path);
+	if( response_code == MTP_RESPONSE_OK )
+	{
+		PRINT_DEBUG("mtp_copy_object : %s -> %s", src_path, dst_path);
+
+		response_code = copy_entry(ctx, entry, parent, src_path, dst_path, 0, newhandle);
+	}
+
+	mtp_db_unlock( ctx );
+
+	free(src_path);
+	free(dst_path);
+
+	return response_code;
+}
+
+uint32_t mtp_move_object(mtp_ctx * ctx, uint32_t handle, uint32_t storage_id, uint32_t parent_handle)
+{
+	uint32_t response_code;
+	uint32_t old_parent,new_parent,old_storage_id;
+	uint32_t params[3];
+	filefoundinfo fileinfo;
+	fs_entry * entry;
+	fs_entry * parent;
+	fs_entry * new_entry;
+	char * src_path;
+	char * dst_path;
+	uint32_t newhandle;
+	int ret,err;
+
+	// The moved object may be the source or the destination of the running copy.
+	mtp_copy_cancel_handle(ctx, handle);
+
+	if( mtp_db_lock( ctx ) )
+		return MTP_RESPONSE_GENERAL_ERROR;
+
+	response_code = prepare(ctx, handle, storage_id, parent_handle, 1, &entry, &parent, &src_path, &dst_path);
+	if( response_code != MTP_RESPONSE_OK )
+		goto done;
+
+	PRINT_DEBUG("mtp_move_object : %s -> %s", src_path, dst_path);
+
+	old_parent = entry->parent;
+	old_storage_id = entry->storage_id;
+	new_parent = parent->handle;
+
+	memset(&fileinfo, 0, sizeof(filefoundinfo));
+	snprintf(fileinfo.filename, sizeof(fileinfo.filename), "%s", entry->name);
+
+	if( entry->flags & ENTRY_IS_DIR )
+		fs_cache_invalidate_storage(ctx, old_storage_id);
+	else
+		fs_cache_invalidate(ctx, handle);
+
+	inotify_handler_echo_begin(ctx, old_storage_id, old_parent, fileinfo.filename, IN_MOVED_FROM);
+	inotify_handler_echo_begin(ctx, storage_id, new_parent, fileinfo.filename, IN_MOVED_TO);
+
+	ret = -1;
+	err = EPERM;
+	if( !set_storage_giduid(ctx, old_storage_id) )
+	{
+		ret = rename(src_path, dst_path);
+		err = errno;
+	}
+	restore_giduid(ctx);
+
+	if( !ret )
+	{
+		if( old_storage_id == storage_id )
+		{
+			// Same storage : The object (and its content) keeps its handle.
+			entry->parent = new_parent;
+
+			__atomic_fetch_add(&ctx->stats.copy_renames, 1, __ATOMIC_RELAXED);
+		}
+		else
+		{
+			// Other storage on the same file system : New handle in the destination storage.
+			new_entry = NULL;
+			if( !fs_entry_stat(dst_path, &fileinfo) )
+				new_entry = add_entry(ctx->fs_db, &fileinfo, new_parent, storage_id);
+
+			// The source entry and, for a folder, its content.
+			fs_db_delete_entry(ctx->fs_db, entry);
+
+			params[0] = handle;
+			mtp_push_event( ctx, MTP_EVENT_OBJECT_REMOVED, 1, params );
+
+			if( new_entry )
+			{
+				params[0] = new_entry->handle;
+				mtp_push_event( ctx, MTP_EVENT_OBJECT_ADDED, 1, params );
+			}
+
+			__atomic_fetch_add(&ctx->stats.copy_renames, 1, __ATOMIC_RELAXED);
+		}
+
+		mtp_journal_rename(ctx, old_storage_id, src_path, storage_id, dst_path);
+	}
+
+	inotify_handler_echo_end(ctx, old_storage_id, old_parent, fileinfo.filename);
+	inotify_handler_echo_end(ctx, storage_id, new_parent, fileinfo.filename);
+
+	if( ret && err == EXDEV )
+	{
+		// Other file system : Copy then delete the source.
+		newhandle = 0xFFFFFFFF;
+
+		response_code = copy_entry(ctx, entry, parent, src_path, dst_path, 1, &newhandle);
+		if( response_code == MTP_RESPONSE_OK && newhandle != 0xFFFFFFFF )
+		{
+			params[0] = newhandle;
+			mtp_push_event( ctx, MTP_EVENT_OBJECT_ADDED, 1, params );
+		}
+	}
+	else if( ret )
+	{
+		PRINT_WARN("mtp_move_object : Can't rename %s to %s (%s)", src_path, dst_path, strerror(err));
+		response_code = posix_to_mtp_errcode(err);
+	}
+
+done:
+	mtp_db_unlock( ctx );
+
+	free(src_path);
+	free(dst_path);
+
+	return response_code;
+}
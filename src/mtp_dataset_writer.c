@@ -0,0 +1,271 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/**
+ * @file   mtp_dataset_writer.c
+ * @brief  Streaming dataset writer.
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+// The datasets are built in the USB write buffer and sent each time it is full :
+// The response size is not limited by the buffer size.
+// The container length is sent first. It is either given to dataset_writer_begin
+// (known size or computed by a first "measure" pass with the same builder),
+// or patched at the end when the whole dataset fits in the buffer.
+// A stream of unknown size (DATASET_UNKNOWN_LENGTH) is sent with a 0xFFFFFFFF length
+// and ends with a short packet (or a ZLP).
+// Only full USB packets are sent before the end : A short packet would end the transfer.
+
+#include "buildconf.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "mtp.h"
+#include "mtp_helpers.h"
+#include "mtp_constant.h"
+#include "mtp_dataset_writer.h"
+
+#include "usb_gadget_fct.h"
+
+#include "logs_out.h"
+
+void dataset_writer_init(mtp_ctx * ctx, mtp_dataset_writer * dsw, int measure)
+{
+	memset(dsw, 0, sizeof(mtp_dataset_writer));
+
+	dsw->ctx = ctx;
+	dsw->buffer = ctx->wrbuffer;
+	dsw->size = ctx->usb_wr_buffer_max_size;
+	dsw->measure = measure;
+}
+
+static int send_data(mtp_dataset_writer * dsw, int size)
+{
+	int ret;
+
+	if( dsw->measure )
+	{
+		dsw->total += size;
+		return size;
+	}
+
+	// Never send more than the announced container length.
+	if( dsw->length > 0 && dsw->total + size > dsw->length )
+	{
+		PRINT_WARN("dataset_writer : dataset larger than announced (0x%"SIZEHEX" > 0x%"SIZEHEX") !", dsw->total + size, dsw->length);
+
+		dsw->error = 1;
+		size = dsw->length - dsw->total;
+	}
+
+	if( size > 0 )
+	{
+		ret = write_usb(dsw->ctx->usb_ctx,EP_DESCRIPTOR_IN,dsw->buffer,size);
+		if( ret < 0 )
+		{
+			dsw->error = 1;
+			return -1;
+		}
+
+		dsw->total += size;
+	}
+
+	return size;
+}
+
+int dataset_writer_begin(mtp_dataset_writer * dsw, uint32_t tx_id, uint16_t code, mtp_size length)
+{
+	MTP_PACKET_HEADER * hdr;
+
+	hdr = (MTP_PACKET_HEADER *)dsw->buffer;
+
+	dsw->length = length;
+	dsw->total = 0;
+
+	dsw->ofs = build_response(dsw->ctx, tx_id, MTP_CONTAINER_TYPE_DATA, code, dsw->buffer, dsw->size, 0,0);
+	if( dsw->ofs < 0 )
+	{
+		dsw->error = 1;
+		return -1;
+	}
+
+	if( length >= 0xFFFFFFFF || length == DATASET_UNKNOWN_LENGTH )
+		hdr->length = 0xFFFFFFFF;
+	else
+		hdr->length = length;
+
+	return 0;
+}
+
+// Send the full USB packets of the buffer.
+int dataset_writer_flush(mtp_dataset_writer * dsw)
+{
+	int size;
+
+	if( dsw->error )
+		return -1;
+
+	if( dsw->measure )
+	{
+		send_data(dsw, dsw->ofs);
+		dsw->ofs = 0;
+
+		return 0;
+	}
+
+	// Container length not sent yet : The dataset must fit in the buffer.
+	if( !dsw->length )
+		return -1;
+
+	size = dsw->ofs - ( dsw->ofs % dsw->ctx->max_packet_size );
+	if( !size )
+		return -1;
+
+	if( send_data(dsw, size) < 0 )
+		return -1;
+
+	memmove(dsw->buffer, dsw->buffer + size, dsw->ofs - size);
+	dsw->ofs -= size;
+
+	return 0;
+}
+
+// ofs : Buffer offset after the element written in dsw->buffer (< 0 : buffer full)
+// Return 0 : element added, 1 : buffer flushed, the element must be written again, -1 : error.
+int dataset_writer_commit(mtp_dataset_writer * dsw, int ofs)
+{
+	int prev_ofs;
+
+	if( ofs >= 0 )
+	{
+		dsw->ofs = ofs;
+		return 0;
+	}
+
+	prev_ofs = dsw->ofs;
+
+	if( dataset_writer_flush(dsw) < 0 || dsw->ofs == prev_ofs )
+	{
+		PRINT_ERROR("dataset_writer : element doesn't fit in the buffer !");
+		dsw->error = 1;
+		return -1;
+	}
+
+	return 1;
+}
+
+int dataset_writer_put32(mtp_dataset_writer * dsw, uint32_t data)
+{
+	int ret;
+
+	do
+	{
+		ret = dataset_writer_commit(dsw, poke32(dsw->buffer, dsw->ofs, dsw->size, data));
+	}while( ret > 0 );
+
+	return ret;
+}
+
+int dataset_writer_put_data(mtp_dataset_writer * dsw, void * data, int size)
+{
+	int chunk;
+
+	while( size > 0 )
+	{
+		if( dsw->ofs == dsw->size && dataset_writer_flush(dsw) < 0 )
+		{
+			dsw->error = 1;
+			return -1;
+		}
+
+		chunk = dsw->size - dsw->ofs;
+		if( chunk > size )
+			chunk = size;
+
+		memcpy(dsw->buffer + dsw->ofs, data, chunk);
+
+		dsw->ofs += chunk;
+		data = (unsigned char *)data + chunk;
+		size -= chunk;
+	}
+
+	return 0;
+}
+
+// Send the remaining data. Return the dataset size (< 0 : error).
+mtp_size dataset_writer_end(mtp_dataset_writer * dsw)
+{
+	mtp_ctx * ctx;
+
+	ctx = dsw->ctx;
+
+	if( dsw->error )
+		return -1;
+
+	if( dsw->measure )
+	{
+		send_data(dsw, dsw->ofs);
+		dsw->ofs = 0;
+
+		return dsw->total;
+	}
+
+	if( !dsw->length )
+	{
+		// Whole dataset in the buffer : Patch the container length.
+		dsw->length = dsw->ofs;
+		poke32(dsw->buffer, 0, dsw->size, dsw->ofs);
+	}
+	else if( dsw->length > 0 )
+	{
+		// The builder produced less data than announced : Pad it.
+		if( dsw->total + dsw->ofs < dsw->length )
+			PRINT_WARN("dataset_writer : dataset smaller than announced ! Padding...");
+
+		while( dsw->total + dsw->ofs < dsw->length )
+		{
+			if( dsw->ofs == dsw->size && dataset_writer_flush(dsw) < 0 )
+				return -1;
+
+			dsw->buffer[dsw->ofs++] = 0x00;
+		}
+	}
+
+	PRINT_DEBUG("dataset_writer : last %d bytes", dsw->ofs);
+	PRINT_DEBUG_BUF(dsw->buffer, dsw->ofs);
+
+	if( send_data(dsw, dsw->ofs) < 0 )
+		return -1;
+
+	dsw->ofs = 0;
+
+	// USB ZLP needed ?
+	if( (dsw->total >= ctx->max_packet_size) && !(dsw->total % ctx->max_packet_size) )
+	{
+		PRINT_DEBUG("%"SIZEHEX" bytes transfer ended - ZLP packet needed", dsw->total);
+
+		write_usb(ctx->usb_ctx,EP_DESCRIPTOR_IN,ctx->wrbuffer,0);
+	}
+
+	return dsw->total;
+}
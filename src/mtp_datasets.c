@@ -41,6 +41,8 @@
 #include "mtp_datasets.h"
 #include "mtp_support_def.h"
 #include "mtp_properties.h"
+#include "mtp_thumb.h"
+#include "mtp_media.h"
 
 #include "usb_gadget_fct.h"
 #include "fs_handles_db.h"
@@ -52,6 +54,23 @@ void set_default_date(struct tm * date)
 	date->tm_year = 110;
 }
 
+// "YYYYMMDDThhmmss[.s][Z|+hhmm]" date string to time (0 : invalid date)
+time_t parse_date_string(const char * str)
+{
+	struct tm date;
+
+	memset(&date, 0, sizeof(struct tm));
+
+	if( sscanf(str, "%4d%2d%2dT%2d%2d%2d", &date.tm_year, &date.tm_mon, &date.tm_mday, &date.tm_hour, &date.tm_min, &date.tm_sec) != 6 )
+		return 0;
+
+	date.tm_year -= 1900;
+	date.tm_mon -= 1;
+	date.tm_isdst = -1;
+
+	return mktime(&date);
+}
+
 int build_deviceinfo_dataset(mtp_ctx * ctx, void * buffer, int maxsize)
 {
 	int ofs,i,elements_cnt;
@@ -176,6 +195,7 @@ int build_storageinfo_dataset(mtp_ctx * ctx,void * buffer, int maxsize,uint32_t
 int build_objectinfo_dataset(mtp_ctx * ctx, void * buffer, int maxsize,fs_entry * entry)
 {
 	struct stat64 entrystat;
+	mtp_thumb_info thumb;
 	time_t t;
 	struct tm lt;
 	int ofs,ret;
@@ -200,23 +220,23 @@ int build_objectinfo_dataset(mtp_ctx * ctx, void * buffer, int maxsize,fs_entry
 	}
 
 	ofs = poke32(buffer, ofs, maxsize, entry->storage_id);                                       // StorageID  (NR)
-	if(entry->flags & ENTRY_IS_DIR)
-		ofs = poke16(buffer, ofs, maxsize, MTP_FORMAT_ASSOCIATION);                              // ObjectFormat Code
-	else
-		ofs = poke16(buffer, ofs, maxsize, MTP_FORMAT_UNDEFINED);                                // ObjectFormat Code
+	ofs = poke16(buffer, ofs, maxsize, mtp_media_format(entry));                                 // ObjectFormat Code
 	ofs = poke16(buffer, ofs, maxsize, 0x0000);                                                  // Protection Status (NR)
 
 	entry->size = entrystat.st_size;
+	entry->date = entrystat.st_mtime;
 
 	if( entry->size >= (mtp_size)(0x100000000) )
 		ofs = poke32(buffer, ofs, maxsize, 0xFFFFFFFF);                                          // Object Compressed Size
 	else
 		ofs = poke32(buffer, ofs, maxsize, entry->size);                                         // Object Compressed Size
 
-	ofs = poke16(buffer, ofs, maxsize, 0x0000);                                                  // Thumb Format (NR)
-	ofs = poke32(buffer, ofs, maxsize, 0x00000000);                                              // Thumb Compressed Size (NR)
-	ofs = poke32(buffer, ofs, maxsize, 0x00000000);                                              // Thumb Pix Width (NR)
-	ofs = poke32(buffer, ofs, maxsize, 0x00000000);                                              // Thumb Pix Height (NR)
+	mtp_thumb_get_info(ctx, path, &entrystat, &thumb);
+
+	ofs = poke16(buffer, ofs, maxsize, thumb.format);                                            // Thumb Format
+	ofs = poke32(buffer, ofs, maxsize, thumb.size);                                              // Thumb Compressed Size
+	ofs = poke32(buffer, ofs, maxsize, thumb.width);                                             // Thumb Pix Width
+	ofs = poke32(buffer, ofs, maxsize, thumb.height);                                            // Thumb Pix Height
 	ofs = poke32(buffer, ofs, maxsize, 0x00000000);                                              // Image Pix Width (NR)
 	ofs = poke32(buffer, ofs, maxsize, 0x00000000);                                              // Image Pix Height (NR)
 	ofs = poke32(buffer, ofs, maxsize, 0x00000000);                                              // Image Bit Depth (NR)
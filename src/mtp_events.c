@@ -0,0 +1,442 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * @file   mtp_events.c
+ * @brief  MTP events sender.
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+// The MTP events are sent on the interrupt endpoint by a dedicated thread :
+// A host not polling the endpoint doesn't block the threads producing the events.
+// While queued, an event superseded by a later one is dropped (an object added
+// then removed is never reported...) and a burst of object events is replaced
+// by a single StorageInfoChanged event, the host rescanning the storage once.
+
+#include "buildconf.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <signal.h>
+
+#include <sys/prctl.h>
+
+#include "mtp.h"
+#include "mtp_constant.h"
+#include "mtp_datasets.h"
+#include "mtp_events.h"
+
+#include "usb_gadget_fct.h"
+
+#include "logs_out.h"
+
+static int send_event(mtp_ctx * ctx, uint32_t event, int nbparams, uint32_t * parameters)
+{
+	unsigned char event_buffer[64];
+	int size;
+	int ret;
+
+	size = build_event_dataset( ctx, event_buffer, sizeof(event_buffer), event , ctx->session_id, 0x00000000, nbparams, parameters);
+	if(size < 0)
+		return -1;
+
+	PRINT_DEBUG("send_event : Event packet buffer - %d Bytes :",size);
+	PRINT_DEBUG_BUF(event_buffer, size);
+
+	ret = write_usb(ctx->usb_ctx,EP_DESCRIPTOR_INT_IN,event_buffer,size);
+
+	PRINT_DEBUG("write_usb return: %d", ret );
+
+	__atomic_fetch_add( &ctx->stats.events_sent, 1, __ATOMIC_RELAXED );
+
+	return ret;
+}
+
+static int is_object_event(uint32_t code)
+{
+	return ( code == MTP_EVENT_OBJECT_ADDED ) || ( code == MTP_EVENT_OBJECT_REMOVED ) || ( code == MTP_EVENT_OBJECT_INFO_CHANGED ) ||
+		( code == MTP_EVENT_OBJECT_PROP_CHANGED );
+}
+
+// Storage of an object event (the storage index is encoded in the handle)
+static uint32_t event_storage_id(mtp_ctx * ctx, mtp_event * ev)
+{
+	int index;
+
+	if( !is_object_event(ev->code) || ev->nbparams < 1 )
+		return 0x00000000;
+
+	index = FS_DB_HANDLE_SHARD(ev->params[0]);
+	if( index >= MAX_STORAGE_NB || !ctx->storages[index].root_path )
+		return 0x00000000;
+
+	return ctx->storages[index].storage_id;
+}
+
+static int find_event(mtp_event_queue * q, uint32_t code, uint32_t param)
+{
+	int i;
+
+	for( i = 0; i < q->nb_events; i++ )
+	{
+		if( q->events[i].code == code && q->events[i].nbparams >= 1 && q->events[i].params[0] == param )
+			return i;
+	}
+
+	return -1;
+}
+
+static void remove_event(mtp_event_queue * q, int index)
+{
+	if( index < 0 || index >= q->nb_events )
+		return;
+
+	memmove( &q->events[index], &q->events[index + 1], ( q->nb_events - index - 1 ) * sizeof(mtp_event) );
+	q->nb_events--;
+}
+
+static void append_event(mtp_event_queue * q, uint32_t code, int nbparams, uint32_t * parameters, int storm)
+{
+	mtp_event * ev;
+	int i;
+
+	ev = &q->events[q->nb_events++];
+
+	memset( ev, 0, sizeof(mtp_event) );
+	ev->code = code;
+	ev->storm = storm;
+
+	for( i = 0; i < nbparams && i < 3; i++ )
+		ev->params[i] = parameters[i];
+
+	ev->nbparams = i;
+}
+
+// Replace the queued object events of a storage by a single StorageInfoChanged.
+static void collapse_storage(mtp_ctx * ctx, mtp_event_queue * q, uint32_t storage_id)
+{
+	int i;
+
+	i = 0;
+	while( i < q->nb_events )
+	{
+		if( event_storage_id(ctx, &q->events[i]) == storage_id )
+		{
+			remove_event(q, i);
+			ctx->stats.events_superseded++;
+		}
+		else
+		{
+			i++;
+		}
+	}
+
+	if( find_event(q, MTP_EVENT_STORAGE_INFO_CHANGED, storage_id) < 0 && q->nb_events < CONFIG_EVENT_QUEUE_SIZE )
+		append_event(q, MTP_EVENT_STORAGE_INFO_CHANGED, 1, &storage_id, 1);
+
+	ctx->stats.events_storms++;
+
+	PRINT_DEBUG("mtp_events_queue : Events storm on storage 0x%.8X, StorageInfoChanged sent instead", storage_id);
+}
+
+// Queue lock held. Returns 1 if the event must be appended.
+static int supersede(mtp_ctx * ctx, mtp_event_queue * q, mtp_event * ev)
+{
+	uint32_t handle,storage_id;
+	int i,nb,added;
+
+	if( ev->code == MTP_EVENT_STORAGE_INFO_CHANGED && ev->nbparams >= 1 )
+	{
+		// Already going to be reported
+		if( find_event(q, MTP_EVENT_STORAGE_INFO_CHANGED, ev->params[0]) >= 0 )
+			return 0;
+	}
+
+	if( !is_object_event(ev->code) || ev->nbparams < 1 )
+		return 1;
+
+	handle = ev->params[0];
+	storage_id = event_storage_id(ctx, ev);
+
+	// The storage will be rescanned by the host.
+	if( storage_id )
+	{
+		i = find_event(q, MTP_EVENT_STORAGE_INFO_CHANGED, storage_id);
+		if( i >= 0 && q->events[i].storm )
+			return 0;
+	}
+
+	switch( ev->code )
+	{
+		case MTP_EVENT_OBJECT_ADDED:
+			if( find_event(q, MTP_EVENT_OBJECT_ADDED, handle) >= 0 )
+				return 0;
+		break;
+
+		case MTP_EVENT_OBJECT_INFO_CHANGED:
+			if( find_event(q, MTP_EVENT_OBJECT_ADDED, handle) >= 0 ||
+				find_event(q, MTP_EVENT_OBJECT_INFO_CHANGED, handle) >= 0 )
+				return 0;
+		break;
+
+		case MTP_EVENT_OBJECT_PROP_CHANGED:
+			if( find_event(q, MTP_EVENT_OBJECT_ADDED, handle) >= 0 )
+				return 0;
+
+			for( i = 0; i < q->nb_events; i++ )
+			{
+				if( q->events[i].code == ev->code && q->events[i].params[0] == handle && q->events[i].params[1] == ev->params[1] )
+					return 0;
+			}
+		break;
+
+		case MTP_EVENT_OBJECT_REMOVED:
+			i = find_event(q, MTP_EVENT_OBJECT_INFO_CHANGED, handle);
+			if( i >= 0 )
+			{
+				remove_event(q, i);
+				ctx->stats.events_superseded++;
+			}
+
+			while( ( i = find_event(q, MTP_EVENT_OBJECT_PROP_CHANGED, handle) ) >= 0 )
+			{
+				remove_event(q, i);
+				ctx->stats.events_superseded++;
+			}
+
+			added = find_event(q, MTP_EVENT_OBJECT_ADDED, handle);
+			if( added >= 0 )
+			{
+				// Never reported to the host : nothing to remove.
+				remove_event(q, added);
+				ctx->stats.events_superseded++;
+				return 0;
+			}
+		break;
+	}
+
+	// Events storm ?
+	nb = 0;
+	for( i = 0; i < q->nb_events; i++ )
+	{
+		if( storage_id && event_storage_id(ctx, &q->events[i]) == storage_id )
+			nb++;
+	}
+
+	if( storage_id && ( nb + 1 >= CONFIG_EVENT_STORM_THRESHOLD || q->nb_events >= CONFIG_EVENT_QUEUE_SIZE ) )
+	{
+		collapse_storage(ctx, q, storage_id);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void *events_gotsig(int sig, siginfo_t *info, void *ucontext)
+{
+	return NULL;
+}
+
+static void* events_thread(void* arg)
+{
+	mtp_ctx * ctx;
+	mtp_event_queue * q;
+	mtp_event events[CONFIG_EVENT_QUEUE_SIZE];
+	struct sigaction sa;
+	uint32_t generation;
+	int i,nb;
+
+	prctl(PR_SET_NAME, (unsigned long) __func__);
+
+	ctx = (mtp_ctx *)arg;
+	q = &ctx->event_queue;
+
+	// SIGUSR1 interrupts a blocked event write at the exit (no SA_RESTART).
+	sa.sa_handler = NULL;
+	sa.sa_sigaction = (void *)events_gotsig;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+
+	sigaction(SIGUSR1, &sa, NULL);
+
+	pthread_mutex_lock( &q->lock );
+
+	for(;;)
+	{
+		while( !q->nb_events && !q->stop )
+			pthread_cond_wait( &q->cond, &q->lock );
+
+		if( q->stop )
+			break;
+
+		// Let the burst build up : the superseded events are dropped meanwhile.
+		pthread_mutex_unlock( &q->lock );
+		usleep( CONFIG_EVENT_BATCH_DELAY_MS * 1000 );
+		pthread_mutex_lock( &q->lock );
+
+		nb = q->nb_events;
+		memcpy( events, q->events, nb * sizeof(mtp_event) );
+		q->nb_events = 0;
+
+		generation = q->generation;
+
+		pthread_mutex_unlock( &q->lock );
+
+		// Session closed or host disconnected meanwhile : The remaining events are dropped.
+		for( i = 0; i < nb && !q->stop && __atomic_load_n( &q->generation, __ATOMIC_ACQUIRE ) == generation; i++ )
+		{
+			send_event( ctx, events[i].code, events[i].nbparams, events[i].params );
+		}
+
+		pthread_mutex_lock( &q->lock );
+	}
+
+	pthread_mutex_unlock( &q->lock );
+
+	q->done = 1;
+
+	return NULL;
+}
+
+int mtp_events_queue(mtp_ctx * ctx, uint32_t event, int nbparams, uint32_t * parameters)
+{
+	mtp_event_queue * q;
+	mtp_event ev;
+	int i;
+
+	q = &ctx->event_queue;
+
+	// No sender thread : synchronous write.
+	if( !q->running )
+		return send_event( ctx, event, nbparams, parameters );
+
+	memset( &ev, 0, sizeof(mtp_event) );
+	ev.code = event;
+	for( i = 0; i < nbparams && i < 3; i++ )
+		ev.params[i] = parameters[i];
+	ev.nbparams = i;
+
+	pthread_mutex_lock( &q->lock );
+
+	ctx->stats.events_queued++;
+
+	if( supersede( ctx, q, &ev ) )
+	{
+		if( q->nb_events < CONFIG_EVENT_QUEUE_SIZE )
+		{
+			append_event( q, ev.code, ev.nbparams, ev.params, 0 );
+		}
+		else
+		{
+			PRINT_WARN("mtp_events_queue : Queue full, event 0x%.4X dropped !", event);
+			ctx->stats.events_dropped++;
+		}
+	}
+	else
+	{
+		ctx->stats.events_superseded++;
+	}
+
+	pthread_cond_signal( &q->cond );
+
+	pthread_mutex_unlock( &q->lock );
+
+	return 0;
+}
+
+// Drop the queued events (session closed, host disconnected) : They belong to the previous session.
+void mtp_events_flush(mtp_ctx * ctx)
+{
+	mtp_event_queue * q;
+
+	q = &ctx->event_queue;
+
+	if( !q->running )
+		return;
+
+	pthread_mutex_lock( &q->lock );
+
+	ctx->stats.events_dropped += q->nb_events;
+	q->nb_events = 0;
+
+	__atomic_fetch_add( &q->generation, 1, __ATOMIC_RELEASE );
+
+	pthread_mutex_unlock( &q->lock );
+}
+
+int mtp_events_init(mtp_ctx * ctx)
+{
+	mtp_event_queue * q;
+	int ret;
+
+	q = &ctx->event_queue;
+
+	if( pthread_mutex_init( &q->lock, NULL ) )
+		return -1;
+
+	if( pthread_cond_init( &q->cond, NULL ) )
+		return -1;
+
+	q->nb_events = 0;
+	q->stop = 0;
+	q->done = 0;
+
+	ret = pthread_create( &q->thread, NULL, events_thread, ctx );
+	if( ret )
+	{
+		PRINT_ERROR("%s : events thread creation failed ! (error %d)", __func__, ret);
+		return -1;
+	}
+
+	q->running = 1;
+
+	return 0;
+}
+
+int mtp_events_deinit(mtp_ctx * ctx)
+{
+	mtp_event_queue * q;
+	void * ret;
+
+	q = &ctx->event_queue;
+
+	if( !q->running )
+		return 0;
+
+	pthread_mutex_lock( &q->lock );
+	q->stop = 1;
+	pthread_cond_signal( &q->cond );
+	pthread_mutex_unlock( &q->lock );
+
+	// The sender may be blocked in an interrupt endpoint write (host gone).
+	while( !q->done )
+	{
+		pthread_kill( q->thread, SIGUSR1 );
+		usleep( 10000 );
+	}
+
+	pthread_join( q->thread, &ret );
+
+	q->running = 0;
+
+	return 0;
+}
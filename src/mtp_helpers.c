@@ -157,6 +157,34 @@ uint64_t peek64(void * buffer, int index, int typesize)
 	return data;
 }
 
+// Read a MTP string (length byte + UTF-16LE characters) and convert it to UTF-8.
+// Return the index after the string (< 0 : string outside the buffer).
+int peek_string(void * buffer, int index, int maxsize, char * str, int maxstrsize)
+{
+	unsigned char *ptr;
+	uint16_t unicode_str[256];
+	int len;
+
+	str[0] = '\0';
+
+	if( index < 0 || index >= maxsize )
+		return -1;
+
+	ptr = ((unsigned char *)buffer);
+
+	len = ptr[index++];
+	if( index + (len * 2) > maxsize )
+		return -1;
+
+	// The characters are copied as is : unicode2charstring uses bytes accesses.
+	memcpy(unicode_str, &ptr[index], len * 2);
+	unicode_str[len] = 0x0000;
+
+	unicode2charstring(str, unicode_str, maxstrsize);
+
+	return index + (len * 2);
+}
+
 int poke_string(void * buffer, int index, int maxsize, const char *str)
 {
 	unsigned char *ptr;
@@ -0,0 +1,2121 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * @file   mtp_journal.c
+ * @brief  Objects changes journal (GetChanges vendor operation).
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+// The objects additions, removals, modifications and renames are recorded with
+// increasing sequence numbers : A host keeps the last one as a token and gets the
+// changes since it with GetChanges, instead of walking the whole storages again.
+// The responder changes and the inotify events are recorded when they happen. The
+// changes not seen this way (made while no session is open, or in folders never
+// listed by the host) are found by a background walk of the storages at the session
+// opening : The storages content is compared with a snapshot (path, inode, size,
+// modification time) kept up to date with the recorded changes. The inodes give the
+// renames. The journal and the snapshots can be saved in a file (change_journal_file)
+// to survive the responder restarts.
+// The journal is bounded : A token older than the oldest record kept, or given by
+// another journal, is expired and the host has to do a full sync.
+// An added, removed or renamed folder stands for its whole content.
+
+#include "buildconf.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "mtp.h"
+#include "mtp_helpers.h"
+#include "mtp_constant.h"
+#include "mtp_dataset_writer.h"
+#include "mtp_journal.h"
+
+#include "logs_out.h"
+
+#define JOURNAL_FILE_MAGIC    "UMTPJRN"
+#define JOURNAL_FILE_VERSION  1
+#define JOURNAL_MAX_HOLES     8
+#define JOURNAL_MAX_STRING    ( 64 * 1024 )
+
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_WHO_PROCESS  1
+
+// Snapshot entry : Object state when last seen.
+typedef struct snap_entry_
+{
+	char * path;          // Relative to the storage root
+	uint64_t ino;
+	mtp_size size;
+	int64_t date;
+	uint32_t date_ns;
+	uint8_t isdir;
+	uint8_t removed;      // Removed while a walk was running (tombstone)
+	uint8_t mark;         // Walk merge : Paired with a removed entry (rename)
+	uint64_t stamp;       // Sequence number of the last recorded change (0 : walk)
+}snap_entry;
+
+typedef struct journal_snapshot_
+{
+	snap_entry * entries; // Sorted by path
+	int nb;
+	int max;
+
+	int valid;            // Walked at least once : Else, no history for this storage.
+	char * root;
+}journal_snapshot;
+
+typedef struct mtp_journal_
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int thread_started;
+	int stop;
+
+	uint32_t walk_req;    // Storages to walk (indexes bitmask)
+	int walking;          // Walk running : Removed entries are kept as tombstones.
+
+	journal_record records[CONFIG_JOURNAL_SIZE];
+	int first;
+	int nb;
+
+	uint64_t head;        // Last sequence number
+	uint64_t base;        // Oldest valid token
+	uint64_t served;      // Last sequence number returned by GetChanges
+
+	// Sequence numbers possibly given after the last save of the journal file
+	uint64_t holes[JOURNAL_MAX_HOLES][2];
+	int nb_holes;
+
+	journal_snapshot snap[MAX_STORAGE_NB];
+
+	// inotify rename in progress (IN_MOVED_FROM received) : Content of the moved folder.
+	journal_snapshot moved;
+	uint32_t moved_cookie;
+	int moved_idx;
+	size_t moved_len;
+
+	int dirty;
+}mtp_journal;
+
+static char * path_cat(const char * a, const char * b)
+{
+	char * path;
+
+	if( !a[0] )
+		return strdup(b);
+
+	if( !b[0] )
+		return strdup(a);
+
+	path = malloc(strlen(a) + 1 + strlen(b) + 1);
+	if( path )
+		sprintf(path, "%s/%s", a, b);
+
+	return path;
+}
+
+// Path relative to the storage root ("" : The root), NULL if outside of it.
+static const char * relative_path(mtp_ctx * ctx, uint32_t storage_id, const char * path)
+{
+	const char * root;
+	size_t len;
+
+	root = mtp_get_storage_root(ctx, storage_id);
+	if( !root || !path )
+		return NULL;
+
+	len = strlen(root);
+	while( len && root[len - 1] == '/' )
+		len--;
+
+	if( strncmp(path, root, len) || ( path[len] && path[len] != '/' ) )
+		return NULL;
+
+	path += len;
+	while( *path == '/' )
+		path++;
+
+	return path;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Storages snapshots
+
+static int snap_cmp(const void * a, const void * b)
+{
+	return strcmp( ((snap_entry *)a)->path, ((snap_entry *)b)->path );
+}
+
+static void snap_free(journal_snapshot * s)
+{
+	int i;
+
+	for( i = 0; i < s->nb; i++ )
+		free(s->entries[i].path);
+
+	free(s->entries);
+
+	s->entries = NULL;
+	s->nb = 0;
+	s->max = 0;
+}
+
+static void snap_set(snap_entry * e, struct stat64 * st)
+{
+	e->ino = st->st_ino;
+	e->isdir = S_ISDIR(st->st_mode) ? 1 : 0;
+	e->size = e->isdir ? 0 : st->st_size;
+	e->date = st->st_mtim.tv_sec;
+	e->date_ns = st->st_mtim.tv_nsec;
+	e->removed = 0;
+}
+
+// Unsorted append.
+static snap_entry * snap_append(journal_snapshot * s, const char * path, struct stat64 * st, uint64_t stamp)
+{
+	snap_entry * entries;
+	snap_entry * e;
+	int max;
+
+	if( s->nb >= s->max )
+	{
+		max = s->max ? s->max * 2 : 256;
+
+		entries = realloc(s->entries, max * sizeof(snap_entry));
+		if( !entries )
+			return NULL;
+
+		s->entries = entries;
+		s->max = max;
+	}
+
+	e = &s->entries[s->nb];
+
+	memset(e, 0, sizeof(snap_entry));
+
+	e->path = strdup(path);
+	if( !e->path )
+		return NULL;
+
+	if( st )
+		snap_set(e, st);
+
+	e->stamp = stamp;
+
+	s->nb++;
+
+	return e;
+}
+
+// Returns 1 if found. *pos : Entry index or insertion index.
+static int snap_find(journal_snapshot * s, const char * path, int * pos)
+{
+	int lo,hi,mid,cmp;
+
+	lo = 0;
+	hi = s->nb;
+	while( lo < hi )
+	{
+		mid = ( lo + hi ) / 2;
+
+		cmp = strcmp(s->entries[mid].path, path);
+		if( !cmp )
+		{
+			*pos = mid;
+			return 1;
+		}
+
+		if( cmp < 0 )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*pos = lo;
+
+	return 0;
+}
+
+// Content of a folder ("" : Whole storage) : Entries [*start, *end[
+static void snap_subtree(journal_snapshot * s, const char * path, int * start, int * end)
+{
+	char * prefix;
+	size_t len;
+	int i;
+
+	*start = 0;
+	*end = 0;
+
+	if( !path[0] )
+	{
+		*end = s->nb;
+		return;
+	}
+
+	len = strlen(path);
+
+	prefix = malloc(len + 2);
+	if( !prefix )
+		return;
+
+	sprintf(prefix, "%s/", path);
+
+	snap_find(s, prefix, &i);
+
+	*start = i;
+	while( i < s->nb && !strncmp(s->entries[i].path, prefix, len + 1) )
+		i++;
+
+	*end = i;
+
+	free(prefix);
+}
+
+static void snap_remove(journal_snapshot * s, int start, int end)
+{
+	int i;
+
+	for( i = start; i < end; i++ )
+		free(s->entries[i].path);
+
+	memmove(&s->entries[start], &s->entries[end], ( s->nb - end ) * sizeof(snap_entry));
+
+	s->nb -= end - start;
+}
+
+// Replace the entries [start, end[ by a sorted list (its entries are taken over). Returns -1 if out of memory.
+static int snap_replace(journal_snapshot * s, int start, int end, snap_entry * list, int nb)
+{
+	snap_entry * entries;
+	int i,max;
+
+	if( s->nb - ( end - start ) + nb > s->max )
+	{
+		max = s->max ? s->max : 256;
+		while( max < s->nb - ( end - start ) + nb )
+			max *= 2;
+
+		entries = realloc(s->entries, max * sizeof(snap_entry));
+		if( !entries )
+			return -1;
+
+		s->entries = entries;
+		s->max = max;
+	}
+
+	for( i = start; i < end; i++ )
+		free(s->entries[i].path);
+
+	memmove(&s->entries[start + nb], &s->entries[end], ( s->nb - end ) * sizeof(snap_entry));
+	memcpy(&s->entries[start], list, nb * sizeof(snap_entry));
+
+	s->nb += nb - ( end - start );
+
+	return 0;
+}
+
+// Entry of a path, updated in place or inserted at its place.
+static snap_entry * snap_insert(journal_snapshot * s, const char * path, struct stat64 * st, uint64_t stamp)
+{
+	snap_entry e;
+	int pos;
+
+	if( !snap_find(s, path, &pos) )
+	{
+		memset(&e, 0, sizeof(snap_entry));
+
+		e.path = strdup(path);
+		if( !e.path )
+			return NULL;
+
+		if( snap_replace(s, pos, pos, &e, 1) )
+		{
+			free(e.path);
+			return NULL;
+		}
+	}
+
+	if( st )
+		snap_set(&s->entries[pos], st);
+
+	s->entries[pos].mark = 0;
+	s->entries[pos].stamp = stamp;
+
+	return &s->entries[pos];
+}
+
+// Storage folder content, unsorted. Returns -1 if the folder can't be read.
+static int walk_folder(mtp_ctx * ctx, journal_snapshot * list, const char * root, const char * rel, uint64_t stamp, int depth)
+{
+	struct stat64 st;
+	struct dirent * d;
+	char * full;
+	char * child;
+	char * child_full;
+	DIR * dir;
+	int link;
+
+	full = path_cat(root, rel);
+	if( !full )
+		return -1;
+
+	dir = opendir(full);
+	if( !dir )
+	{
+		free(full);
+		return -1;
+	}
+
+	while( ( d = readdir(dir) ) )
+	{
+		if( !strcmp(d->d_name, ".") || !strcmp(d->d_name, "..") )
+			continue;
+
+		if( !ctx->usb_cfg.show_hidden_files && d->d_name[0] == '.' )
+			continue;
+
+		child = path_cat(rel, d->d_name);
+		child_full = path_cat(full, d->d_name);
+
+		if( child && child_full && !lstat64(child_full, &st) )
+		{
+			// The symbolic links are followed like in the handles db, but not walked.
+			link = S_ISLNK(st.st_mode);
+			if( !link || !stat64(child_full, &st) )
+			{
+				snap_append(list, child, &st, stamp);
+
+				if( S_ISDIR(st.st_mode) && !link && depth < CONFIG_JOURNAL_MAX_DEPTH )
+					walk_folder(ctx, list, root, child, stamp, depth + 1);
+			}
+		}
+
+		free(child);
+		free(child_full);
+	}
+
+	closedir(dir);
+	free(full);
+
+	return 0;
+}
+
+static journal_snapshot * storage_snapshot(mtp_ctx * ctx, mtp_journal * j, int idx)
+{
+	journal_snapshot * s;
+	char * root;
+
+	root = ctx->storages[idx].root_path;
+	if( !root )
+		return NULL;
+
+	s = &j->snap[idx];
+
+	// Other storage at this index : New history.
+	if( !s->root || strcmp(s->root, root) )
+	{
+		snap_free(s);
+		free(s->root);
+
+		s->valid = 0;
+		s->root = strdup(root);
+		if( !s->root )
+			return NULL;
+	}
+
+	return s;
+}
+
+// Recorded object (and content) added or modified.
+static void snap_added(mtp_ctx * ctx, journal_snapshot * s, const char * rel, struct stat64 * st, uint64_t seq)
+{
+	journal_snapshot list;
+	int start,end;
+
+	if( !snap_insert(s, rel, st, seq) || !S_ISDIR(st->st_mode) )
+		return;
+
+	memset(&list, 0, sizeof(list));
+
+	walk_folder(ctx, &list, s->root, rel, seq, 0);
+
+	qsort(list.entries, list.nb, sizeof(snap_entry), snap_cmp);
+
+	// The folder content is contiguous : Replaced in place.
+	snap_subtree(s, rel, &start, &end);
+	if( snap_replace(s, start, end, list.entries, list.nb) )
+	{
+		snap_free(&list);
+		return;
+	}
+
+	free(list.entries);
+}
+
+// Recorded object (and content) removed.
+// moved : Renamed object, its content is taken out of the snapshot (instead of freed) to be moved.
+static void snap_removed(mtp_journal * j, journal_snapshot * s, const char * rel, uint64_t seq, journal_snapshot * moved)
+{
+	snap_entry * e;
+	int start,end,pos;
+
+	snap_subtree(s, rel, &start, &end);
+
+	if( moved && end > start )
+	{
+		snap_free(moved);
+
+		moved->entries = malloc(( end - start ) * sizeof(snap_entry));
+		if( moved->entries )
+		{
+			memcpy(moved->entries, &s->entries[start], ( end - start ) * sizeof(snap_entry));
+			moved->nb = end - start;
+			moved->max = end - start;
+
+			memmove(&s->entries[start], &s->entries[end], ( s->nb - end ) * sizeof(snap_entry));
+			s->nb -= end - start;
+			end = start;
+		}
+	}
+
+	snap_remove(s, start, end);
+
+	if( snap_find(s, rel, &pos) )
+	{
+		if( !j->walking )
+		{
+			snap_remove(s, pos, pos + 1);
+			return;
+		}
+
+		s->entries[pos].removed = 1;
+		s->entries[pos].stamp = seq;
+		return;
+	}
+
+	// The running walk may have seen it.
+	if( j->walking )
+	{
+		e = snap_insert(s, rel, NULL, seq);
+		if( e )
+			e->removed = 1;
+	}
+}
+
+// Recorded object renamed : Its content taken out by snap_removed() is moved under the new path
+// (old_len : Length of the old path), no folder walk.
+static void snap_renamed(mtp_ctx * ctx, journal_snapshot * s, journal_snapshot * moved, size_t old_len, const char * rel, struct stat64 * st, uint64_t seq)
+{
+	snap_entry * e;
+	char * path;
+	int i,start,end;
+
+	// Unknown or empty folder, or a file.
+	if( !moved->nb )
+	{
+		snap_added(ctx, s, rel, st, seq);
+		return;
+	}
+
+	// Same order with the new prefix.
+	for( i = 0; i < moved->nb; i++ )
+	{
+		e = &moved->entries[i];
+
+		path = malloc(strlen(rel) + strlen(e->path + old_len) + 1);
+		if( !path )
+		{
+			snap_free(moved);
+			snap_added(ctx, s, rel, st, seq);
+			return;
+		}
+
+		sprintf(path, "%s%s", rel, e->path + old_len);
+
+		free(e->path);
+		e->path = path;
+		e->stamp = seq;
+	}
+
+	if( !snap_insert(s, rel, st, seq) )
+	{
+		snap_free(moved);
+		return;
+	}
+
+	snap_subtree(s, rel, &start, &end);
+	if( snap_replace(s, start, end, moved->entries, moved->nb) )
+	{
+		snap_free(moved);
+		return;
+	}
+
+	free(moved->entries);
+	moved->entries = NULL;
+	moved->nb = 0;
+	moved->max = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Records
+
+static journal_record * journal_last(mtp_journal * j)
+{
+	if( !j->nb )
+		return NULL;
+
+	return &j->records[( j->first + j->nb - 1 ) % CONFIG_JOURNAL_SIZE];
+}
+
+// A change couldn't be recorded : The previous tokens expire.
+static void journal_gap(mtp_journal * j)
+{
+	j->head++;
+	j->base = j->head;
+}
+
+static journal_record * journal_append(mtp_ctx * ctx, mtp_journal * j, int type, uint32_t storage_id, int flags, mtp_size size, int64_t date, const char * path, const char * old_path)
+{
+	journal_record * rec;
+
+	if( j->nb == CONFIG_JOURNAL_SIZE )
+	{
+		// Oldest record dropped : The tokens before it expire.
+		rec = &j->records[j->first];
+
+		j->base = rec->seq;
+
+		free(rec->path);
+		free(rec->old_path);
+
+		j->first = ( j->first + 1 ) % CONFIG_JOURNAL_SIZE;
+		j->nb--;
+	}
+
+	rec = &j->records[( j->first + j->nb ) % CONFIG_JOURNAL_SIZE];
+
+	memset(rec, 0, sizeof(journal_record));
+
+	rec->path = strdup(path);
+	if( old_path )
+		rec->old_path = strdup(old_path);
+
+	if( !rec->path || ( old_path && !rec->old_path ) )
+	{
+		free(rec->path);
+		free(rec->old_path);
+
+		journal_gap(j);
+		return NULL;
+	}
+
+	rec->seq = ++j->head;
+	rec->storage_id = storage_id;
+	rec->type = type;
+	rec->flags = flags;
+	rec->size = size;
+	rec->date = date;
+
+	j->nb++;
+	j->dirty = 1;
+
+	__atomic_fetch_add(&ctx->stats.journal_records, 1, __ATOMIC_RELAXED);
+
+	return rec;
+}
+
+// Journal lock held.
+static void record_live(mtp_ctx * ctx, mtp_journal * j, int type, int idx, const char * rel, const char * old_rel, const char * full, uint32_t cookie)
+{
+	struct stat64 st;
+	journal_snapshot moved;
+	journal_snapshot * s;
+	journal_record * last;
+	journal_record * rec;
+	uint32_t storage_id;
+	char * path;
+	int flags,pos,known,renamed;
+
+	storage_id = ctx->storages[idx].storage_id;
+
+	s = storage_snapshot(ctx, j, idx);
+
+	// End of an inotify rename : The moved folder content is in j->moved.
+	renamed = type == JOURNAL_ADD && cookie && cookie == j->moved_cookie && idx == j->moved_idx;
+	if( !renamed )
+	{
+		snap_free(&j->moved);
+		j->moved_cookie = 0;
+	}
+
+	memset(&st, 0, sizeof(st));
+
+	flags = 0;
+	if( type == JOURNAL_REMOVE )
+	{
+		if( s && snap_find(s, rel, &pos) && s->entries[pos].isdir )
+			flags = JOURNAL_FLAG_FOLDER;
+	}
+	else
+	{
+		// Already gone : Its removal follows.
+		if( stat64(full, &st) )
+			return;
+
+		if( S_ISDIR(st.st_mode) )
+		{
+			// A folder content change is recorded with the objects changed.
+			if( type == JOURNAL_MODIFY )
+				return;
+
+			flags = JOURNAL_FLAG_FOLDER;
+		}
+	}
+
+	last = journal_last(j);
+	rec = NULL;
+
+	if( type == JOURNAL_ADD && cookie && last && last->type == JOURNAL_REMOVE && last->cookie == cookie && last->storage_id == storage_id &&
+		last->seq > j->served )
+	{
+		// inotify rename (IN_MOVED_FROM, IN_MOVED_TO) : The removal becomes a rename.
+		// (Not if the removal was already returned by GetChanges : An addition follows it)
+		path = strdup(rel);
+		if( path )
+		{
+			last->type = JOURNAL_RENAME;
+			last->old_path = last->path;
+			last->path = path;
+			last->flags = flags;
+			last->size = flags ? 0 : st.st_size;
+			last->date = st.st_mtim.tv_sec;
+			last->cookie = 0;
+			last->seq = ++j->head;
+
+			j->dirty = 1;
+
+			rec = last;
+		}
+	}
+	else
+	{
+		known = s && snap_find(s, rel, &pos) && !s->entries[pos].removed;
+
+		// A file replaced (moved over) is modified.
+		if( type == JOURNAL_ADD && !flags && known )
+			type = JOURNAL_MODIFY;
+
+		if( type == JOURNAL_MODIFY && last && ( last->type == JOURNAL_ADD || last->type == JOURNAL_MODIFY ) &&
+			last->storage_id == storage_id && !strcmp(last->path, rel) )
+		{
+			// Modified again : The last record is moved forward.
+			last->size = st.st_size;
+			last->date = st.st_mtim.tv_sec;
+			last->seq = ++j->head;
+
+			j->dirty = 1;
+
+			rec = last;
+		}
+		else
+		{
+			rec = journal_append(ctx, j, type, storage_id, flags, flags ? 0 : st.st_size, st.st_mtim.tv_sec, rel, old_rel);
+			if( rec )
+				rec->cookie = cookie;
+		}
+	}
+
+	if( !rec || !s )
+		return;
+
+	if( type == JOURNAL_REMOVE )
+	{
+		if( !cookie )
+		{
+			snap_removed(j, s, rel, rec->seq, NULL);
+			return;
+		}
+
+		// May be moved (IN_MOVED_FROM) : Its content is kept until the next record.
+		snap_removed(j, s, rel, rec->seq, &j->moved);
+
+		j->moved_cookie = cookie;
+		j->moved_idx = idx;
+		j->moved_len = strlen(rel);
+		return;
+	}
+
+	if( type == JOURNAL_RENAME && old_rel )
+	{
+		memset(&moved, 0, sizeof(moved));
+
+		snap_removed(j, s, old_rel, rec->seq, &moved);
+		snap_renamed(ctx, s, &moved, strlen(old_rel), rel, &st, rec->seq);
+		return;
+	}
+
+	if( renamed )
+	{
+		snap_renamed(ctx, s, &j->moved, j->moved_len, rel, &st, rec->seq);
+		j->moved_cookie = 0;
+		return;
+	}
+
+	snap_added(ctx, s, rel, &st, rec->seq);
+}
+
+void mtp_journal_record(mtp_ctx * ctx, int type, uint32_t storage_id, char * path, uint32_t cookie)
+{
+	mtp_journal * j;
+	const char * rel;
+	int idx;
+
+	j = __atomic_load_n((mtp_journal **)&ctx->journal, __ATOMIC_ACQUIRE);
+	if( !j || !path )
+		return;
+
+	idx = mtp_get_storage_index_by_id(ctx, storage_id);
+	if( idx < 0 )
+		return;
+
+	rel = relative_path(ctx, storage_id, path);
+	if( !rel || !rel[0] )
+		return;
+
+	pthread_mutex_lock(&j->lock);
+
+	record_live(ctx, j, type, idx, rel, NULL, path, cookie);
+
+	pthread_mutex_unlock(&j->lock);
+}
+
+void mtp_journal_entry(mtp_ctx * ctx, int type, fs_entry * entry, uint32_t cookie)
+{
+	char * path;
+
+	if( !__atomic_load_n(&ctx->journal, __ATOMIC_ACQUIRE) || !entry )
+		return;
+
+	path = build_full_path(ctx->fs_db, mtp_get_storage_root(ctx, entry->storage_id), entry);
+	if( path )
+	{
+		mtp_journal_record(ctx, type, entry->storage_id, path, cookie);
+		free(path);
+	}
+}
+
+void mtp_journal_rename(mtp_ctx * ctx, uint32_t old_storage_id, char * old_path, uint32_t storage_id, char * path)
+{
+	mtp_journal * j;
+	const char * old_rel;
+	const char * rel;
+	int idx;
+
+	j = __atomic_load_n((mtp_journal **)&ctx->journal, __ATOMIC_ACQUIRE);
+	if( !j || !old_path || !path )
+		return;
+
+	if( old_storage_id != storage_id )
+	{
+		mtp_journal_record(ctx, JOURNAL_REMOVE, old_storage_id, old_path, 0);
+		mtp_journal_record(ctx, JOURNAL_ADD, storage_id, path, 0);
+		return;
+	}
+
+	idx = mtp_get_storage_index_by_id(ctx, storage_id);
+	if( idx < 0 )
+		return;
+
+	old_rel = relative_path(ctx, storage_id, old_path);
+	rel = relative_path(ctx, storage_id, path);
+	if( !old_rel || !old_rel[0] || !rel || !rel[0] )
+		return;
+
+	pthread_mutex_lock(&j->lock);
+
+	record_live(ctx, j, JOURNAL_RENAME, idx, rel, old_rel, path, 0);
+
+	pthread_mutex_unlock(&j->lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Storages walks
+
+static int path_set_cmp(const void * a, const void * b)
+{
+	return strcmp( *(char **)a, *(char **)b );
+}
+
+static int ino_cmp(const void * a, const void * b)
+{
+	uint64_t ino_a,ino_b;
+
+	ino_a = (*(snap_entry **)a)->ino;
+	ino_b = (*(snap_entry **)b)->ino;
+
+	return ( ino_a > ino_b ) - ( ino_a < ino_b );
+}
+
+// Is an ancestor folder of path in the (sorted) set ?
+static int has_ancestor(char ** set, int nb, const char * path)
+{
+	char * tmp;
+	char * key;
+	char * p;
+	int found;
+
+	if( !nb )
+		return 0;
+
+	tmp = strdup(path);
+	if( !tmp )
+		return 0;
+
+	found = 0;
+	p = tmp;
+	while( !found && ( p = strchr(p, '/') ) )
+	{
+		*p = '\0';
+
+		key = tmp;
+		found = bsearch(&key, set, nb, sizeof(char *), path_set_cmp) != NULL;
+
+		*p++ = '/';
+	}
+
+	free(tmp);
+
+	return found;
+}
+
+// Has an ancestor folder been changed after the walk start ?
+static int live_ancestor(journal_snapshot * s, const char * path, uint64_t walk_seq)
+{
+	char * tmp;
+	char * p;
+	int found,pos;
+
+	tmp = strdup(path);
+	if( !tmp )
+		return 0;
+
+	found = 0;
+	p = tmp;
+	while( !found && ( p = strchr(p, '/') ) )
+	{
+		*p = '\0';
+
+		found = snap_find(s, tmp, &pos) && s->entries[pos].stamp > walk_seq;
+
+		*p++ = '/';
+	}
+
+	free(tmp);
+
+	return found;
+}
+
+// Path after the renames of its parent folders already recorded.
+static char * renamed_path(char ** old_dirs, char ** new_dirs, int nb, const char * path)
+{
+	size_t len,best_len;
+	char * new_path;
+	int i,best;
+
+	best = -1;
+	best_len = 0;
+	for( i = 0; i < nb; i++ )
+	{
+		len = strlen(old_dirs[i]);
+		if( len > best_len && !strncmp(path, old_dirs[i], len) && path[len] == '/' )
+		{
+			best = i;
+			best_len = len;
+		}
+	}
+
+	if( best < 0 )
+		return strdup(path);
+
+	new_path = malloc(strlen(new_dirs[best]) + strlen(path + best_len) + 1);
+	if( new_path )
+		sprintf(new_path, "%s%s", new_dirs[best], path + best_len);
+
+	return new_path;
+}
+
+// Record the differences between the snapshot and a (sorted) walk, then the walk becomes
+// the snapshot. The entries changed after the walk start are kept from the snapshot.
+static void merge_walk(mtp_ctx * ctx, mtp_journal * j, journal_snapshot * s, uint32_t storage_id, journal_snapshot * w, uint64_t walk_seq)
+{
+	snap_entry ** removes;
+	snap_entry ** adds;
+	snap_entry ** mods;
+	snap_entry ** pairs;
+	snap_entry ** by_ino;
+	char ** dirs;
+	char ** old_dirs;
+	char ** new_dirs;
+	snap_entry * entries;
+	snap_entry * e;
+	snap_entry * a;
+	snap_entry * r;
+	char * old_path;
+	int nb_removes,nb_adds,nb_mods,nb_dirs,nb_renamed,nb_changes;
+	int i,k,n,cmp,lo,hi,max;
+
+	max = s->nb + w->nb + 1;
+
+	removes = malloc(max * sizeof(snap_entry *));
+	adds = malloc(max * sizeof(snap_entry *));
+	mods = malloc(max * sizeof(snap_entry *));
+	pairs = malloc(max * sizeof(snap_entry *));
+	by_ino = malloc(max * sizeof(snap_entry *));
+	dirs = malloc(max * sizeof(char *));
+	old_dirs = malloc(max * sizeof(char *));
+	new_dirs = malloc(max * sizeof(char *));
+	entries = malloc(max * sizeof(snap_entry));
+
+	if( !removes || !adds || !mods || !pairs || !by_ino || !dirs || !old_dirs || !new_dirs || !entries )
+	{
+		PRINT_ERROR("%s : Memory allocation failure !", __func__);
+		journal_gap(j);
+		goto done;
+	}
+
+	nb_removes = 0;
+	nb_adds = 0;
+	nb_mods = 0;
+	nb_changes = 0;
+
+	// Differences
+	i = 0;
+	k = 0;
+	while( i < s->nb || k < w->nb )
+	{
+		if( k >= w->nb )
+			cmp = -1;
+		else if( i >= s->nb )
+			cmp = 1;
+		else
+			cmp = strcmp(s->entries[i].path, w->entries[k].path);
+
+		if( cmp < 0 )
+		{
+			r = &s->entries[i++];
+			if( r->stamp <= walk_seq && !r->removed )
+				removes[nb_removes++] = r;
+		}
+		else if( cmp > 0 )
+		{
+			a = &w->entries[k++];
+			if( live_ancestor(s, a->path, walk_seq) )
+				a->removed = 1;
+			else
+				adds[nb_adds++] = a;
+		}
+		else
+		{
+			r = &s->entries[i++];
+			a = &w->entries[k++];
+
+			if( r->stamp > walk_seq )
+			{
+				a->removed = 1;
+			}
+			else if( r->removed )
+			{
+				adds[nb_adds++] = a;
+			}
+			else if( r->isdir != a->isdir )
+			{
+				removes[nb_removes++] = r;
+				adds[nb_adds++] = a;
+			}
+			else if( !a->isdir && ( r->size != a->size || r->date != a->date || r->date_ns != a->date_ns ) )
+			{
+				mods[nb_mods++] = a;
+			}
+		}
+	}
+
+	// First walk of the storage : Nothing to compare with.
+	if( s->valid )
+	{
+		// Renames : Removed and added objects with the same inode (and the same size and date).
+		memcpy(by_ino, adds, nb_adds * sizeof(snap_entry *));
+		qsort(by_ino, nb_adds, sizeof(snap_entry *), ino_cmp);
+
+		for( i = 0; i < nb_removes; i++ )
+		{
+			r = removes[i];
+			pairs[i] = NULL;
+
+			lo = 0;
+			hi = nb_adds;
+			while( lo < hi )
+			{
+				k = ( lo + hi ) / 2;
+				if( by_ino[k]->ino < r->ino )
+					lo = k + 1;
+				else
+					hi = k;
+			}
+
+			for( k = lo; k < nb_adds && by_ino[k]->ino == r->ino; k++ )
+			{
+				a = by_ino[k];
+				if( a->mark || a->isdir != r->isdir )
+					continue;
+
+				if( !a->isdir && ( a->size != r->size || a->date != r->date ) )
+					continue;
+
+				pairs[i] = a;
+				a->mark = 1;
+				break;
+			}
+		}
+
+		// Removed : The content of a removed folder is not reported.
+		nb_dirs = 0;
+		for( i = 0; i < nb_removes; i++ )
+		{
+			if( !pairs[i] && removes[i]->isdir )
+				dirs[nb_dirs++] = removes[i]->path;
+		}
+
+		for( i = 0; i < nb_removes; i++ )
+		{
+			r = removes[i];
+			if( pairs[i] || has_ancestor(dirs, nb_dirs, r->path) )
+				continue;
+
+			journal_append(ctx, j, JOURNAL_REMOVE, storage_id, r->isdir ? JOURNAL_FLAG_FOLDER : 0, 0, 0, r->path, NULL);
+			nb_changes++;
+		}
+
+		// Renamed : Parent folders first, their content follows them.
+		nb_renamed = 0;
+		for( i = 0; i < nb_removes; i++ )
+		{
+			r = removes[i];
+			a = pairs[i];
+			if( !a )
+				continue;
+
+			// Its previous folder is removed : Added.
+			if( has_ancestor(dirs, nb_dirs, r->path) )
+			{
+				a->mark = 0;
+				continue;
+			}
+
+			old_path = renamed_path(old_dirs, new_dirs, nb_renamed, r->path);
+
+			if( a->isdir )
+			{
+				old_dirs[nb_renamed] = r->path;
+				new_dirs[nb_renamed] = a->path;
+				nb_renamed++;
+			}
+
+			if( !old_path )
+			{
+				journal_gap(j);
+				continue;
+			}
+
+			if( strcmp(old_path, a->path) )
+			{
+				journal_append(ctx, j, JOURNAL_RENAME, storage_id, a->isdir ? JOURNAL_FLAG_FOLDER : 0, a->size, a->date, a->path, old_path);
+				nb_changes++;
+			}
+
+			free(old_path);
+		}
+
+		// Added : The content of an added folder is not reported.
+		nb_dirs = 0;
+		for( i = 0; i < nb_adds; i++ )
+		{
+			a = adds[i];
+			if( a->mark || has_ancestor(dirs, nb_dirs, a->path) )
+				continue;
+
+			if( a->isdir )
+				dirs[nb_dirs++] = a->path;
+
+			journal_append(ctx, j, JOURNAL_ADD, storage_id, a->isdir ? JOURNAL_FLAG_FOLDER : 0, a->size, a->date, a->path, NULL);
+			nb_changes++;
+		}
+
+		for( i = 0; i < nb_mods; i++ )
+		{
+			a = mods[i];
+
+			journal_append(ctx, j, JOURNAL_MODIFY, storage_id, 0, a->size, a->date, a->path, NULL);
+			nb_changes++;
+		}
+
+		if( nb_changes )
+			PRINT_DEBUG("%s : %d changes found on storage 0x%.8X", __func__, nb_changes, storage_id);
+	}
+
+	// New snapshot
+	i = 0;
+	k = 0;
+	n = 0;
+	while( i < s->nb || k < w->nb )
+	{
+		if( k >= w->nb )
+			cmp = -1;
+		else if( i >= s->nb )
+			cmp = 1;
+		else
+			cmp = strcmp(s->entries[i].path, w->entries[k].path);
+
+		e = NULL;
+		if( cmp < 0 )
+		{
+			r = &s->entries[i++];
+			if( r->stamp > walk_seq && !r->removed )
+				e = r;
+		}
+		else if( cmp > 0 )
+		{
+			a = &w->entries[k++];
+			if( !a->removed )
+				e = a;
+		}
+		else
+		{
+			r = &s->entries[i++];
+			a = &w->entries[k++];
+
+			if( r->stamp <= walk_seq )
+				e = a;
+			else if( !r->removed )
+				e = r;
+		}
+
+		if( e )
+		{
+			entries[n] = *e;
+			entries[n].mark = 0;
+			n++;
+
+			e->path = NULL;
+		}
+	}
+
+	snap_free(s);
+
+	s->entries = entries;
+	s->nb = n;
+	s->max = max;
+	s->valid = 1;
+
+	entries = NULL;
+
+	j->dirty = 1;
+
+done:
+	free(removes);
+	free(adds);
+	free(mods);
+	free(pairs);
+	free(by_ino);
+	free(dirs);
+	free(old_dirs);
+	free(new_dirs);
+	free(entries);
+}
+
+// Journal lock held (released during the walk).
+static void walk_storage(mtp_ctx * ctx, mtp_journal * j, int idx)
+{
+	journal_snapshot list;
+	journal_snapshot * s;
+	uint64_t walk_seq;
+	uint32_t storage_id;
+	char * root;
+	int ret;
+
+	if( !ctx->storages[idx].root_path || ( ctx->storages[idx].flags & UMTP_STORAGE_NOTMOUNTED ) )
+		return;
+
+	root = strdup(ctx->storages[idx].root_path);
+	if( !root )
+		return;
+
+	storage_id = ctx->storages[idx].storage_id;
+	walk_seq = j->head;
+	j->walking++;
+
+	pthread_mutex_unlock(&j->lock);
+
+	memset(&list, 0, sizeof(list));
+
+	ret = walk_folder(ctx, &list, root, "", 0, 0);
+	if( !ret )
+		qsort(list.entries, list.nb, sizeof(snap_entry), snap_cmp);
+
+	pthread_mutex_lock(&j->lock);
+
+	j->walking--;
+
+	// Storage removed or replaced during the walk : Dropped.
+	s = storage_snapshot(ctx, j, idx);
+	if( !ret && s && !strcmp(s->root, root) )
+		merge_walk(ctx, j, s, storage_id, &list, walk_seq);
+
+	snap_free(&list);
+	free(root);
+
+	__atomic_fetch_add(&ctx->stats.journal_walks, 1, __ATOMIC_RELAXED);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Journal file
+
+static int file_write(FILE * f, const void * data, size_t size)
+{
+	if( !size )
+		return 0;
+
+	return fwrite(data, size, 1, f) == 1 ? 0 : -1;
+}
+
+static int file_write_string(FILE * f, const char * str)
+{
+	uint32_t len;
+
+	len = str ? strlen(str) : 0;
+
+	if( file_write(f, &len, sizeof(len)) )
+		return -1;
+
+	return file_write(f, str, len);
+}
+
+static int file_read(FILE * f, void * data, size_t size)
+{
+	if( !size )
+		return 0;
+
+	return fread(data, size, 1, f) == 1 ? 0 : -1;
+}
+
+// Returns NULL for an empty string, *err is set on error.
+static char * file_read_string(FILE * f, int * err)
+{
+	uint32_t len;
+	char * str;
+
+	if( file_read(f, &len, sizeof(len)) || len > JOURNAL_MAX_STRING )
+	{
+		*err = 1;
+		return NULL;
+	}
+
+	if( !len )
+		return NULL;
+
+	str = malloc(len + 1);
+	if( !str || file_read(f, str, len) )
+	{
+		free(str);
+		*err = 1;
+		return NULL;
+	}
+
+	str[len] = '\0';
+
+	return str;
+}
+
+// Journal lock held.
+static int journal_save(mtp_ctx * ctx, mtp_journal * j)
+{
+	journal_record * rec;
+	snap_entry * e;
+	char magic[8];
+	char * tmp_path;
+	uint32_t val;
+	FILE * f;
+	int i,k,err;
+
+	if( !ctx->change_journal_file[0] || !j->dirty )
+		return 0;
+
+	tmp_path = malloc(strlen(ctx->change_journal_file) + 5);
+	if( !tmp_path )
+		return -1;
+
+	sprintf(tmp_path, "%s.tmp", ctx->change_journal_file);
+
+	f = fopen(tmp_path, "wb");
+	if( !f )
+	{
+		PRINT_ERROR("%s : Can't create %s !", __func__, tmp_path);
+		free(tmp_path);
+		return -1;
+	}
+
+	memset(magic, 0, sizeof(magic));
+	strcpy(magic, JOURNAL_FILE_MAGIC);
+
+	val = JOURNAL_FILE_VERSION;
+
+	err = file_write(f, magic, sizeof(magic));
+	err |= file_write(f, &val, sizeof(val));
+	err |= file_write(f, &j->head, sizeof(j->head));
+	err |= file_write(f, &j->base, sizeof(j->base));
+
+	val = j->nb_holes;
+	err |= file_write(f, &val, sizeof(val));
+	err |= file_write(f, j->holes, j->nb_holes * sizeof(j->holes[0]));
+
+	// Snapshots
+	val = 0;
+	for( i = 0; i < MAX_STORAGE_NB; i++ )
+	{
+		if( j->snap[i].root )
+			val++;
+	}
+
+	err |= file_write(f, &val, sizeof(val));
+
+	for( i = 0; i < MAX_STORAGE_NB && !err; i++ )
+	{
+		if( !j->snap[i].root )
+			continue;
+
+		val = ctx->storages[i].storage_id;
+		err |= file_write(f, &val, sizeof(val));
+		err |= file_write_string(f, j->snap[i].root);
+
+		val = j->snap[i].valid;
+		err |= file_write(f, &val, sizeof(val));
+
+		val = 0;
+		for( k = 0; k < j->snap[i].nb; k++ )
+		{
+			if( !j->snap[i].entries[k].removed )
+				val++;
+		}
+
+		err |= file_write(f, &val, sizeof(val));
+
+		for( k = 0; k < j->snap[i].nb && !err; k++ )
+		{
+			e = &j->snap[i].entries[k];
+			if( e->removed )
+				continue;
+
+			err |= file_write(f, &e->ino, sizeof(e->ino));
+			err |= file_write(f, &e->size, sizeof(e->size));
+			err |= file_write(f, &e->date, sizeof(e->date));
+			err |= file_write(f, &e->date_ns, sizeof(e->date_ns));
+
+			val = e->isdir;
+			err |= file_write(f, &val, sizeof(val));
+			err |= file_write_string(f, e->path);
+		}
+	}
+
+	// Records
+	val = j->nb;
+	err |= file_write(f, &val, sizeof(val));
+
+	for( i = 0; i < j->nb && !err; i++ )
+	{
+		rec = &j->records[( j->first + i ) % CONFIG_JOURNAL_SIZE];
+
+		err |= file_write(f, &rec->seq, sizeof(rec->seq));
+		err |= file_write(f, &rec->storage_id, sizeof(rec->storage_id));
+		err |= file_write(f, &rec->type, sizeof(rec->type));
+		err |= file_write(f, &rec->flags, sizeof(rec->flags));
+		err |= file_write(f, &rec->size, sizeof(rec->size));
+		err |= file_write(f, &rec->date, sizeof(rec->date));
+		err |= file_write_string(f, rec->path);
+		err |= file_write_string(f, rec->old_path);
+	}
+
+	if( fflush(f) || fsync(fileno(f)) )
+		err = 1;
+
+	if( fclose(f) )
+		err = 1;
+
+	if( err || rename(tmp_path, ctx->change_journal_file) )
+	{
+		PRINT_ERROR("%s : Can't write %s !", __func__, ctx->change_journal_file);
+
+		remove(tmp_path);
+		free(tmp_path);
+
+		return -1;
+	}
+
+	free(tmp_path);
+
+	j->dirty = 0;
+
+	PRINT_DEBUG("%s : %d records saved (token 0x%.16"PRIX64")", __func__, j->nb, j->head);
+
+	return 0;
+}
+
+static int journal_load(mtp_ctx * ctx, mtp_journal * j)
+{
+	journal_snapshot * s;
+	journal_record * rec;
+	journal_record tmp_rec;
+	snap_entry tmp_entry;
+	snap_entry * e;
+	uint32_t ids[MAX_STORAGE_NB][2];
+	uint32_t nb_ids;
+	char magic[8];
+	char * root;
+	char * path;
+	uint32_t val,nb,valid,storage_id,isdir;
+	FILE * f;
+	int i,k,idx,err;
+
+	f = fopen(ctx->change_journal_file, "rb");
+	if( !f )
+		return -1;
+
+	err = file_read(f, magic, sizeof(magic));
+	err |= file_read(f, &val, sizeof(val));
+
+	if( err || memcmp(magic, JOURNAL_FILE_MAGIC, sizeof(JOURNAL_FILE_MAGIC)) || val != JOURNAL_FILE_VERSION )
+	{
+		PRINT_WARN("%s : %s is not a valid journal file", __func__, ctx->change_journal_file);
+		fclose(f);
+		return -1;
+	}
+
+	err |= file_read(f, &j->head, sizeof(j->head));
+	err |= file_read(f, &j->base, sizeof(j->base));
+	err |= file_read(f, &val, sizeof(val));
+
+	if( err || val > JOURNAL_MAX_HOLES )
+		goto error;
+
+	j->nb_holes = val;
+	err |= file_read(f, j->holes, j->nb_holes * sizeof(j->holes[0]));
+
+	// Snapshots : The storages are found by their root path.
+	nb_ids = 0;
+
+	err |= file_read(f, &nb, sizeof(nb));
+	for( i = 0; i < (int)nb && !err; i++ )
+	{
+		err |= file_read(f, &storage_id, sizeof(storage_id));
+
+		root = file_read_string(f, &err);
+
+		err |= file_read(f, &valid, sizeof(valid));
+		err |= file_read(f, &val, sizeof(val));
+
+		s = NULL;
+		if( !err && root )
+		{
+			for( idx = 0; idx < MAX_STORAGE_NB; idx++ )
+			{
+				if( ctx->storages[idx].root_path && !j->snap[idx].root && !strcmp(ctx->storages[idx].root_path, root) )
+				{
+					s = &j->snap[idx];
+					s->root = root;
+					s->valid = valid;
+					root = NULL;
+
+					if( nb_ids < MAX_STORAGE_NB )
+					{
+						ids[nb_ids][0] = storage_id;
+						ids[nb_ids][1] = ctx->storages[idx].storage_id;
+						nb_ids++;
+					}
+					break;
+				}
+			}
+		}
+
+		free(root);
+
+		for( k = 0; k < (int)val && !err; k++ )
+		{
+			memset(&tmp_entry, 0, sizeof(tmp_entry));
+
+			err |= file_read(f, &tmp_entry.ino, sizeof(tmp_entry.ino));
+			err |= file_read(f, &tmp_entry.size, sizeof(tmp_entry.size));
+			err |= file_read(f, &tmp_entry.date, sizeof(tmp_entry.date));
+			err |= file_read(f, &tmp_entry.date_ns, sizeof(tmp_entry.date_ns));
+			err |= file_read(f, &isdir, sizeof(isdir));
+			tmp_entry.isdir = isdir ? 1 : 0;
+
+			path = file_read_string(f, &err);
+			if( !path )
+				err = 1;
+
+			// Storage not configured anymore : Skipped.
+			if( !err && s )
+			{
+				e = snap_append(s, path, NULL, 0);
+				if( e )
+				{
+					tmp_entry.path = e->path;
+					*e = tmp_entry;
+				}
+				else
+				{
+					err = 1;
+				}
+			}
+
+			free(path);
+		}
+
+		if( s && !err )
+			qsort(s->entries, s->nb, sizeof(snap_entry), snap_cmp);
+	}
+
+	// Records
+	err |= file_read(f, &nb, sizeof(nb));
+	for( i = 0; i < (int)nb && !err; i++ )
+	{
+		memset(&tmp_rec, 0, sizeof(tmp_rec));
+
+		err |= file_read(f, &tmp_rec.seq, sizeof(tmp_rec.seq));
+		err |= file_read(f, &tmp_rec.storage_id, sizeof(tmp_rec.storage_id));
+		err |= file_read(f, &tmp_rec.type, sizeof(tmp_rec.type));
+		err |= file_read(f, &tmp_rec.flags, sizeof(tmp_rec.flags));
+		err |= file_read(f, &tmp_rec.size, sizeof(tmp_rec.size));
+		err |= file_read(f, &tmp_rec.date, sizeof(tmp_rec.date));
+		tmp_rec.path = file_read_string(f, &err);
+		tmp_rec.old_path = file_read_string(f, &err);
+
+		for( k = 0; k < (int)nb_ids; k++ )
+		{
+			if( ids[k][0] == tmp_rec.storage_id )
+				break;
+		}
+
+		if( err || !tmp_rec.path || k == (int)nb_ids )
+		{
+			free(tmp_rec.path);
+			free(tmp_rec.old_path);
+			continue;
+		}
+
+		tmp_rec.storage_id = ids[k][1];
+
+		if( j->nb == CONFIG_JOURNAL_SIZE )
+		{
+			rec = &j->records[j->first];
+
+			j->base = rec->seq;
+
+			free(rec->path);
+			free(rec->old_path);
+
+			j->first = ( j->first + 1 ) % CONFIG_JOURNAL_SIZE;
+			j->nb--;
+		}
+
+		j->records[( j->first + j->nb ) % CONFIG_JOURNAL_SIZE] = tmp_rec;
+		j->nb++;
+	}
+
+	if( err )
+		goto error;
+
+	fclose(f);
+
+	return 0;
+
+error:
+	PRINT_WARN("%s : %s is corrupted", __func__, ctx->change_journal_file);
+
+	fclose(f);
+
+	return -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Walker thread
+
+static void * journal_thread(void * arg)
+{
+	mtp_ctx * ctx;
+	mtp_journal * j;
+	int idx;
+
+	ctx = (mtp_ctx *)arg;
+	j = (mtp_journal *)ctx->journal;
+
+	prctl(PR_SET_NAME, (unsigned long) __func__);
+
+	// Low priority : The MTP transfers first.
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#ifdef SYS_ioprio_set
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, syscall(SYS_gettid), IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+#endif
+
+	pthread_mutex_lock( &j->lock );
+
+	while( !j->stop )
+	{
+		if( !j->walk_req )
+		{
+			pthread_cond_wait( &j->cond, &j->lock );
+			continue;
+		}
+
+		for( idx = 0; idx < MAX_STORAGE_NB && !j->stop; idx++ )
+		{
+			if( !( j->walk_req & ( 1 << idx ) ) )
+				continue;
+
+			// Cleared before the walk : A new request during the walk runs it again.
+			j->walk_req &= ~( 1 << idx );
+
+			walk_storage(ctx, j, idx);
+		}
+
+		if( !j->walk_req )
+			journal_save(ctx, j);
+	}
+
+	pthread_mutex_unlock( &j->lock );
+
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Init
+
+// New history : Random tokens range, the tokens of another journal are expired.
+static void journal_fresh(mtp_journal * j)
+{
+	uint32_t rnd;
+	int fd,ok;
+
+	ok = 0;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if( fd >= 0 )
+	{
+		ok = read(fd, &rnd, sizeof(rnd)) == sizeof(rnd);
+		close(fd);
+	}
+
+	if( !ok )
+		rnd = time(NULL) ^ getpid();
+
+	j->head = (uint64_t)rnd << 32;
+	j->base = j->head;
+	j->nb_holes = 0;
+	j->dirty = 1;
+}
+
+static void journal_clear(mtp_journal * j)
+{
+	int i;
+
+	for( i = 0; i < j->nb; i++ )
+	{
+		free(j->records[( j->first + i ) % CONFIG_JOURNAL_SIZE].path);
+		free(j->records[( j->first + i ) % CONFIG_JOURNAL_SIZE].old_path);
+	}
+
+	j->first = 0;
+	j->nb = 0;
+
+	for( i = 0; i < MAX_STORAGE_NB; i++ )
+	{
+		snap_free(&j->snap[i]);
+		free(j->snap[i].root);
+
+		j->snap[i].root = NULL;
+		j->snap[i].valid = 0;
+	}
+
+	snap_free(&j->moved);
+	j->moved_cookie = 0;
+}
+
+static mtp_journal * journal_init(mtp_ctx * ctx)
+{
+	mtp_journal * j;
+	int i;
+
+	j = __atomic_load_n((mtp_journal **)&ctx->journal, __ATOMIC_ACQUIRE);
+	if( j || !ctx->change_journal )
+		return j;
+
+	j = malloc(sizeof(mtp_journal));
+	if( !j )
+		return NULL;
+
+	memset(j, 0, sizeof(mtp_journal));
+
+	if( pthread_mutex_init( &j->lock, NULL ) || pthread_cond_init( &j->cond, NULL ) )
+	{
+		free(j);
+		return NULL;
+	}
+
+	if( ctx->change_journal_file[0] && !journal_load(ctx, j) )
+	{
+		// The changes since the last save are lost : Their tokens expire.
+		if( j->nb_holes == JOURNAL_MAX_HOLES )
+		{
+			if( j->base < j->holes[0][1] )
+				j->base = j->holes[0][1];
+
+			memmove(&j->holes[0], &j->holes[1], ( JOURNAL_MAX_HOLES - 1 ) * sizeof(j->holes[0]));
+			j->nb_holes--;
+		}
+
+		j->holes[j->nb_holes][0] = j->head;
+		j->holes[j->nb_holes][1] = j->head + 0x100000000ULL;
+		j->nb_holes++;
+
+		j->head += 0x100000000ULL;
+
+		// Holes before the oldest token : Not needed anymore.
+		while( j->nb_holes && j->holes[0][1] <= j->base )
+		{
+			memmove(&j->holes[0], &j->holes[1], ( j->nb_holes - 1 ) * sizeof(j->holes[0]));
+			j->nb_holes--;
+		}
+
+		j->dirty = 1;
+
+		PRINT_MSG("Change journal : %d records loaded from %s", j->nb, ctx->change_journal_file);
+	}
+	else
+	{
+		journal_clear(j);
+		journal_fresh(j);
+	}
+
+	for( i = 0; i < MAX_STORAGE_NB; i++ )
+		storage_snapshot(ctx, j, i);
+
+	__atomic_store_n((mtp_journal **)&ctx->journal, j, __ATOMIC_RELEASE);
+
+	if( pthread_create( &j->thread, NULL, journal_thread, ctx ) )
+	{
+		PRINT_ERROR("%s : journal thread creation failed !", __func__);
+	}
+	else
+	{
+		j->thread_started = 1;
+	}
+
+	return j;
+}
+
+void mtp_journal_session_open(mtp_ctx * ctx)
+{
+	mtp_journal * j;
+	int i;
+
+	j = journal_init(ctx);
+	if( !j )
+		return;
+
+	// Changes made without session : Found by the storages walks.
+	pthread_mutex_lock( &j->lock );
+
+	for( i = 0; i < MAX_STORAGE_NB; i++ )
+	{
+		if( ctx->storages[i].root_path )
+			j->walk_req |= 1 << i;
+	}
+
+	pthread_cond_signal( &j->cond );
+
+	pthread_mutex_unlock( &j->lock );
+}
+
+// Changes possibly missed (inotify overflow, archive unpacked...) : Storage walked again.
+void mtp_journal_rescan(mtp_ctx * ctx, uint32_t storage_id)
+{
+	mtp_journal * j;
+	int idx;
+
+	j = __atomic_load_n((mtp_journal **)&ctx->journal, __ATOMIC_ACQUIRE);
+	if( !j )
+		return;
+
+	idx = mtp_get_storage_index_by_id(ctx, storage_id);
+	if( idx < 0 )
+		return;
+
+	pthread_mutex_lock( &j->lock );
+
+	j->walk_req |= 1 << idx;
+
+	pthread_cond_signal( &j->cond );
+
+	pthread_mutex_unlock( &j->lock );
+}
+
+void mtp_journal_save(mtp_ctx * ctx)
+{
+	mtp_journal * j;
+
+	j = __atomic_load_n((mtp_journal **)&ctx->journal, __ATOMIC_ACQUIRE);
+	if( !j )
+		return;
+
+	pthread_mutex_lock( &j->lock );
+
+	journal_save(ctx, j);
+
+	pthread_mutex_unlock( &j->lock );
+}
+
+void mtp_journal_deinit(mtp_ctx * ctx)
+{
+	mtp_journal * j;
+
+	j = (mtp_journal *)ctx->journal;
+	if( !j )
+		return;
+
+	pthread_mutex_lock( &j->lock );
+	j->stop = 1;
+	pthread_cond_broadcast( &j->cond );
+	pthread_mutex_unlock( &j->lock );
+
+	if( j->thread_started )
+		pthread_join( j->thread, NULL );
+
+	journal_save(ctx, j);
+
+	ctx->journal = NULL;
+
+	journal_clear(j);
+
+	pthread_mutex_destroy( &j->lock );
+	pthread_cond_destroy( &j->cond );
+
+	free( j );
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetChanges
+
+static int token_valid(mtp_journal * j, uint64_t token)
+{
+	int i;
+
+	if( token < j->base || token > j->head )
+		return 0;
+
+	for( i = 0; i < j->nb_holes; i++ )
+	{
+		if( token > j->holes[i][0] && token < j->holes[i][1] )
+			return 0;
+	}
+
+	return 1;
+}
+
+// Changes after a token. storage_id : 0x00000000 or 0xFFFFFFFF for all the storages.
+uint32_t mtp_journal_get_changes(mtp_ctx * ctx, uint64_t token, uint32_t storage_id, mtp_journal_changes * changes)
+{
+	journal_record * rec;
+	journal_record * dst;
+	mtp_journal * j;
+	uint32_t response_code;
+	int i;
+
+	memset(changes, 0, sizeof(mtp_journal_changes));
+
+	j = __atomic_load_n((mtp_journal **)&ctx->journal, __ATOMIC_ACQUIRE);
+	if( !j )
+		return MTP_RESPONSE_OPERATION_NOT_SUPPORTED;
+
+	if( storage_id == 0xFFFFFFFF )
+		storage_id = 0x00000000;
+
+	if( storage_id && mtp_get_storage_index_by_id(ctx, storage_id) < 0 )
+		return MTP_RESPONSE_INVALID_STORAGE_ID;
+
+	changes->records = malloc(CONFIG_JOURNAL_MAX_CHANGES * sizeof(journal_record));
+	if( !changes->records )
+		return MTP_RESPONSE_GENERAL_ERROR;
+
+	pthread_mutex_lock( &j->lock );
+
+	response_code = MTP_RESPONSE_OK;
+
+	changes->token = j->head;
+
+	if( j->walk_req || j->walking )
+	{
+		// Storages walks running : The changes found are not recorded yet.
+		response_code = MTP_RESPONSE_DEVICE_BUSY;
+	}
+	else if( !token_valid(j, token) )
+	{
+		__atomic_fetch_add(&ctx->stats.journal_expired, 1, __ATOMIC_RELAXED);
+
+		PRINT_DEBUG("%s : token 0x%.16"PRIX64" expired (0x%.16"PRIX64" - 0x%.16"PRIX64")", __func__, token, j->base, j->head);
+
+		response_code = MTP_RESPONSE_CHANGES_TOKEN_EXPIRED;
+	}
+	else
+	{
+		for( i = 0; i < j->nb; i++ )
+		{
+			rec = &j->records[( j->first + i ) % CONFIG_JOURNAL_SIZE];
+
+			// Sorted : Only the last record can be moved forward.
+			if( rec->seq <= token || ( storage_id && rec->storage_id != storage_id ) )
+				continue;
+
+			if( changes->nb == CONFIG_JOURNAL_MAX_CHANGES )
+			{
+				changes->more = 1;
+				break;
+			}
+
+			dst = &changes->records[changes->nb];
+
+			*dst = *rec;
+			dst->path = strdup(rec->path);
+			dst->old_path = NULL;
+			if( rec->old_path )
+				dst->old_path = strdup(rec->old_path);
+
+			if( !dst->path || ( rec->old_path && !dst->old_path ) )
+			{
+				free(dst->path);
+				free(dst->old_path);
+
+				response_code = MTP_RESPONSE_GENERAL_ERROR;
+				break;
+			}
+
+			changes->nb++;
+		}
+	}
+
+	// A returned removal can't become a rename anymore.
+	if( changes->nb && changes->records[changes->nb - 1].seq > j->served )
+		j->served = changes->records[changes->nb - 1].seq;
+
+	pthread_mutex_unlock( &j->lock );
+
+	// Partial answer : The next call starts after the last change returned.
+	if( response_code == MTP_RESPONSE_OK && changes->more )
+		changes->token = changes->records[changes->nb - 1].seq;
+
+	return response_code;
+}
+
+static int put64(mtp_dataset_writer * dsw, uint64_t data)
+{
+	if( dataset_writer_put32(dsw, data & 0xFFFFFFFF) < 0 )
+		return -1;
+
+	return dataset_writer_put32(dsw, data >> 32);
+}
+
+// UTF-8 path : Its size (UINT32) then the bytes, without terminator.
+static int put_path(mtp_dataset_writer * dsw, char * path)
+{
+	uint32_t len;
+
+	len = path ? strlen(path) : 0;
+
+	if( dataset_writer_put32(dsw, len) < 0 )
+		return -1;
+
+	return dataset_writer_put_data(dsw, path, len);
+}
+
+int mtp_journal_changes_dataset(mtp_dataset_writer * dsw, mtp_journal_changes * changes)
+{
+	journal_record * rec;
+	int i;
+
+	if( dataset_writer_put32(dsw, changes->nb) < 0 )
+		return -1;
+
+	for( i = 0; i < changes->nb; i++ )
+	{
+		rec = &changes->records[i];
+
+		if( put64(dsw, rec->seq) < 0 ||
+			dataset_writer_put32(dsw, rec->type | ( (uint32_t)rec->flags << 16 )) < 0 ||
+			dataset_writer_put32(dsw, rec->storage_id) < 0 ||
+			put64(dsw, rec->size) < 0 ||
+			put64(dsw, rec->date) < 0 ||
+			put_path(dsw, rec->path) < 0 ||
+			put_path(dsw, rec->old_path) < 0 )
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void mtp_journal_free_changes(mtp_journal_changes * changes)
+{
+	int i;
+
+	if( changes->records )
+	{
+		for( i = 0; i < changes->nb; i++ )
+		{
+			free(changes->records[i].path);
+			free(changes->records[i].old_path);
+		}
+
+		free(changes->records);
+	}
+
+	memset(changes, 0, sizeof(mtp_journal_changes));
+}
@@ -0,0 +1,1445 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/**
+ * @file   mtp_media.c
+ * @brief  Media files metadata indexer.
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+// The audio tags (ID3, Vorbis comments, MP4 atoms), the duration and the images /
+// videos size are read from the files headers and attached to their objects entries.
+// The media files of the folders listed by the host are queued to low priority
+// workers : The metadata are usually indexed when the host requests them.
+// Else they are read on demand. An indexed entry is refreshed when the object
+// size or modification date changes.
+
+#include "buildconf.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "mtp.h"
+#include "mtp_constant.h"
+#include "mtp_media.h"
+#include "mtp_properties.h"
+
+#include "logs_out.h"
+
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_WHO_PROCESS  1
+
+typedef struct media_job_
+{
+	uint32_t handle;
+	uint32_t storage_id;
+	int notify;          // Metadata sent as missing : Notify the host once indexed
+}media_job;
+
+typedef struct mtp_media_pool_
+{
+	pthread_t threads[CONFIG_MEDIA_MAX_WORKERS];
+	int nb_threads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t idle_cond;
+
+	media_job queue[CONFIG_MEDIA_QUEUE_SIZE];
+	int first;
+	int nb_jobs;
+	int busy;
+
+	int stop;
+}mtp_media_pool;
+
+// Metadata being parsed
+typedef struct media_tags_
+{
+	char str[MEDIA_STR_NB][CONFIG_MEDIA_MAX_STRING];
+
+	uint16_t track;
+	uint32_t duration;
+	uint32_t width;
+	uint32_t height;
+}media_tags;
+
+typedef struct media_extension_
+{
+	const char * ext;
+	uint16_t format;
+}media_extension;
+
+static const media_extension media_extensions[] =
+{
+	{ "mp3",  MTP_FORMAT_MP3 },
+	{ "flac", MTP_FORMAT_FLAC },
+	{ "ogg",  MTP_FORMAT_OGG },
+	{ "oga",  MTP_FORMAT_OGG },
+	{ "opus", MTP_FORMAT_OGG },
+	{ "mp4",  MTP_FORMAT_MP4_CONTAINER },
+	{ "m4a",  MTP_FORMAT_MP4_CONTAINER },
+	{ "m4v",  MTP_FORMAT_MP4_CONTAINER },
+	{ "jpg",  MTP_FORMAT_EXIF_JPEG },
+	{ "jpeg", MTP_FORMAT_EXIF_JPEG },
+	{ "jpe",  MTP_FORMAT_EXIF_JPEG },
+	{ NULL,   MTP_FORMAT_UNDEFINED }
+};
+
+uint16_t mtp_media_format(fs_entry * entry)
+{
+	char * ext;
+	int i;
+
+	if( entry->flags & ENTRY_IS_DIR )
+		return MTP_FORMAT_ASSOCIATION;
+
+	ext = strrchr(entry->name, '.');
+	if( !ext )
+		return MTP_FORMAT_UNDEFINED;
+
+	i = 0;
+	while( media_extensions[i].ext )
+	{
+		if( !strcasecmp(ext + 1, media_extensions[i].ext) )
+			return media_extensions[i].format;
+		i++;
+	}
+
+	return MTP_FORMAT_UNDEFINED;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Parsers helpers
+
+static uint32_t be16(unsigned char * p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t be32(unsigned char * p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint64_t be64(unsigned char * p)
+{
+	return ((uint64_t)be32(p) << 32) | be32(p + 4);
+}
+
+static uint32_t le16(unsigned char * p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t le32(unsigned char * p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t le64(unsigned char * p)
+{
+	return le32(p) | ((uint64_t)le32(p + 4) << 32);
+}
+
+static int read_at(int fd, void * buffer, int size, off64_t ofs)
+{
+	if( ofs < 0 || pread64(fd, buffer, size, ofs) != size )
+		return -1;
+
+	return 0;
+}
+
+// Append an unicode character to an UTF-8 string.
+static int put_utf8(char * str, int ofs, int maxsize, uint32_t c)
+{
+	if( c < 0x80 )
+	{
+		if( ofs + 1 >= maxsize )
+			return -1;
+		str[ofs++] = c;
+	}
+	else if( c < 0x800 )
+	{
+		if( ofs + 2 >= maxsize )
+			return -1;
+		str[ofs++] = 0xC0 | (c >> 6);
+		str[ofs++] = 0x80 | (c & 0x3F);
+	}
+	else
+	{
+		if( ofs + 3 >= maxsize )
+			return -1;
+		str[ofs++] = 0xE0 | (c >> 12);
+		str[ofs++] = 0x80 | ((c >> 6) & 0x3F);
+		str[ofs++] = 0x80 | (c & 0x3F);
+	}
+
+	return ofs;
+}
+
+// Set a tag string (UTF-8 or latin-1 source). The first value only is kept.
+static void set_str(media_tags * tags, int str_id, unsigned char * src, int size, int latin1)
+{
+	char * dst;
+	int i,ofs,ret;
+
+	dst = tags->str[str_id];
+	if( dst[0] )
+		return;
+
+	ofs = 0;
+	for( i = 0; i < size && src[i]; i++ )
+	{
+		if( latin1 || src[i] < 0x80 )
+		{
+			ret = put_utf8(dst, ofs, CONFIG_MEDIA_MAX_STRING, src[i]);
+		}
+		else
+		{
+			// Copy the whole UTF-8 sequence or nothing.
+			ret = ofs;
+			do
+			{
+				if( ret + 1 >= CONFIG_MEDIA_MAX_STRING )
+				{
+					ret = -1;
+					break;
+				}
+				dst[ret++] = src[i++];
+			}while( i < size && ( src[i] & 0xC0 ) == 0x80 );
+			i--;
+		}
+
+		if( ret < 0 )
+			break;
+
+		ofs = ret;
+	}
+
+	// Trailing spaces (ID3v1 fields padding)
+	while( ofs && dst[ofs - 1] == ' ' )
+		ofs--;
+
+	dst[ofs] = 0;
+}
+
+static void set_str_utf16(media_tags * tags, int str_id, unsigned char * src, int size, int big_endian)
+{
+	char * dst;
+	uint32_t c;
+	int i,ofs;
+
+	dst = tags->str[str_id];
+	if( dst[0] )
+		return;
+
+	ofs = 0;
+	for( i = 0; i + 1 < size; i += 2 )
+	{
+		c = big_endian ? be16(&src[i]) : le16(&src[i]);
+		if( !c )
+			break;
+
+		// Surrogate pairs : Outside of the MTP strings (UCS-2) range.
+		if( c >= 0xD800 && c <= 0xDFFF )
+			c = '?';
+
+		ofs = put_utf8(dst, ofs, CONFIG_MEDIA_MAX_STRING, c);
+		if( ofs < 0 )
+		{
+			ofs = 0;
+			break;
+		}
+		dst[ofs] = 0;
+	}
+}
+
+// "2004", "2004-05-06", "2004:05:06 07:08:09"... to a MTP date string.
+static void set_date(media_tags * tags, char * date, int size)
+{
+	int val[6] = { 0, 1, 1, 0, 0, 0 };
+	int i,nb;
+	char * ptr;
+
+	if( tags->str[MEDIA_STR_DATE][0] || size < 4 )
+		return;
+
+	ptr = date;
+	for( nb = 0; nb < 6 && ptr < date + size; nb++ )
+	{
+		if( *ptr < '0' || *ptr > '9' )
+			break;
+
+		val[nb] = 0;
+		for( i = 0; ptr < date + size && *ptr >= '0' && *ptr <= '9' && i < 4; i++ )
+			val[nb] = val[nb] * 10 + ( *ptr++ - '0' );
+
+		if( ptr < date + size && ( *ptr == '-' || *ptr == ':' || *ptr == ' ' || *ptr == 'T' ) )
+			ptr++;
+	}
+
+	if( !nb || val[0] < 1000 || !val[1] || !val[2] )
+		return;
+
+	snprintf(tags->str[MEDIA_STR_DATE], CONFIG_MEDIA_MAX_STRING, "%.4d%.2d%.2dT%.2d%.2d%.2d",
+				val[0], val[1] % 100, val[2] % 100, val[3] % 100, val[4] % 100, val[5] % 100);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MP3 : ID3v2 / ID3v1 tags, duration from the Xing / VBRI header or the bitrate
+
+static const uint16_t mp3_bitrates[2][16] =
+{
+	{ 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 },   // MPEG 1 Layer III
+	{ 0,  8, 16, 24, 32, 40, 48, 56,  64,  80,  96, 112, 128, 144, 160, 0 }    // MPEG 2 / 2.5 Layer III
+};
+
+static const uint32_t mp3_samplerates[3] = { 44100, 48000, 32000 };
+
+static uint32_t syncsafe32(unsigned char * p)
+{
+	return ((p[0] & 0x7F) << 21) | ((p[1] & 0x7F) << 14) | ((p[2] & 0x7F) << 7) | (p[3] & 0x7F);
+}
+
+static void id3v2_text_frame(media_tags * tags, int str_id, unsigned char * data, int size)
+{
+	char tmp[16];
+
+	if( size < 2 )
+		return;
+
+	switch( data[0] )
+	{
+		case 0x00: // ISO-8859-1
+			if( str_id == MEDIA_STR_NB )
+			{
+				// Track number ("3" or "3/12")
+				snprintf(tmp, sizeof(tmp), "%.*s", size - 1 < 15 ? size - 1 : 15, (char*)&data[1]);
+				tags->track = atoi(tmp);
+			}
+			else if( str_id == MEDIA_STR_DATE )
+				set_date(tags, (char*)&data[1], size - 1);
+			else
+				set_str(tags, str_id, &data[1], size - 1, 1);
+		break;
+
+		case 0x01: // UTF-16 with BOM
+			if( size >= 3 )
+				set_str_utf16(tags, str_id < MEDIA_STR_NB ? str_id : MEDIA_STR_NB - 1, &data[3], size - 3, data[1] == 0xFE);
+		break;
+
+		case 0x02: // UTF-16BE
+			set_str_utf16(tags, str_id < MEDIA_STR_NB ? str_id : MEDIA_STR_NB - 1, &data[1], size - 1, 1);
+		break;
+
+		case 0x03: // UTF-8
+			if( str_id == MEDIA_STR_NB )
+			{
+				snprintf(tmp, sizeof(tmp), "%.*s", size - 1 < 15 ? size - 1 : 15, (char*)&data[1]);
+				tags->track = atoi(tmp);
+			}
+			else if( str_id == MEDIA_STR_DATE )
+				set_date(tags, (char*)&data[1], size - 1);
+			else
+				set_str(tags, str_id, &data[1], size - 1, 0);
+		break;
+	}
+}
+
+// Return the ID3v2 tag size (0 : no tag).
+static uint32_t parse_id3v2(int fd, media_tags * tags)
+{
+	static const char * frame_ids[][2] =
+	{
+		{ "TIT2", "TT2" }, { "TPE1", "TP1" }, { "TALB", "TAL" }, { "TCON", "TCO" },
+		{ "TDRC", "TYE" }, { "TRCK", "TRK" }
+	};
+	unsigned char hdr[10];
+	unsigned char data[CONFIG_MEDIA_MAX_STRING * 2 + 3];
+	uint32_t tag_size,frame_size,ofs;
+	int version,hdr_size,i,str_id,size;
+
+	if( read_at(fd, hdr, 10, 0) || memcmp(hdr, "ID3", 3) )
+		return 0;
+
+	version = hdr[3];
+	tag_size = syncsafe32(&hdr[6]) + 10;
+	if( hdr[5] & 0x10 )
+		tag_size += 10; // Footer
+
+	if( version < 2 || version > 4 )
+		return tag_size;
+
+	hdr_size = version == 2 ? 6 : 10;
+
+	ofs = 10;
+	if( ( hdr[5] & 0x40 ) && version > 2 )
+	{
+		// Extended header
+		if( read_at(fd, data, 4, ofs) )
+			return tag_size;
+
+		ofs += version == 4 ? syncsafe32(data) : be32(data) + 4;
+	}
+
+	while( ofs + hdr_size < tag_size )
+	{
+		if( read_at(fd, hdr, hdr_size, ofs) || !hdr[0] )
+			break;
+
+		if( version == 2 )
+			frame_size = (hdr[3] << 16) | (hdr[4] << 8) | hdr[5];
+		else if( version == 3 )
+			frame_size = be32(&hdr[4]);
+		else
+			frame_size = syncsafe32(&hdr[4]);
+
+		ofs += hdr_size;
+
+		if( frame_size > tag_size - ofs )
+			break;
+
+		str_id = -1;
+		for( i = 0; i < 6; i++ )
+		{
+			if( !memcmp(hdr, frame_ids[i][version == 2], version == 2 ? 3 : 4) )
+				str_id = i;
+		}
+
+		// Not from the ID3v2.4 "TDRC" : ID3v2.3 year frame
+		if( version == 3 && !memcmp(hdr, "TYER", 4) )
+			str_id = 4;
+
+		if( str_id >= 0 )
+		{
+			size = frame_size < sizeof(data) ? frame_size : sizeof(data);
+			if( !read_at(fd, data, size, ofs) )
+			{
+				switch( str_id )
+				{
+					case 0: id3v2_text_frame(tags, MEDIA_STR_TITLE,  data, size); break;
+					case 1: id3v2_text_frame(tags, MEDIA_STR_ARTIST, data, size); break;
+					case 2: id3v2_text_frame(tags, MEDIA_STR_ALBUM,  data, size); break;
+					case 3: id3v2_text_frame(tags, MEDIA_STR_GENRE,  data, size); break;
+					case 4: id3v2_text_frame(tags, MEDIA_STR_DATE,   data, size); break;
+					case 5: id3v2_text_frame(tags, MEDIA_STR_NB,     data, size); break;
+				}
+			}
+		}
+
+		ofs += frame_size;
+	}
+
+	return tag_size;
+}
+
+static int parse_id3v1(int fd, off64_t file_size, media_tags * tags)
+{
+	unsigned char tag[128];
+
+	if( file_size < 128 || read_at(fd, tag, 128, file_size - 128) || memcmp(tag, "TAG", 3) )
+		return 0;
+
+	set_str(tags, MEDIA_STR_TITLE,  &tag[3],  30, 1);
+	set_str(tags, MEDIA_STR_ARTIST, &tag[33], 30, 1);
+	set_str(tags, MEDIA_STR_ALBUM,  &tag[63], 30, 1);
+	set_date(tags, (char*)&tag[93], 4);
+
+	// ID3v1.1 track number
+	if( !tags->track && !tag[125] && tag[126] )
+		tags->track = tag[126];
+
+	return 128;
+}
+
+static int parse_mp3(int fd, off64_t file_size, media_tags * tags)
+{
+	unsigned char buffer[CONFIG_MEDIA_SCAN_SIZE];
+	uint32_t audio_start,frames,samplerate,bitrate,samples;
+	int i,mpeg1,mono,side_info,size,v1_size;
+
+	audio_start = parse_id3v2(fd, tags);
+	v1_size = parse_id3v1(fd, file_size, tags);
+
+	size = sizeof(buffer);
+	if( audio_start + size > file_size )
+		size = file_size - audio_start;
+
+	if( size < 4 || read_at(fd, buffer, size, audio_start) )
+		return 0;
+
+	// First frame header
+	for( i = 0; i + 4 <= size; i++ )
+	{
+		if( buffer[i] == 0xFF && ( buffer[i + 1] & 0xE6 ) == 0xE2 &&          // Sync, Layer III
+			( buffer[i + 2] & 0xF0 ) != 0xF0 && ( buffer[i + 2] & 0x0C ) != 0x0C )
+			break;
+	}
+
+	if( i + 4 > size )
+		return 0;
+
+	mpeg1 = ( buffer[i + 1] & 0x18 ) == 0x18;
+	mono = ( buffer[i + 3] & 0xC0 ) == 0xC0;
+
+	samplerate = mp3_samplerates[( buffer[i + 2] >> 2 ) & 3];
+	if( !mpeg1 )
+		samplerate /= ( buffer[i + 1] & 0x18 ) == 0x10 ? 2 : 4;   // MPEG 2 / MPEG 2.5
+
+	bitrate = mp3_bitrates[!mpeg1][buffer[i + 2] >> 4] * 1000;
+	samples = mpeg1 ? 1152 : 576;
+
+	side_info = mpeg1 ? ( mono ? 17 : 32 ) : ( mono ? 9 : 17 );
+
+	frames = 0;
+	if( i + 4 + side_info + 12 <= size &&
+		( !memcmp(&buffer[i + 4 + side_info], "Xing", 4) || !memcmp(&buffer[i + 4 + side_info], "Info", 4) ) )
+	{
+		if( buffer[i + 4 + side_info + 7] & 0x01 )
+			frames = be32(&buffer[i + 4 + side_info + 8]);
+	}
+	else if( i + 4 + 32 + 18 <= size && !memcmp(&buffer[i + 4 + 32], "VBRI", 4) )
+	{
+		frames = be32(&buffer[i + 4 + 32 + 14]);
+	}
+
+	if( frames )
+		tags->duration = ( (uint64_t)frames * samples * 1000 ) / samplerate;
+	else if( bitrate )
+		tags->duration = ( (uint64_t)( file_size - audio_start - i - v1_size ) * 8 * 1000 ) / bitrate;
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FLAC / Ogg (Vorbis, Opus) : Vorbis comments
+
+static void parse_vorbis_comments(unsigned char * data, uint32_t size, media_tags * tags)
+{
+	static const struct { const char * key; int str_id; } keys[] =
+	{
+		{ "TITLE=", MEDIA_STR_TITLE }, { "ARTIST=", MEDIA_STR_ARTIST }, { "ALBUM=", MEDIA_STR_ALBUM },
+		{ "GENRE=", MEDIA_STR_GENRE }, { "DATE=", MEDIA_STR_DATE }, { "TRACKNUMBER=", MEDIA_STR_NB },
+		{ NULL, 0 }
+	};
+	uint32_t ofs,len,nb,i;
+	char tmp[16];
+	int k,key_len;
+
+	if( size < 8 )
+		return;
+
+	ofs = 4 + le32(data);   // Vendor string
+	if( ofs > size - 4 )
+		return;
+
+	nb = le32(&data[ofs]);
+	ofs += 4;
+
+	for( i = 0; i < nb && ofs <= size - 4; i++ )
+	{
+		len = le32(&data[ofs]);
+		ofs += 4;
+
+		if( len > size - ofs )
+			break;
+
+		for( k = 0; keys[k].key; k++ )
+		{
+			key_len = strlen(keys[k].key);
+			if( len > key_len && !strncasecmp((char*)&data[ofs], keys[k].key, key_len) )
+			{
+				if( keys[k].str_id == MEDIA_STR_NB )
+				{
+					snprintf(tmp, sizeof(tmp), "%.*s", len - key_len < 15 ? len - key_len : 15, (char*)&data[ofs + key_len]);
+					if( !tags->track )
+						tags->track = atoi(tmp);
+				}
+				else if( keys[k].str_id == MEDIA_STR_DATE )
+					set_date(tags, (char*)&data[ofs + key_len], len - key_len);
+				else
+					set_str(tags, keys[k].str_id, &data[ofs + key_len], len - key_len, 0);
+			}
+		}
+
+		ofs += len;
+	}
+}
+
+static int parse_flac(int fd, media_tags * tags)
+{
+	unsigned char hdr[4];
+	unsigned char streaminfo[34];
+	unsigned char * data;
+	uint32_t size,samplerate;
+	uint64_t total_samples;
+	off64_t ofs;
+	int i,last;
+
+	// Some encoders prepend an ID3v2 tag
+	ofs = parse_id3v2(fd, tags);
+
+	if( read_at(fd, hdr, 4, ofs) || memcmp(hdr, "fLaC", 4) )
+		return -1;
+
+	ofs += 4;
+
+	for( i = 0; i < CONFIG_MEDIA_MAX_BLOCKS; i++ )
+	{
+		if( read_at(fd, hdr, 4, ofs) )
+			break;
+
+		last = hdr[0] & 0x80;
+		size = (hdr[1] << 16) | (hdr[2] << 8) | hdr[3];
+		ofs += 4;
+
+		switch( hdr[0] & 0x7F )
+		{
+			case 0: // STREAMINFO
+				if( size >= 34 && !read_at(fd, streaminfo, 34, ofs) )
+				{
+					samplerate = (streaminfo[10] << 12) | (streaminfo[11] << 4) | (streaminfo[12] >> 4);
+					total_samples = ((uint64_t)(streaminfo[13] & 0x0F) << 32) | be32(&streaminfo[14]);
+					if( samplerate )
+						tags->duration = ( total_samples * 1000 ) / samplerate;
+				}
+			break;
+
+			case 4: // VORBIS_COMMENT
+				if( size > CONFIG_MEDIA_SCAN_SIZE * 16 )
+					size = CONFIG_MEDIA_SCAN_SIZE * 16;
+
+				data = malloc(size);
+				if( data )
+				{
+					if( !read_at(fd, data, size, ofs) )
+						parse_vorbis_comments(data, size, tags);
+					free(data);
+				}
+			break;
+		}
+
+		if( last )
+			break;
+
+		ofs += size;
+	}
+
+	return 0;
+}
+
+// Ogg : The two first packets of the stream (identification and comments headers)
+// are in the first pages. The duration is the last page granule position.
+static int parse_ogg(int fd, off64_t file_size, media_tags * tags)
+{
+	unsigned char * buffer;
+	unsigned char * packet;
+	uint32_t ofs,seg_ofs,serial,samplerate,preskip,packet_size;
+	uint64_t granule;
+	int size,nb_segs,i,packet_idx,opus;
+
+	size = CONFIG_MEDIA_SCAN_SIZE * 16;
+	if( size > file_size )
+		size = file_size;
+
+	buffer = malloc(size);
+	packet = malloc(size);
+	if( !buffer || !packet || read_at(fd, buffer, size, 0) )
+	{
+		free(buffer);
+		free(packet);
+		return -1;
+	}
+
+	samplerate = 0;
+	preskip = 0;
+	opus = 0;
+	serial = 0;
+	packet_idx = 0;
+	packet_size = 0;
+
+	ofs = 0;
+	while( packet_idx < 2 && ofs + 27 <= size && !memcmp(&buffer[ofs], "OggS", 4) )
+	{
+		if( !ofs )
+			serial = le32(&buffer[ofs + 14]);
+
+		nb_segs = buffer[ofs + 26];
+		if( ofs + 27 + nb_segs > size )
+			break;
+
+		seg_ofs = ofs + 27 + nb_segs;
+
+		for( i = 0; i < nb_segs && packet_idx < 2; i++ )
+		{
+			if( le32(&buffer[ofs + 14]) == serial && seg_ofs + buffer[ofs + 27 + i] <= size )
+			{
+				memcpy(&packet[packet_size], &buffer[seg_ofs], buffer[ofs + 27 + i]);
+				packet_size += buffer[ofs + 27 + i];
+			}
+
+			seg_ofs += buffer[ofs + 27 + i];
+
+			// End of packet
+			if( buffer[ofs + 27 + i] < 255 && le32(&buffer[ofs + 14]) == serial )
+			{
+				if( !packet_idx )
+				{
+					if( packet_size >= 16 && !memcmp(packet, "\x01vorbis", 7) )
+					{
+						samplerate = le32(&packet[12]);
+					}
+					else if( packet_size >= 12 && !memcmp(packet, "OpusHead", 8) )
+					{
+						opus = 1;
+						samplerate = 48000;
+						preskip = le16(&packet[10]);
+					}
+				}
+				else
+				{
+					if( !opus && packet_size > 7 && !memcmp(packet, "\x03vorbis", 7) )
+						parse_vorbis_comments(&packet[7], packet_size - 7, tags);
+					else if( opus && packet_size > 8 && !memcmp(packet, "OpusTags", 8) )
+						parse_vorbis_comments(&packet[8], packet_size - 8, tags);
+				}
+
+				packet_idx++;
+				packet_size = 0;
+			}
+		}
+
+		ofs = seg_ofs;
+	}
+
+	// Comments packet larger than the buffer (cover art) : Parse its beginning.
+	if( packet_idx == 1 && packet_size > 8 )
+	{
+		if( !opus && !memcmp(packet, "\x03vorbis", 7) )
+			parse_vorbis_comments(&packet[7], packet_size - 7, tags);
+		else if( opus && !memcmp(packet, "OpusTags", 8) )
+			parse_vorbis_comments(&packet[8], packet_size - 8, tags);
+	}
+
+	free(packet);
+
+	// Last page
+	if( samplerate )
+	{
+		size = CONFIG_MEDIA_SCAN_SIZE * 8;   // Ogg pages : 64KB max
+		if( size > file_size )
+			size = file_size;
+
+		if( !read_at(fd, buffer, size, file_size - size) )
+		{
+			for( i = size - 27; i >= 0; i-- )
+			{
+				if( !memcmp(&buffer[i], "OggS", 4) && le32(&buffer[i + 14]) == serial )
+				{
+					granule = le64(&buffer[i + 6]);
+					if( granule != 0xFFFFFFFFFFFFFFFFULL && granule > preskip )
+						tags->duration = ( ( granule - preskip ) * 1000 ) / samplerate;
+					break;
+				}
+			}
+		}
+	}
+
+	free(buffer);
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MP4 : moov/mvhd duration, moov/trak/tkhd video size, moov/udta/meta/ilst tags
+
+static void mp4_ilst_item(int fd, uint32_t type, off64_t ofs, uint64_t size, media_tags * tags)
+{
+	unsigned char data[CONFIG_MEDIA_MAX_STRING + 16];
+	int len;
+
+	// 'data' atom : size, 'data', type, locale, value
+	len = size < sizeof(data) ? size : sizeof(data);
+	if( len < 16 || read_at(fd, data, len, ofs) || memcmp(&data[4], "data", 4) )
+		return;
+
+	switch( type )
+	{
+		case 0xA96E616D: set_str(tags, MEDIA_STR_TITLE,  &data[16], len - 16, 0); break;   // nam
+		case 0xA9415254: set_str(tags, MEDIA_STR_ARTIST, &data[16], len - 16, 0); break;   // ART
+		case 0xA9616C62: set_str(tags, MEDIA_STR_ALBUM,  &data[16], len - 16, 0); break;   // alb
+		case 0xA967656E: set_str(tags, MEDIA_STR_GENRE,  &data[16], len - 16, 0); break;   // gen
+		case 0xA9646179: set_date(tags, (char*)&data[16], len - 16); break;                // day
+		case 0x74726B6E: // trkn
+			if( len >= 20 )
+				tags->track = be16(&data[18]);
+		break;
+	}
+}
+
+static void mp4_parse_boxes(int fd, off64_t ofs, off64_t end, int depth, media_tags * tags)
+{
+	unsigned char hdr[96];
+	uint64_t size,timescale,duration;
+	uint32_t type,width,height;
+	int hdr_size,len;
+
+	while( ofs + 8 <= end && depth < 8 )
+	{
+		if( read_at(fd, hdr, 8, ofs) )
+			return;
+
+		size = be32(hdr);
+		type = be32(&hdr[4]);
+		hdr_size = 8;
+
+		if( size == 1 )
+		{
+			if( read_at(fd, hdr, 16, ofs) )
+				return;
+
+			size = be64(&hdr[8]);
+			hdr_size = 16;
+		}
+		else if( !size )
+		{
+			size = end - ofs;
+		}
+
+		if( size < hdr_size || size > (uint64_t)( end - ofs ) )
+			return;
+
+		switch( type )
+		{
+			case 0x6D6F6F76: // moov
+			case 0x7472616B: // trak
+			case 0x75647461: // udta
+			case 0x696C7374: // ilst
+				mp4_parse_boxes(fd, ofs + hdr_size, ofs + size, depth + 1, tags);
+			break;
+
+			case 0x6D657461: // meta : Full box (version / flags), except in the QuickTime files
+				if( !read_at(fd, hdr, 16, ofs + hdr_size) && !memcmp(&hdr[4], "hdlr", 4) )
+					mp4_parse_boxes(fd, ofs + hdr_size, ofs + size, depth + 1, tags);
+				else
+					mp4_parse_boxes(fd, ofs + hdr_size + 4, ofs + size, depth + 1, tags);
+			break;
+
+			case 0x6D766864: // mvhd
+				if( size >= hdr_size + 32 && !read_at(fd, hdr, 32, ofs + hdr_size) )
+				{
+					if( hdr[0] == 1 )
+					{
+						timescale = be32(&hdr[20]);
+						duration = be64(&hdr[24]);
+					}
+					else
+					{
+						timescale = be32(&hdr[12]);
+						duration = be32(&hdr[16]);
+					}
+
+					if( timescale )
+						tags->duration = ( duration * 1000 ) / timescale;
+				}
+			break;
+
+			case 0x746B6864: // tkhd
+				// Version 0 : 32 bits times, version 1 : 64 bits times
+				len = size - hdr_size < 96 ? size - hdr_size : 96;
+				if( len >= 84 && !read_at(fd, hdr, len, ofs + hdr_size) && ( hdr[0] != 1 || len >= 96 ) )
+				{
+					width = be32(&hdr[hdr[0] == 1 ? 88 : 76]) >> 16;
+					height = be32(&hdr[hdr[0] == 1 ? 92 : 80]) >> 16;
+
+					// Video track : The largest one
+					if( width * height > tags->width * tags->height )
+					{
+						tags->width = width;
+						tags->height = height;
+					}
+				}
+			break;
+
+			default:
+				if( depth && ( hdr[4] == 0xA9 || type == 0x74726B6E ) )
+					mp4_ilst_item(fd, type, ofs + hdr_size, size - hdr_size, tags);
+			break;
+		}
+
+		ofs += size;
+	}
+}
+
+static int parse_mp4(int fd, off64_t file_size, media_tags * tags)
+{
+	unsigned char hdr[8];
+
+	if( read_at(fd, hdr, 8, 0) || memcmp(&hdr[4], "ftyp", 4) )
+		return -1;
+
+	mp4_parse_boxes(fd, 0, file_size, 0, tags);
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// JPEG : Frame size, EXIF date taken
+
+static void exif_date(unsigned char * tiff, uint32_t size, media_tags * tags)
+{
+	uint32_t ifd,entry,nb,i,tag,ofs,exif_ifd,date_ofs;
+	int le,pass;
+
+	if( size < 8 )
+		return;
+
+	if( tiff[0] == 'I' && tiff[1] == 'I' )
+		le = 1;
+	else if( tiff[0] == 'M' && tiff[1] == 'M' )
+		le = 0;
+	else
+		return;
+
+	date_ofs = 0;
+	exif_ifd = 0;
+	ifd = le ? le32(&tiff[4]) : be32(&tiff[4]);
+
+	// IFD0 (DateTime, Exif IFD pointer) then the Exif IFD (DateTimeOriginal)
+	for( pass = 0; pass < 2 && ifd && ifd <= size - 2; pass++ )
+	{
+		nb = le ? le16(&tiff[ifd]) : be16(&tiff[ifd]);
+
+		for( i = 0; i < nb; i++ )
+		{
+			entry = ifd + 2 + i * 12;
+			if( entry > size - 12 )
+				break;
+
+			tag = le ? le16(&tiff[entry]) : be16(&tiff[entry]);
+			ofs = le ? le32(&tiff[entry + 8]) : be32(&tiff[entry + 8]);
+
+			if( tag == 0x8769 )
+				exif_ifd = ofs;
+
+			if( ( tag == 0x0132 && !date_ofs ) || tag == 0x9003 )
+				date_ofs = ofs;
+		}
+
+		ifd = exif_ifd;
+		exif_ifd = 0;
+	}
+
+	if( date_ofs && date_ofs <= size - 19 )
+		set_date(tags, (char*)&tiff[date_ofs], 19);
+}
+
+static int parse_jpeg(int fd, media_tags * tags)
+{
+	unsigned char hdr[10];
+	unsigned char * segment;
+	off64_t ofs;
+	int i,len;
+
+	if( read_at(fd, hdr, 2, 0) || hdr[0] != 0xFF || hdr[1] != 0xD8 )
+		return -1;
+
+	ofs = 2;
+	for( i = 0; i < CONFIG_MEDIA_MAX_BLOCKS; i++ )
+	{
+		if( read_at(fd, hdr, 4, ofs) || hdr[0] != 0xFF )
+			break;
+
+		if( hdr[1] == 0xDA || hdr[1] == 0xD9 )
+			break;
+
+		len = be16(&hdr[2]);
+		if( len < 2 )
+			break;
+
+		if( hdr[1] == 0xE1 && len > 2 + 6 + 8 && !tags->str[MEDIA_STR_DATE][0] )
+		{
+			segment = malloc(len - 2);
+			if( segment )
+			{
+				if( !read_at(fd, segment, len - 2, ofs + 4) && !memcmp(segment, "Exif\0\0", 6) )
+					exif_date(segment + 6, len - 2 - 6, tags);
+
+				free(segment);
+			}
+		}
+
+		// Start of frame
+		if( hdr[1] >= 0xC0 && hdr[1] <= 0xCF && hdr[1] != 0xC4 && hdr[1] != 0xC8 && hdr[1] != 0xCC )
+		{
+			if( !read_at(fd, hdr, 9, ofs) )
+			{
+				tags->height = be16(&hdr[5]);
+				tags->width = be16(&hdr[7]);
+			}
+			break;
+		}
+
+		ofs += 2 + len;
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Read the metadata of a file. Return a new mtp_media_info (to be freed), NULL if not a media file.
+static mtp_media_info * media_parse(char * path, uint16_t format)
+{
+	struct stat64 st;
+	mtp_media_info * info;
+	media_tags * tags;
+	int fd,i,len,strings_size,ofs;
+
+	fd = open(path, O_RDONLY | O_LARGEFILE);
+	if( fd < 0 )
+		return NULL;
+
+	if( fstat64(fd, &st) )
+	{
+		close(fd);
+		return NULL;
+	}
+
+	tags = malloc(sizeof(media_tags));
+	if( !tags )
+	{
+		close(fd);
+		return NULL;
+	}
+
+	memset(tags, 0, sizeof(media_tags));
+
+	switch( format )
+	{
+		case MTP_FORMAT_MP3:
+			parse_mp3(fd, st.st_size, tags);
+		break;
+
+		case MTP_FORMAT_FLAC:
+			parse_flac(fd, tags);
+		break;
+
+		case MTP_FORMAT_OGG:
+			parse_ogg(fd, st.st_size, tags);
+		break;
+
+		case MTP_FORMAT_MP4_CONTAINER:
+			parse_mp4(fd, st.st_size, tags);
+		break;
+
+		case MTP_FORMAT_EXIF_JPEG:
+			parse_jpeg(fd, tags);
+		break;
+	}
+
+	close(fd);
+
+	// Compact : The strings are packed after the structure.
+	strings_size = 0;
+	for( i = 0; i < MEDIA_STR_NB; i++ )
+	{
+		if( tags->str[i][0] )
+			strings_size += strlen(tags->str[i]) + 1;
+	}
+
+	info = malloc(sizeof(mtp_media_info) + strings_size);
+	if( info )
+	{
+		memset(info, 0, sizeof(mtp_media_info));
+
+		info->size = st.st_size;
+		info->date = st.st_mtime;
+		info->format = format;
+		info->track = tags->track;
+		info->duration = tags->duration;
+		info->width = tags->width;
+		info->height = tags->height;
+
+		ofs = 0;
+		for( i = 0; i < MEDIA_STR_NB; i++ )
+		{
+			info->str_ofs[i] = 0xFFFF;
+
+			if( tags->str[i][0] )
+			{
+				len = strlen(tags->str[i]) + 1;
+				memcpy(&info->strings[ofs], tags->str[i], len);
+				info->str_ofs[i] = ofs;
+				ofs += len;
+			}
+		}
+	}
+
+	free(tags);
+
+	return info;
+}
+
+const char * mtp_media_string(mtp_media_info * info, int str_id)
+{
+	if( !info || str_id >= MEDIA_STR_NB || info->str_ofs[str_id] == 0xFFFF )
+		return NULL;
+
+	return &info->strings[info->str_ofs[str_id]];
+}
+
+static int media_up_to_date(fs_entry * entry, mtp_media_info * info)
+{
+	return info && entry->date && info->size == entry->size && info->date == entry->date;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Background indexer
+
+static void * media_worker(void * arg)
+{
+	mtp_ctx * ctx;
+	mtp_media_pool * pool;
+	mtp_media_info * info;
+	mtp_media_info * old_info;
+	fs_db_shard * shard;
+	fs_entry * entry;
+	media_job job;
+	mtp_size size;
+	uint32_t date;
+	uint16_t format;
+	char * path;
+	int shard_idx;
+
+	ctx = (mtp_ctx *)arg;
+	pool = (mtp_media_pool *)ctx->media_pool;
+
+	prctl(PR_SET_NAME, (unsigned long) __func__);
+
+	// Low priority : The MTP transfers first.
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#ifdef SYS_ioprio_set
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, syscall(SYS_gettid), IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+#endif
+
+	pthread_mutex_lock( &pool->lock );
+
+	while( !pool->stop )
+	{
+		if( !pool->nb_jobs )
+		{
+			pthread_cond_wait( &pool->cond, &pool->lock );
+			continue;
+		}
+
+		job = pool->queue[pool->first];
+		pool->first = (pool->first + 1) % CONFIG_MEDIA_QUEUE_SIZE;
+		pool->nb_jobs--;
+		pool->busy++;
+
+		pthread_mutex_unlock( &pool->lock );
+
+		shard_idx = FS_DB_HANDLE_SHARD(job.handle);
+
+		// The db is only accessed with the storage lock held.
+		path = NULL;
+		format = MTP_FORMAT_UNDEFINED;
+		size = 0;
+		date = 0;
+		if( !mtp_db_lock_storage( ctx, shard_idx ) )
+		{
+			entry = NULL;
+			if( ctx->fs_db )
+				entry = get_entry_by_handle(ctx->fs_db, job.handle);
+
+			if( entry && !( entry->flags & ENTRY_IS_DELETED ) )
+			{
+				format = mtp_media_format(entry);
+
+				if( !media_up_to_date(entry, entry->media) )
+				{
+					size = entry->size;
+					date = entry->date;
+					path = build_full_path(ctx->fs_db, mtp_get_storage_root(ctx, entry->storage_id), entry);
+				}
+				else if( job.notify )
+				{
+					// Indexed meanwhile (after the host got the objects list)
+					objectproplist_media_changed(ctx, entry->handle, format, entry->media);
+				}
+			}
+
+			mtp_db_unlock_storage( ctx, shard_idx );
+		}
+
+		if( path )
+		{
+			info = media_parse(path, format);
+			free(path);
+
+			if( info && !mtp_db_lock_storage( ctx, shard_idx ) )
+			{
+				entry = NULL;
+				if( ctx->fs_db )
+					entry = get_entry_by_handle(ctx->fs_db, job.handle);
+
+				if( entry )
+				{
+					// Size and date read by the parser : Only if the entry wasn't updated meanwhile.
+					if( entry->size == size && entry->date == date )
+					{
+						entry->size = info->size;
+						entry->date = info->date;
+					}
+
+					old_info = __atomic_exchange_n((mtp_media_info **)&entry->media, info, __ATOMIC_ACQ_REL);
+
+					// Lock-free readers may still be using the previous metadata.
+					shard = fs_db_get_shard(ctx->fs_db, entry->storage_id);
+					if( old_info && shard )
+						fs_db_retire(shard, old_info);
+
+					if( job.notify )
+						objectproplist_media_changed(ctx, entry->handle, format, info);
+
+					info = NULL;
+
+					__atomic_fetch_add(&ctx->stats.media_indexed, 1, __ATOMIC_RELAXED);
+				}
+
+				mtp_db_unlock_storage( ctx, shard_idx );
+			}
+
+			free(info);
+		}
+
+		pthread_mutex_lock( &pool->lock );
+
+		pool->busy--;
+		if( !pool->busy )
+			pthread_cond_broadcast( &pool->idle_cond );
+	}
+
+	pthread_mutex_unlock( &pool->lock );
+
+	return NULL;
+}
+
+static mtp_media_pool * media_pool(mtp_ctx * ctx)
+{
+	mtp_media_pool * pool;
+	int i;
+
+	pool = (mtp_media_pool *)ctx->media_pool;
+	if( pool )
+		return pool;
+
+	pool = malloc(sizeof(mtp_media_pool));
+	if( !pool )
+		return NULL;
+
+	memset(pool, 0, sizeof(mtp_media_pool));
+
+	if( pthread_mutex_init( &pool->lock, NULL ) || pthread_cond_init( &pool->cond, NULL ) || pthread_cond_init( &pool->idle_cond, NULL ) )
+	{
+		free(pool);
+		return NULL;
+	}
+
+	ctx->media_pool = pool;
+
+	for( i = 0; i < ctx->media_workers && i < CONFIG_MEDIA_MAX_WORKERS; i++ )
+	{
+		if( pthread_create( &pool->threads[i], NULL, media_worker, ctx ) )
+		{
+			PRINT_ERROR("%s : media indexer worker creation failed !", __func__);
+			break;
+		}
+		pool->nb_threads++;
+	}
+
+	return pool;
+}
+
+// Return 0 if the file is queued (< 0 : not queued).
+static int queue_job(mtp_ctx * ctx, fs_entry * entry, int notify)
+{
+	mtp_media_pool * pool;
+	int i,ret;
+
+	if( ctx->media_workers <= 0 || ( entry->flags & ENTRY_IS_DIR ) )
+		return -1;
+
+	if( mtp_media_format(entry) == MTP_FORMAT_UNDEFINED || media_up_to_date(entry, entry->media) )
+		return -1;
+
+	pool = media_pool(ctx);
+	if( !pool || !pool->nb_threads )
+		return -1;
+
+	ret = 0;
+
+	pthread_mutex_lock( &pool->lock );
+
+	// Already queued : The host has to be notified once it is indexed.
+	for( i = 0; notify && i < pool->nb_jobs; i++ )
+	{
+		if( pool->queue[(pool->first + i) % CONFIG_MEDIA_QUEUE_SIZE].handle == entry->handle )
+		{
+			pool->queue[(pool->first + i) % CONFIG_MEDIA_QUEUE_SIZE].notify = 1;
+			pthread_mutex_unlock( &pool->lock );
+			return 0;
+		}
+	}
+
+	if( pool->nb_jobs < CONFIG_MEDIA_QUEUE_SIZE )
+	{
+		pool->queue[(pool->first + pool->nb_jobs) % CONFIG_MEDIA_QUEUE_SIZE].handle = entry->handle;
+		pool->queue[(pool->first + pool->nb_jobs) % CONFIG_MEDIA_QUEUE_SIZE].storage_id = entry->storage_id;
+		pool->queue[(pool->first + pool->nb_jobs) % CONFIG_MEDIA_QUEUE_SIZE].notify = notify;
+		pool->nb_jobs++;
+
+		pthread_cond_signal( &pool->cond );
+	}
+	else
+	{
+		__atomic_fetch_add(&ctx->stats.media_dropped, 1, __ATOMIC_RELAXED);
+		ret = -1;
+	}
+
+	pthread_mutex_unlock( &pool->lock );
+
+	return ret;
+}
+
+// Queue a media file for the background indexing. The db lock must be held.
+void mtp_media_queue(mtp_ctx * ctx, fs_entry * entry)
+{
+	queue_job(ctx, entry, 0);
+}
+
+// Return the media metadata of an object, NULL if it isn't a media file.
+// Not indexed yet : Read now. *tmp_info is set if the returned metadata must be freed
+// by the caller (outdated indexed metadata : refreshed by the indexer).
+// indexed_only : Not read now but queued, the indexer notifies the host (objects lists).
+// (Read now if the indexing queue is full)
+mtp_media_info * mtp_media_get(mtp_ctx * ctx, fs_entry * entry, mtp_media_info ** tmp_info, int indexed_only)
+{
+	mtp_media_info * info;
+	mtp_media_info * expected;
+	uint16_t format;
+	char * path;
+
+	*tmp_info = NULL;
+
+	format = mtp_media_format(entry);
+	if( format == MTP_FORMAT_UNDEFINED || format == MTP_FORMAT_ASSOCIATION )
+		return NULL;
+
+	info = __atomic_load_n((mtp_media_info **)&entry->media, __ATOMIC_ACQUIRE);
+	if( media_up_to_date(entry, info) )
+		return info;
+
+	if( indexed_only && !queue_job(ctx, entry, 1) )
+		return NULL;
+
+	path = build_full_path(ctx->fs_db, mtp_get_storage_root(ctx, entry->storage_id), entry);
+	if( !path )
+		return NULL;
+
+	info = media_parse(path, format);
+
+	free(path);
+
+	if( !info )
+		return NULL;
+
+	__atomic_fetch_add(&ctx->stats.media_on_demand, 1, __ATOMIC_RELAXED);
+
+	// First indexing : Published without the db writer lock (nothing to retire).
+	expected = NULL;
+	if( __atomic_compare_exchange_n((mtp_media_info **)&entry->media, &expected, info, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) )
+		return info;
+
+	// Outdated metadata : The indexer replaces them.
+	*tmp_info = info;
+
+	mtp_media_queue(ctx, entry);
+
+	return info;
+}
+
+// Drop the queued jobs and wait for the running ones (the handles db is about to be released).
+void mtp_media_flush(mtp_ctx * ctx)
+{
+	mtp_media_pool * pool;
+
+	pool = (mtp_media_pool *)ctx->media_pool;
+	if( !pool )
+		return;
+
+	pthread_mutex_lock( &pool->lock );
+
+	pool->nb_jobs = 0;
+
+	while( pool->busy )
+		pthread_cond_wait( &pool->idle_cond, &pool->lock );
+
+	pthread_mutex_unlock( &pool->lock );
+}
+
+void mtp_media_deinit(mtp_ctx * ctx)
+{
+	mtp_media_pool * pool;
+	int i;
+
+	pool = (mtp_media_pool *)ctx->media_pool;
+	if( !pool )
+		return;
+
+	pthread_mutex_lock( &pool->lock );
+	pool->stop = 1;
+	pthread_cond_broadcast( &pool->cond );
+	pthread_mutex_unlock( &pool->lock );
+
+	for( i = 0; i < pool->nb_threads; i++ )
+		pthread_join( pool->threads[i], NULL );
+
+	pthread_mutex_destroy( &pool->lock );
+	pthread_cond_destroy( &pool->cond );
+	pthread_cond_destroy( &pool->idle_cond );
+
+	free( pool );
+
+	ctx->media_pool = NULL;
+}
@@ -43,7 +43,7 @@ uint32_t mtp_op_BeginEditObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr
 	if(!ctx->fs_db)
 		return MTP_RESPONSE_SESSION_NOT_OPEN;
 
-	if( pthread_mutex_lock( &ctx->inotify_mutex ) )
+	if( mtp_db_lock( ctx ) )
 		return MTP_RESPONSE_GENERAL_ERROR;
 
 	response_code = MTP_RESPONSE_OK;
@@ -52,7 +52,7 @@ uint32_t mtp_op_BeginEditObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr
 
 	check_handle_access( ctx, NULL, handle, 1, &response_code);
 
-	pthread_mutex_unlock( &ctx->inotify_mutex );
+	mtp_db_unlock( ctx );
 
 	return response_code;
 }
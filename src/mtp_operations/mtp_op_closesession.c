@@ -32,6 +32,13 @@
 #include "mtp_helpers.h"
 #include "mtp_constant.h"
 #include "mtp_operations.h"
+#include "mtp_copy.h"
+#include "mtp_media.h"
+#include "mtp_search.h"
+#include "mtp_dataset_writer.h"
+#include "mtp_archive.h"
+#include "mtp_journal.h"
+#include "mtp_events.h"
 
 #include "logs_out.h"
 
@@ -40,6 +47,13 @@ uint32_t mtp_op_CloseSession(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, i
 	if(!ctx->fs_db)
 		return MTP_RESPONSE_SESSION_NOT_OPEN;
 
+	mtp_copy_cancel(ctx);
+	mtp_media_flush(ctx);
+	mtp_events_flush(ctx);
+	mtp_find_free(ctx);
+	mtp_archive_free(ctx);
+	mtp_journal_save(ctx);
+
 	deinit_fs_db(ctx->fs_db);
 
 	ctx->fs_db = 0;
@@ -0,0 +1,65 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/**
+ * @file   mtp_op_copyobject.c
+ * @brief  Copy object operation.
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+#include "buildconf.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "mtp.h"
+#include "mtp_helpers.h"
+#include "mtp_constant.h"
+#include "mtp_operations.h"
+#include "mtp_copy.h"
+
+#include "logs_out.h"
+
+uint32_t mtp_op_CopyObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int * size,uint32_t * ret_params, int * ret_params_size)
+{
+	uint32_t response_code;
+	uint32_t handle,storage_id,parent_handle;
+	uint32_t newhandle;
+
+	if(!ctx->fs_db)
+		return MTP_RESPONSE_SESSION_NOT_OPEN;
+
+	handle = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER), 4);             // Get param 1 - object handle
+	storage_id = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER) + 4, 4);     // Get param 2 - destination storage
+	parent_handle = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER) + 8, 4);  // Get param 3 - destination parent
+
+	PRINT_DEBUG("MTP_OPERATION_COPY_OBJECT : Handle 0x%.8x -> Storage 0x%.8x Parent 0x%.8x", handle, storage_id, parent_handle);
+
+	newhandle = 0xFFFFFFFF;
+
+	response_code = mtp_copy_object(ctx, handle, storage_id, parent_handle, &newhandle);
+	if( response_code == MTP_RESPONSE_OK )
+	{
+		ret_params[0] = newhandle;
+		*ret_params_size = sizeof(uint32_t);
+	}
+
+	return response_code;
+}
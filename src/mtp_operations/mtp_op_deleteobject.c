@@ -33,6 +33,7 @@
 #include "mtp_constant.h"
 #include "mtp_operations.h"
 #include "mtp_ops_helpers.h"
+#include "mtp_copy.h"
 
 #include "logs_out.h"
 
@@ -45,14 +46,17 @@ uint32_t mtp_op_DeleteObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, i
 	if(!ctx->fs_db)
 		return MTP_RESPONSE_SESSION_NOT_OPEN;
 
-	if( pthread_mutex_lock( &ctx->inotify_mutex ) )
-		return MTP_RESPONSE_GENERAL_ERROR;
-
 	handle = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER), 4); // Get param 1 - object handle
 
+	// Stop the folder copy writing / moving this object.
+	mtp_copy_cancel_handle( ctx, handle );
+
+	if( mtp_db_lock( ctx ) )
+		return MTP_RESPONSE_GENERAL_ERROR;
+
 	if( check_handle_access( ctx, NULL, handle, 1, &response_code) )
 	{
-		pthread_mutex_unlock( &ctx->inotify_mutex );
+		mtp_db_unlock( ctx );
 
 		return response_code;
 	}
@@ -81,7 +85,7 @@ uint32_t mtp_op_DeleteObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, i
 
 	restore_giduid(ctx);
 
-	pthread_mutex_unlock( &ctx->inotify_mutex );
+	mtp_db_unlock( ctx );
 
 	return response_code;
 }
@@ -43,7 +43,7 @@ uint32_t mtp_op_EndEditObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr,
 	if(!ctx->fs_db)
 		return MTP_RESPONSE_SESSION_NOT_OPEN;
 
-	if( pthread_mutex_lock( &ctx->inotify_mutex ) )
+	if( mtp_db_lock( ctx ) )
 		return MTP_RESPONSE_GENERAL_ERROR;
 
 	response_code = MTP_RESPONSE_OK;
@@ -54,7 +54,7 @@ uint32_t mtp_op_EndEditObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr,
 
 	entry_close(ctx->fs_db, get_entry_by_handle(ctx->fs_db, handle));
 
-	pthread_mutex_unlock( &ctx->inotify_mutex );
+	mtp_db_unlock( ctx );
 
 	return response_code;
 }
@@ -0,0 +1,84 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/**
+ * @file   mtp_op_findobjects.c
+ * @brief  Find objects operation (vendor extension).
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+#include "buildconf.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "mtp.h"
+#include "mtp_helpers.h"
+#include "mtp_constant.h"
+#include "mtp_operations.h"
+#include "mtp_search.h"
+#include "usb_gadget_fct.h"
+
+#include "logs_out.h"
+
+// Parameters : Storage ID (0xFFFFFFFF : all), root folder handle (0x00000000 : storage root), match mode.
+// Data (host to device) : Pattern string.
+// Response : Number of objects found, incomplete result flag. The handles are read with GetFindResults.
+uint32_t mtp_op_FindObjects(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int * size,uint32_t * ret_params, int * ret_params_size)
+{
+	uint32_t response_code;
+	uint32_t storageid;
+	uint32_t root_handle;
+	uint32_t mode;
+	char pattern[256+1];
+	int sz,incomplete;
+
+	if(!ctx->fs_db)
+		return MTP_RESPONSE_SESSION_NOT_OPEN;
+
+	storageid = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER), 4);           // Get param 1 - storage id
+	root_handle = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER) + 4, 4);     // Get param 2 - root folder handle
+	mode = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER) + 8, 4);            // Get param 3 - match mode
+
+	sz = read_usb(ctx->usb_ctx, ctx->rdbuffer2, ctx->usb_rd_buffer_max_size);
+	if( sz < (int)sizeof(MTP_PACKET_HEADER) )
+		return MTP_RESPONSE_INVALID_DATASET;
+
+	*size = sz;
+
+	if( peek_string(ctx->rdbuffer2, sizeof(MTP_PACKET_HEADER), sz, pattern, sizeof(pattern)) < 0 )
+	{
+		PRINT_ERROR("MTP_OPERATION_FIND_OBJECTS : Malformed pattern !");
+		return MTP_RESPONSE_INVALID_DATASET;
+	}
+
+	PRINT_DEBUG("MTP_OPERATION_FIND_OBJECTS : Storage 0x%.8X, Root 0x%.8X, Mode %d, Pattern %s", storageid, root_handle, mode, pattern);
+
+	response_code = mtp_find_objects(ctx, storageid, root_handle, mode, pattern, &incomplete);
+	if( response_code == MTP_RESPONSE_OK )
+	{
+		ret_params[0] = ctx->find_results_count;
+		ret_params[1] = incomplete;
+		*ret_params_size = sizeof(uint32_t) * 2;
+	}
+
+	return response_code;
+}
@@ -0,0 +1,80 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/**
+ * @file   mtp_op_getarchiveerrors.c
+ * @brief  Get archive errors operation (uMTP Responder extension).
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+#include "buildconf.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "mtp.h"
+#include "mtp_helpers.h"
+#include "mtp_constant.h"
+#include "mtp_operations.h"
+#include "mtp_dataset_writer.h"
+#include "mtp_archive.h"
+
+#include "logs_out.h"
+
+// Parameters : First error index.
+// Data (device to host) : Number of errors, then for each error : Entry index in the archive (UINT32, first entry : 1),
+// MTP response code (UINT16), entry name (String).
+uint32_t mtp_op_GetArchiveErrors(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int * size,uint32_t * ret_params, int * ret_params_size)
+{
+	mtp_dataset_writer dsw;
+	mtp_size length;
+	uint32_t first;
+	int sz;
+
+	if(!ctx->fs_db)
+		return MTP_RESPONSE_SESSION_NOT_OPEN;
+
+	first = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER), 4);               // Get param 1 - first error index
+
+	// Measure pass : The names sizes are not known.
+	dataset_writer_init(ctx, &dsw, 1);
+	dataset_writer_begin(&dsw, mtp_packet_hdr->tx_id, mtp_packet_hdr->code, 0);
+
+	if( mtp_archive_errors_dataset(ctx, &dsw, first) < 0 )
+		return MTP_RESPONSE_GENERAL_ERROR;
+
+	length = dataset_writer_end(&dsw);
+	if( length <= 0 )
+		return MTP_RESPONSE_GENERAL_ERROR;
+
+	dataset_writer_init(ctx, &dsw, 0);
+	dataset_writer_begin(&dsw, mtp_packet_hdr->tx_id, mtp_packet_hdr->code, length);
+
+	mtp_archive_errors_dataset(ctx, &dsw, first);
+
+	sz = dataset_writer_end(&dsw);
+	if( sz < 0 )
+		return MTP_RESPONSE_GENERAL_ERROR;
+
+	*size = sz;
+
+	return MTP_RESPONSE_OK;
+}
@@ -0,0 +1,117 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * @file   mtp_op_getchanges.c
+ * @brief  Get changes operation (uMTP Responder extension).
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+#include "buildconf.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "mtp.h"
+#include "mtp_helpers.h"
+#include "mtp_constant.h"
+#include "mtp_operations.h"
+#include "mtp_dataset_writer.h"
+#include "mtp_journal.h"
+
+#include "logs_out.h"
+
+// Parameters : Token (low 32 bits, high 32 bits), Storage ID (0x00000000 / 0xFFFFFFFF : all the storages).
+// Data (device to host) : Number of changes, then for each change : Sequence number (UINT64),
+// change type (UINT16 : 1 added, 2 removed, 3 modified, 4 renamed), flags (UINT16 : 0x0001 folder, its content included),
+// Storage ID (UINT32), size (UINT64), modification time (UINT64, seconds since the Epoch),
+// path relative to the storage root and previous path (rename) : Size (UINT32) then UTF-8 bytes.
+// Response parameters : Next token (low 32 bits, high 32 bits), more changes (1) or not (0).
+// MTP_RESPONSE_CHANGES_TOKEN_EXPIRED : Full sync needed, the response parameters give the current token.
+uint32_t mtp_op_GetChanges(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int * size,uint32_t * ret_params, int * ret_params_size)
+{
+	mtp_journal_changes changes;
+	mtp_dataset_writer dsw;
+	mtp_size length;
+	uint64_t token;
+	uint32_t storage_id;
+	uint32_t response_code;
+	int sz;
+
+	if(!ctx->fs_db)
+		return MTP_RESPONSE_SESSION_NOT_OPEN;
+
+	token = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER), 4);                          // Get param 1 - token low
+	token |= (uint64_t)peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER) + 4, 4) << 32;     // Get param 2 - token high
+	storage_id = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER) + 8, 4);                 // Get param 3 - storage id
+
+	response_code = mtp_journal_get_changes(ctx, token, storage_id, &changes);
+
+	if( response_code == MTP_RESPONSE_CHANGES_TOKEN_EXPIRED )
+	{
+		ret_params[0] = changes.token & 0xFFFFFFFF;
+		ret_params[1] = changes.token >> 32;
+		*ret_params_size = 2 * sizeof(uint32_t);
+	}
+
+	if( response_code != MTP_RESPONSE_OK )
+	{
+		mtp_journal_free_changes(&changes);
+		return response_code;
+	}
+
+	// Measure pass : The paths sizes are not known.
+	dataset_writer_init(ctx, &dsw, 1);
+	dataset_writer_begin(&dsw, mtp_packet_hdr->tx_id, mtp_packet_hdr->code, 0);
+
+	mtp_journal_changes_dataset(&dsw, &changes);
+
+	length = dataset_writer_end(&dsw);
+	if( length <= 0 )
+	{
+		mtp_journal_free_changes(&changes);
+		return MTP_RESPONSE_GENERAL_ERROR;
+	}
+
+	dataset_writer_init(ctx, &dsw, 0);
+	dataset_writer_begin(&dsw, mtp_packet_hdr->tx_id, mtp_packet_hdr->code, length);
+
+	mtp_journal_changes_dataset(&dsw, &changes);
+
+	sz = dataset_writer_end(&dsw);
+	if( sz < 0 )
+	{
+		mtp_journal_free_changes(&changes);
+		return MTP_RESPONSE_GENERAL_ERROR;
+	}
+
+	*size = sz;
+
+	PRINT_DEBUG("GetChanges : %d changes since 0x%.16"PRIX64" (more : %d)", changes.nb, token, changes.more);
+
+	ret_params[0] = changes.token & 0xFFFFFFFF;
+	ret_params[1] = changes.token >> 32;
+	ret_params[2] = changes.more;
+	*ret_params_size = 3 * sizeof(uint32_t);
+
+	mtp_journal_free_changes(&changes);
+
+	return MTP_RESPONSE_OK;
+}
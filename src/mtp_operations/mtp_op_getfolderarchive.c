@@ -0,0 +1,72 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/**
+ * @file   mtp_op_getfolderarchive.c
+ * @brief  Get folder archive operation (uMTP Responder extension).
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+#include "buildconf.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "mtp.h"
+#include "mtp_helpers.h"
+#include "mtp_constant.h"
+#include "mtp_operations.h"
+#include "mtp_dataset_writer.h"
+#include "mtp_archive.h"
+
+#include "logs_out.h"
+
+// Parameters : Folder handle, archive format (0 : tar, 1 : tar + zstd).
+// Data (device to host) : Archive stream, 0xFFFFFFFF container length.
+// Response : Number of files sent, number of objects skipped (unreadable, special files).
+uint32_t mtp_op_GetFolderArchive(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int * size,uint32_t * ret_params, int * ret_params_size)
+{
+	uint32_t response_code;
+	uint32_t handle;
+	uint32_t format;
+	uint32_t files,skipped;
+
+	if(!ctx->fs_db)
+		return MTP_RESPONSE_SESSION_NOT_OPEN;
+
+	handle = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER), 4);              // Get param 1 - folder handle
+	format = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER) + 4, 4);          // Get param 2 - archive format
+
+	PRINT_DEBUG("MTP_OPERATION_GET_FOLDER_ARCHIVE : Handle 0x%.8X, Format %d", handle, format);
+
+	files = 0;
+	skipped = 0;
+
+	response_code = mtp_archive_send(ctx, mtp_packet_hdr, handle, format, &files, &skipped);
+	if( response_code == MTP_RESPONSE_OK )
+	{
+		ret_params[0] = files;
+		ret_params[1] = skipped;
+		*ret_params_size = sizeof(uint32_t) * 2;
+	}
+
+	return response_code;
+}
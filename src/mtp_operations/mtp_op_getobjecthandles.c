@@ -34,13 +34,14 @@
 #include "mtp_constant.h"
 #include "mtp_operations.h"
 #include "usb_gadget_fct.h"
-#include "inotify.h"
+#include "mtp_ops_helpers.h"
+#include "mtp_dataset_writer.h"
 
 #include "logs_out.h"
 
 uint32_t mtp_op_GetObjectHandles(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int * size,uint32_t * ret_params, int * ret_params_size)
 {
-	int ofs;
+	mtp_dataset_writer dsw;
 	uint32_t storageid;
 	uint32_t parent_handle;
 	int handle_index;
@@ -49,32 +50,30 @@ uint32_t mtp_op_GetObjectHandles(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hd
 	char * full_path;
 	char * tmp_str;
 	int sz,ret;
+	int store_index;
 
 	if(!ctx->fs_db)
 		return MTP_RESPONSE_SESSION_NOT_OPEN;
 
-	if( pthread_mutex_lock( &ctx->inotify_mutex ) )
-		return MTP_RESPONSE_GENERAL_ERROR;
-
 	storageid = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER) + 0, 4);        // Get param 1 - Storage ID
 
-	sz = build_response(ctx, mtp_packet_hdr->tx_id, MTP_CONTAINER_TYPE_DATA, mtp_packet_hdr->code, ctx->wrbuffer, ctx->usb_wr_buffer_max_size, 0,0);
-	if(sz < 0)
-		goto error;
-
-	parent_handle = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER)+ 8, 4);     // Get param 3 - parent handle
-
-	PRINT_DEBUG("MTP_OPERATION_GET_OBJECT_HANDLES - Parent Handle 0x%.8x, Storage ID 0x%.8x",parent_handle,storageid);
-
 	if(!mtp_get_storage_root(ctx,storageid))
 	{
 		PRINT_WARN("MTP_OPERATION_GET_OBJECT_HANDLES : INVALID STORAGE ID!");
 
-		pthread_mutex_unlock( &ctx->inotify_mutex );
-
 		return MTP_RESPONSE_INVALID_STORAGE_ID;
 	}
 
+	// The folder scan only locks this storage : the other ones remain available.
+	store_index = mtp_get_storage_index_by_id(ctx, storageid);
+
+	if( mtp_db_lock_storage( ctx, store_index ) )
+		return MTP_RESPONSE_GENERAL_ERROR;
+
+	parent_handle = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER)+ 8, 4);     // Get param 3 - parent handle
+
+	PRINT_DEBUG("MTP_OPERATION_GET_OBJECT_HANDLES - Parent Handle 0x%.8x, Storage ID 0x%.8x",parent_handle,storageid);
+
 	tmp_str = NULL;
 	full_path = NULL;
 	entry = NULL;
@@ -82,7 +81,7 @@ uint32_t mtp_op_GetObjectHandles(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hd
 	if(parent_handle && parent_handle!=0xFFFFFFFF)
 	{
 		entry = get_entry_by_handle(ctx->fs_db, parent_handle);
-		if(entry)
+		if(entry && entry->storage_id == storageid)
 		{
 			tmp_str = build_full_path(ctx->fs_db, mtp_get_storage_root(ctx, entry->storage_id), entry);
 			full_path = tmp_str;
@@ -100,20 +99,13 @@ uint32_t mtp_op_GetObjectHandles(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hd
 
 	if( full_path )
 	{
-		// Count the number of files...
-		ret = -1;
-
-		if(!set_storage_giduid(ctx, storageid))
-		{
-			ret = scan_and_add_folder(ctx->fs_db, full_path, parent_handle, storageid);
-		}
-		restore_giduid(ctx);
+		ret = sync_folder(ctx, entry, full_path, parent_handle, storageid);
 
 		if(ret < 0)
 		{
 			PRINT_WARN("MTP_OPERATION_GET_OBJECT_HANDLES : FOLDER ACCESS ERROR !");
 
-			pthread_mutex_unlock( &ctx->inotify_mutex );
+			mtp_db_unlock_storage( ctx, store_index );
 
 			return MTP_RESPONSE_ACCESS_DENIED;
 		}
@@ -130,65 +122,41 @@ uint32_t mtp_op_GetObjectHandles(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hd
 		// Restart
 		init_search_handle(ctx->fs_db, parent_handle, storageid);
 
-		// Register a watch point.
-		if( entry )
-		{
-			if ( entry->flags & ENTRY_IS_DIR )
-			{
-				entry->watch_descriptor = inotify_handler_addwatch( ctx, full_path );
-			}
-		}
-
 		if (tmp_str)
 			free(tmp_str);
 	}
 
-	// Update packet size
-	poke32(ctx->wrbuffer, 0, ctx->usb_wr_buffer_max_size, sizeof(MTP_PACKET_HEADER) + ((1+nb_of_handles)*4) );
-
-	// Build and send the handles array
-	ofs = sizeof(MTP_PACKET_HEADER);
+	// Total size = Header size + nb of handles field (uint32_t) + all handles
+	dataset_writer_init(ctx, &dsw, 0);
+	dataset_writer_begin(&dsw, mtp_packet_hdr->tx_id, mtp_packet_hdr->code, sizeof(MTP_PACKET_HEADER) + sizeof(uint32_t) + (nb_of_handles * sizeof(uint32_t)) );
 
-	ofs = poke32(ctx->wrbuffer, ofs, ctx->usb_wr_buffer_max_size, nb_of_handles);
+	dataset_writer_put32(&dsw, nb_of_handles);
 
 	PRINT_DEBUG("MTP_OPERATION_GET_OBJECT_HANDLES response :");
 
 	handle_index = 0;
-	do
+	while( handle_index < nb_of_handles && (entry = get_next_child_handle(ctx->fs_db)) )
 	{
-		do
-		{
-			entry = get_next_child_handle(ctx->fs_db);
-			if(entry)
-			{
-				PRINT_DEBUG("File : %s Handle:%.8x",entry->name,entry->handle);
-				ofs = poke32(ctx->wrbuffer, ofs, ctx->usb_wr_buffer_max_size, entry->handle);
-
-				handle_index++;
-			}
-		}while( ofs >= 0 && ofs < ctx->max_packet_size && handle_index < nb_of_handles);
-
-		if(ofs < 0)
-			goto error;
-
-		PRINT_DEBUG_BUF(ctx->wrbuffer, ofs);
+		PRINT_DEBUG("File : %s Handle:%.8x",entry->name,entry->handle);
 
-		// Current usb packet full, need to send it.
-		write_usb(ctx->usb_ctx,EP_DESCRIPTOR_IN,ctx->wrbuffer,ofs);
+		if( dataset_writer_put32(&dsw, entry->handle) < 0 )
+			break;
 
-		ofs = 0;
+		handle_index++;
+	}
 
-	}while( handle_index < nb_of_handles);
+	sz = dataset_writer_end(&dsw);
+	if( sz < 0 )
+		goto error;
 
-	// Total size = Header size + nb of handles field (uint32_t) + all handles
-	check_and_send_USB_ZLP(ctx , sizeof(MTP_PACKET_HEADER) + sizeof(uint32_t) + (nb_of_handles * sizeof(uint32_t)) );
+	*size = sz;
 
-	pthread_mutex_unlock( &ctx->inotify_mutex );
+	mtp_db_unlock_storage( ctx, store_index );
 
 	return MTP_RESPONSE_OK;
 
 error:
-	pthread_mutex_unlock( &ctx->inotify_mutex );
+	mtp_db_unlock_storage( ctx, store_index );
 
 	return MTP_RESPONSE_GENERAL_ERROR;
 }
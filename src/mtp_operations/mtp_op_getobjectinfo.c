@@ -35,11 +35,13 @@
 #include "mtp_operations.h"
 #include "mtp_datasets.h"
 #include "usb_gadget_fct.h"
+#include "fs_cache.h"
 
 #include "logs_out.h"
 
 uint32_t mtp_op_GetObjectInfo(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int * size,uint32_t * ret_params, int * ret_params_size)
 {
+	int lock;
 	uint32_t handle;
 	uint32_t response_code;
 	int sz,tmp_sz;
@@ -48,7 +50,9 @@ uint32_t mtp_op_GetObjectInfo(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr,
 	if(!ctx->fs_db)
 		return MTP_RESPONSE_SESSION_NOT_OPEN;
 
-	if( pthread_mutex_lock( &ctx->inotify_mutex ) )
+	// Lookups only : the handles db writers are not blocked.
+	lock = mtp_db_read_lock( ctx );
+	if( lock < 0 )
 		return MTP_RESPONSE_GENERAL_ERROR;
 
 	handle = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER), 4); // Get param 1 - object handle
@@ -86,12 +90,16 @@ uint32_t mtp_op_GetObjectInfo(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr,
 		response_code = MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 	}
 
-	pthread_mutex_unlock( &ctx->inotify_mutex );
+	mtp_db_read_unlock( ctx, lock );
+
+	// The object will probably be read next : warm up the cache.
+	if( response_code == MTP_RESPONSE_OK )
+		fs_cache_prefetch_handle(ctx, handle);
 
 	return response_code;
 
 error:
-	pthread_mutex_unlock( &ctx->inotify_mutex );
+	mtp_db_read_unlock( ctx, lock );
 
 	return MTP_RESPONSE_GENERAL_ERROR;
 }
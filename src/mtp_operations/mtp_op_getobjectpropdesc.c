@@ -41,6 +41,7 @@
 
 uint32_t mtp_op_GetObjectPropDesc(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int * size,uint32_t * ret_params, int * ret_params_size)
 {
+	int lock;
 	uint32_t response_code;
 	uint32_t format_id;
 	uint32_t property_id;
@@ -49,7 +50,9 @@ uint32_t mtp_op_GetObjectPropDesc(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_h
 	if(!ctx->fs_db)
 		return MTP_RESPONSE_SESSION_NOT_OPEN;
 
-	if( pthread_mutex_lock( &ctx->inotify_mutex ) )
+	// Lookups only : the handles db writers are not blocked.
+	lock = mtp_db_read_lock( ctx );
+	if( lock < 0 )
 		return MTP_RESPONSE_GENERAL_ERROR;
 
 	property_id = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER), 4);  // Get param 1 - property id
@@ -89,12 +92,12 @@ uint32_t mtp_op_GetObjectPropDesc(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_h
 		response_code = MTP_RESPONSE_OPERATION_NOT_SUPPORTED;
 	}
 
-	pthread_mutex_unlock( &ctx->inotify_mutex );
+	mtp_db_read_unlock( ctx, lock );
 
 	return response_code;
 
 error:
-	pthread_mutex_unlock( &ctx->inotify_mutex );
+	mtp_db_read_unlock( ctx, lock );
 
 	return MTP_RESPONSE_GENERAL_ERROR;
 }
@@ -27,18 +27,336 @@
 
 #include <inttypes.h>
 #include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "mtp.h"
 #include "mtp_helpers.h"
 #include "mtp_constant.h"
 #include "mtp_operations.h"
 #include "mtp_properties.h"
+#include "mtp_ops_helpers.h"
+#include "mtp_dataset_writer.h"
 #include "usb_gadget_fct.h"
+#include "fs_cache.h"
 
 #include "logs_out.h"
 
+// Append an object to the properties list. Return the number of elements (< 0 : error).
+static int write_objectproplist_entry(mtp_ctx * ctx, mtp_dataset_writer * dsw, fs_entry * entry, uint32_t format_id, uint32_t prop_code, uint32_t prop_group_code, int use_index)
+{
+	int tmp_ofs,nb,ret;
+
+	if( !objectproplist_format_match(entry, format_id) )
+		return 0;
+
+	do
+	{
+		tmp_ofs = dsw->ofs;
+
+		nb = build_objectproplist_entry(ctx, dsw->buffer, &tmp_ofs, dsw->size, entry, prop_code, prop_group_code, use_index);
+
+		ret = dataset_writer_commit(dsw, nb < 0 ? -1 : tmp_ofs);
+	}while( ret > 0 );
+
+	if( ret < 0 )
+		return -1;
+
+	return nb;
+}
+
+// Bulk list walk : The db lock is released between the batches (and while the buffer is sent).
+// The entries are never freed while the session is open and the new ones are added at the
+// lists heads : Resumed from the heads recorded at the start, both passes list the same objects
+// unless some of them are deleted meanwhile (shards deletions counters).
+typedef struct objectproplist_walk_
+{
+	fs_entry * parent;
+	uint32_t format_id;
+	uint32_t prop_code;
+	uint32_t prop_group_code;
+	uint32_t depth;
+
+	fs_entry * heads[MAX_STORAGE_NB];
+	uint32_t deletions[MAX_STORAGE_NB];
+
+	int storage;        // Current storage index
+	fs_entry * entry;   // Next entry to check
+	int budget;         // Entries to check before the next db lock release
+}objectproplist_walk;
+
+static void walk_start(mtp_ctx * ctx, objectproplist_walk * walk)
+{
+	fs_db_shard * shard;
+	int i;
+
+	for( i = 0; i < MAX_STORAGE_NB; i++ )
+	{
+		walk->heads[i] = NULL;
+		walk->deletions[i] = 0;
+
+		if( !ctx->storages[i].root_path || ( ctx->storages[i].flags & UMTP_STORAGE_NOTMOUNTED ) )
+			continue;
+
+		if( walk->parent && walk->parent->storage_id != ctx->storages[i].storage_id )
+			continue;
+
+		shard = fs_db_get_shard(ctx->fs_db, ctx->storages[i].storage_id);
+		if( shard )
+		{
+			walk->heads[i] = shard->entry_list;
+			walk->deletions[i] = shard->deletions;
+		}
+	}
+}
+
+static void walk_rewind(objectproplist_walk * walk)
+{
+	walk->storage = 0;
+	walk->entry = walk->heads[0];
+	walk->budget = CONFIG_PROPLIST_BATCH;
+}
+
+// Return 1 if some entries were deleted since the walk start.
+static int walk_changed(mtp_ctx * ctx, objectproplist_walk * walk)
+{
+	fs_db_shard * shard;
+	int i;
+
+	for( i = 0; i < MAX_STORAGE_NB; i++ )
+	{
+		if( !walk->heads[i] )
+			continue;
+
+		shard = fs_db_get_shard(ctx->fs_db, ctx->storages[i].storage_id);
+		if( !shard || shard->deletions != walk->deletions[i] )
+			return 1;
+	}
+
+	return 0;
+}
+
+// Next object listed : Children of a folder (depth 1), of the storages roots (handle 0, depth 1)
+// or all the known objects (handle 0xFFFFFFFF).
+// Return NULL at the end of the list (walk->storage == MAX_STORAGE_NB) or once the batch is checked.
+static fs_entry * walk_next(mtp_ctx * ctx, objectproplist_walk * walk)
+{
+	fs_entry * entry;
+
+	while( walk->storage < MAX_STORAGE_NB && walk->budget > 0 )
+	{
+		entry = walk->entry;
+		if( !entry )
+		{
+			walk->storage++;
+			if( walk->storage < MAX_STORAGE_NB )
+				walk->entry = walk->heads[walk->storage];
+
+			continue;
+		}
+
+		walk->entry = entry->next;
+		walk->budget--;
+
+		if( ( entry->flags & ENTRY_IS_DELETED ) || entry->storage_id != ctx->storages[walk->storage].storage_id )
+			continue;
+
+		if( walk->parent )
+		{
+			if( entry->parent != walk->parent->handle || entry->handle == walk->parent->handle )
+				continue;
+		}
+		else
+		{
+			// Skip the storage root entry
+			if( !entry->handle || ( walk->depth == 1 && entry->parent ) )
+				continue;
+		}
+
+		if( objectproplist_format_match(entry, walk->format_id) )
+			return entry;
+	}
+
+	return NULL;
+}
+
+// Return the number of elements (-1 : error, -2 : objects deleted during the walk).
+// start : The walk starts with this pass.
+static int write_objectproplist(mtp_ctx * ctx, mtp_dataset_writer * dsw, objectproplist_walk * walk, int start)
+{
+	fs_entry * entry;
+	int nb,cnt,ret,tmp_ofs;
+
+	if( mtp_db_lock( ctx ) )
+		return -1;
+
+	if( start )
+		walk_start(ctx, walk);
+
+	walk_rewind(walk);
+
+	ret = walk_changed(ctx, walk) ? -2 : 0;
+
+	cnt = 0;
+	entry = NULL;
+
+	while( !ret )
+	{
+		if( !entry )
+			entry = walk_next(ctx, walk);
+
+		if( !entry && walk->storage >= MAX_STORAGE_NB )
+			break;
+
+		if( entry )
+		{
+			tmp_ofs = dsw->ofs;
+
+			nb = build_objectproplist_entry(ctx, dsw->buffer, &tmp_ofs, dsw->size, entry, walk->prop_code, walk->prop_group_code, 1);
+			if( nb >= 0 )
+			{
+				dsw->ofs = tmp_ofs;
+				cnt += nb;
+				entry = NULL;
+
+				continue;
+			}
+		}
+
+		// Buffer full (the entry is written again) or batch checked :
+		// The db writers can run while the buffer is sent.
+		mtp_db_unlock( ctx );
+
+		if( entry && dataset_writer_flush(dsw) < 0 )
+			return -1;
+
+		if( mtp_db_lock( ctx ) )
+			return -1;
+
+		if( walk_changed(ctx, walk) )
+			ret = -2;
+
+		walk->budget = CONFIG_PROPLIST_BATCH;
+	}
+
+	mtp_db_unlock( ctx );
+
+	if( ret < 0 )
+		return ret;
+
+	return cnt;
+}
+
+// Children of a folder (depth 1) or all the known objects (handle 0xFFFFFFFF) in a single data phase.
+// The list is walked twice : The number of elements is measured first, it is the first dataset field.
+static uint32_t send_bulk_objectproplist(mtp_ctx * ctx, MTP_PACKET_HEADER * mtp_packet_hdr, int * size, uint32_t handle, uint32_t format_id, uint32_t prop_code, uint32_t prop_group_code, uint32_t depth)
+{
+	mtp_dataset_writer dsw;
+	objectproplist_walk walk;
+	uint32_t response_code;
+	char * full_path;
+	mtp_size length;
+	int i,ret,tries,numberofelements;
+
+	// The folders may have to be scanned.
+	if( mtp_db_lock( ctx ) )
+		return MTP_RESPONSE_GENERAL_ERROR;
+
+	response_code = MTP_RESPONSE_OK;
+	memset(&walk, 0, sizeof(walk));
+
+	walk.format_id = format_id;
+	walk.prop_code = prop_code;
+	walk.prop_group_code = prop_group_code;
+	walk.depth = depth;
+
+	if( depth == 1 && handle != 0x00000000 && handle != 0xFFFFFFFF )
+	{
+		walk.parent = get_entry_by_handle(ctx->fs_db, handle);
+		if( !walk.parent )
+		{
+			response_code = MTP_RESPONSE_INVALID_OBJECT_HANDLE;
+		}
+		else if( walk.parent->flags & ENTRY_IS_DIR )
+		{
+			ret = -1;
+			full_path = build_full_path(ctx->fs_db, mtp_get_storage_root(ctx, walk.parent->storage_id), walk.parent);
+			if( full_path )
+			{
+				ret = sync_folder(ctx, walk.parent, full_path, walk.parent->handle, walk.parent->storage_id);
+				free(full_path);
+			}
+
+			if( ret < 0 )
+			{
+				PRINT_WARN("MTP_OPERATION_GET_OBJECT_PROP_LIST : FOLDER ACCESS ERROR !");
+				response_code = MTP_RESPONSE_ACCESS_DENIED;
+			}
+		}
+	}
+	else if( depth == 1 )
+	{
+		// Storages roots content
+		for( i = 0; i < MAX_STORAGE_NB; i++ )
+		{
+			if( !ctx->storages[i].root_path || ( ctx->storages[i].flags & UMTP_STORAGE_NOTMOUNTED ) )
+				continue;
+
+			ret = sync_folder(ctx, get_entry_by_handle_and_storageid(ctx->fs_db, 0x00000000, ctx->storages[i].storage_id), ctx->storages[i].root_path, 0x00000000, ctx->storages[i].storage_id);
+			if( ret < 0 )
+				PRINT_WARN("MTP_OPERATION_GET_OBJECT_PROP_LIST : STORAGE 0x%.8X ACCESS ERROR !", ctx->storages[i].storage_id);
+		}
+	}
+
+	mtp_db_unlock( ctx );
+
+	if( response_code != MTP_RESPONSE_OK )
+		return response_code;
+
+	// First pass : Number of elements (started again if objects are deleted meanwhile).
+	tries = 0;
+	do
+	{
+		dataset_writer_init(ctx, &dsw, 1);
+		dataset_writer_begin(&dsw, mtp_packet_hdr->tx_id, mtp_packet_hdr->code, 0);
+
+		numberofelements = write_objectproplist(ctx, &dsw, &walk, 1);
+	}while( numberofelements == -2 && ++tries < 3 );
+
+	if( numberofelements < 0 )
+		return MTP_RESPONSE_GENERAL_ERROR;
+
+	PRINT_DEBUG("MTP_OPERATION_GET_OBJECT_PROP_LIST response (%d elements)",numberofelements);
+
+	// Second pass : The dataset is sent while it is built.
+	// Its size isn't known : The media metadata may be indexed meanwhile.
+	dataset_writer_init(ctx, &dsw, 0);
+	dataset_writer_begin(&dsw, mtp_packet_hdr->tx_id, mtp_packet_hdr->code, DATASET_UNKNOWN_LENGTH);
+
+	dataset_writer_put32(&dsw, numberofelements);   // Number of elements
+
+	ret = write_objectproplist(ctx, &dsw, &walk, 0);
+	if( ret != numberofelements )
+	{
+		PRINT_WARN("MTP_OPERATION_GET_OBJECT_PROP_LIST : objects deleted during the transfer !");
+		response_code = MTP_RESPONSE_GENERAL_ERROR;
+	}
+
+	// The data phase is ended in any case.
+	length = dataset_writer_end(&dsw);
+	if( length < 0 )
+		response_code = MTP_RESPONSE_GENERAL_ERROR;
+	else
+		*size = length;
+
+	return response_code;
+}
+
 uint32_t mtp_op_GetObjectPropList(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int * size,uint32_t * ret_params, int * ret_params_size)
 {
+	mtp_dataset_writer dsw;
+	int lock;
 	fs_entry * entry;
 	uint32_t response_code;
 	uint32_t handle;
@@ -46,14 +364,12 @@ uint32_t mtp_op_GetObjectPropList(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_h
 	uint32_t prop_code;
 	uint32_t prop_group_code;
 	uint32_t depth;
-	int sz,tmp_sz;
+	mtp_size sz;
+	int nb;
 
 	if(!ctx->fs_db)
 		return MTP_RESPONSE_SESSION_NOT_OPEN;
 
-	if( pthread_mutex_lock( &ctx->inotify_mutex ) )
-		return MTP_RESPONSE_GENERAL_ERROR;
-
 	handle = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER), 4);
 	format_id = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER) + 4, 4);
 	prop_code = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER) + 8, 4);
@@ -62,52 +378,46 @@ uint32_t mtp_op_GetObjectPropList(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_h
 
 	PRINT_DEBUG("MTP_OPERATION_GET_OBJECT_PROP_LIST :(Handle: 0x%.8X FormatCode: 0x%.8X ObjPropCode: 0x%.8X ObjPropGroupCode: 0x%.8X Depth: %d)", handle, format_id, prop_code, prop_group_code, depth);
 
-	if( format_id != 0x00000000 )
-	{   // Specification by format not currently supported
-		response_code = MTP_RESPONSE_SPECIFICATION_BY_FORMAT_UNSUPPORTED;
-	}
-
-	if( prop_code == 0x00000000 )
-	{   // ObjectPropGroupCode not currently supported
+	if( prop_code == 0x00000000 && prop_group_code == 0x00000000 )
+	{
+		PRINT_DEBUG("MTP_OPERATION_GET_OBJECT_PROP_LIST : ObjectPropGroupCode 0x00000000 not supported !");
 
-		if( prop_group_code == 0x00000000 )
-		{
-			response_code = MTP_RESPONSE_PARAMETER_NOT_SUPPORTED;
+		return MTP_RESPONSE_PARAMETER_NOT_SUPPORTED;
+	}
 
-			PRINT_DEBUG("MTP_OPERATION_GET_OBJECT_PROP_LIST : ObjectPropGroupCode not currently supported !");
+	// All the objects, or all the children of a folder.
+	if( handle == 0xFFFFFFFF || ( handle == 0x00000000 && depth == 0xFFFFFFFF ) )
+		return send_bulk_objectproplist(ctx, mtp_packet_hdr, size, 0xFFFFFFFF, format_id, prop_code, prop_group_code, 0xFFFFFFFF);
 
-			pthread_mutex_unlock( &ctx->inotify_mutex );
+	if( depth == 1 )
+		return send_bulk_objectproplist(ctx, mtp_packet_hdr, size, handle, format_id, prop_code, prop_group_code, depth);
 
-			return MTP_RESPONSE_PARAMETER_NOT_SUPPORTED;
-		}
-		else
-		{
-		}
+	if( depth )
+		return MTP_RESPONSE_SPECIFICATION_BY_DEPTH_UNSUPPORTED;
 
-	}
+	// Lookups only : the handles db writers are not blocked.
+	lock = mtp_db_read_lock( ctx );
+	if( lock < 0 )
+		return MTP_RESPONSE_GENERAL_ERROR;
 
 	entry = get_entry_by_handle(ctx->fs_db, handle);
 	if( entry )
 	{
-		sz = build_response(ctx, mtp_packet_hdr->tx_id, MTP_CONTAINER_TYPE_DATA, mtp_packet_hdr->code, ctx->wrbuffer, ctx->usb_wr_buffer_max_size,0,0);
-		if(sz < 0)
-			goto error;
-
-		tmp_sz = build_objectproplist_dataset(ctx, ctx->wrbuffer + sizeof(MTP_PACKET_HEADER),ctx->usb_wr_buffer_max_size - sizeof(MTP_PACKET_HEADER),entry, handle, format_id, prop_code, prop_group_code, depth);
-		if( tmp_sz < 0)
-			goto error;
+		// Single object : The container length is set once the dataset is built.
+		dataset_writer_init(ctx, &dsw, 0);
+		dataset_writer_begin(&dsw, mtp_packet_hdr->tx_id, mtp_packet_hdr->code, 0);
 
-		sz += tmp_sz;
+		dataset_writer_put32(&dsw, 0);   // Number of elements
 
-		// Update packet size
-		poke32(ctx->wrbuffer, 0, ctx->usb_wr_buffer_max_size, sz);
-
-		PRINT_DEBUG("MTP_OPERATION_GET_OBJECT_PROP_LIST response (%d Bytes):",sz);
-		PRINT_DEBUG_BUF(ctx->wrbuffer, sz);
+		nb = write_objectproplist_entry(ctx, &dsw, entry, format_id, prop_code, prop_group_code, 0);
+		if( nb < 0 )
+			goto error;
 
-		write_usb(ctx->usb_ctx,EP_DESCRIPTOR_IN,ctx->wrbuffer,sz);
+		poke32(dsw.buffer, sizeof(MTP_PACKET_HEADER), dsw.size, nb);   // Number of elements
 
-		check_and_send_USB_ZLP(ctx , sz );
+		sz = dataset_writer_end(&dsw);
+		if( sz < 0 )
+			goto error;
 
 		*size = sz;
 
@@ -117,12 +427,16 @@ uint32_t mtp_op_GetObjectPropList(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_h
 	{
 		response_code = MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 	}
-	pthread_mutex_unlock( &ctx->inotify_mutex );
+	mtp_db_read_unlock( ctx, lock );
+
+	// Single object : It will probably be read next.
+	if( response_code == MTP_RESPONSE_OK )
+		fs_cache_prefetch_handle(ctx, handle);
 
 	return response_code;
 
 error:
-	pthread_mutex_unlock( &ctx->inotify_mutex );
+	mtp_db_read_unlock( ctx, lock );
 
 	return MTP_RESPONSE_GENERAL_ERROR;
 }
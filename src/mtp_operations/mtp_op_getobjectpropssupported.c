@@ -34,38 +34,35 @@
 #include "mtp_operations.h"
 #include "mtp_properties.h"
 #include "usb_gadget_fct.h"
+#include "mtp_dataset_writer.h"
 
 #include "logs_out.h"
 
 uint32_t mtp_op_GetObjectPropsSupported(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int * size,uint32_t * ret_params, int * ret_params_size)
 {
+	mtp_dataset_writer dsw;
 	uint32_t format_id;
-	int sz,tmp_sz;
+	mtp_size sz;
+	int tmp_sz;
 
 	if(!ctx->fs_db)
 		return MTP_RESPONSE_SESSION_NOT_OPEN;
 
 	format_id = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER), 4); // Get param 1 - format
 
-	sz = build_response(ctx, mtp_packet_hdr->tx_id, MTP_CONTAINER_TYPE_DATA, mtp_packet_hdr->code, ctx->wrbuffer, ctx->usb_wr_buffer_max_size, 0,0);
-	if(sz < 0)
+	dataset_writer_init(ctx, &dsw, 0);
+	if( dataset_writer_begin(&dsw, mtp_packet_hdr->tx_id, mtp_packet_hdr->code, 0) < 0 )
 		goto error;
 
-	tmp_sz = build_properties_supported_dataset(ctx,ctx->wrbuffer + sizeof(MTP_PACKET_HEADER), ctx->usb_wr_buffer_max_size - sizeof(MTP_PACKET_HEADER), format_id);
-	if(tmp_sz < 0)
+	tmp_sz = build_properties_supported_dataset(ctx, dsw.buffer + dsw.ofs, dsw.size - dsw.ofs, format_id);
+	if( dataset_writer_commit(&dsw, tmp_sz < 0 ? -1 : dsw.ofs + tmp_sz) )
 		goto error;
 
-	sz += tmp_sz;
-
-	// Update packet size
-	poke32(ctx->wrbuffer, 0, ctx->usb_wr_buffer_max_size, sz);
-
-	PRINT_DEBUG("MTP_OPERATION_GET_OBJECT_PROPS_SUPPORTED response (%d Bytes):",sz);
-	PRINT_DEBUG_BUF(ctx->wrbuffer, sz);
+	PRINT_DEBUG("MTP_OPERATION_GET_OBJECT_PROPS_SUPPORTED response (%d Bytes):",dsw.ofs);
 
-	write_usb(ctx->usb_ctx,EP_DESCRIPTOR_IN,ctx->wrbuffer,sz);
-
-	check_and_send_USB_ZLP(ctx , sz );
+	sz = dataset_writer_end(&dsw);
+	if(sz < 0)
+		goto error;
 
 	*size = sz;
 
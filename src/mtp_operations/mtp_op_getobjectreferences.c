@@ -33,20 +33,25 @@
 #include "mtp_constant.h"
 #include "mtp_operations.h"
 #include "usb_gadget_fct.h"
+#include "mtp_dataset_writer.h"
 
 #include "logs_out.h"
 
 uint32_t mtp_op_GetObjectReferences(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int * size,uint32_t * ret_params, int * ret_params_size)
 {
+	mtp_dataset_writer dsw;
+	int lock;
 	uint32_t response_code;
 	uint32_t handle;
 	fs_entry * entry;
-	int sz;
+	mtp_size sz;
 
 	if(!ctx->fs_db)
 		return MTP_RESPONSE_SESSION_NOT_OPEN;
 
-	if( pthread_mutex_lock( &ctx->inotify_mutex ) )
+	// Lookups only : the handles db writers are not blocked.
+	lock = mtp_db_read_lock( ctx );
+	if( lock < 0 )
 		return MTP_RESPONSE_GENERAL_ERROR;
 
 	handle = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER), 4);
@@ -54,38 +59,31 @@ uint32_t mtp_op_GetObjectReferences(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet
 	entry = get_entry_by_handle(ctx->fs_db, handle);
 	if( entry )
 	{
-		sz = build_response(ctx, mtp_packet_hdr->tx_id, MTP_CONTAINER_TYPE_DATA, mtp_packet_hdr->code, ctx->wrbuffer, ctx->usb_wr_buffer_max_size, 0,0);
+		// No references : Empty array.
+		dataset_writer_init(ctx, &dsw, 0);
+		dataset_writer_begin(&dsw, mtp_packet_hdr->tx_id, mtp_packet_hdr->code, 0);
 
-		sz = poke32(ctx->wrbuffer, sz, ctx->usb_wr_buffer_max_size, 0x0000000);
+		dataset_writer_put32(&dsw, 0x00000000);
 
+		sz = dataset_writer_end(&dsw);
 		if(sz < 0)
 			goto error;
 
-		// Update packet size
-		poke32(ctx->wrbuffer, 0, ctx->usb_wr_buffer_max_size, sz);
-
-		PRINT_DEBUG("MTP_OPERATION_GET_OBJECT_REFERENCES response (%d Bytes):",sz);
-		PRINT_DEBUG_BUF(ctx->wrbuffer, sz);
-
-		write_usb(ctx->usb_ctx,EP_DESCRIPTOR_IN,ctx->wrbuffer,sz);
-
-		check_and_send_USB_ZLP(ctx , sz );
+		*size = sz;
 
 		response_code = MTP_RESPONSE_OK;
-
-		*size = sz;
 	}
 	else
 	{
 		response_code = MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 	}
 
-	pthread_mutex_unlock( &ctx->inotify_mutex );
+	mtp_db_read_unlock( ctx, lock );
 
 	return response_code;
 
 error:
-	pthread_mutex_unlock( &ctx->inotify_mutex );
+	mtp_db_read_unlock( ctx, lock );
 
 	return MTP_RESPONSE_GENERAL_ERROR;
 }
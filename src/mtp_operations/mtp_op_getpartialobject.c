@@ -39,7 +39,7 @@
 
 uint32_t mtp_op_GetPartialObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int * size,uint32_t * ret_params, int * ret_params_size)
 {
-	int sz;
+	int sz,store_index;
 	uint32_t response_code;
 	uint32_t handle;
 	fs_entry * entry;
@@ -50,11 +50,18 @@ uint32_t mtp_op_GetPartialObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hd
 	if(!ctx->fs_db)
 		return MTP_RESPONSE_SESSION_NOT_OPEN;
 
-	if( pthread_mutex_lock( &ctx->inotify_mutex ) )
-		return MTP_RESPONSE_GENERAL_ERROR;
-
 	handle = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER), 4);           // Get param 1 - Object handle
 
+	// Only the object storage is locked.
+	store_index = FS_DB_HANDLE_SHARD(handle);
+
+	// No storage for this handle : Unknown handle.
+	if( store_index >= MAX_STORAGE_NB || !ctx->storages[store_index].root_path )
+		return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
+
+	if( mtp_db_lock_storage( ctx, store_index ) )
+		return MTP_RESPONSE_GENERAL_ERROR;
+
 	if( mtp_packet_hdr->code == MTP_OPERATION_GET_PARTIAL_OBJECT_64 )
 	{
 		offset = peek64(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER) + 4, 8); // Get param 2 - Offset in bytes
@@ -72,7 +79,7 @@ uint32_t mtp_op_GetPartialObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hd
 
 	if( check_handle_access( ctx, entry, handle, 0, &response_code) )
 	{
-		pthread_mutex_unlock( &ctx->inotify_mutex );
+		mtp_db_unlock_storage( ctx, store_index );
 		return response_code;
 	}
 
@@ -92,7 +99,7 @@ uint32_t mtp_op_GetPartialObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hd
 		{
 			if(actualsize == -2)
 			{
-				pthread_mutex_unlock( &ctx->inotify_mutex );
+				mtp_db_unlock_storage( ctx, store_index );
 				return MTP_RESPONSE_NO_RESPONSE;
 			}
 		}
@@ -108,12 +115,12 @@ uint32_t mtp_op_GetPartialObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hd
 		response_code = MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 	}
 
-	pthread_mutex_unlock( &ctx->inotify_mutex );
+	mtp_db_unlock_storage( ctx, store_index );
 
 	return response_code;
 
 error:
-	pthread_mutex_unlock( &ctx->inotify_mutex );
+	mtp_db_unlock_storage( ctx, store_index );
 
 	return MTP_RESPONSE_GENERAL_ERROR;
 }
@@ -34,20 +34,19 @@
 #include "mtp_operations.h"
 
 #include "usb_gadget_fct.h"
+#include "mtp_dataset_writer.h"
 
 #include "logs_out.h"
 
 uint32_t mtp_op_GetStorageIDs(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int * size,uint32_t * ret_params, int * ret_params_size)
 {
-	int ofs,i,cnt;
+	mtp_dataset_writer dsw;
+	mtp_size sz;
+	int i,cnt;
 
 	if(!ctx->fs_db)
 		return MTP_RESPONSE_SESSION_NOT_OPEN;
 
-	ofs = build_response(ctx, mtp_packet_hdr->tx_id, MTP_CONTAINER_TYPE_DATA, mtp_packet_hdr->code, ctx->wrbuffer, ctx->usb_wr_buffer_max_size, 0,0);
-	if(ofs < 0)
-		goto error;
-
 	cnt = 0;
 	i = 0;
 	while( (i < MAX_STORAGE_NB) && ctx->storages[i].root_path)
@@ -61,21 +60,21 @@ uint32_t mtp_op_GetStorageIDs(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr,
 		i++;
 	}
 
-	ofs = poke_array(ctx->wrbuffer, ofs, ctx->usb_wr_buffer_max_size, 4 * cnt, 4, (void*)ctx->temp_array, 1);
-	if(ofs < 0)
-		goto error;
+	dataset_writer_init(ctx, &dsw, 0);
+	dataset_writer_begin(&dsw, mtp_packet_hdr->tx_id, mtp_packet_hdr->code, sizeof(MTP_PACKET_HEADER) + sizeof(uint32_t) + (cnt * sizeof(uint32_t)) );
 
-	// Update packet size
-	poke32(ctx->wrbuffer, 0, ctx->usb_wr_buffer_max_size, ofs);
+	dataset_writer_put32(&dsw, cnt);
 
-	PRINT_DEBUG("MTP_OPERATION_GET_STORAGE_IDS response (%d Bytes):",ofs);
-	PRINT_DEBUG_BUF(ctx->wrbuffer, ofs);
+	for( i = 0; i < cnt; i++ )
+		dataset_writer_put32(&dsw, ctx->temp_array[i]);
 
-	write_usb(ctx->usb_ctx,EP_DESCRIPTOR_IN,ctx->wrbuffer,ofs);
+	PRINT_DEBUG("MTP_OPERATION_GET_STORAGE_IDS response (%d Storages):",cnt);
 
-	check_and_send_USB_ZLP(ctx , ofs );
+	sz = dataset_writer_end(&dsw);
+	if(sz < 0)
+		goto error;
 
-	*size = ofs;
+	*size = sz;
 
 	return MTP_RESPONSE_OK;
 
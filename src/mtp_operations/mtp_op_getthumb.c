@@ -0,0 +1,102 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/**
+ * @file   mtp_op_getthumb.c
+ * @brief  Get thumb operation.
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+#include "buildconf.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "mtp.h"
+#include "mtp_helpers.h"
+#include "mtp_constant.h"
+#include "mtp_operations.h"
+#include "mtp_dataset_writer.h"
+#include "mtp_thumb.h"
+
+#include "logs_out.h"
+
+uint32_t mtp_op_GetThumb(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int * size,uint32_t * ret_params, int * ret_params_size)
+{
+	mtp_dataset_writer dsw;
+	struct stat64 entrystat;
+	unsigned char * thumb;
+	uint32_t handle;
+	fs_entry * entry;
+	char * path;
+	int lock,thumb_size;
+	mtp_size sz;
+
+	if(!ctx->fs_db)
+		return MTP_RESPONSE_SESSION_NOT_OPEN;
+
+	lock = mtp_db_read_lock( ctx );
+	if( lock < 0 )
+		return MTP_RESPONSE_GENERAL_ERROR;
+
+	handle = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER), 4); // Get param 1 - object handle
+
+	path = NULL;
+	entry = get_entry_by_handle(ctx->fs_db, handle);
+	if( entry && !(entry->flags & ENTRY_IS_DIR) )
+		path = build_full_path(ctx->fs_db, mtp_get_storage_root(ctx, entry->storage_id), entry);
+
+	mtp_db_read_unlock( ctx, lock );
+
+	if( !entry )
+	{
+		PRINT_WARN("MTP_OPERATION_GET_THUMB ! : Entry/Handle not found (0x%.8X)", handle);
+
+		return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
+	}
+
+	thumb = NULL;
+	if( path && !stat64(path, &entrystat) )
+		thumb = mtp_thumb_get(ctx, path, &entrystat, &thumb_size);
+
+	free(path);
+
+	if( !thumb )
+		return MTP_RESPONSE_NO_THUMBNAIL_PRESENT;
+
+	dataset_writer_init(ctx, &dsw, 0);
+	dataset_writer_begin(&dsw, mtp_packet_hdr->tx_id, mtp_packet_hdr->code, sizeof(MTP_PACKET_HEADER) + thumb_size);
+	dataset_writer_put_data(&dsw, thumb, thumb_size);
+	sz = dataset_writer_end(&dsw);
+
+	free(thumb);
+
+	if( sz < 0 )
+		return MTP_RESPONSE_GENERAL_ERROR;
+
+	*size = sz;
+
+	__atomic_fetch_add(&ctx->stats.thumb_sent, 1, __ATOMIC_RELAXED);
+
+	return MTP_RESPONSE_OK;
+}
@@ -32,6 +32,7 @@
 #include "mtp_helpers.h"
 #include "mtp_constant.h"
 #include "mtp_operations.h"
+#include "mtp_journal.h"
 
 #include "logs_out.h"
 
@@ -63,19 +64,23 @@ uint32_t mtp_op_OpenSession(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, in
 		return MTP_RESPONSE_GENERAL_ERROR;
 	}
 
+	ctx->session_stats = ctx->stats;
+
 	i = 0;
 	while( (i < MAX_STORAGE_NB) && ctx->storages[i].root_path)
 	{
-		if( pthread_mutex_lock( &ctx->inotify_mutex ) )
+		if( mtp_db_lock_storage( ctx, i ) )
 			return MTP_RESPONSE_GENERAL_ERROR;
 
 		alloc_root_entry(ctx->fs_db, ctx->storages[i].storage_id);
 
-		pthread_mutex_unlock( &ctx->inotify_mutex );
+		mtp_db_unlock_storage( ctx, i );
 
 		i++;
 	}
 
+	mtp_journal_session_open(ctx);
+
 	PRINT_DEBUG("Open session - ID 0x%.8x",ctx->session_id);
 
 	return MTP_RESPONSE_OK;
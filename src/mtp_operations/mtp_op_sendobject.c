@@ -31,7 +31,10 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
+#include <errno.h>
 
 #include "logs_out.h"
 
@@ -39,6 +42,10 @@
 #include "mtp_helpers.h"
 #include "mtp_constant.h"
 #include "mtp_operations.h"
+#include "mtp_ops_helpers.h"
+#include "fs_cache.h"
+#include "inotify.h"
+#include "mtp_journal.h"
 
 #include "usb_gadget_fct.h"
 
@@ -51,11 +58,13 @@ uint32_t mtp_op_SendObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int
 	int flags;
 	mode_t mode;
 	int sz;
+	int write_error;
+	struct timespec times[2];
 
 	if(!ctx->fs_db)
 		return MTP_RESPONSE_SESSION_NOT_OPEN;
 
-	if( pthread_mutex_lock( &ctx->inotify_mutex ) )
+	if( mtp_db_lock( ctx ) )
 		return MTP_RESPONSE_GENERAL_ERROR;
 
 	response_code = MTP_RESPONSE_GENERAL_ERROR;
@@ -79,11 +88,14 @@ uint32_t mtp_op_SendObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int
 
 					if( check_handle_access( ctx, entry, 0x00000000, 1, &response_code) )
 					{
-						pthread_mutex_unlock( &ctx->inotify_mutex );
+						mtp_db_unlock( ctx );
 
 						return response_code;
 					}
 
+					// The cached file descriptor and blocks are outdated by this write.
+					fs_cache_invalidate(ctx, entry->handle);
+
 					if( mtp_packet_hdr->code == MTP_OPERATION_SEND_PARTIAL_OBJECT )
 					{
 						flags = O_RDWR | O_LARGEFILE;
@@ -91,17 +103,44 @@ uint32_t mtp_op_SendObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int
 					}
 					else
 					{
-						flags = O_CREAT | O_WRONLY | O_TRUNC | O_LARGEFILE;
+						// No O_TRUNC : Keep the blocks reserved by SendObjectInfo.
+						// The file is truncated to the received size at the end of the transfer.
+						flags = O_CREAT | O_WRONLY | O_LARGEFILE;
 						mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
 					}
 
-					file = entry_open(ctx->fs_db, entry, flags, mode);
+					file = -1;
+
+					if( ( mtp_get_storage_flags(ctx, entry->storage_id) & UMTP_STORAGE_DIRECT_IO ) &&
+						!( ctx->SendObjInfoOffset & (CONFIG_DIRECT_IO_ALIGNMENT-1) ) )
+					{
+						file = entry_open(ctx->fs_db, entry, flags | O_DIRECT, mode);
+						if( file == -1 )
+						{
+							PRINT_DEBUG("SEND_OBJECT : O_DIRECT open failure, fallback to buffered I/O");
+						}
+					}
+
+					if( file == -1 )
+						file = entry_open(ctx->fs_db, entry, flags, mode);
+
+					if( file != -1 && file_wrcache_open(ctx, file, ctx->SendObjInfoOffset) )
+					{
+						if( mtp_packet_hdr->code != MTP_OPERATION_SEND_PARTIAL_OBJECT )
+							entry_close(ctx->fs_db, entry);
+
+						file = -1;
+					}
 
 					if( file != -1 )
 					{
+						inotify_handler_echo_begin(ctx, entry->storage_id, entry->parent, entry->name, IN_MODIFY);
+
 						ctx->transferring_file_data = 1;
 
-						lseek64(file, ctx->SendObjInfoOffset, SEEK_SET);
+						// The data phase runs without the db lock : The entry is pinned until the end of the transfer.
+						entry_pin(entry);
+						mtp_db_unlock( ctx );
 
 						sz = *size - sizeof(MTP_PACKET_HEADER);
 						tmp_ptr = ((unsigned char*)mtp_packet_hdr) ;
@@ -109,15 +148,11 @@ uint32_t mtp_op_SendObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int
 
 						if(sz > 0)
 						{
-							if( write(file, tmp_ptr, sz) != sz)
-							{
-								// TODO : Handle this error case properly
-							}
+							file_wrcache_write(ctx, tmp_ptr, sz);
 
 							ctx->SendObjInfoSize -= sz;
 						}
 
-						tmp_ptr = ctx->rdbuffer2;
 						if( sz == ( ctx->usb_rd_buffer_max_size - sizeof(MTP_PACKET_HEADER) ) )
 						{
 							sz = ctx->usb_rd_buffer_max_size;
@@ -130,20 +165,52 @@ uint32_t mtp_op_SendObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int
 
 						while( ( sz == ctx->usb_rd_buffer_max_size ) && ( !ctx->cancel_req ) && ( sz >= 0 ) )
 						{
-							sz = read_usb(ctx->usb_ctx, ctx->rdbuffer2, ctx->usb_rd_buffer_max_size);
+							// Receive the data directly into the write coalescing buffer.
+							tmp_ptr = file_wrcache_getbuf(ctx, ctx->usb_rd_buffer_max_size);
+
+							sz = read_usb(ctx->usb_ctx, tmp_ptr, ctx->usb_rd_buffer_max_size);
 
 							if( sz >= 0 )
 							{
-								if( write(file, tmp_ptr, sz) != sz)
-								{
-									// TODO : Handle this error case properly
-								}
+								file_wrcache_commit(ctx, sz);
 
 								ctx->SendObjInfoSize -= sz;
 							}
 						};
 
+						write_error = file_wrcache_close(ctx);
+
+						if( mtp_packet_hdr->code != MTP_OPERATION_SEND_PARTIAL_OBJECT )
+						{
+							// Set the final file size and release the unused preallocated blocks.
+							if( ftruncate64(file, ctx->write_file_offset) && !write_error )
+								write_error = errno;
+						}
+
+						if( mtp_db_lock( ctx ) )
+							PRINT_ERROR("SEND_OBJECT : Mutex lock error !");
+
+						entry_unpin(ctx->fs_db, entry);
+
 						entry->size = lseek64(file, 0, SEEK_END);
+						entry->date = 0; // Modification time read again when needed
+
+						// Modification time given by SendObjectPropList.
+						if( mtp_packet_hdr->code != MTP_OPERATION_SEND_PARTIAL_OBJECT && ctx->SendObjInfoDate && !write_error )
+						{
+							times[0].tv_sec = ctx->SendObjInfoDate;
+							times[0].tv_nsec = 0;
+							times[1] = times[0];
+
+							if( !futimens(file, times) )
+								entry->date = ctx->SendObjInfoDate;
+						}
+
+						ctx->SendObjInfoDate = 0;
+
+						inotify_handler_echo_end(ctx, entry->storage_id, entry->parent, entry->name);
+
+						mtp_journal_entry(ctx, JOURNAL_MODIFY, entry, 0);
 
 						ctx->transferring_file_data = 0;
 
@@ -154,12 +221,21 @@ uint32_t mtp_op_SendObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int
 						{
 							ctx->cancel_req = 0;
 
-							pthread_mutex_unlock( &ctx->inotify_mutex );
+							mtp_db_unlock( ctx );
 
 							return MTP_RESPONSE_NO_RESPONSE;
 						}
 
-						response_code = MTP_RESPONSE_OK;
+						if( write_error )
+						{
+							PRINT_ERROR("SEND_OBJECT : Handle 0x%.8x write error (%s) !", entry->handle, strerror(write_error));
+
+							response_code = posix_to_mtp_errcode(write_error);
+						}
+						else
+						{
+							response_code = MTP_RESPONSE_OK;
+						}
 					}
 				}
 				else
@@ -172,7 +248,7 @@ uint32_t mtp_op_SendObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int
 
 				if( check_handle_access( ctx, NULL, ctx->SendObjInfoHandle, 1, &response_code) )
 				{
-					pthread_mutex_unlock( &ctx->inotify_mutex );
+					mtp_db_unlock( ctx );
 
 					return response_code;
 				}
@@ -191,7 +267,7 @@ uint32_t mtp_op_SendObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int
 		response_code = MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 	}
 
-	if( pthread_mutex_unlock( &ctx->inotify_mutex ) )
+	if( mtp_db_unlock( ctx ) )
 	{
 		response_code = MTP_RESPONSE_GENERAL_ERROR;
 	}
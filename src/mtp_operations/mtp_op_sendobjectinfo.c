@@ -48,7 +48,7 @@ uint32_t mtp_op_SendObjectInfo(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr,
 	if(!ctx->fs_db)
 		return MTP_RESPONSE_SESSION_NOT_OPEN;
 
-	if( pthread_mutex_lock( &ctx->inotify_mutex ) )
+	if( mtp_db_lock( ctx ) )
 		return MTP_RESPONSE_GENERAL_ERROR;
 
 	storageid = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER), 4);         // Get param 1 - storage id
@@ -71,7 +71,7 @@ uint32_t mtp_op_SendObjectInfo(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr,
 		*ret_params_size = sizeof(uint32_t) * 3;
 	}
 
-	pthread_mutex_unlock( &ctx->inotify_mutex );
+	mtp_db_unlock( ctx );
 
 	*size = sz;
 
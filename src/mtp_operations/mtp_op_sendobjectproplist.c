@@ -0,0 +1,250 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/**
+ * @file   mtp_op_sendobjectproplist.c
+ * @brief  send object prop list operation
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+#include "buildconf.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "mtp.h"
+#include "mtp_helpers.h"
+#include "mtp_constant.h"
+#include "mtp_datasets.h"
+#include "mtp_operations.h"
+#include "mtp_sanitize.h"
+#include "usb_gadget_fct.h"
+
+#include "logs_out.h"
+
+// Skip a property value. Return the index after the value (< 0 : invalid type or value outside the dataset).
+static int skip_value(void * dataset, int ofs, int size, uint16_t data_type)
+{
+	int elementsize;
+	uint32_t nb;
+
+	switch( data_type & ~0x4000 )
+	{
+		case MTP_TYPE_INT8:
+		case MTP_TYPE_UINT8:
+			elementsize = 1;
+		break;
+		case MTP_TYPE_INT16:
+		case MTP_TYPE_UINT16:
+			elementsize = 2;
+		break;
+		case MTP_TYPE_INT32:
+		case MTP_TYPE_UINT32:
+			elementsize = 4;
+		break;
+		case MTP_TYPE_INT64:
+		case MTP_TYPE_UINT64:
+			elementsize = 8;
+		break;
+		case MTP_TYPE_INT128:
+		case MTP_TYPE_UINT128:
+			elementsize = 16;
+		break;
+		default:
+			return -1;
+		break;
+	}
+
+	nb = 1;
+
+	if( data_type & 0x4000 )
+	{
+		// Array : Number of elements first.
+		if( ofs + 4 > size )
+			return -1;
+
+		nb = peek(dataset, ofs, 4);
+		ofs += 4;
+	}
+
+	if( nb > (uint32_t)(size - ofs) / elementsize )
+		return -1;
+
+	return ofs + (nb * elementsize);
+}
+
+// ObjectPropList dataset : Number of elements, then { ObjectHandle, PropertyCode, Datatype, Value } elements.
+static uint32_t parse_objectproplist(void * dataset, int size, char * name, int namesize, time_t * date, uint32_t * failed_index)
+{
+	char tmp_str[256+1];
+	char title[256+1];
+	uint32_t nb_of_elements;
+	uint32_t i;
+	uint16_t prop_code;
+	uint16_t data_type;
+	int ofs;
+
+	name[0] = '\0';
+	title[0] = '\0';
+	*date = 0;
+
+	if( size < 4 )
+		return MTP_RESPONSE_INVALID_DATASET;
+
+	nb_of_elements = peek(dataset, 0, 4);
+	ofs = 4;
+
+	for( i = 0; i < nb_of_elements; i++ )
+	{
+		*failed_index = i;
+
+		if( ofs + 8 > size )
+			return MTP_RESPONSE_INVALID_DATASET;
+
+		// ObjectHandle (unused, 0x00000000)
+		prop_code = peek(dataset, ofs + 4, 2);
+		data_type = peek(dataset, ofs + 6, 2);
+		ofs += 8;
+
+		if( data_type != MTP_TYPE_STR )
+		{
+			ofs = skip_value(dataset, ofs, size, data_type);
+			if( ofs < 0 )
+				return MTP_RESPONSE_INVALID_OBJECT_PROP_FORMAT;
+
+			continue;
+		}
+
+		ofs = peek_string(dataset, ofs, size, tmp_str, sizeof(tmp_str));
+		if( ofs < 0 )
+			return MTP_RESPONSE_INVALID_DATASET;
+
+		PRINT_DEBUG("MTP_OPERATION_SEND_OBJECT_PROP_LIST : Property 0x%.4X : %s", prop_code, tmp_str);
+
+		switch( prop_code )
+		{
+			case MTP_PROPERTY_OBJECT_FILE_NAME:
+				snprintf(name, namesize, "%s", tmp_str);
+			break;
+
+			case MTP_PROPERTY_NAME:
+				snprintf(title, sizeof(title), "%s", tmp_str);
+			break;
+
+			case MTP_PROPERTY_DATE_MODIFIED:
+				*date = parse_date_string(tmp_str);
+			break;
+
+			default:
+			break;
+		}
+	}
+
+	// No file name : Use the object name.
+	if( !name[0] )
+		snprintf(name, namesize, "%s", title);
+
+	*failed_index = 0x00000000;
+
+	if( sanitize_name(name, namesize) != 1 )
+	{
+		PRINT_ERROR("MTP_OPERATION_SEND_OBJECT_PROP_LIST : Malformed object name !");
+		return MTP_RESPONSE_INVALID_DATASET;
+	}
+
+	return MTP_RESPONSE_OK;
+}
+
+uint32_t mtp_op_SendObjectPropList(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int * size,uint32_t * ret_params, int * ret_params_size)
+{
+	uint32_t response_code;
+	uint32_t storageid;
+	uint32_t parent_handle;
+	uint32_t format_id;
+	uint32_t new_handle;
+	uint32_t failed_index;
+	mtp_size objectsize;
+	char name[256+1];
+	time_t date;
+	int sz;
+
+	if(!ctx->fs_db)
+		return MTP_RESPONSE_SESSION_NOT_OPEN;
+
+	storageid = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER), 4);           // Get param 1 - storage id
+	parent_handle = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER) + 4, 4);   // Get param 2 - parent handle
+	format_id = peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER) + 8, 4);       // Get param 3 - object format
+	objectsize = ((mtp_size)peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER) + 12, 4) << 32) |   // Get param 4 - object size MSB
+				  (mtp_size)peek(mtp_packet_hdr, sizeof(MTP_PACKET_HEADER) + 16, 4);           // Get param 5 - object size LSB
+
+	PRINT_DEBUG("MTP_OPERATION_SEND_OBJECT_PROP_LIST : Rx dataset...");
+
+	sz = read_usb(ctx->usb_ctx, ctx->rdbuffer2, ctx->usb_rd_buffer_max_size);
+	if( sz < (int)sizeof(MTP_PACKET_HEADER) )
+		return MTP_RESPONSE_INVALID_DATASET;
+
+	PRINT_DEBUG_BUF(ctx->rdbuffer2, sz);
+
+	*size = sz;
+
+	failed_index = 0x00000000;
+
+	response_code = parse_objectproplist(ctx->rdbuffer2 + sizeof(MTP_PACKET_HEADER), sz - sizeof(MTP_PACKET_HEADER), name, sizeof(name), &date, &failed_index);
+	if( response_code == MTP_RESPONSE_OK )
+	{
+		if(parent_handle == 0xFFFFFFFF)
+			parent_handle = 0x00000000;
+
+		PRINT_DEBUG("MTP_OPERATION_SEND_OBJECT_PROP_LIST : Storage 0x%.8X, Parent 0x%.8X, Format 0x%.4X, Size 0x%"SIZEHEX", Name %s", storageid, parent_handle, format_id, objectsize, name);
+
+		if( mtp_db_lock( ctx ) )
+			return MTP_RESPONSE_GENERAL_ERROR;
+
+		new_handle = 0xFFFFFFFF;
+
+		response_code = mtp_create_object(ctx, storageid, parent_handle, name, format_id == MTP_FORMAT_ASSOCIATION, objectsize, &new_handle);
+		if( response_code == MTP_RESPONSE_OK )
+		{
+			// Applied once the data is received.
+			ctx->SendObjInfoDate = date;
+
+			ret_params[0] = storageid;
+			ret_params[1] = parent_handle;
+			ret_params[2] = new_handle;
+			ret_params[3] = 0x00000000;
+			*ret_params_size = sizeof(uint32_t) * 4;
+		}
+
+		mtp_db_unlock( ctx );
+	}
+	else
+	{
+		ret_params[0] = 0x00000000;
+		ret_params[1] = 0x00000000;
+		ret_params[2] = 0x00000000;
+		ret_params[3] = failed_index;
+		*ret_params_size = sizeof(uint32_t) * 4;
+	}
+
+	return response_code;
+}
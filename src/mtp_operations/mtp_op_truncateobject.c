@@ -29,6 +29,7 @@
 #include <pthread.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <sys/inotify.h>
 
 #include "logs_out.h"
 
@@ -36,6 +37,9 @@
 #include "mtp_helpers.h"
 #include "mtp_constant.h"
 #include "mtp_operations.h"
+#include "fs_cache.h"
+#include "inotify.h"
+#include "mtp_journal.h"
 
 uint32_t mtp_op_TruncateObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, int * size,uint32_t * ret_params, int * ret_params_size)
 {
@@ -48,7 +52,7 @@ uint32_t mtp_op_TruncateObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr,
 	if(!ctx->fs_db)
 		return MTP_RESPONSE_SESSION_NOT_OPEN;
 
-	if( pthread_mutex_lock( &ctx->inotify_mutex ) )
+	if( mtp_db_lock( ctx ) )
 		return MTP_RESPONSE_GENERAL_ERROR;
 
 	response_code = MTP_RESPONSE_GENERAL_ERROR;
@@ -62,7 +66,7 @@ uint32_t mtp_op_TruncateObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr,
 
 		if( check_handle_access( ctx, entry, handle, 1, &response_code) )
 		{
-			pthread_mutex_unlock( &ctx->inotify_mutex );
+			mtp_db_unlock( ctx );
 			return response_code;
 		}
 
@@ -70,14 +74,26 @@ uint32_t mtp_op_TruncateObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr,
 		if(full_path)
 		{
 			PRINT_DEBUG("Truncate file at 0x%"SIZEHEX" Bytes",offset);
+			fs_cache_invalidate(ctx, entry->handle);
+
+			inotify_handler_echo_begin(ctx, entry->storage_id, entry->parent, entry->name, IN_MODIFY);
+
 			if( !truncate64(full_path, offset) )
 			{
+				entry->size = offset;
+				entry->date = 0;
+
 				response_code = MTP_RESPONSE_OK;
 			}
 			else
 			{
 				response_code = posix_to_mtp_errcode(errno);
 			}
+
+			inotify_handler_echo_end(ctx, entry->storage_id, entry->parent, entry->name);
+
+			if( response_code == MTP_RESPONSE_OK )
+				mtp_journal_record(ctx, JOURNAL_MODIFY, entry->storage_id, full_path, 0);
 		}
 	}
 	else
@@ -85,7 +101,7 @@ uint32_t mtp_op_TruncateObject(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr,
 		response_code = MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 	}
 
-	pthread_mutex_unlock( &ctx->inotify_mutex );
+	mtp_db_unlock( ctx );
 
 	return response_code;
 }
@@ -31,6 +31,11 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
 
 #include "mtp.h"
 #include "mtp_helpers.h"
@@ -38,21 +43,215 @@
 #include "mtp_operations.h"
 #include "usb_gadget_fct.h"
 #include "inotify.h"
+#include "mtp_ops_helpers.h"
+#include "mtp_autotune.h"
+#include "fs_cache.h"
+#include "mtp_media.h"
+#include "mtp_journal.h"
 
 #include "logs_out.h"
 
+// Buffered path : The file data is read in the read buffer and sent from it.
+// The data phase is seen as a stream (MTP header + file data), stream_pos must be a multiple of chunk_size.
+static int send_stream_read( mtp_ctx * ctx, fs_entry * entry, mtp_offset offset, mtp_offset stream_pos, mtp_size stream_size, mtp_size ContainerLength, int chunk_size )
+{
+	mtp_size window_len;
+	mtp_size window_size;
+	mtp_size read_size;
+	unsigned char * read_ptr;
+	int bytes_read;
+	int ofs,hdr_size,chunk;
+
+	hdr_size = sizeof(MTP_PACKET_HEADER);
+
+	// The read window holds a whole number of USB chunks :
+	// No chunk crosses a window boundary, so every chunk is sent straight from the read buffer.
+	window_size = ( ctx->read_file_chunk_size / chunk_size ) * chunk_size;
+	if( !window_size )
+		window_size = chunk_size;
+
+	while( stream_pos < stream_size && !ctx->cancel_req )
+	{
+		window_len = stream_size - stream_pos;
+		if( window_len > window_size )
+			window_len = window_size;
+
+		if( !stream_pos )
+		{
+			// First window : The container header is placed in the reserved headroom,
+			// just in front of the file data.
+			memcpy(ctx->read_file_buffer, ctx->wrbuffer, hdr_size);
+			poke32(ctx->read_file_buffer, 0, hdr_size, ContainerLength);
+
+			read_ptr = &ctx->read_file_buffer[hdr_size];
+			read_size = window_len - hdr_size;
+		}
+		else
+		{
+			read_ptr = ctx->read_file_buffer;
+			read_size = window_len;
+		}
+
+		if( read_size )
+		{
+			bytes_read = fs_cache_read(ctx, entry, read_ptr, offset + ( stream_pos + ( read_ptr - ctx->read_file_buffer ) - hdr_size ), read_size);
+			if( bytes_read < 0 )
+				return -1;
+
+			if( bytes_read < read_size )
+			{
+				// The file shrank during the transfer : The container length is already sent, pad with zeros.
+				PRINT_WARN("send_file_data : Short read (0x%X / 0x%"SIZEHEX") !",bytes_read,read_size);
+				memset(&read_ptr[bytes_read], 0, read_size - bytes_read);
+			}
+
+			ctx->stats.tx_payload_bytes += read_size;
+			ctx->stats.tx_read_bytes += read_size;
+		}
+
+		// Send the window content, chunk by chunk.
+		ofs = 0;
+		while( ofs < window_len && !ctx->cancel_req )
+		{
+			chunk = chunk_size;
+			if( ofs + chunk > window_len )
+				chunk = window_len - ofs;
+
+			write_usb(ctx->usb_ctx, EP_DESCRIPTOR_IN, &ctx->read_file_buffer[ofs], chunk);
+
+			ctx->stats.tx_chunks++;
+
+			ofs += chunk;
+		}
+
+		stream_pos += window_len;
+
+		PRINT_DEBUG("---> 0x%"SIZEHEX" / 0x%"SIZEHEX, stream_pos, stream_size);
+	}
+
+	return 0;
+}
+
+// Mapped path : The USB chunks are written straight from a read-only mapping of the file.
+// The mapping is only accessed by the kernel (write to the endpoint) : If the file shrinks,
+// the faulting write fails with EFAULT instead of raising SIGBUS in the daemon.
+// Returns the stream position reached. The caller completes the transfer with the buffered path.
+static mtp_offset send_stream_mmap( mtp_ctx * ctx, fs_entry * entry, mtp_offset offset, mtp_size stream_size, mtp_size ContainerLength, int chunk_size )
+{
+	struct stat filestat;
+	mtp_offset stream_pos;
+	mtp_offset file_ofs,map_ofs;
+	mtp_size seg_len,seg_size;
+	unsigned char * map;
+	long page_size;
+	int bytes_read;
+	int ofs,hdr_size,chunk,delta;
+	int ret,fault;
+
+	hdr_size = sizeof(MTP_PACKET_HEADER);
+
+	page_size = sysconf(_SC_PAGESIZE);
+	if( page_size <= 0 )
+		page_size = 4096;
+
+	seg_size = ( CONFIG_MMAP_SEGMENT_SIZE / chunk_size ) * chunk_size;
+	if( !seg_size )
+		seg_size = chunk_size;
+
+	// First chunk : container header + first file bytes, built in the USB write buffer.
+	chunk = chunk_size;
+	if( chunk > stream_size )
+		chunk = stream_size;
+
+	poke32(ctx->wrbuffer, 0, ctx->usb_wr_buffer_max_size, ContainerLength);
+
+	bytes_read = fs_cache_read(ctx, entry, &ctx->wrbuffer[hdr_size], offset, chunk - hdr_size);
+	if( bytes_read != chunk - hdr_size )
+		return 0;
+
+	write_usb(ctx->usb_ctx, EP_DESCRIPTOR_IN, ctx->wrbuffer, chunk);
+
+	ctx->stats.tx_payload_bytes += chunk - hdr_size;
+	ctx->stats.tx_payload_copied_bytes += chunk - hdr_size;
+	ctx->stats.tx_mmap_bytes += chunk - hdr_size;
+	ctx->stats.tx_chunks++;
+
+	stream_pos = chunk;
+
+	fault = 0;
+	while( stream_pos < stream_size && !ctx->cancel_req && !fault )
+	{
+		seg_len = stream_size - stream_pos;
+		if( seg_len > seg_size )
+			seg_len = seg_size;
+
+		file_ofs = offset + stream_pos - hdr_size;
+
+		// Don't map beyond the current end of file.
+		if( fstat(entry->file_descriptor, &filestat) || (mtp_offset)filestat.st_size < file_ofs + seg_len )
+		{
+			PRINT_WARN("send_file_data : File shrank during the transfer !");
+			break;
+		}
+
+		map_ofs = ( file_ofs / page_size ) * page_size;
+		delta = file_ofs - map_ofs;
+
+		map = mmap(NULL, seg_len + delta, PROT_READ, MAP_SHARED, entry->file_descriptor, map_ofs);
+		if( map == MAP_FAILED )
+		{
+			PRINT_DEBUG("send_file_data : mmap failure (%d) !",errno);
+			break;
+		}
+
+		madvise(map, seg_len + delta, MADV_SEQUENTIAL);
+
+		ofs = 0;
+		while( ofs < seg_len && !ctx->cancel_req )
+		{
+			chunk = chunk_size;
+			if( ofs + chunk > seg_len )
+				chunk = seg_len - ofs;
+
+			ret = write_usb(ctx->usb_ctx, EP_DESCRIPTOR_IN, &map[delta + ofs], chunk);
+			if( ret < 0 && errno == EFAULT )
+			{
+				// The mapped pages are gone (file truncated) : Nothing was queued for this chunk.
+				PRINT_WARN("send_file_data : Mapped file truncated during the transfer !");
+				fault = 1;
+				break;
+			}
+
+			ctx->stats.tx_payload_bytes += chunk;
+			ctx->stats.tx_mmap_bytes += chunk;
+			ctx->stats.file_read_bytes += chunk;
+			ctx->stats.tx_chunks++;
+
+			ofs += chunk;
+			stream_pos += chunk;
+		}
+
+		munmap(map, seg_len + delta);
+
+		PRINT_DEBUG("---> 0x%"SIZEHEX" / 0x%"SIZEHEX" (mmap)", stream_pos, stream_size);
+	}
+
+	return stream_pos;
+}
+
+// Must be called with the entry storage lock held (mtp_db_lock_storage()).
+// The lock is released during the data phase, the entry being pinned.
 mtp_size send_file_data( mtp_ctx * ctx, fs_entry * entry,mtp_offset offset, mtp_size maxsize )
 {
 	mtp_size actualsize;
-	mtp_size j;
-	int ofs;
-	mtp_size blocksize;
 	mtp_size ContainerLength;
-	int file,bytes_read;
-	mtp_offset buf_index;
-	int io_buffer_index;
-	int first_part_size;
-	unsigned char * usb_buffer_ptr;
+	mtp_size stream_size;
+	mtp_offset stream_pos;
+	mtp_size chunk_size;
+	uint32_t storage_flags;
+	int file,use_mmap,ret;
+	int store_index;
+	uint64_t start_time,elapsed_time;
 
 	if( !ctx->read_file_buffer )
 	{
@@ -63,9 +262,8 @@ mtp_size send_file_data( mtp_ctx * ctx, fs_entry * entry,mtp_offset offset, mtp_
 		memset(ctx->read_file_buffer, 0, ctx->read_file_buffer_size);
 	}
 
-	usb_buffer_ptr = NULL;
-
-	buf_index = -1;
+	// Effective sizes (auto-tuning)
+	chunk_size = ctx->usb_wr_chunk_size;
 
 	if( offset >= entry->size )
 	{
@@ -84,98 +282,71 @@ mtp_size send_file_data( mtp_ctx * ctx, fs_entry * entry,mtp_offset offset, mtp_
 	else
 		ContainerLength = sizeof(MTP_PACKET_HEADER) + actualsize;
 
-	poke32(ctx->wrbuffer, 0, ctx->usb_wr_buffer_max_size, ContainerLength);
+	// The data phase is seen as a stream : MTP header + file data.
+	stream_size = sizeof(MTP_PACKET_HEADER) + actualsize;
 
-	ofs = sizeof(MTP_PACKET_HEADER);
+	// Serve the object from a file mapping ?
+	// Read only storages : as soon as the object spans several USB chunks.
+	// Other storages : for objects above the mmap threshold.
+	use_mmap = 0;
+	if( ctx->mmap_threshold && stream_size > 2 * chunk_size )
+	{
+		storage_flags = mtp_get_storage_flags(ctx, entry->storage_id);
+
+		if( ( storage_flags != 0xFFFFFFFF && ( storage_flags & UMTP_STORAGE_READONLY ) ) || actualsize >= (mtp_size)ctx->mmap_threshold )
+			use_mmap = 1;
+	}
 
-	PRINT_DEBUG("send_file_data : Offset 0x%"SIZEHEX" - Maxsize 0x%"SIZEHEX" - Size 0x%"SIZEHEX" - ActualSize 0x%"SIZEHEX, offset,maxsize,entry->size,actualsize);
+	PRINT_DEBUG("send_file_data : Offset 0x%"SIZEHEX" - Maxsize 0x%"SIZEHEX" - Size 0x%"SIZEHEX" - ActualSize 0x%"SIZEHEX" - mmap %d", offset,maxsize,entry->size,actualsize,use_mmap);
 
-	file = entry_open(ctx->fs_db, entry, O_RDONLY | O_LARGEFILE, 0);
+	file = fs_cache_open(ctx, entry);
 	if( file != -1 )
 	{
 		ctx->transferring_file_data = 1;
 
-		j = 0;
-		do
-		{
-			if((j + ((mtp_size)(ctx->usb_wr_buffer_max_size) - ofs)) < actualsize)
-				blocksize = ((mtp_size)(ctx->usb_wr_buffer_max_size) - ofs);
-			else
-				blocksize = actualsize - j;
-
-			// Is the target page loaded ?
-			if( buf_index != ((offset + j) & ~((mtp_offset)(ctx->read_file_buffer_size-1))) )
-			{
-				bytes_read = entry_read(ctx->fs_db, entry, ctx->read_file_buffer, ((offset + j) & ~((mtp_offset)(ctx->read_file_buffer_size-1))) , (mtp_size)ctx->read_file_buffer_size);
-				if( bytes_read < 0 )
-				{
-					entry_close( ctx->fs_db, entry );
-					return -1;
-				}
+		// Access pattern tracking : read-ahead / prefetch policy.
+		fs_cache_access(ctx, entry, offset, actualsize);
 
-				buf_index = ((offset + j) & ~((mtp_offset)(ctx->read_file_buffer_size-1)));
-			}
+		// The data phase runs without the db lock (inotify events, msgqueue commands...) :
+		// The entry is pinned until the end of the transfer.
+		store_index = FS_DB_HANDLE_SHARD(entry->handle);
 
-			io_buffer_index = (offset + j) & (mtp_offset)(ctx->read_file_buffer_size-1);
+		entry_pin(entry);
+		mtp_db_unlock_storage( ctx, store_index );
 
-			// Is a new page needed ?
-			if( io_buffer_index + blocksize < ctx->read_file_buffer_size )
-			{
-				// No, just use the io buffer
+		start_time = mtp_autotune_get_time_us();
 
-				if( !ofs )
-				{
-					// Use the I/O buffer directly
-					usb_buffer_ptr = (unsigned char *)&ctx->read_file_buffer[io_buffer_index];
-				}
-				else
-				{
-					memcpy(&ctx->wrbuffer[ofs], &ctx->read_file_buffer[io_buffer_index], blocksize );
-					usb_buffer_ptr = (unsigned char *)&ctx->wrbuffer[0];
-				}
-			}
-			else
+		stream_pos = 0;
+		if( use_mmap )
+		{
+			stream_pos = send_stream_mmap(ctx, entry, offset, stream_size, ContainerLength, chunk_size);
+			if( stream_pos < stream_size && !ctx->cancel_req )
 			{
-				// Yes, new page needed. Get the first part in the io buffer and the load a new page to get the remaining data.
-				first_part_size = blocksize - ( ( io_buffer_index + blocksize ) - (mtp_size)ctx->read_file_buffer_size);
-
-				memcpy(&ctx->wrbuffer[ofs], &ctx->read_file_buffer[io_buffer_index], first_part_size  );
-
-				buf_index += (mtp_offset)ctx->read_file_buffer_size;
-				bytes_read = entry_read(ctx->fs_db, entry, ctx->read_file_buffer, buf_index , ctx->read_file_buffer_size);
-				if( bytes_read < 0 )
-				{
-					entry_close( ctx->fs_db, entry );
-					return -1;
-				}
-
-				memcpy(&ctx->wrbuffer[ofs + first_part_size], &ctx->read_file_buffer[0], blocksize - first_part_size );
-
-				usb_buffer_ptr = (unsigned char *)&ctx->wrbuffer[0];
+				PRINT_DEBUG("send_file_data : mmap fallback at 0x%"SIZEHEX, stream_pos);
+				ctx->stats.tx_mmap_fallbacks++;
 			}
+		}
 
-			j   += blocksize;
-			ofs += blocksize;
-
-			PRINT_DEBUG("---> 0x%"SIZEHEX" (0x%X)",j,ofs);
-
-			if( !ctx->cancel_req )
-			{
-
-				write_usb(ctx->usb_ctx, EP_DESCRIPTOR_IN, usb_buffer_ptr, ofs);
+		ret = send_stream_read(ctx, entry, offset, stream_pos, stream_size, ContainerLength, chunk_size);
 
-			}
+		if( mtp_db_lock_storage( ctx, store_index ) )
+			PRINT_ERROR("send_file_data : Mutex lock error !");
 
-			ofs = 0;
+		entry_unpin(ctx->fs_db, entry);
 
-		}while( j < actualsize && !ctx->cancel_req );
+		if( ret < 0 )
+		{
+			ctx->transferring_file_data = 0;
+			fs_cache_release( ctx, entry );
+			return -1;
+		}
 
 		ctx->transferring_file_data = 0;
 
-		entry_close( ctx->fs_db, entry );
+		fs_cache_release( ctx, entry );
 
 		if( !pthread_mutex_lock( &ctx->cancel_mutex ) )
-		{	
+		{
 			if( ctx->cancel_req )
 			{
 				PRINT_DEBUG("send_file_data : Cancelled ! Aborted...");
@@ -191,6 +362,22 @@ mtp_size send_file_data( mtp_ctx * ctx, fs_entry * entry,mtp_offset offset, mtp_
 				PRINT_DEBUG("send_file_data : Full transfer done !");
 
 				check_and_send_USB_ZLP(ctx , sizeof(MTP_PACKET_HEADER) + actualsize );
+
+				elapsed_time = mtp_autotune_get_time_us() - start_time;
+
+				if( use_mmap )
+				{
+					ctx->stats.tx_mmap_transfers++;
+					ctx->stats.tx_mmap_time_us += elapsed_time;
+				}
+				else
+				{
+					ctx->stats.tx_read_transfers++;
+					ctx->stats.tx_read_time_us += elapsed_time;
+
+					// The buffers auto-tuning only applies to the buffered path.
+					mtp_autotune_update(ctx, actualsize, elapsed_time);
+				}
 			}
 
 			pthread_mutex_unlock( &ctx->cancel_mutex );
@@ -202,6 +389,223 @@ mtp_size send_file_data( mtp_ctx * ctx, fs_entry * entry,mtp_offset offset, mtp_
 	return actualsize;
 }
 
+static int write_file_chunk( int file, unsigned char * buffer, int size, mtp_offset offset )
+{
+	int ret;
+
+	while( size > 0 )
+	{
+		ret = pwrite64( file, buffer, size, offset );
+		if( ret < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+
+			return errno;
+		}
+
+		if( !ret )
+			return ENOSPC;
+
+		buffer += ret;
+		size -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+static void file_wrcache_flush( mtp_ctx * ctx, int final )
+{
+	int len,ret,fl;
+
+	do
+	{
+		len = ctx->write_file_buffer_fill;
+
+		// O_DIRECT : Only write full aligned blocks, keep the remaining bytes for the next flush.
+		if( ctx->write_file_direct )
+			len &= ~(CONFIG_DIRECT_IO_ALIGNMENT-1);
+
+		if( len && !ctx->write_file_error )
+		{
+			ret = write_file_chunk( ctx->write_file_fd, ctx->write_file_buffer, len, ctx->write_file_offset );
+			if( ret )
+			{
+				PRINT_ERROR("file_wrcache_flush : Write error at offset 0x%"SIZEHEX" (%s)", ctx->write_file_offset, strerror(ret));
+				ctx->write_file_error = ret;
+			}
+		}
+
+		ctx->write_file_offset += len;
+		ctx->write_file_buffer_fill -= len;
+
+		if( ctx->write_file_buffer_fill )
+			memmove( ctx->write_file_buffer, &ctx->write_file_buffer[len], ctx->write_file_buffer_fill );
+
+		if( final && ctx->write_file_buffer_fill && ctx->write_file_direct )
+		{
+			// Unaligned file tail : switch back to buffered I/O to write it.
+			fl = fcntl( ctx->write_file_fd, F_GETFL );
+			if( fl != -1 )
+				fcntl( ctx->write_file_fd, F_SETFL, fl & ~O_DIRECT );
+
+			ctx->write_file_direct = 0;
+		}
+		else
+		{
+			final = 0;
+		}
+	}while( final );
+}
+
+int file_wrcache_open( mtp_ctx * ctx, int file, mtp_offset offset )
+{
+	int fl;
+
+	if( !ctx->write_file_buffer )
+	{
+		// At least one full USB read + one unaligned O_DIRECT remainder.
+		if( ctx->write_file_buffer_size < ctx->usb_rd_buffer_max_size + CONFIG_DIRECT_IO_ALIGNMENT )
+			ctx->write_file_buffer_size = ctx->usb_rd_buffer_max_size + CONFIG_DIRECT_IO_ALIGNMENT;
+
+		ctx->write_file_buffer_size = (ctx->write_file_buffer_size + (CONFIG_DIRECT_IO_ALIGNMENT-1)) & ~(CONFIG_DIRECT_IO_ALIGNMENT-1);
+
+		if( posix_memalign( (void**)&ctx->write_file_buffer, CONFIG_DIRECT_IO_ALIGNMENT, ctx->write_file_buffer_size ) )
+		{
+			PRINT_ERROR("file_wrcache_open : Write buffer allocation error (%d bytes) !", ctx->write_file_buffer_size);
+			ctx->write_file_buffer = NULL;
+			return -1;
+		}
+	}
+
+	ctx->write_file_fd = file;
+	ctx->write_file_offset = offset;
+	ctx->write_file_buffer_fill = 0;
+	ctx->write_file_error = 0;
+	ctx->write_file_direct = 0;
+
+	fl = fcntl( file, F_GETFL );
+	if( fl != -1 && ( fl & O_DIRECT ) )
+	{
+		if( offset & (CONFIG_DIRECT_IO_ALIGNMENT-1) )
+			fcntl( file, F_SETFL, fl & ~O_DIRECT ); // Unaligned start offset : Use buffered I/O.
+		else
+			ctx->write_file_direct = 1;
+	}
+
+	return 0;
+}
+
+unsigned char * file_wrcache_getbuf( mtp_ctx * ctx, int size )
+{
+	if( ctx->write_file_buffer_size - ctx->write_file_buffer_fill < size )
+		file_wrcache_flush( ctx, 0 );
+
+	return &ctx->write_file_buffer[ctx->write_file_buffer_fill];
+}
+
+void file_wrcache_commit( mtp_ctx * ctx, int size )
+{
+	if( size > 0 )
+		ctx->write_file_buffer_fill += size;
+}
+
+void file_wrcache_write( mtp_ctx * ctx, unsigned char * data, int size )
+{
+	int chunk;
+
+	while( size > 0 )
+	{
+		chunk = ctx->write_file_buffer_size - ctx->write_file_buffer_fill;
+		if( !chunk )
+		{
+			file_wrcache_flush( ctx, 0 );
+			continue;
+		}
+
+		if( chunk > size )
+			chunk = size;
+
+		memcpy( &ctx->write_file_buffer[ctx->write_file_buffer_fill], data, chunk );
+		ctx->write_file_buffer_fill += chunk;
+
+		data += chunk;
+		size -= chunk;
+	}
+}
+
+int file_wrcache_close( mtp_ctx * ctx )
+{
+	file_wrcache_flush( ctx, 1 );
+
+	ctx->write_file_fd = -1;
+
+	return ctx->write_file_error;
+}
+
+// Scan a folder and add its content to the db. The storage lock must be held.
+// entry : Folder entry (NULL if unknown). Returns the scan result (< 0 : access error).
+int sync_folder(mtp_ctx * ctx, fs_entry * entry, char * full_path, uint32_t parent_handle, uint32_t storage_id)
+{
+	fs_db_shard * shard;
+	fs_entry * child;
+	int ret,wd;
+
+	if( entry && !( entry->flags & ENTRY_IS_DIR ) )
+		entry = NULL;
+
+	// A watched folder is kept up to date by the inotify events : No need to scan it again.
+	if( entry && ( entry->flags & ENTRY_IS_SYNCED ) && inotify_handler_touchwatch( ctx, entry->watch_descriptor ) )
+		return 0;
+
+	if( entry )
+	{
+		entry->flags &= ~ENTRY_IS_SYNCED;
+
+		// Register a watch point before the scan : No change can be missed.
+		wd = inotify_handler_addwatch( ctx, full_path );
+		if( wd != -1 )
+			entry->watch_descriptor = wd;
+	}
+
+	ret = -1;
+
+	if(!set_storage_giduid(ctx, storage_id))
+	{
+		ret = scan_and_add_folder(ctx->fs_db, full_path, parent_handle, storage_id);
+	}
+	restore_giduid(ctx);
+
+	if( entry && ret >= 0 )
+	{
+		entry->flags |= ENTRY_IS_SCANNED;
+
+		if( entry->watch_descriptor != -1 )
+			entry->flags |= ENTRY_IS_SYNCED;
+	}
+
+	// The host is browsing this folder : Index its media files metadata.
+	// (Not with init_search_handle() : The callers may be walking the db)
+	shard = fs_db_get_shard(ctx->fs_db, storage_id);
+	if( ret >= 0 && ctx->media_workers > 0 && shard )
+	{
+		child = shard->entry_list;
+		while( child )
+		{
+			if( child->parent == parent_handle && child->storage_id == storage_id &&
+				!( child->flags & ( ENTRY_IS_DELETED | ENTRY_IS_DIR ) ) && child->handle != child->parent )
+			{
+				mtp_media_queue(ctx, child);
+			}
+
+			child = child->next;
+		}
+	}
+
+	return ret;
+}
+
 int delete_tree(mtp_ctx * ctx,uint32_t handle)
 {
 	int ret;
@@ -212,6 +616,11 @@ int delete_tree(mtp_ctx * ctx,uint32_t handle)
 	entry = get_entry_by_handle(ctx->fs_db, handle);
 	if(entry)
 	{
+		if(entry->flags & ENTRY_IS_DIR)
+			fs_cache_invalidate_storage(ctx, entry->storage_id);
+		else
+			fs_cache_invalidate(ctx, entry->handle);
+
 		path = build_full_path(ctx->fs_db, mtp_get_storage_root(ctx, entry->storage_id), entry);
 
 		if (path)
@@ -222,27 +631,31 @@ int delete_tree(mtp_ctx * ctx,uint32_t handle)
 
 				if(!ret)
 				{
-					entry->flags |= ENTRY_IS_DELETED;
-					if( entry->watch_descriptor != -1 )
-					{
-						inotify_handler_rmwatch( ctx, entry->watch_descriptor );
-						entry->watch_descriptor = -1;
-					}
+					// The folder content entries too.
+					fs_db_delete_entry(ctx->fs_db, entry);
+
+					mtp_journal_record(ctx, JOURNAL_REMOVE, entry->storage_id, path, 0);
 				}
 				else
+				{
 					scan_and_add_folder(ctx->fs_db, path, handle, entry->storage_id); // partially deleted ? update/sync the db.
+
+					mtp_journal_rescan(ctx, entry->storage_id);
+				}
 			}
 			else
 			{
+				inotify_handler_echo_begin(ctx, entry->storage_id, entry->parent, entry->name, IN_DELETE);
+
 				ret = remove(path);
+
+				inotify_handler_echo_end(ctx, entry->storage_id, entry->parent, entry->name);
+
 				if(!ret)
 				{
-					entry->flags |= ENTRY_IS_DELETED;
-					if( entry->watch_descriptor != -1 )
-					{
-						inotify_handler_rmwatch( ctx, entry->watch_descriptor );
-						entry->watch_descriptor = -1;
-					}
+					fs_db_delete_entry(ctx->fs_db, entry);
+
+					mtp_journal_record(ctx, JOURNAL_REMOVE, entry->storage_id, path, 0);
 				}
 			}
 
@@ -255,27 +668,13 @@ int delete_tree(mtp_ctx * ctx,uint32_t handle)
 
 int umount_store(mtp_ctx * ctx, int store_index, int update_flag)
 {
-	fs_entry * entry;
-
 	if(store_index >= 0 && store_index < MAX_STORAGE_NB )
 	{
 		if( ctx->storages[store_index].root_path )
 		{
-			entry = NULL;
-			do
-			{
-				entry = get_entry_by_storageid( ctx->fs_db, ctx->storages[store_index].storage_id, entry );
-				if(entry)
-				{
-					entry->flags |= ENTRY_IS_DELETED;
-					if( entry->watch_descriptor != -1 )
-					{
-						inotify_handler_rmwatch( ctx, entry->watch_descriptor );
-						entry->watch_descriptor = -1;
-					}
-					entry = entry->next;
-				}
-			}while(entry);
+			fs_cache_invalidate_storage(ctx, ctx->storages[store_index].storage_id);
+
+			fs_db_drop_storage( ctx->fs_db, ctx->storages[store_index].storage_id );
 
 			if( update_flag )
 				ctx->storages[store_index].flags |= UMTP_STORAGE_NOTMOUNTED;
@@ -31,6 +31,7 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
 #include <time.h>
 
 #include "mtp.h"
@@ -39,11 +40,14 @@
 #include "mtp_constant_strings.h"
 #include "mtp_datasets.h"
 #include "mtp_properties.h"
+#include "mtp_media.h"
 
 #include "fs_handles_db.h"
 #include "hash_utils.h"
 #include "mtp_sanitize.h"
 #include "usb_gadget_fct.h"
+#include "inotify.h"
+#include "mtp_journal.h"
 
 #include "logs_out.h"
 
@@ -58,6 +62,38 @@ const formats_property fmt_properties[]=
 												MTP_PROPERTY_OBJECT_FILE_NAME, MTP_PROPERTY_DATE_MODIFIED, MTP_PROPERTY_PARENT_OBJECT, MTP_PROPERTY_PERSISTENT_UID,
 												MTP_PROPERTY_NAME, MTP_PROPERTY_DISPLAY_NAME, MTP_PROPERTY_DATE_CREATED,
 												0xFFFF}
+	},
+	// Media files : Metadata from the media indexer (see mtp_media.c)
+	{ MTP_FORMAT_MP3          , (uint16_t[]){   MTP_PROPERTY_STORAGE_ID, MTP_PROPERTY_OBJECT_FORMAT, MTP_PROPERTY_PROTECTION_STATUS, MTP_PROPERTY_OBJECT_SIZE,
+												MTP_PROPERTY_OBJECT_FILE_NAME, MTP_PROPERTY_DATE_MODIFIED, MTP_PROPERTY_PARENT_OBJECT, MTP_PROPERTY_PERSISTENT_UID,
+												MTP_PROPERTY_NAME, MTP_PROPERTY_DISPLAY_NAME, MTP_PROPERTY_DATE_CREATED, MTP_PROPERTY_ARTIST, MTP_PROPERTY_ALBUM_NAME,
+												MTP_PROPERTY_TRACK, MTP_PROPERTY_ORIGINAL_RELEASE_DATE, MTP_PROPERTY_GENRE, MTP_PROPERTY_DURATION,
+												0xFFFF}
+	},
+	{ MTP_FORMAT_FLAC         , (uint16_t[]){   MTP_PROPERTY_STORAGE_ID, MTP_PROPERTY_OBJECT_FORMAT, MTP_PROPERTY_PROTECTION_STATUS, MTP_PROPERTY_OBJECT_SIZE,
+												MTP_PROPERTY_OBJECT_FILE_NAME, MTP_PROPERTY_DATE_MODIFIED, MTP_PROPERTY_PARENT_OBJECT, MTP_PROPERTY_PERSISTENT_UID,
+												MTP_PROPERTY_NAME, MTP_PROPERTY_DISPLAY_NAME, MTP_PROPERTY_DATE_CREATED, MTP_PROPERTY_ARTIST, MTP_PROPERTY_ALBUM_NAME,
+												MTP_PROPERTY_TRACK, MTP_PROPERTY_ORIGINAL_RELEASE_DATE, MTP_PROPERTY_GENRE, MTP_PROPERTY_DURATION,
+												0xFFFF}
+	},
+	{ MTP_FORMAT_OGG          , (uint16_t[]){   MTP_PROPERTY_STORAGE_ID, MTP_PROPERTY_OBJECT_FORMAT, MTP_PROPERTY_PROTECTION_STATUS, MTP_PROPERTY_OBJECT_SIZE,
+												MTP_PROPERTY_OBJECT_FILE_NAME, MTP_PROPERTY_DATE_MODIFIED, MTP_PROPERTY_PARENT_OBJECT, MTP_PROPERTY_PERSISTENT_UID,
+												MTP_PROPERTY_NAME, MTP_PROPERTY_DISPLAY_NAME, MTP_PROPERTY_DATE_CREATED, MTP_PROPERTY_ARTIST, MTP_PROPERTY_ALBUM_NAME,
+												MTP_PROPERTY_TRACK, MTP_PROPERTY_ORIGINAL_RELEASE_DATE, MTP_PROPERTY_GENRE, MTP_PROPERTY_DURATION,
+												0xFFFF}
+	},
+	{ MTP_FORMAT_MP4_CONTAINER, (uint16_t[]){   MTP_PROPERTY_STORAGE_ID, MTP_PROPERTY_OBJECT_FORMAT, MTP_PROPERTY_PROTECTION_STATUS, MTP_PROPERTY_OBJECT_SIZE,
+												MTP_PROPERTY_OBJECT_FILE_NAME, MTP_PROPERTY_DATE_MODIFIED, MTP_PROPERTY_PARENT_OBJECT, MTP_PROPERTY_PERSISTENT_UID,
+												MTP_PROPERTY_NAME, MTP_PROPERTY_DISPLAY_NAME, MTP_PROPERTY_DATE_CREATED, MTP_PROPERTY_ARTIST, MTP_PROPERTY_ALBUM_NAME,
+												MTP_PROPERTY_TRACK, MTP_PROPERTY_ORIGINAL_RELEASE_DATE, MTP_PROPERTY_GENRE, MTP_PROPERTY_DURATION,
+												MTP_PROPERTY_WIDTH, MTP_PROPERTY_HEIGHT,
+												0xFFFF}
+	},
+	{ MTP_FORMAT_EXIF_JPEG    , (uint16_t[]){   MTP_PROPERTY_STORAGE_ID, MTP_PROPERTY_OBJECT_FORMAT, MTP_PROPERTY_PROTECTION_STATUS, MTP_PROPERTY_OBJECT_SIZE,
+												MTP_PROPERTY_OBJECT_FILE_NAME, MTP_PROPERTY_DATE_MODIFIED, MTP_PROPERTY_PARENT_OBJECT, MTP_PROPERTY_PERSISTENT_UID,
+												MTP_PROPERTY_NAME, MTP_PROPERTY_DISPLAY_NAME, MTP_PROPERTY_DATE_CREATED, MTP_PROPERTY_WIDTH,
+												MTP_PROPERTY_HEIGHT, MTP_PROPERTY_DATE_AUTHORED,
+												0xFFFF}
 	}
 #if 0
 	{ MTP_FORMAT_TEXT         , (uint16_t[]){   MTP_PROPERTY_STORAGE_ID, MTP_PROPERTY_OBJECT_FORMAT, MTP_PROPERTY_PROTECTION_STATUS, MTP_PROPERTY_OBJECT_SIZE,
@@ -70,12 +106,6 @@ const formats_property fmt_properties[]=
 												MTP_PROPERTY_NAME, MTP_PROPERTY_DISPLAY_NAME, MTP_PROPERTY_DATE_CREATED,
 												0xFFFF}
 	},
-	{ MTP_FORMAT_MP4_CONTAINER, (uint16_t[]){   MTP_PROPERTY_STORAGE_ID, MTP_PROPERTY_OBJECT_FORMAT, MTP_PROPERTY_PROTECTION_STATUS, MTP_PROPERTY_OBJECT_SIZE,
-												MTP_PROPERTY_OBJECT_FILE_NAME, MTP_PROPERTY_DATE_MODIFIED, MTP_PROPERTY_PARENT_OBJECT, MTP_PROPERTY_PERSISTENT_UID,
-												MTP_PROPERTY_NAME, MTP_PROPERTY_DISPLAY_NAME, MTP_PROPERTY_DATE_CREATED, MTP_PROPERTY_ARTIST, MTP_PROPERTY_ALBUM_NAME,
-												MTP_PROPERTY_DURATION, MTP_PROPERTY_DESCRIPTION, MTP_PROPERTY_WIDTH, MTP_PROPERTY_HEIGHT, MTP_PROPERTY_DATE_AUTHORED,
-												0xFFFF}
-	},
 	{ MTP_FORMAT_3GP_CONTAINER, (uint16_t[]){   MTP_PROPERTY_STORAGE_ID, MTP_PROPERTY_OBJECT_FORMAT, MTP_PROPERTY_PROTECTION_STATUS, MTP_PROPERTY_OBJECT_SIZE,
 												MTP_PROPERTY_OBJECT_FILE_NAME, MTP_PROPERTY_DATE_MODIFIED, MTP_PROPERTY_PARENT_OBJECT, MTP_PROPERTY_PERSISTENT_UID,
 												MTP_PROPERTY_NAME, MTP_PROPERTY_DISPLAY_NAME, MTP_PROPERTY_DATE_CREATED, MTP_PROPERTY_ARTIST, MTP_PROPERTY_ALBUM_NAME,
@@ -89,25 +119,12 @@ const formats_property fmt_properties[]=
 												MTP_PROPERTY_AUDIO_WAVE_CODEC, MTP_PROPERTY_BITRATE_TYPE, MTP_PROPERTY_AUDIO_BITRATE, MTP_PROPERTY_NUMBER_OF_CHANNELS,MTP_PROPERTY_SAMPLE_RATE,
 												0xFFFF}
 	},
-	{ MTP_FORMAT_MP3          , (uint16_t[]){   MTP_PROPERTY_STORAGE_ID, MTP_PROPERTY_OBJECT_FORMAT, MTP_PROPERTY_PROTECTION_STATUS, MTP_PROPERTY_OBJECT_SIZE,
-												MTP_PROPERTY_OBJECT_FILE_NAME, MTP_PROPERTY_DATE_MODIFIED, MTP_PROPERTY_PARENT_OBJECT, MTP_PROPERTY_PERSISTENT_UID,
-												MTP_PROPERTY_NAME, MTP_PROPERTY_DISPLAY_NAME, MTP_PROPERTY_DATE_CREATED,MTP_PROPERTY_ARTIST,MTP_PROPERTY_ALBUM_NAME,
-												MTP_PROPERTY_ALBUM_ARTIST, MTP_PROPERTY_TRACK, MTP_PROPERTY_ORIGINAL_RELEASE_DATE, MTP_PROPERTY_GENRE, MTP_PROPERTY_COMPOSER,
-												MTP_PROPERTY_AUDIO_WAVE_CODEC, MTP_PROPERTY_BITRATE_TYPE, MTP_PROPERTY_AUDIO_BITRATE, MTP_PROPERTY_NUMBER_OF_CHANNELS,MTP_PROPERTY_SAMPLE_RATE,
-												0xFFFF}
-	},
 	{ MTP_FORMAT_MPEG         , (uint16_t[]){   MTP_PROPERTY_STORAGE_ID, MTP_PROPERTY_OBJECT_FORMAT, MTP_PROPERTY_PROTECTION_STATUS, MTP_PROPERTY_OBJECT_SIZE,
 												MTP_PROPERTY_OBJECT_FILE_NAME, MTP_PROPERTY_DATE_MODIFIED, MTP_PROPERTY_PARENT_OBJECT, MTP_PROPERTY_PERSISTENT_UID,
 												MTP_PROPERTY_NAME, MTP_PROPERTY_DISPLAY_NAME, MTP_PROPERTY_DATE_CREATED, MTP_PROPERTY_ARTIST, MTP_PROPERTY_ALBUM_NAME,
 												MTP_PROPERTY_DURATION, MTP_PROPERTY_DESCRIPTION, MTP_PROPERTY_WIDTH, MTP_PROPERTY_HEIGHT, MTP_PROPERTY_DATE_AUTHORED,
 												0xFFFF}
 	},
-	{ MTP_FORMAT_EXIF_JPEG    , (uint16_t[]){   MTP_PROPERTY_STORAGE_ID, MTP_PROPERTY_OBJECT_FORMAT, MTP_PROPERTY_PROTECTION_STATUS, MTP_PROPERTY_OBJECT_SIZE,
-												MTP_PROPERTY_OBJECT_FILE_NAME, MTP_PROPERTY_DATE_MODIFIED, MTP_PROPERTY_PARENT_OBJECT, MTP_PROPERTY_PERSISTENT_UID,
-												MTP_PROPERTY_NAME, MTP_PROPERTY_DISPLAY_NAME, MTP_PROPERTY_DATE_CREATED, MTP_PROPERTY_DESCRIPTION, MTP_PROPERTY_WIDTH,
-												MTP_PROPERTY_HEIGHT, MTP_PROPERTY_DATE_AUTHORED,
-												0xFFFF}
-	},
 	{ MTP_FORMAT_BMP          , (uint16_t[]){   MTP_PROPERTY_STORAGE_ID, MTP_PROPERTY_OBJECT_FORMAT, MTP_PROPERTY_PROTECTION_STATUS, MTP_PROPERTY_OBJECT_SIZE,
 												MTP_PROPERTY_OBJECT_FILE_NAME, MTP_PROPERTY_DATE_MODIFIED, MTP_PROPERTY_PARENT_OBJECT, MTP_PROPERTY_PERSISTENT_UID,
 												MTP_PROPERTY_NAME, MTP_PROPERTY_DISPLAY_NAME, MTP_PROPERTY_DATE_CREATED, MTP_PROPERTY_DESCRIPTION, MTP_PROPERTY_WIDTH,
@@ -134,14 +151,6 @@ const formats_property fmt_properties[]=
 												MTP_PROPERTY_NUMBER_OF_CHANNELS, MTP_PROPERTY_SAMPLE_RATE,
 												0xFFFF}
 	},
-	{ MTP_FORMAT_OGG          , (uint16_t[]){   MTP_PROPERTY_STORAGE_ID, MTP_PROPERTY_OBJECT_FORMAT, MTP_PROPERTY_PROTECTION_STATUS, MTP_PROPERTY_OBJECT_SIZE,
-												MTP_PROPERTY_OBJECT_FILE_NAME, MTP_PROPERTY_DATE_MODIFIED, MTP_PROPERTY_PARENT_OBJECT, MTP_PROPERTY_PERSISTENT_UID,
-												MTP_PROPERTY_NAME, MTP_PROPERTY_DISPLAY_NAME, MTP_PROPERTY_DATE_CREATED, MTP_PROPERTY_ARTIST, MTP_PROPERTY_ALBUM_NAME,
-												MTP_PROPERTY_ALBUM_ARTIST, MTP_PROPERTY_TRACK, MTP_PROPERTY_ORIGINAL_RELEASE_DATE, MTP_PROPERTY_DURATION, MTP_PROPERTY_DESCRIPTION,
-												MTP_PROPERTY_GENRE, MTP_PROPERTY_COMPOSER, MTP_PROPERTY_AUDIO_WAVE_CODEC, MTP_PROPERTY_BITRATE_TYPE, MTP_PROPERTY_AUDIO_BITRATE,
-												MTP_PROPERTY_NUMBER_OF_CHANNELS, MTP_PROPERTY_SAMPLE_RATE,
-												0xFFFF}
-	},
 	{ MTP_FORMAT_AAC          , (uint16_t[]){   MTP_PROPERTY_STORAGE_ID, MTP_PROPERTY_OBJECT_FORMAT, MTP_PROPERTY_PROTECTION_STATUS, MTP_PROPERTY_OBJECT_SIZE,
 												MTP_PROPERTY_OBJECT_FILE_NAME, MTP_PROPERTY_DATE_MODIFIED, MTP_PROPERTY_PARENT_OBJECT, MTP_PROPERTY_PERSISTENT_UID,
 												MTP_PROPERTY_NAME, MTP_PROPERTY_DISPLAY_NAME, MTP_PROPERTY_DATE_CREATED, MTP_PROPERTY_ARTIST, MTP_PROPERTY_ALBUM_NAME,
@@ -175,11 +184,6 @@ const formats_property fmt_properties[]=
 												MTP_PROPERTY_NAME, MTP_PROPERTY_DISPLAY_NAME, MTP_PROPERTY_DATE_CREATED,
 												0xFFFF}
 	},
-	{ MTP_FORMAT_FLAC        ,  (uint16_t[]){   MTP_PROPERTY_STORAGE_ID, MTP_PROPERTY_OBJECT_FORMAT, MTP_PROPERTY_PROTECTION_STATUS, MTP_PROPERTY_OBJECT_SIZE,
-												MTP_PROPERTY_OBJECT_FILE_NAME, MTP_PROPERTY_DATE_MODIFIED, MTP_PROPERTY_PARENT_OBJECT, MTP_PROPERTY_PERSISTENT_UID,
-												MTP_PROPERTY_NAME, MTP_PROPERTY_DISPLAY_NAME, MTP_PROPERTY_DATE_CREATED,
-												0xFFFF}
-	},
 	{ MTP_FORMAT_AVI          , (uint16_t[]){   MTP_PROPERTY_STORAGE_ID, MTP_PROPERTY_OBJECT_FORMAT, MTP_PROPERTY_PROTECTION_STATUS, MTP_PROPERTY_OBJECT_SIZE,
 												MTP_PROPERTY_OBJECT_FILE_NAME, MTP_PROPERTY_DATE_MODIFIED, MTP_PROPERTY_PARENT_OBJECT, MTP_PROPERTY_PERSISTENT_UID,
 												MTP_PROPERTY_NAME, MTP_PROPERTY_DISPLAY_NAME, MTP_PROPERTY_DATE_CREATED, MTP_PROPERTY_ARTIST, MTP_PROPERTY_ALBUM_NAME,
@@ -272,6 +276,27 @@ const profile_property properties[]=
 	{MTP_PROPERTY_PROTECTION_STATUS,   MTP_TYPE_UINT16,    0x00,   0x0000             , 0x000000000 , 0x00 , 0xFFFF },
 	{MTP_PROPERTY_HIDDEN,              MTP_TYPE_UINT16,    0x00,   0x0000             , 0x000000000 , 0x00 , 0xFFFF },
 
+	// Other formats
+	{MTP_PROPERTY_OBJECT_SIZE,         MTP_TYPE_UINT64,    0x00,   0x0000000000000000 , 0x000000000 , 0x00 , 0xFFFF },
+	{MTP_PROPERTY_DISPLAY_NAME,        MTP_TYPE_STR,       0x00,   0x0000             , 0x000000000 , 0x00 , 0xFFFF },
+	{MTP_PROPERTY_OBJECT_FILE_NAME,    MTP_TYPE_STR,       0x01,   0x0000             , 0x000000000 , 0x00 , 0xFFFF },
+	{MTP_PROPERTY_DATE_CREATED,        MTP_TYPE_STR,       0x00,   0x00               , 0x000000000 , 0x00 , 0xFFFF },
+	{MTP_PROPERTY_DATE_MODIFIED,       MTP_TYPE_STR,       0x00,   0x00               , 0x000000000 , 0x00 , 0xFFFF },
+	{MTP_PROPERTY_PARENT_OBJECT,       MTP_TYPE_UINT32,    0x00,   0x00000000         , 0x000000000 , 0x00 , 0xFFFF },
+	{MTP_PROPERTY_PERSISTENT_UID,      MTP_TYPE_UINT128,   0x00,   0x00               , 0x000000000 , 0x00 , 0xFFFF },
+	{MTP_PROPERTY_NAME,                MTP_TYPE_STR,       0x00,   0x00               , 0x000000000 , 0x00 , 0xFFFF },
+
+	// Media metadata
+	{MTP_PROPERTY_ARTIST,              MTP_TYPE_STR,       0x00,   0x00               , 0x000000000 , 0x00 , 0xFFFF },
+	{MTP_PROPERTY_ALBUM_NAME,          MTP_TYPE_STR,       0x00,   0x00               , 0x000000000 , 0x00 , 0xFFFF },
+	{MTP_PROPERTY_GENRE,               MTP_TYPE_STR,       0x00,   0x00               , 0x000000000 , 0x00 , 0xFFFF },
+	{MTP_PROPERTY_ORIGINAL_RELEASE_DATE, MTP_TYPE_STR,     0x00,   0x00               , 0x000000000 , 0x00 , 0xFFFF },
+	{MTP_PROPERTY_DATE_AUTHORED,       MTP_TYPE_STR,       0x00,   0x00               , 0x000000000 , 0x00 , 0xFFFF },
+	{MTP_PROPERTY_TRACK,               MTP_TYPE_UINT16,    0x00,   0x0000             , 0x000000000 , 0x00 , 0xFFFF },
+	{MTP_PROPERTY_DURATION,            MTP_TYPE_UINT32,    0x00,   0x00000000         , 0x000000000 , 0x00 , 0xFFFF },
+	{MTP_PROPERTY_WIDTH,               MTP_TYPE_UINT32,    0x00,   0x00000000         , 0x000000000 , 0x00 , 0xFFFF },
+	{MTP_PROPERTY_HEIGHT,              MTP_TYPE_UINT32,    0x00,   0x00000000         , 0x000000000 , 0x00 , 0xFFFF },
+
 	{0xFFFF,                           MTP_TYPE_UINT32,    0x00,   0x00000000         , 0x000000000 , 0x00 }
 };
 
@@ -285,6 +310,112 @@ const profile_property dev_properties[]=
 	{0xFFFF,                                               MTP_TYPE_UINT32,    0x00,   0x00000000           , 0x000000000 , 0x00 }
 };
 
+// Media metadata properties : Value string id (MEDIA_STR_NB : integer value)
+static const uint16_t media_properties[][2]=
+{
+	{ MTP_PROPERTY_ARTIST,                MEDIA_STR_ARTIST },
+	{ MTP_PROPERTY_ALBUM_NAME,            MEDIA_STR_ALBUM },
+	{ MTP_PROPERTY_GENRE,                 MEDIA_STR_GENRE },
+	{ MTP_PROPERTY_ORIGINAL_RELEASE_DATE, MEDIA_STR_DATE },
+	{ MTP_PROPERTY_DATE_AUTHORED,         MEDIA_STR_DATE },
+	{ MTP_PROPERTY_TRACK,                 MEDIA_STR_NB },
+	{ MTP_PROPERTY_DURATION,              MEDIA_STR_NB },
+	{ MTP_PROPERTY_WIDTH,                 MEDIA_STR_NB },
+	{ MTP_PROPERTY_HEIGHT,                MEDIA_STR_NB },
+	{ 0xFFFF,                             0 }
+};
+
+static int format_has_property(uint16_t format_id, uint16_t prop_code)
+{
+	int i,j;
+
+	i = 0;
+	while( fmt_properties[i].format_code != 0xFFFF && fmt_properties[i].format_code != format_id )
+		i++;
+
+	j = 0;
+	while( fmt_properties[i].properties[j] != 0xFFFF )
+	{
+		if( fmt_properties[i].properties[j] == prop_code )
+			return 1;
+		j++;
+	}
+
+	return 0;
+}
+
+static int media_property_index(uint16_t prop_code)
+{
+	int i;
+
+	i = 0;
+	while( media_properties[i][0] != 0xFFFF && media_properties[i][0] != prop_code )
+		i++;
+
+	if( media_properties[i][0] == 0xFFFF )
+		return -1;
+
+	return i;
+}
+
+// Media property value : String (returned, "" if unknown) or integer (*value).
+static const char * media_property_value(mtp_media_info * media, int idx, uint32_t * value)
+{
+	const char * str;
+
+	*value = 0;
+
+	if( media_properties[idx][1] != MEDIA_STR_NB )
+	{
+		str = mtp_media_string(media, media_properties[idx][1]);
+		return str ? str : "";
+	}
+
+	if( media )
+	{
+		switch( media_properties[idx][0] )
+		{
+			case MTP_PROPERTY_TRACK:    *value = media->track;    break;
+			case MTP_PROPERTY_DURATION: *value = media->duration; break;
+			case MTP_PROPERTY_WIDTH:    *value = media->width;    break;
+			case MTP_PROPERTY_HEIGHT:   *value = media->height;   break;
+		}
+	}
+
+	return NULL;
+}
+
+// Media metadata indexed after they were missing in an objects list : The host reads them again.
+void objectproplist_media_changed(mtp_ctx * ctx, uint32_t handle, uint16_t format, mtp_media_info * media)
+{
+	uint32_t params[2];
+	uint32_t value;
+	const char * str;
+	int i;
+
+	params[0] = handle;
+
+	if( mtp_media_string(media, MEDIA_STR_TITLE) )
+	{
+		params[1] = MTP_PROPERTY_NAME;
+		mtp_push_event(ctx, MTP_EVENT_OBJECT_PROP_CHANGED, 2, params);
+	}
+
+	for( i = 0; media_properties[i][0] != 0xFFFF; i++ )
+	{
+		if( !format_has_property(format, media_properties[i][0]) )
+			continue;
+
+		// Default value : Already sent.
+		str = media_property_value(media, i, &value);
+		if( str ? !*str : !value )
+			continue;
+
+		params[1] = media_properties[i][0];
+		mtp_push_event(ctx, MTP_EVENT_OBJECT_PROP_CHANGED, 2, params);
+	}
+}
+
 int build_properties_dataset(mtp_ctx * ctx,void * buffer, int maxsize,uint32_t property_id,uint32_t format_id)
 {
 	int ofs,i,j;
@@ -485,6 +616,7 @@ int setObjectPropValue(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, uint32_
 	char * path2;
 	char * old_filename;
 	char * new_filename;
+	fs_db_shard * shard;
 	uint32_t response_code;
 	int ret;
 
@@ -523,7 +655,7 @@ int setObjectPropValue(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, uint32_
 				{
 					entry->name = old_filename;
 					free(path);
-					free(new_filename);
+					fs_db_retire(fs_db_get_shard(ctx->fs_db, entry->storage_id), new_filename);
 					return MTP_RESPONSE_GENERAL_ERROR;
 				}
 
@@ -531,6 +663,9 @@ int setObjectPropValue(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, uint32_
 
 				ret = -1;
 
+				inotify_handler_echo_begin(ctx, entry->storage_id, entry->parent, old_filename, IN_MOVED_FROM);
+				inotify_handler_echo_begin(ctx, entry->storage_id, entry->parent, new_filename, IN_MOVED_TO);
+
 				if(!set_storage_giduid(ctx, entry->storage_id))
 				{
 					ret = rename(path, path2);
@@ -539,18 +674,30 @@ int setObjectPropValue(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, uint32_
 
 				if(ret)
 				{
+					inotify_handler_echo_end(ctx, entry->storage_id, entry->parent, old_filename);
+					inotify_handler_echo_end(ctx, entry->storage_id, entry->parent, new_filename);
+
 					PRINT_ERROR("setObjectPropValue : Can't rename %s to %s", path, path2);
 
 					free(path);
 					free(path2);
-					free(new_filename);
+					fs_db_retire(fs_db_get_shard(ctx->fs_db, entry->storage_id), new_filename);
 					return MTP_RESPONSE_GENERAL_ERROR;
 				}
 
-				remove_entry(ctx->fs_db, entry);
+				shard = fs_db_get_shard(ctx->fs_db, entry->storage_id);
+
+				remove_entry(shard, entry);
 				entry->name = new_filename;
-				insert_entry(ctx->fs_db, entry);
-				free(old_filename);
+				insert_entry(shard, entry);
+
+				inotify_handler_echo_end(ctx, entry->storage_id, entry->parent, old_filename);
+				inotify_handler_echo_end(ctx, entry->storage_id, entry->parent, new_filename);
+
+				// Lock-free readers may still be using the old name.
+				fs_db_retire(shard, old_filename);
+
+				mtp_journal_rename(ctx, entry->storage_id, path, entry->storage_id, path2);
 
 				free(path);
 				free(path2);
@@ -570,9 +717,13 @@ int setObjectPropValue(mtp_ctx * ctx,MTP_PACKET_HEADER * mtp_packet_hdr, uint32_
 
 int build_ObjectPropValue_dataset(mtp_ctx * ctx,void * buffer, int maxsize,uint32_t handle,uint32_t prop_code)
 {
-	int ofs;
+	int ofs,idx;
 	fs_entry * entry;
 	char timestr[32];
+	mtp_media_info * media;
+	mtp_media_info * tmp_media;
+	const char * str;
+	uint32_t value;
 
 	ofs = 0;
 
@@ -584,10 +735,7 @@ int build_ObjectPropValue_dataset(mtp_ctx * ctx,void * buffer, int maxsize,uint3
 		switch(prop_code)
 		{
 			case MTP_PROPERTY_OBJECT_FORMAT:
-				if(entry->flags & ENTRY_IS_DIR)
-					ofs = poke16(buffer, ofs, maxsize, MTP_FORMAT_ASSOCIATION);                          // ObjectFormat Code
-				else
-					ofs = poke16(buffer, ofs, maxsize, MTP_FORMAT_UNDEFINED);                            // ObjectFormat Code
+				ofs = poke16(buffer, ofs, maxsize, mtp_media_format(entry));                             // ObjectFormat Code
 			break;
 
 			case MTP_PROPERTY_OBJECT_SIZE:
@@ -600,10 +748,40 @@ int build_ObjectPropValue_dataset(mtp_ctx * ctx,void * buffer, int maxsize,uint3
 			break;
 
 			case MTP_PROPERTY_NAME:
+				// Media title if known
+				media = mtp_media_get(ctx, entry, &tmp_media, 0);
+				str = mtp_media_string(media, MEDIA_STR_TITLE);
+				ofs = poke_string(buffer, ofs, maxsize, str ? str : entry->name);
+				free(tmp_media);
+			break;
+
 			case MTP_PROPERTY_OBJECT_FILE_NAME:
 				ofs = poke_string(buffer, ofs, maxsize, entry->name);                                      // Filename
 			break;
 
+			case MTP_PROPERTY_ARTIST:
+			case MTP_PROPERTY_ALBUM_NAME:
+			case MTP_PROPERTY_GENRE:
+			case MTP_PROPERTY_ORIGINAL_RELEASE_DATE:
+			case MTP_PROPERTY_DATE_AUTHORED:
+			case MTP_PROPERTY_TRACK:
+			case MTP_PROPERTY_DURATION:
+			case MTP_PROPERTY_WIDTH:
+			case MTP_PROPERTY_HEIGHT:
+				idx = media_property_index(prop_code);
+				media = mtp_media_get(ctx, entry, &tmp_media, 0);
+				str = media_property_value(media, idx, &value);
+
+				if( str )
+					ofs = poke_string(buffer, ofs, maxsize, str);
+				else if( prop_code == MTP_PROPERTY_TRACK )
+					ofs = poke16(buffer, ofs, maxsize, value);
+				else
+					ofs = poke32(buffer, ofs, maxsize, value);
+
+				free(tmp_media);
+			break;
+
 			case MTP_PROPERTY_STORAGE_ID:
 				ofs = poke32(buffer, ofs, maxsize, entry->storage_id);
 			break;
@@ -685,7 +863,8 @@ int build_DevicePropValue_dataset(mtp_ctx * ctx,void * buffer, int maxsize,uint3
 	return ofs;
 }
 
-int objectproplist_element(mtp_ctx * ctx, void * buffer, int * ofs, int maxsize, uint16_t prop_code, uint32_t handle, void * data,uint32_t prop_code_param)
+// prop_code_param : 0xFFFFFFFF all properties, 0x00000000 properties of the prop_group_code group.
+int objectproplist_element(mtp_ctx * ctx, void * buffer, int * ofs, int maxsize, uint16_t prop_code, uint32_t handle, void * data,uint32_t prop_code_param, uint32_t prop_group_code)
 {
 	int i;
 	uint64_t tmp_data[2];
@@ -702,7 +881,7 @@ int objectproplist_element(mtp_ctx * ctx, void * buffer, int * ofs, int maxsize,
 	else
 		tmp_ptr = (void*)&tmp_data;
 
-	if( (prop_code != prop_code_param) && (prop_code_param != 0xFFFFFFFF) )
+	if( (prop_code != prop_code_param) && (prop_code_param != 0xFFFFFFFF) && (prop_code_param != 0x00000000) )
 	{
 		return 0;
 	}
@@ -713,6 +892,11 @@ int objectproplist_element(mtp_ctx * ctx, void * buffer, int * ofs, int maxsize,
 		i++;
 	}
 
+	if( prop_code_param == 0x00000000 && properties[i].group_code != prop_group_code )
+	{
+		return 0;
+	}
+
 	if( properties[i].prop_code == prop_code )
 	{
 		*ofs = poke32(buffer, *ofs, maxsize, handle);
@@ -753,94 +937,175 @@ int objectproplist_element(mtp_ctx * ctx, void * buffer, int * ofs, int maxsize,
 	return 0;
 }
 
-int build_objectproplist_dataset(mtp_ctx * ctx, void * buffer, int maxsize,fs_entry * entry, uint32_t handle,uint32_t format_id, uint32_t prop_code, uint32_t prop_group_code, uint32_t depth)
+int objectproplist_format_match(fs_entry * entry, uint32_t format_id)
+{
+	if( !format_id )
+		return 1;
+
+	return format_id == mtp_media_format(entry);
+}
+
+// Read the values of an object properties. Returns -1 if the object is not accessible anymore.
+// use_index : Size and date from the objects db (no stat if known), indexed media metadata only.
+int objectproplist_read(mtp_ctx * ctx, fs_entry * entry, objectproplist_values * values, uint32_t prop_code, int use_index)
 {
 	struct stat64 entrystat;
+	char * path;
+	int ret;
+
+	memset(values, 0, sizeof(objectproplist_values));
+
+	if( !use_index || !entry->date )
+	{
+		ret = -1;
+		path = build_full_path(ctx->fs_db, mtp_get_storage_root(ctx, entry->storage_id), entry);
+
+		if(path)
+		{
+			ret = stat64(path, &entrystat);
+			free(path);
+		}
+
+		if(ret)
+			return -1;
+
+		/* update the file size infomation */
+		entry->size = entrystat.st_size;
+		entry->date = entrystat.st_mtime;
+	}
+
+	values->entry = entry;
+	values->name = entry->name;
+	values->size = entry->size;
+	values->date = entry->date;
+	values->format = mtp_media_format(entry);
+
+	// Media metadata : Indexed in background, else read now.
+	// (use_index : Indexed ones only, the host is notified once the others are indexed)
+	if( values->format != MTP_FORMAT_UNDEFINED && values->format != MTP_FORMAT_ASSOCIATION &&
+		( prop_code == 0xFFFFFFFF || prop_code == 0x00000000 || prop_code == MTP_PROPERTY_NAME || media_property_index(prop_code) >= 0 ) )
+	{
+		values->media = mtp_media_get(ctx, entry, &values->tmp_media, use_index);
+	}
+
+	return 0;
+}
+
+void objectproplist_release(objectproplist_values * values)
+{
+	free(values->tmp_media);
+	values->tmp_media = NULL;
+	values->media = NULL;
+}
+
+// Appends the properties of an object. Returns the number of elements, -1 if the buffer is full.
+// use_index : Size and date from the objects db (no stat if known).
+int build_objectproplist_entry(mtp_ctx * ctx, void * buffer, int * ofs, int maxsize, fs_entry * entry, uint32_t prop_code, uint32_t prop_group_code, int use_index)
+{
+	objectproplist_values values;
+	int numberofelements;
+
+	if( objectproplist_read(ctx, entry, &values, prop_code, use_index) < 0 )
+		return 0;
+
+	numberofelements = build_objectproplist_values(ctx, buffer, ofs, maxsize, &values, prop_code, prop_group_code);
+
+	objectproplist_release(&values);
+
+	return numberofelements;
+}
+
+// Appends the properties of an object from its values. Returns the number of elements, -1 if the buffer is full.
+int build_objectproplist_values(mtp_ctx * ctx, void * buffer, int * ofs, int maxsize, objectproplist_values * values, uint32_t prop_code, uint32_t prop_group_code)
+{
 	time_t t;
 	struct tm lt;
-	int ofs,ret,numberofelements;
-	char * path;
+	int numberofelements;
 	char timestr[32];
 	// tmp_dword : 2 dword to fix the static analysis error with the MTP_TYPE_UINT64 case.
 	// Probably a false positive alert
 	// but some codes was added to check possible second word corruption
 	uint32_t tmp_dword[2];
 	uint32_t tmp_dword_array[4];
+	uint32_t handle,value;
+	uint16_t format,track;
+	mtp_media_info * media;
+	fs_entry * entry;
+	const char * str;
+	int i;
 
 	tmp_dword[1] = 0xDEADBEEF;  // Canary
 
-	ret = -1;
-	path = build_full_path(ctx->fs_db, mtp_get_storage_root(ctx, entry->storage_id), entry);
-
-	if(path)
-	{
-		ret = stat64(path, &entrystat);
-	}
-
-	if(ret)
-	{
-		if(path)
-			free(path);
-		return 0;
-	}
-
-	/* update the file size infomation */
-	entry->size = entrystat.st_size;
+	entry = values->entry;
+	format = values->format;
+	media = values->media;
 
+	handle = entry->handle;
 	numberofelements = 0;
 
-	ofs = poke32(buffer, 0, maxsize, numberofelements);   // Number of elements
-
-	numberofelements += objectproplist_element(ctx, buffer, &ofs, maxsize, MTP_PROPERTY_STORAGE_ID, handle, &entry->storage_id,prop_code);
+	numberofelements += objectproplist_element(ctx, buffer, ofs, maxsize, MTP_PROPERTY_STORAGE_ID, handle, &entry->storage_id,prop_code,prop_group_code);
 
-	if(entry->flags & ENTRY_IS_DIR)
-		tmp_dword[0] = MTP_FORMAT_ASSOCIATION;
-	else
-		tmp_dword[0] = MTP_FORMAT_UNDEFINED;
+	tmp_dword[0] = format;
 
-	numberofelements += objectproplist_element(ctx, buffer, &ofs, maxsize, MTP_PROPERTY_OBJECT_FORMAT, handle, &tmp_dword[0],prop_code);
+	numberofelements += objectproplist_element(ctx, buffer, ofs, maxsize, MTP_PROPERTY_OBJECT_FORMAT, handle, &tmp_dword[0],prop_code,prop_group_code);
 
 	if(entry->flags & ENTRY_IS_DIR)
 		tmp_dword[0] = MTP_ASSOCIATION_TYPE_GENERIC_FOLDER;
 	else
 		tmp_dword[0] = 0x0000;
 
-	numberofelements += objectproplist_element(ctx, buffer, &ofs, maxsize, MTP_PROPERTY_ASSOCIATION_TYPE, handle, &tmp_dword[0],prop_code);
-	numberofelements += objectproplist_element(ctx, buffer, &ofs, maxsize, MTP_PROPERTY_PARENT_OBJECT, handle, &entry->parent,prop_code);
-	numberofelements += objectproplist_element(ctx, buffer, &ofs, maxsize, MTP_PROPERTY_OBJECT_SIZE, handle, &entry->size,prop_code);
+	numberofelements += objectproplist_element(ctx, buffer, ofs, maxsize, MTP_PROPERTY_ASSOCIATION_TYPE, handle, &tmp_dword[0],prop_code,prop_group_code);
+	numberofelements += objectproplist_element(ctx, buffer, ofs, maxsize, MTP_PROPERTY_PARENT_OBJECT, handle, &entry->parent,prop_code,prop_group_code);
+	numberofelements += objectproplist_element(ctx, buffer, ofs, maxsize, MTP_PROPERTY_OBJECT_SIZE, handle, &values->size,prop_code,prop_group_code);
 
 	tmp_dword[0] = 0x0000;
-	numberofelements += objectproplist_element(ctx, buffer, &ofs, maxsize, MTP_PROPERTY_PROTECTION_STATUS, handle, &tmp_dword[0],prop_code);
+	numberofelements += objectproplist_element(ctx, buffer, ofs, maxsize, MTP_PROPERTY_PROTECTION_STATUS, handle, &tmp_dword[0],prop_code,prop_group_code);
 
-	numberofelements += objectproplist_element(ctx, buffer, &ofs, maxsize, MTP_PROPERTY_OBJECT_FILE_NAME, handle, entry->name,prop_code);
-	numberofelements += objectproplist_element(ctx, buffer, &ofs, maxsize, MTP_PROPERTY_NAME, handle, entry->name,prop_code);
-	numberofelements += objectproplist_element(ctx, buffer, &ofs, maxsize, MTP_PROPERTY_DISPLAY_NAME, handle, 0,prop_code);
+	numberofelements += objectproplist_element(ctx, buffer, ofs, maxsize, MTP_PROPERTY_OBJECT_FILE_NAME, handle, values->name,prop_code,prop_group_code);
+	str = mtp_media_string(media, MEDIA_STR_TITLE);
+	numberofelements += objectproplist_element(ctx, buffer, ofs, maxsize, MTP_PROPERTY_NAME, handle, str ? (void*)str : (void*)values->name,prop_code,prop_group_code);
+	numberofelements += objectproplist_element(ctx, buffer, ofs, maxsize, MTP_PROPERTY_DISPLAY_NAME, handle, 0,prop_code,prop_group_code);
 
 	// Date Created (NR) "YYYYMMDDThhmmss.s"
-	set_default_date(&lt);
-	t = entrystat.st_mtime;
-	localtime_r(&t, &lt);
-	snprintf(timestr,sizeof(timestr),"%.4d%.2d%.2dT%.2d%.2d%.2d",1900 + lt.tm_year, lt.tm_mon + 1, lt.tm_mday, lt.tm_hour, lt.tm_min, lt.tm_sec);
-	numberofelements += objectproplist_element(ctx, buffer, &ofs, maxsize, MTP_PROPERTY_DATE_CREATED, handle, &timestr,prop_code);
-
 	// Date Modified (NR) "YYYYMMDDThhmmss.s"
 	set_default_date(&lt);
-	t = entrystat.st_mtime;
+	t = values->date;
 	localtime_r(&t, &lt);
 	snprintf(timestr,sizeof(timestr),"%.4d%.2d%.2dT%.2d%.2d%.2d",1900 + lt.tm_year, lt.tm_mon + 1, lt.tm_mday, lt.tm_hour, lt.tm_min, lt.tm_sec);
-	numberofelements += objectproplist_element(ctx, buffer, &ofs, maxsize, MTP_PROPERTY_DATE_MODIFIED, handle, &timestr,prop_code);
+	numberofelements += objectproplist_element(ctx, buffer, ofs, maxsize, MTP_PROPERTY_DATE_CREATED, handle, &timestr,prop_code,prop_group_code);
+	numberofelements += objectproplist_element(ctx, buffer, ofs, maxsize, MTP_PROPERTY_DATE_MODIFIED, handle, &timestr,prop_code,prop_group_code);
 
 	tmp_dword_array[0] = entry->handle;
 	tmp_dword_array[1] = entry->parent;
 	tmp_dword_array[2] = entry->storage_id;
 	tmp_dword_array[3] = 0x00000000;
-	numberofelements += objectproplist_element(ctx, buffer, &ofs, maxsize, MTP_PROPERTY_PERSISTENT_UID, handle, &tmp_dword_array,prop_code);
+	numberofelements += objectproplist_element(ctx, buffer, ofs, maxsize, MTP_PROPERTY_PERSISTENT_UID, handle, &tmp_dword_array,prop_code,prop_group_code);
 
-	poke32(buffer, 0, maxsize, numberofelements);   // Number of elements
+	// Media metadata properties of this format
+	for( i = 0; media_properties[i][0] != 0xFFFF; i++ )
+	{
+		if( !format_has_property(format, media_properties[i][0]) )
+			continue;
+
+		str = media_property_value(media, i, &value);
+		if( str )
+			numberofelements += objectproplist_element(ctx, buffer, ofs, maxsize, media_properties[i][0], handle, (void*)str,prop_code,prop_group_code);
+		else if( media_properties[i][0] == MTP_PROPERTY_TRACK )
+		{
+			track = value;
+			numberofelements += objectproplist_element(ctx, buffer, ofs, maxsize, media_properties[i][0], handle, &track,prop_code,prop_group_code);
+		}
+		else
+			numberofelements += objectproplist_element(ctx, buffer, ofs, maxsize, media_properties[i][0], handle, &value,prop_code,prop_group_code);
+	}
 
 	if( tmp_dword[1] != 0xDEADBEEF )
 	{
-		PRINT_ERROR("build_objectproplist_dataset : second dword modified ! Please report ! (0x%.8X)", tmp_dword[1] );
+		PRINT_ERROR("build_objectproplist_values : second dword modified ! Please report ! (0x%.8X)", tmp_dword[1] );
 	}
-	return ofs;
+
+	if( *ofs < 0 )
+		return -1;
+
+	return numberofelements;
 }
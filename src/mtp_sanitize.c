@@ -232,24 +232,42 @@ int sanitize_name(char *str, int max_len)
 
 int check_realpath(char *rootpath, char *pathtocheck)
 {
-	int i;
+	int i,ret;
+	char * realroot;
 	char * realp;
 
+	// The storage root may be a symbolic link itself.
+	realroot = realpath( rootpath, NULL);
+	if(!realroot)
+		return 0;
+
 	realp = realpath( pathtocheck, NULL);
 	if(!realp)
+	{
+		free(realroot);
 		return 0;
+	}
+
+	ret = 1;
 
 	i = 0;
-	while( rootpath[i] )
+	while( realroot[i] )
 	{
-		if( rootpath[i] != realp[i] )
+		if( realroot[i] != realp[i] )
 		{
-			free(realp);
-			return 0;
+			ret = 0;
+			break;
 		}
+
+		i++;
 	}
 
+	// The root folder itself or one of its sub folders ("/mnt/sd" doesn't contain "/mnt/sdcard2").
+	if( ret && realp[i] != '/' && realp[i] != '\0' && realroot[i - 1] != '/' )
+		ret = 0;
+
 	free(realp);
+	free(realroot);
 
-	return 1;
+	return ret;
 }
@@ -0,0 +1,442 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/**
+ * @file   mtp_search.c
+ * @brief  Objects search (FindObjects vendor extension).
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+// The names are matched against the objects db : The prefix and glob patterns
+// use the sorted names index of the storage, the substrings are matched on all
+// the db entries. Only the folders below the search root never added to the db
+// are scanned, up to CONFIG_FIND_MAX_SCANS folders per request : The host can
+// search again to continue the scan (incomplete result flag).
+
+#include "buildconf.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+
+#include "mtp.h"
+#include "mtp_helpers.h"
+#include "mtp_constant.h"
+#include "mtp_ops_helpers.h"
+#include "mtp_search.h"
+
+#include "logs_out.h"
+
+typedef struct find_state_
+{
+	mtp_ctx * ctx;
+
+	uint32_t root_handle;
+	uint32_t mode;
+	const char * pattern;
+
+	uint32_t * results;
+	int nb_results;
+	int max_results;
+
+	int incomplete;
+
+	// Folders scan
+	fs_entry ** folders;
+	int nb_folders;
+	int max_folders;
+}find_state;
+
+static int push_folder(find_state * st, fs_entry * entry)
+{
+	fs_entry ** tmp;
+
+	if( st->nb_folders >= st->max_folders )
+	{
+		tmp = realloc(st->folders, ( st->max_folders * 2 + 64 ) * sizeof(fs_entry *));
+		if( !tmp )
+			return -1;
+
+		st->folders = tmp;
+		st->max_folders = st->max_folders * 2 + 64;
+	}
+
+	st->folders[st->nb_folders++] = entry;
+
+	return 0;
+}
+
+static int cmp_folders_parent(const void * a, const void * b)
+{
+	uint32_t pa,pb;
+
+	pa = (*(fs_entry **)a)->parent;
+	pb = (*(fs_entry **)b)->parent;
+
+	return ( pa > pb ) - ( pa < pb );
+}
+
+static int collect_folder(fs_entry * entry, void * arg)
+{
+	find_state * st = (find_state *)arg;
+
+	if( ( entry->flags & ENTRY_IS_DIR ) && entry->handle != entry->parent )
+		return push_folder(st, entry);
+
+	return 0;
+}
+
+// Add the folders below root never added to the db. The storage lock must be held.
+static int scan_unindexed_folders(find_state * st, uint32_t storage_id, fs_entry * root)
+{
+	mtp_ctx * ctx = st->ctx;
+	fs_db_shard * shard;
+	fs_entry ** known;
+	fs_entry * folder;
+	fs_entry * head;
+	fs_entry * entry;
+	fs_entry key;
+	fs_entry * key_ptr;
+	fs_entry ** child;
+	char * path;
+	int nb_known,first,nb_scans,ret;
+
+	shard = fs_db_get_shard(ctx->fs_db, storage_id);
+	if( !shard )
+		return 0;
+
+	// Known folders of the storage, sorted by parent : Children lookup.
+	st->nb_folders = 0;
+	if( fs_db_find_names(ctx->fs_db, storage_id, "", collect_folder, st) < 0 )
+	{
+		free(st->folders);
+		st->folders = NULL;
+		st->max_folders = 0;
+		return -1;
+	}
+
+	known = st->folders;
+	nb_known = st->nb_folders;
+	qsort(known, nb_known, sizeof(fs_entry *), cmp_folders_parent);
+
+	// Folders to visit
+	st->folders = NULL;
+	st->nb_folders = 0;
+	st->max_folders = 0;
+
+	ret = push_folder(st, root);
+
+	nb_scans = 0;
+	while( !ret && st->nb_folders )
+	{
+		folder = st->folders[--st->nb_folders];
+
+		if( folder->flags & ENTRY_IS_DELETED )
+			continue;
+
+		if( !( folder->flags & ENTRY_IS_SCANNED ) )
+		{
+			if( nb_scans >= CONFIG_FIND_MAX_SCANS )
+			{
+				st->incomplete = 1;
+				continue;
+			}
+
+			if( folder->handle == 0x00000000 )
+				path = strdup(mtp_get_storage_root(ctx, storage_id));
+			else
+				path = build_full_path(ctx->fs_db, mtp_get_storage_root(ctx, storage_id), folder);
+
+			if( !path )
+				continue;
+
+			head = shard->entry_list;
+
+			sync_folder(ctx, folder, path, folder->handle, storage_id);
+
+			free(path);
+
+			nb_scans++;
+
+			// New sub folders (the new entries are at the head of the list)
+			for( entry = shard->entry_list; !ret && entry && entry != head; entry = entry->next )
+			{
+				if( ( entry->flags & ENTRY_IS_DIR ) && !( entry->flags & ENTRY_IS_DELETED ) &&
+					entry->parent == folder->handle && entry->handle != entry->parent )
+				{
+					ret = push_folder(st, entry);
+				}
+			}
+		}
+
+		// Sub folders already known
+		key.parent = folder->handle;
+		key_ptr = &key;
+
+		child = bsearch(&key_ptr, known, nb_known, sizeof(fs_entry *), cmp_folders_parent);
+		if( child )
+		{
+			first = child - known;
+			while( first > 0 && known[first - 1]->parent == folder->handle )
+				first--;
+
+			while( !ret && first < nb_known && known[first]->parent == folder->handle )
+			{
+				if( known[first]->storage_id == storage_id && known[first]->handle != known[first]->parent )
+					ret = push_folder(st, known[first]);
+
+				first++;
+			}
+		}
+	}
+
+	free(known);
+
+	free(st->folders);
+	st->folders = NULL;
+	st->nb_folders = 0;
+	st->max_folders = 0;
+
+	if( nb_scans )
+		PRINT_DEBUG("mtp_find_objects : %d folders scanned", nb_scans);
+
+	return ret;
+}
+
+static int under_root(mtp_ctx * ctx, fs_entry * entry, uint32_t root_handle)
+{
+	int depth;
+
+	if( !root_handle )
+		return 1;
+
+	depth = 0;
+	while( entry && entry->parent && depth < CONFIG_FIND_MAX_DEPTH )
+	{
+		if( entry->parent == root_handle )
+			return 1;
+
+		entry = get_entry_by_handle(ctx->fs_db, entry->parent);
+		depth++;
+	}
+
+	return 0;
+}
+
+static int match_entry(fs_entry * entry, void * arg)
+{
+	find_state * st = (find_state *)arg;
+	uint32_t * tmp;
+	int match;
+
+	if( entry->handle == entry->parent )
+		return 0;
+
+	switch( st->mode )
+	{
+		case MTP_FIND_PREFIX: // Selected by the names index
+			match = 1;
+		break;
+
+		case MTP_FIND_GLOB:
+			match = !fnmatch(st->pattern, entry->name, FNM_CASEFOLD);
+		break;
+
+		default:
+			match = strcasestr(entry->name, st->pattern) != NULL;
+		break;
+	}
+
+	if( !match || !under_root(st->ctx, entry, st->root_handle) )
+		return 0;
+
+	if( st->nb_results >= CONFIG_FIND_MAX_RESULTS )
+	{
+		st->incomplete = 1;
+		return 1;
+	}
+
+	if( st->nb_results >= st->max_results )
+	{
+		tmp = realloc(st->results, ( st->max_results * 2 + 256 ) * sizeof(uint32_t));
+		if( !tmp )
+		{
+			st->incomplete = 1;
+			return 1;
+		}
+
+		st->results = tmp;
+		st->max_results = st->max_results * 2 + 256;
+	}
+
+	st->results[st->nb_results++] = entry->handle;
+
+	return 0;
+}
+
+static uint32_t find_in_storage(find_state * st, uint32_t storage_id)
+{
+	mtp_ctx * ctx = st->ctx;
+	fs_entry * root;
+	char prefix[256+1];
+	uint32_t storage_flags;
+	int store_index,i;
+
+	storage_flags = mtp_get_storage_flags(ctx, storage_id);
+	if( storage_flags == 0xFFFFFFFF || ( storage_flags & UMTP_STORAGE_LOCKED ) )
+		return MTP_RESPONSE_STORE_NOT_AVAILABLE;
+
+	store_index = mtp_get_storage_index_by_id(ctx, storage_id);
+
+	if( mtp_db_lock_storage( ctx, store_index ) )
+		return MTP_RESPONSE_GENERAL_ERROR;
+
+	if( st->root_handle )
+		root = get_entry_by_handle(ctx->fs_db, st->root_handle);
+	else
+		root = get_entry_by_handle_and_storageid(ctx->fs_db, 0x00000000, storage_id);
+
+	if( !root || root->storage_id != storage_id || !( root->flags & ENTRY_IS_DIR ) || ( root->flags & ENTRY_IS_DELETED ) )
+	{
+		mtp_db_unlock_storage( ctx, store_index );
+		return MTP_RESPONSE_INVALID_PARENT_OBJECT;
+	}
+
+	if( scan_unindexed_folders(st, storage_id, root) < 0 )
+	{
+		mtp_db_unlock_storage( ctx, store_index );
+		return MTP_RESPONSE_GENERAL_ERROR;
+	}
+
+	// Literal start of the pattern : names index lookup.
+	prefix[0] = 0;
+	if( st->mode == MTP_FIND_PREFIX )
+	{
+		snprintf(prefix, sizeof(prefix), "%s", st->pattern);
+	}
+	else if( st->mode == MTP_FIND_GLOB )
+	{
+		i = 0;
+		while( i < (int)sizeof(prefix) - 1 && st->pattern[i] && !strchr("*?[\\", st->pattern[i]) )
+		{
+			prefix[i] = st->pattern[i];
+			i++;
+		}
+		prefix[i] = 0;
+	}
+
+	fs_db_find_names(ctx->fs_db, storage_id, prefix, match_entry, st);
+
+	mtp_db_unlock_storage( ctx, store_index );
+
+	return MTP_RESPONSE_OK;
+}
+
+// Search the objects below root_handle (0x00000000 / 0xFFFFFFFF : storage root) of a storage
+// (0xFFFFFFFF : all storages). The matching handles are kept in ctx->find_results.
+uint32_t mtp_find_objects(mtp_ctx * ctx, uint32_t storage_id, uint32_t root_handle, uint32_t mode, char * pattern, int * incomplete)
+{
+	find_state st;
+	fs_entry * root;
+	uint32_t response_code;
+	int i;
+
+	*incomplete = 0;
+
+	mtp_find_free(ctx);
+
+	if( mode > MTP_FIND_GLOB )
+		return MTP_RESPONSE_PARAMETER_NOT_SUPPORTED;
+
+	if( root_handle == 0xFFFFFFFF )
+		root_handle = 0x00000000;
+
+	memset(&st, 0, sizeof(st));
+	st.ctx = ctx;
+	st.root_handle = root_handle;
+	st.mode = mode;
+	st.pattern = pattern;
+
+	// Search root folder : Its storage.
+	if( root_handle )
+	{
+		if( mtp_db_lock( ctx ) )
+			return MTP_RESPONSE_GENERAL_ERROR;
+
+		root = get_entry_by_handle(ctx->fs_db, root_handle);
+		if( root && ( storage_id == 0xFFFFFFFF || storage_id == root->storage_id ) )
+			storage_id = root->storage_id;
+		else
+			storage_id = 0x00000000;
+
+		mtp_db_unlock( ctx );
+
+		if( !storage_id )
+			return MTP_RESPONSE_INVALID_PARENT_OBJECT;
+	}
+
+	if( storage_id != 0xFFFFFFFF )
+	{
+		if( !mtp_get_storage_root(ctx, storage_id) )
+			return MTP_RESPONSE_INVALID_STORAGE_ID;
+
+		response_code = find_in_storage(&st, storage_id);
+	}
+	else
+	{
+		response_code = MTP_RESPONSE_OK;
+
+		i = 0;
+		while( i < MAX_STORAGE_NB && ctx->storages[i].root_path && response_code == MTP_RESPONSE_OK )
+		{
+			// Unavailable storages are skipped
+			if( find_in_storage(&st, ctx->storages[i].storage_id) == MTP_RESPONSE_GENERAL_ERROR )
+				response_code = MTP_RESPONSE_GENERAL_ERROR;
+
+			i++;
+		}
+	}
+
+	if( response_code != MTP_RESPONSE_OK )
+	{
+		free(st.results);
+		return response_code;
+	}
+
+	PRINT_DEBUG("mtp_find_objects : \"%s\" (mode %d) : %d objects found%s", pattern, mode, st.nb_results, st.incomplete ? " (incomplete)" : "");
+
+	ctx->find_results = st.results;
+	ctx->find_results_count = st.nb_results;
+
+	*incomplete = st.incomplete;
+
+	return MTP_RESPONSE_OK;
+}
+
+void mtp_find_free(mtp_ctx * ctx)
+{
+	free(ctx->find_results);
+
+	ctx->find_results = NULL;
+	ctx->find_results_count = 0;
+}
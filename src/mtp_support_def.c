@@ -38,7 +38,7 @@ const unsigned short supported_op[]=
 	MTP_OPERATION_GET_OBJECT_HANDLES                     ,//0x1007
 	MTP_OPERATION_GET_OBJECT_INFO                        ,//0x1008
 	MTP_OPERATION_GET_OBJECT                             ,//0x1009
-	//MTP_OPERATION_GET_THUMB                              ,//0x100A
+	MTP_OPERATION_GET_THUMB                              ,//0x100A
 	MTP_OPERATION_DELETE_OBJECT                          ,//0x100B
 	MTP_OPERATION_SEND_OBJECT_INFO                       ,//0x100C
 	MTP_OPERATION_SEND_OBJECT                            ,//0x100D
@@ -46,19 +46,28 @@ const unsigned short supported_op[]=
 	MTP_OPERATION_GET_DEVICE_PROP_VALUE                  ,//0x1015
 	MTP_OPERATION_SET_DEVICE_PROP_VALUE                  ,//0x1016
 	//MTP_OPERATION_RESET_DEVICE_PROP_VALUE                ,//0x1017
+	MTP_OPERATION_MOVE_OBJECT                            ,//0x1019
+	MTP_OPERATION_COPY_OBJECT                            ,//0x101A
 	MTP_OPERATION_GET_PARTIAL_OBJECT                     ,//0x101B
 	MTP_OPERATION_GET_OBJECT_PROPS_SUPPORTED             ,//0x9801
 	MTP_OPERATION_GET_OBJECT_PROP_DESC                   ,//0x9802
 	MTP_OPERATION_GET_OBJECT_PROP_VALUE                  ,//0x9803
 	MTP_OPERATION_SET_OBJECT_PROP_VALUE                  ,//0x9804
 	MTP_OPERATION_GET_OBJECT_PROP_LIST                   ,//0x9805
+	MTP_OPERATION_SEND_OBJECT_PROP_LIST                  ,//0x9808
 	//MTP_OPERATION_GET_OBJECT_REFERENCES                  ,//0x9810
 	//MTP_OPERATION_SET_OBJECT_REFERENCES                  ,//0x9811
 	MTP_OPERATION_GET_PARTIAL_OBJECT_64                  ,//0x95C1
 	MTP_OPERATION_SEND_PARTIAL_OBJECT                    ,//0x95C2
 	MTP_OPERATION_TRUNCATE_OBJECT                        ,//0x95C3
 	MTP_OPERATION_BEGIN_EDIT_OBJECT                      ,//0x95C4
-	MTP_OPERATION_END_EDIT_OBJECT                         //0x95C5
+	MTP_OPERATION_END_EDIT_OBJECT                        ,//0x95C5
+	MTP_OPERATION_FIND_OBJECTS                           ,//0x9D01
+	MTP_OPERATION_GET_FIND_RESULTS                       ,//0x9D02
+	MTP_OPERATION_GET_FOLDER_ARCHIVE                     ,//0x9D03
+	MTP_OPERATION_SEND_FOLDER_ARCHIVE                    ,//0x9D04
+	MTP_OPERATION_GET_ARCHIVE_ERRORS                     ,//0x9D05
+	MTP_OPERATION_GET_CHANGES                             //0x9D06
 };
 
 const int supported_op_size=sizeof(supported_op);
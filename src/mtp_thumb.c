@@ -0,0 +1,924 @@
+/*
+ * uMTP Responder
+ * Copyright (c) 2018 - 2025 Viveris Technologies
+ *
+ * uMTP Responder is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * uMTP Responder is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 3 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with uMTP Responder; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/**
+ * @file   mtp_thumb.c
+ * @brief  Objects thumbnails.
+ * @author Jean-Franois DEL NERO <Jean-Francois.DELNERO@viveris.fr>
+ */
+
+// JPEG thumbnails for the GetThumb operation and the ObjectInfo dataset.
+// The thumbnail embedded in the EXIF header is used when present : Only the
+// header (64KB max) is read, the image isn't decoded.
+// Else, with libjpeg (LIBJPEG=1 build option), a downscaled copy is generated :
+// The GetObjectInfo requests queue the generation to background workers,
+// a GetThumb request not served by the cache generates it at once.
+// The thumbnails are kept in the "thumbnail_cache" folder (if set), keyed by the
+// image device, inode, size and modification time : A modified image gets a new
+// thumbnail. An empty cache file marks an image without possible thumbnail.
+// The folder size is limited by "thumbnail_cache_max_size" : The least recently used
+// thumbnails (oldest modification time, refreshed when read) are removed first.
+
+#include "buildconf.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+
+#ifdef USE_LIBJPEG
+#include <setjmp.h>
+#include <jpeglib.h>
+#endif
+
+#include "mtp.h"
+#include "mtp_constant.h"
+#include "mtp_thumb.h"
+
+#include "logs_out.h"
+
+typedef struct mtp_thumb_pool_
+{
+	pthread_t threads[CONFIG_THUMB_MAX_WORKERS];
+	int nb_threads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	char * queue[CONFIG_THUMB_QUEUE_SIZE];
+	int first;
+	int nb_jobs;
+
+	int stop;
+}mtp_thumb_pool;
+
+static const char * thumb_extensions[] =
+{
+	"jpg", "jpeg", "jpe", "jfif",
+	NULL
+};
+
+int mtp_thumb_supported(char * name)
+{
+	char * ext;
+	int i;
+
+	ext = strrchr(name, '.');
+	if( !ext )
+		return 0;
+
+	i = 0;
+	while( thumb_extensions[i] )
+	{
+		if( !strcasecmp(ext + 1, thumb_extensions[i]) )
+			return 1;
+		i++;
+	}
+
+	return 0;
+}
+
+static uint32_t get16(unsigned char * p, int le)
+{
+	if( le )
+		return p[0] | (p[1] << 8);
+
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(unsigned char * p, int le)
+{
+	if( le )
+		return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// Image size from the JPEG frame header.
+static int jpeg_dimensions(unsigned char * data, int size, uint32_t * width, uint32_t * height)
+{
+	int ofs,marker;
+
+	ofs = 2;
+	while( ofs + 9 <= size )
+	{
+		if( data[ofs] != 0xFF )
+			return -1;
+
+		marker = data[ofs + 1];
+		if( marker == 0xFF )
+		{
+			ofs++;
+			continue;
+		}
+
+		if( marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC )
+		{
+			*height = get16(&data[ofs + 5], 0);
+			*width = get16(&data[ofs + 7], 0);
+			return 0;
+		}
+
+		if( marker == 0xDA || marker == 0xD9 )
+			return -1;
+
+		ofs += 2 + get16(&data[ofs + 2], 0);
+	}
+
+	return -1;
+}
+
+// Locate the IFD1 JPEG thumbnail in the EXIF TIFF structure.
+static int exif_thumb_location(unsigned char * tiff, uint32_t size, uint32_t * thumb_ofs, uint32_t * thumb_size)
+{
+	uint32_t ifd,entry,nb_entries,i;
+	uint32_t tag,type,value;
+	int le;
+
+	*thumb_ofs = 0;
+	*thumb_size = 0;
+
+	if( size < 8 )
+		return -1;
+
+	if( tiff[0] == 'I' && tiff[1] == 'I' )
+		le = 1;
+	else if( tiff[0] == 'M' && tiff[1] == 'M' )
+		le = 0;
+	else
+		return -1;
+
+	if( get16(&tiff[2], le) != 42 )
+		return -1;
+
+	// IFD0 : Skipped, only its next IFD (IFD1, the thumbnail one) offset is needed.
+	ifd = get32(&tiff[4], le);
+	if( ifd > size - 2 )
+		return -1;
+
+	nb_entries = get16(&tiff[ifd], le);
+	ifd += 2 + nb_entries * 12;
+	if( ifd > size - 4 )
+		return -1;
+
+	ifd = get32(&tiff[ifd], le);
+	if( !ifd || ifd > size - 2 )
+		return -1;
+
+	nb_entries = get16(&tiff[ifd], le);
+	for( i = 0; i < nb_entries; i++ )
+	{
+		entry = ifd + 2 + i * 12;
+		if( entry > size - 12 )
+			break;
+
+		tag = get16(&tiff[entry], le);
+		type = get16(&tiff[entry + 2], le);
+
+		if( type == 3 ) // SHORT
+			value = get16(&tiff[entry + 8], le);
+		else
+			value = get32(&tiff[entry + 8], le);
+
+		if( tag == 0x0201 ) // JPEGInterchangeFormat
+			*thumb_ofs = value;
+
+		if( tag == 0x0202 ) // JPEGInterchangeFormatLength
+			*thumb_size = value;
+	}
+
+	if( !*thumb_ofs || *thumb_size < 4 || *thumb_ofs > size || *thumb_size > size - *thumb_ofs )
+		return -1;
+
+	if( tiff[*thumb_ofs] != 0xFF || tiff[*thumb_ofs + 1] != 0xD8 )
+		return -1;
+
+	return 0;
+}
+
+// Extract the EXIF thumbnail of a JPEG file. Only the header markers are read.
+static unsigned char * exif_thumb(char * path, int * size)
+{
+	unsigned char hdr[4];
+	unsigned char * segment;
+	unsigned char * thumb;
+	uint32_t thumb_ofs,thumb_size;
+	off64_t ofs;
+	int fd,len,i;
+
+	fd = open(path, O_RDONLY | O_LARGEFILE);
+	if( fd < 0 )
+		return NULL;
+
+	thumb = NULL;
+
+	if( pread64(fd, hdr, 2, 0) != 2 || hdr[0] != 0xFF || hdr[1] != 0xD8 )
+		goto done;
+
+	ofs = 2;
+	for( i = 0; i < CONFIG_THUMB_MAX_MARKERS; i++ )
+	{
+		if( pread64(fd, hdr, 4, ofs) != 4 || hdr[0] != 0xFF )
+			break;
+
+		// Start of scan : No EXIF header.
+		if( hdr[1] == 0xDA || hdr[1] == 0xD9 )
+			break;
+
+		len = get16(&hdr[2], 0);
+		if( len < 2 )
+			break;
+
+		if( hdr[1] == 0xE1 && len > 2 + 6 + 8 )
+		{
+			segment = malloc(len - 2);
+			if( !segment )
+				break;
+
+			if( pread64(fd, segment, len - 2, ofs + 4) == len - 2 && !memcmp(segment, "Exif\0\0", 6) )
+			{
+				if( !exif_thumb_location(segment + 6, len - 2 - 6, &thumb_ofs, &thumb_size) )
+				{
+					thumb = malloc(thumb_size);
+					if( thumb )
+					{
+						memcpy(thumb, segment + 6 + thumb_ofs, thumb_size);
+						*size = thumb_size;
+					}
+				}
+
+				free(segment);
+				break;
+			}
+
+			free(segment);
+		}
+
+		ofs += 2 + len;
+	}
+
+done:
+	close(fd);
+
+	return thumb;
+}
+
+#ifdef USE_LIBJPEG
+
+typedef struct thumb_jpeg_error_
+{
+	struct jpeg_error_mgr pub;
+	jmp_buf jmp;
+}thumb_jpeg_error;
+
+static void thumb_jpeg_error_exit(j_common_ptr cinfo)
+{
+	longjmp(((thumb_jpeg_error *)cinfo->err)->jmp, 1);
+}
+
+// Decode the image at 1/2 - 1/8 of its size (DCT scaling), downscale it and encode it.
+static unsigned char * generate_thumb(char * path, int * size)
+{
+	struct jpeg_decompress_struct dinfo;
+	struct jpeg_compress_struct cinfo;
+	thumb_jpeg_error jerr;
+	FILE * f;
+	unsigned char * volatile row;
+	unsigned char * volatile image;
+	unsigned char * out;
+	unsigned long out_size;
+	JSAMPROW rowptr;
+	unsigned int width,height,x,y,dy,sx;
+	int denom;
+
+	f = fopen(path, "rb");
+	if( !f )
+		return NULL;
+
+	row = NULL;
+	image = NULL;
+	out = NULL;
+	out_size = 0;
+
+	memset(&dinfo, 0, sizeof(dinfo));
+	memset(&cinfo, 0, sizeof(cinfo));
+
+	dinfo.err = jpeg_std_error(&jerr.pub);
+	cinfo.err = &jerr.pub;
+	jerr.pub.error_exit = thumb_jpeg_error_exit;
+
+	if( setjmp(jerr.jmp) )
+	{
+		jpeg_destroy_decompress(&dinfo);
+		jpeg_destroy_compress(&cinfo);
+		fclose(f);
+		free(row);
+		free(image);
+		free(out);
+		return NULL;
+	}
+
+	jpeg_create_decompress(&dinfo);
+	jpeg_stdio_src(&dinfo, f);
+	jpeg_read_header(&dinfo, TRUE);
+
+	denom = 1;
+	while( denom < 8 && ( dinfo.image_width / (denom * 2) >= CONFIG_THUMB_MAX_SIZE ) && ( dinfo.image_height / (denom * 2) >= CONFIG_THUMB_MAX_SIZE ) )
+		denom *= 2;
+
+	dinfo.scale_num = 1;
+	dinfo.scale_denom = denom;
+	dinfo.out_color_space = JCS_RGB;
+	dinfo.dct_method = JDCT_IFAST;
+	dinfo.do_fancy_upsampling = FALSE;
+
+	jpeg_start_decompress(&dinfo);
+
+	// Keep the aspect ratio.
+	if( dinfo.output_width >= dinfo.output_height )
+	{
+		width = dinfo.output_width < CONFIG_THUMB_MAX_SIZE ? dinfo.output_width : CONFIG_THUMB_MAX_SIZE;
+		height = ( (uint64_t)dinfo.output_height * width ) / dinfo.output_width;
+	}
+	else
+	{
+		height = dinfo.output_height < CONFIG_THUMB_MAX_SIZE ? dinfo.output_height : CONFIG_THUMB_MAX_SIZE;
+		width = ( (uint64_t)dinfo.output_width * height ) / dinfo.output_height;
+	}
+
+	if( !width )
+		width = 1;
+	if( !height )
+		height = 1;
+
+	row = malloc(dinfo.output_width * 3);
+	image = malloc(width * height * 3);
+	if( !row || !image )
+		longjmp(jerr.jmp, 1);
+
+	// Nearest neighbour downscale, one source line at a time.
+	dy = 0;
+	while( dinfo.output_scanline < dinfo.output_height )
+	{
+		y = dinfo.output_scanline;
+
+		rowptr = row;
+		jpeg_read_scanlines(&dinfo, &rowptr, 1);
+
+		while( dy < height && ( (uint64_t)dy * dinfo.output_height ) / height == y )
+		{
+			for( x = 0; x < width; x++ )
+			{
+				sx = ( (uint64_t)x * dinfo.output_width ) / width;
+				memcpy(&image[(dy * width + x) * 3], &row[sx * 3], 3);
+			}
+			dy++;
+		}
+	}
+
+	jpeg_finish_decompress(&dinfo);
+	jpeg_destroy_decompress(&dinfo);
+
+	jpeg_create_compress(&cinfo);
+	jpeg_mem_dest(&cinfo, &out, &out_size);
+
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, CONFIG_THUMB_QUALITY, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+
+	while( cinfo.next_scanline < cinfo.image_height )
+	{
+		rowptr = &image[cinfo.next_scanline * width * 3];
+		jpeg_write_scanlines(&cinfo, &rowptr, 1);
+	}
+
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+
+	fclose(f);
+	free(row);
+	free(image);
+
+	*size = out_size;
+
+	return out;
+}
+
+#endif
+
+static int cache_path(mtp_ctx * ctx, struct stat64 * st, char * path, int maxsize)
+{
+	if( !ctx->thumbnail_cache[0] )
+		return -1;
+
+	snprintf(path, maxsize, "%s/%"PRIx64"-%"PRIx64"-%"PRIx64"-%"PRIx64".jpg", ctx->thumbnail_cache,
+				(uint64_t)st->st_dev, (uint64_t)st->st_ino, (uint64_t)st->st_size, (uint64_t)st->st_mtime);
+
+	return 0;
+}
+
+typedef struct cache_file_
+{
+	char * name;
+	time_t mtime;
+	int64_t size;
+}cache_file;
+
+static int cmp_cache_files(const void * a, const void * b)
+{
+	const cache_file * file_a = (const cache_file *)a;
+	const cache_file * file_b = (const cache_file *)b;
+
+	if( file_a->mtime == file_b->mtime )
+		return 0;
+
+	return file_a->mtime < file_b->mtime ? -1 : 1;
+}
+
+// Return the cache folder size (< 0 : error). max_size != 0 : The least recently used
+// thumbnails are removed until a quarter of the limit is free. Called with the cache lock held.
+static int64_t cache_trim(mtp_ctx * ctx, int64_t max_size)
+{
+	char path[MAX_CFG_STRING_SIZE + NAME_MAX + 2];
+	struct stat64 st;
+	struct dirent * d;
+	cache_file * files;
+	cache_file * tmp;
+	int64_t total;
+	DIR * dir;
+	int i,nb,max,len;
+
+	dir = opendir(ctx->thumbnail_cache);
+	if( !dir )
+		return -1;
+
+	files = NULL;
+	nb = 0;
+	max = 0;
+	total = 0;
+
+	while( (d = readdir(dir)) )
+	{
+		// Thumbnails only (The files being written end with .tmp)
+		len = strlen(d->d_name);
+		if( len < 4 || strcmp(&d->d_name[len - 4], ".jpg") )
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", ctx->thumbnail_cache, d->d_name);
+		if( lstat64(path, &st) || !S_ISREG(st.st_mode) )
+			continue;
+
+		total += st.st_size;
+
+		if( !max_size || max < 0 )
+			continue;
+
+		if( nb == max )
+		{
+			tmp = realloc(files, ( max ? max * 2 : 256 ) * sizeof(cache_file));
+			if( !tmp )
+			{
+				max = -1; // Only the first ones can be removed.
+				continue;
+			}
+
+			files = tmp;
+			max = max ? max * 2 : 256;
+		}
+
+		files[nb].name = strdup(d->d_name);
+		if( !files[nb].name )
+			continue;
+
+		files[nb].mtime = st.st_mtime;
+		files[nb].size = st.st_size;
+		nb++;
+	}
+
+	closedir(dir);
+
+	if( max_size && total > max_size )
+	{
+		qsort(files, nb, sizeof(cache_file), cmp_cache_files);
+
+		for( i = 0; i < nb && total > max_size - max_size / 4; i++ )
+		{
+			snprintf(path, sizeof(path), "%s/%s", ctx->thumbnail_cache, files[i].name);
+			if( !unlink(path) )
+				total -= files[i].size;
+		}
+
+		PRINT_DEBUG("mtp_thumb : cache size limit reached, %d thumbnails removed", i);
+	}
+
+	for( i = 0; i < nb; i++ )
+		free(files[i].name);
+
+	free(files);
+
+	return total;
+}
+
+// A thumbnail was added : Keep the cache folder under its size limit.
+static void cache_account(mtp_ctx * ctx, int size)
+{
+	int64_t max_size;
+
+	max_size = (int64_t)ctx->thumbnail_cache_max_size * 1024 * 1024;
+	if( !max_size )
+		return;
+
+	pthread_mutex_lock( &ctx->thumb_cache_lock );
+
+	// First write : The folder content is measured.
+	if( ctx->thumb_cache_size < 0 )
+		ctx->thumb_cache_size = cache_trim(ctx, 0);
+	else
+		ctx->thumb_cache_size += size;
+
+	if( ctx->thumb_cache_size > max_size )
+		ctx->thumb_cache_size = cache_trim(ctx, max_size);
+
+	pthread_mutex_unlock( &ctx->thumb_cache_lock );
+}
+
+// Read a cached thumbnail (header_only : Its first CONFIG_THUMB_HEADER_SIZE bytes).
+// Return the data, NULL if not cached (size < 0) or no thumbnail possible (size 0).
+static unsigned char * cache_read(mtp_ctx * ctx, struct stat64 * st, int * size, int header_only)
+{
+	char path[MAX_CFG_STRING_SIZE + 64];
+	struct stat64 cache_stat;
+	unsigned char * data;
+	int fd,read_size;
+
+	*size = -1;
+
+	if( cache_path(ctx, st, path, sizeof(path)) )
+		return NULL;
+
+	fd = open(path, O_RDONLY);
+	if( fd < 0 )
+		return NULL;
+
+	data = NULL;
+
+	if( !fstat64(fd, &cache_stat) && cache_stat.st_size <= CONFIG_THUMB_MAX_DATA_SIZE )
+	{
+		*size = cache_stat.st_size;
+
+		// Used : Kept longer by the size limit eviction.
+		if( ctx->thumbnail_cache_max_size && cache_stat.st_mtime + CONFIG_THUMB_CACHE_TOUCH_S < time(NULL) )
+			futimens(fd, NULL);
+
+		read_size = *size;
+		if( header_only && read_size > CONFIG_THUMB_HEADER_SIZE )
+			read_size = CONFIG_THUMB_HEADER_SIZE;
+
+		if( read_size )
+		{
+			data = malloc(read_size);
+			if( data && read(fd, data, read_size) != read_size )
+			{
+				free(data);
+				data = NULL;
+				*size = -1;
+			}
+		}
+	}
+
+	close(fd);
+
+	if( *size >= 0 )
+		__atomic_fetch_add(&ctx->stats.thumb_cache_hits, 1, __ATOMIC_RELAXED);
+
+	return data;
+}
+
+// Store a thumbnail (size 0 : No thumbnail possible). Written in a temporary file then renamed.
+static void cache_write(mtp_ctx * ctx, struct stat64 * st, unsigned char * data, int size)
+{
+	char path[MAX_CFG_STRING_SIZE + 64];
+	char tmp_path[MAX_CFG_STRING_SIZE + 96];
+	int fd,ret;
+
+	if( cache_path(ctx, st, path, sizeof(path)) )
+		return;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%lx.tmp", path, (unsigned long)pthread_self());
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if( fd < 0 )
+	{
+		PRINT_DEBUG("mtp_thumb : can't create %s", tmp_path);
+		return;
+	}
+
+	ret = 0;
+	if( size && write(fd, data, size) != size )
+		ret = -1;
+
+	if( close(fd) )
+		ret = -1;
+
+	if( ret || rename(tmp_path, path) )
+	{
+		unlink(tmp_path);
+		return;
+	}
+
+	cache_account(ctx, size);
+}
+
+#ifdef USE_LIBJPEG
+
+static void * thumb_worker(void * arg)
+{
+	mtp_ctx * ctx;
+	mtp_thumb_pool * pool;
+	struct stat64 st;
+	unsigned char * data;
+	char cache_file[MAX_CFG_STRING_SIZE + 64];
+	char * path;
+	int size;
+
+	ctx = (mtp_ctx *)arg;
+	pool = (mtp_thumb_pool *)ctx->thumb_pool;
+
+	prctl(PR_SET_NAME, (unsigned long) __func__);
+
+	pthread_mutex_lock( &pool->lock );
+
+	while( !pool->stop )
+	{
+		if( !pool->nb_jobs )
+		{
+			pthread_cond_wait( &pool->cond, &pool->lock );
+			continue;
+		}
+
+		path = pool->queue[pool->first];
+		pool->queue[pool->first] = NULL;
+		pool->first = (pool->first + 1) % CONFIG_THUMB_QUEUE_SIZE;
+		pool->nb_jobs--;
+
+		pthread_mutex_unlock( &pool->lock );
+
+		if( !stat64(path, &st) && !cache_path(ctx, &st, cache_file, sizeof(cache_file)) && access(cache_file, F_OK) )
+		{
+			data = generate_thumb(path, &size);
+			if( data )
+				__atomic_fetch_add(&ctx->stats.thumb_generated, 1, __ATOMIC_RELAXED);
+			else
+				size = 0;
+
+			cache_write(ctx, &st, data, size);
+
+			free(data);
+		}
+
+		free(path);
+
+		pthread_mutex_lock( &pool->lock );
+	}
+
+	pthread_mutex_unlock( &pool->lock );
+
+	return NULL;
+}
+
+// Queue a thumbnail generation. Called by the MTP operations thread only.
+static void thumb_queue(mtp_ctx * ctx, char * path)
+{
+	mtp_thumb_pool * pool;
+	int i;
+
+	if( ctx->thumbnail_workers <= 0 || !ctx->thumbnail_cache[0] )
+		return;
+
+	pool = (mtp_thumb_pool *)ctx->thumb_pool;
+	if( !pool )
+	{
+		pool = malloc(sizeof(mtp_thumb_pool));
+		if( !pool )
+			return;
+
+		memset(pool, 0, sizeof(mtp_thumb_pool));
+
+		if( pthread_mutex_init( &pool->lock, NULL ) || pthread_cond_init( &pool->cond, NULL ) )
+		{
+			free(pool);
+			return;
+		}
+
+		ctx->thumb_pool = pool;
+
+		for( i = 0; i < ctx->thumbnail_workers && i < CONFIG_THUMB_MAX_WORKERS; i++ )
+		{
+			if( pthread_create( &pool->threads[i], NULL, thumb_worker, ctx ) )
+			{
+				PRINT_ERROR("%s : thumbnails worker creation failed !", __func__);
+				break;
+			}
+			pool->nb_threads++;
+		}
+	}
+
+	if( !pool->nb_threads )
+		return;
+
+	pthread_mutex_lock( &pool->lock );
+
+	for( i = 0; i < pool->nb_jobs; i++ )
+	{
+		if( !strcmp( pool->queue[(pool->first + i) % CONFIG_THUMB_QUEUE_SIZE], path ) )
+		{
+			pthread_mutex_unlock( &pool->lock );
+			return;
+		}
+	}
+
+	if( pool->nb_jobs < CONFIG_THUMB_QUEUE_SIZE )
+	{
+		pool->queue[(pool->first + pool->nb_jobs) % CONFIG_THUMB_QUEUE_SIZE] = strdup(path);
+		if( pool->queue[(pool->first + pool->nb_jobs) % CONFIG_THUMB_QUEUE_SIZE] )
+		{
+			pool->nb_jobs++;
+			pthread_cond_signal( &pool->cond );
+		}
+	}
+	else
+	{
+		__atomic_fetch_add(&ctx->stats.thumb_dropped, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock( &pool->lock );
+}
+
+#endif
+
+void mtp_thumb_init(mtp_ctx * ctx)
+{
+	pthread_mutex_init( &ctx->thumb_cache_lock, NULL );
+
+	ctx->thumb_cache_size = -1;
+}
+
+void mtp_thumb_deinit(mtp_ctx * ctx)
+{
+	mtp_thumb_pool * pool;
+	int i;
+
+	pool = (mtp_thumb_pool *)ctx->thumb_pool;
+	if( !pool )
+		return;
+
+	pthread_mutex_lock( &pool->lock );
+	pool->stop = 1;
+	pthread_cond_broadcast( &pool->cond );
+	pthread_mutex_unlock( &pool->lock );
+
+	for( i = 0; i < pool->nb_threads; i++ )
+		pthread_join( pool->threads[i], NULL );
+
+	for( i = 0; i < CONFIG_THUMB_QUEUE_SIZE; i++ )
+		free( pool->queue[i] );
+
+	pthread_mutex_destroy( &pool->lock );
+	pthread_cond_destroy( &pool->cond );
+
+	free( pool );
+
+	ctx->thumb_pool = NULL;
+}
+
+// Thumbnail fields of the ObjectInfo dataset. Return 0 if the object has (or will have) a thumbnail.
+int mtp_thumb_get_info(mtp_ctx * ctx, char * path, struct stat64 * st, mtp_thumb_info * info)
+{
+	unsigned char * data;
+	int size;
+
+	memset(info, 0, sizeof(mtp_thumb_info));
+
+	if( !S_ISREG(st->st_mode) || !mtp_thumb_supported(path) )
+		return -1;
+
+	// Cached : The frame header is at the beginning of the thumbnail.
+	data = cache_read(ctx, st, &size, 1);
+	if( size == 0 )
+		return -1;
+
+	if( data )
+	{
+		info->format = MTP_FORMAT_EXIF_JPEG;
+		info->size = size;
+
+		jpeg_dimensions(data, size < CONFIG_THUMB_HEADER_SIZE ? size : CONFIG_THUMB_HEADER_SIZE, &info->width, &info->height);
+
+		free(data);
+
+		return 0;
+	}
+	else
+	{
+		data = exif_thumb(path, &size);
+		if( data )
+		{
+			__atomic_fetch_add(&ctx->stats.thumb_exif, 1, __ATOMIC_RELAXED);
+
+			cache_write(ctx, st, data, size);
+		}
+		else
+		{
+#ifdef USE_LIBJPEG
+			thumb_queue(ctx, path);
+
+			info->format = MTP_FORMAT_EXIF_JPEG;
+
+			return 0;
+#else
+			return -1;
+#endif
+		}
+	}
+
+	if( !data )
+		return -1;
+
+	info->format = MTP_FORMAT_EXIF_JPEG;
+	info->size = size;
+
+	jpeg_dimensions(data, size, &info->width, &info->height);
+
+	free(data);
+
+	return 0;
+}
+
+// Thumbnail data (caller frees it), NULL if the object has no thumbnail.
+unsigned char * mtp_thumb_get(mtp_ctx * ctx, char * path, struct stat64 * st, int * size)
+{
+	unsigned char * data;
+
+	if( !S_ISREG(st->st_mode) || !mtp_thumb_supported(path) )
+		return NULL;
+
+	data = cache_read(ctx, st, size, 0);
+	if( data || !*size )
+		return data;
+
+	data = exif_thumb(path, size);
+	if( data )
+	{
+		__atomic_fetch_add(&ctx->stats.thumb_exif, 1, __ATOMIC_RELAXED);
+	}
+#ifdef USE_LIBJPEG
+	else
+	{
+		data = generate_thumb(path, size);
+		if( data )
+			__atomic_fetch_add(&ctx->stats.thumb_generated, 1, __ATOMIC_RELAXED);
+		else
+			*size = 0;
+	}
+#else
+	else
+	{
+		return NULL;
+	}
+#endif
+
+	cache_write(ctx, st, data, *size);
+
+	return data;
+}
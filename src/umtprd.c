@@ -43,6 +43,10 @@
 
 #include "usb_gadget.h"
 #include "usb_gadget_fct.h"
+#include "mtp_copy.h"
+#include "mtp_media.h"
+#include "mtp_journal.h"
+#include "mtp_events.h"
 
 #include "logs_out.h"
 
@@ -130,6 +134,11 @@ static int main_thread(const char *conffile)
 
 		PRINT_MSG("uMTP Responder : Disconnected");
 
+		mtp_copy_cancel(mtp_context);
+		mtp_media_flush(mtp_context);
+		mtp_events_flush(mtp_context);
+		mtp_journal_save(mtp_context);
+
 		if(mtp_context->fs_db)
 		{
 			deinit_fs_db(mtp_context->fs_db);
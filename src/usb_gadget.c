@@ -45,6 +45,7 @@
 #include <signal.h>
 
 #include <errno.h>
+#include <dirent.h>
 #ifdef CONFIG_USB_NON_BLOCKING_WRITE
 #include <poll.h>
 #endif
@@ -57,6 +58,11 @@
 #include "usb_gadget.h"
 
 #include "usb_gadget_fct.h"
+#include "mtp_autotune.h"
+#include "mtp_copy.h"
+#include "mtp_media.h"
+#include "mtp_journal.h"
+#include "mtp_events.h"
 
 #include "logs_out.h"
 
@@ -127,6 +133,55 @@ int write_usb(usb_gadget * ctx, int channel, unsigned char * buffer, int size)
 	return ret;
 }
 
+// FunctionFS doesn't report the negotiated speed : Get it from the UDC sysfs entry.
+static int get_udc_speed(void)
+{
+	DIR * dir;
+	struct dirent *d;
+	FILE * f;
+	char path[512];
+	char speed_str[64];
+	int speed;
+
+	speed = USB_SPEED_UNKNOWN;
+
+	dir = opendir("/sys/class/udc");
+	if( dir )
+	{
+		while( speed == USB_SPEED_UNKNOWN && (d = readdir(dir)) != NULL )
+		{
+			if( d->d_name[0] == '.' )
+				continue;
+
+			snprintf(path, sizeof(path), "/sys/class/udc/%s/current_speed", d->d_name);
+
+			f = fopen(path, "r");
+			if( f )
+			{
+				memset(speed_str, 0, sizeof(speed_str));
+				if( fgets(speed_str, sizeof(speed_str), f) )
+				{
+					if( !strncmp(speed_str, "super-speed-plus", 16) )
+						speed = USB_SPEED_SUPER_PLUS;
+					else if( !strncmp(speed_str, "super-speed", 11) )
+						speed = USB_SPEED_SUPER;
+					else if( !strncmp(speed_str, "high-speed", 10) )
+						speed = USB_SPEED_HIGH;
+					else if( !strncmp(speed_str, "full-speed", 10) )
+						speed = USB_SPEED_FULL;
+					else if( !strncmp(speed_str, "low-speed", 9) )
+						speed = USB_SPEED_LOW;
+				}
+				fclose(f);
+			}
+		}
+
+		closedir(dir);
+	}
+
+	return speed;
+}
+
 int is_usb_up(usb_gadget * ctx)
 {
 	if(ctx->stop)
@@ -659,6 +714,8 @@ int handle_ep0(usb_gadget * ctx)
 			{
 				case GADGETFS_CONNECT:
 					PRINT_DEBUG("handle_ep0 : EP0 CONNECT event");
+
+					mtp_autotune_reset(mtp_context, events[i].u.speed);
 				break;
 
 				case GADGETFS_DISCONNECT:
@@ -815,6 +872,10 @@ int handle_ffs_ep0(usb_gadget * ctx)
 				if (!status)
 				{
 					ctx->stop = 0;
+
+					if( ctx->thread_not_started )
+						mtp_autotune_reset(mtp_context, get_udc_speed());
+
 					if( ctx->thread_not_started )
 						ctx->thread_not_started = pthread_create(&ctx->thread, NULL, io_thread, ctx);
 				}
@@ -848,11 +909,16 @@ int handle_ffs_ep0(usb_gadget * ctx)
 				ctx->stop = 0;
 
 				// Drop the file system db
-				if ( !pthread_mutex_lock( &mtp_context->inotify_mutex ) )
+				mtp_copy_cancel( mtp_context );
+				mtp_media_flush( mtp_context );
+				mtp_events_flush( mtp_context );
+				mtp_journal_save( mtp_context );
+
+				if ( !mtp_db_lock( mtp_context ) )
 				{
 					deinit_fs_db(mtp_context->fs_db);
 					mtp_context->fs_db = 0;
-					if ( pthread_mutex_unlock( &mtp_context->inotify_mutex ) )
+					if ( mtp_db_unlock( mtp_context ) )
 					{
 						PRINT_ERROR("handle_ffs_ep0 : Mutex unlock error !");
 					}